@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "async_log.h"
+
+constexpr auto LOG_FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+struct log_record {
+    int64_t time_ns;
+    uint16_t event;
+    uint16_t payload_length; // bytes kept in payload
+    uint32_t length; // bytes the caller passed
+    long args[2];
+    char payload[LOG_PAYLOAD_MAX];
+};
+
+// Single producer (the owning thread), single consumer (the writer thread)
+struct log_ring {
+    log_record records[LOG_RING_SIZE];
+    alignas(64) std::atomic<uint32_t> head; // next record to fill, owner only
+    alignas(64) std::atomic<uint32_t> tail; // next record to format, writer only
+    std::atomic<uint64_t> dropped;
+    log_ring() : head(0), tail(0), dropped(0) {}
+};
+
+static const char *const log_formats[LOG_EVENT_COUNT] = {
+    "ep0: write: transferred %ld bytes.",
+    "ep0: read: transferred %ld bytes.",
+    "ep0: stall",
+    "ep%ld: write: transferred %ld bytes.",
+    "ep%ld: read: transferred %ld bytes.",
+    "tcp_sock: received %ld bytes.",
+    "udp_sock: received %ld bytes.",
+    "udp_sock: fast retransmit of frame %ld.",
+    "usb_tx_buffer: used %ld bytes / %ld bytes.",
+};
+
+static std::mutex rings_mtx;
+static std::vector<log_ring *> rings; // one per thread that ever logged; kept for the process lifetime
+static thread_local log_ring *own_ring = nullptr;
+static std::atomic<bool> running(false);
+static std::atomic<bool> stopping(false);
+static std::thread *writer = nullptr;
+static FILE *log_out = nullptr;
+static int64_t start_ns = 0;
+
+static int64_t now_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void dump_hex_and_ascii(FILE *out, const char *data, const size_t length)
+{
+    const uint8_t *c = reinterpret_cast<const uint8_t *>(data);
+    for (size_t offset = 0; offset < length; offset += 16) {
+        fprintf(out, "  %04lx: ", (unsigned long) offset);
+        for (size_t p = 0; p < 16; p++) {
+            if (offset + p < length) {
+                fprintf(out, "%02x ", c[offset + p]);
+            } else {
+                fprintf(out, "   ");
+            }
+        }
+        for (size_t p = 0; p < 16 && offset + p < length; p++) {
+            fputc(isprint(c[offset + p]) ? c[offset + p] : '.', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+static void fill_record(log_record *r, log_event event, long arg0, long arg1, const void *payload, size_t length)
+{
+    r->time_ns = now_ns();
+    r->event = event;
+    r->args[0] = arg0;
+    r->args[1] = arg1;
+    r->length = payload != nullptr ? length : 0;
+    r->payload_length = std::min(r->length, (uint32_t) LOG_PAYLOAD_MAX);
+    if (r->payload_length > 0) {memcpy(r->payload, payload, r->payload_length);}
+}
+
+static void format_record(FILE *out, const log_record &r, bool timestamp)
+{
+    if (timestamp) {fprintf(out, "[%12.6f] ", (r.time_ns - start_ns) / 1e9);}
+    fprintf(out, log_formats[r.event], r.args[0], r.args[1]);
+    fputc('\n', out);
+    if (r.length > 0) {
+        dump_hex_and_ascii(out, r.payload, r.payload_length);
+        if (r.length > r.payload_length) {fprintf(out, "  (%u bytes not logged)\n", (unsigned) (r.length - r.payload_length));}
+    }
+}
+
+uint64_t log_get_dropped(void)
+{
+    std::lock_guard<std::mutex> lock(rings_mtx);
+    uint64_t dropped = 0;
+    for (auto ring : rings) {dropped += ring->dropped.load(std::memory_order_relaxed);}
+    return dropped;
+}
+
+// Takes the records queued so far and writes them in time order
+static bool flush_rings(std::vector<log_record> &batch, uint64_t *dropped_seen)
+{
+    batch.clear();
+    uint64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(rings_mtx);
+        for (auto ring : rings) {
+            const auto head = ring->head.load(std::memory_order_acquire);
+            auto tail = ring->tail.load(std::memory_order_relaxed);
+            for (; tail != head; tail++) {batch.push_back(ring->records[tail % LOG_RING_SIZE]);}
+            ring->tail.store(tail, std::memory_order_release);
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+        }
+    }
+    std::sort(batch.begin(), batch.end(), [](const log_record &a, const log_record &b) {return a.time_ns < b.time_ns;});
+    for (const auto &r : batch) {format_record(log_out, r, true);}
+    if (dropped != *dropped_seen) {
+        fprintf(log_out, "log: %lu records dropped, ring full.\n", (unsigned long) (dropped - *dropped_seen));
+        *dropped_seen = dropped;
+    }
+    if (!batch.empty()) {fflush(log_out);}
+    return !batch.empty();
+}
+
+void log_start(FILE *out)
+{
+    if (running.load()) {return;}
+    log_out = out;
+    start_ns = now_ns();
+    stopping.store(false);
+    writer = new std::thread([] {
+        std::vector<log_record> batch;
+        batch.reserve(LOG_RING_SIZE);
+        uint64_t dropped_seen = 0;
+        while (!stopping.load()) {
+            if (!flush_rings(batch, &dropped_seen)) {std::this_thread::sleep_for(LOG_FLUSH_INTERVAL);}
+        }
+        flush_rings(batch, &dropped_seen);
+    });
+    running.store(true);
+}
+
+void log_stop(void)
+{
+    if (!running.exchange(false)) {return;}
+    stopping.store(true);
+    writer->join();
+    delete writer;
+    writer = nullptr;
+}
+
+void log_write(log_event event, long arg0, long arg1, const void *payload, size_t length)
+{
+    if (!running.load(std::memory_order_relaxed)) {
+        log_record r;
+        fill_record(&r, event, arg0, arg1, payload, length);
+        format_record(stdout, r, false);
+        return;
+    }
+
+    if (own_ring == nullptr) {
+        own_ring = new log_ring();
+        std::lock_guard<std::mutex> lock(rings_mtx);
+        rings.push_back(own_ring);
+    }
+    const auto head = own_ring->head.load(std::memory_order_relaxed);
+    if (head - own_ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+        own_ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    fill_record(&own_ring->records[head % LOG_RING_SIZE], event, arg0, arg1, payload, length);
+    own_ring->head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,32 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+constexpr size_t LOG_PAYLOAD_MAX = 64; // a full bulk packet; longer payloads are cut
+constexpr size_t LOG_RING_SIZE = 1024; // records per logging thread
+
+// Debug log events of the data paths; the format of each is in async_log.cpp
+enum log_event : uint16_t {
+    LOG_EP0_WRITE, // bytes
+    LOG_EP0_READ, // bytes
+    LOG_EP0_STALL,
+    LOG_EP_WRITE, // ep, bytes
+    LOG_EP_READ, // ep, bytes
+    LOG_TCP_RECV, // bytes
+    LOG_UDP_RECV, // bytes
+    LOG_UDP_FAST_RETRANSMIT, // seq
+    LOG_TX_BUFFER, // used, size
+    LOG_EVENT_COUNT,
+};
+
+// Records logging threads cannot queue because their ring is full. Counted,
+// never waited for.
+uint64_t log_get_dropped(void);
+// Starts the writer thread that formats queued records to out. Until then,
+// and after log_stop(), log_write() prints right away.
+void log_start(FILE *out);
+// Writes the queued records and stops the writer thread.
+void log_stop(void);
+// Queues one fixed-size record in the ring of the calling thread: time, event,
+// arguments and up to LOG_PAYLOAD_MAX bytes of payload, dumped as hex.
+void log_write(log_event event, long arg0 = 0, long arg1 = 0, const void *payload = nullptr, size_t length = 0);
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "at_command.h"
+
+#include "board.h"
+
+// Defaults of the S registers, as on Hayes compatible modems
+static constexpr uint8_t s_defaults[AT_S_REGISTERS] = {0, 0, 43, 13, 10, 8, 2, 50, 2, 6, 14, 95, 50, 0, 0, 0};
+
+static void at_echo(at_state *state, int value) {state->echo = value != 0;}
+static void at_factory(at_state *state, int value) {(void) value; at_reset(state);}
+// ATZ restores the S registers; only AT&F turns echo back on
+static void at_soft_reset(at_state *state, int value)
+{
+    (void) value;
+    const auto echo = state->echo;
+    at_reset(state);
+    state->echo = echo;
+}
+
+// Commands that change the state. Everything else (V, Q, X, &C, \N, ...) is
+// accepted and ignored; A, D, S and the link statistics queries are decoded
+// in at_parse().
+struct at_command_entry {
+    char prefix; // '&', '\\', '%' or 0
+    char letter;
+    void (*apply)(at_state *state, int value);
+};
+
+static constexpr at_command_entry at_commands[] = {
+    {0, 'E', at_echo},
+    {0, 'Z', at_soft_reset},
+    {'&', 'F', at_factory},
+};
+
+static char to_upper(char c)
+{
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+// Decimal argument at pos, -1 if there is none
+static int read_number(std::string_view line, size_t *pos)
+{
+    int value = -1;
+    while (*pos < line.length() && line[*pos] >= '0' && line[*pos] <= '9') {
+        value = std::min((value < 0 ? 0 : value) * 10 + (line[*pos] - '0'), 255);
+        (*pos)++;
+    }
+    return value;
+}
+
+at_line_reader::at_line_reader(void)
+{
+    length = 0;
+    start = 0;
+    scanned = 0;
+}
+
+size_t at_line_reader::feed(std::string_view data)
+{
+    // Lines already returned are only removed now, so their views stay valid until here
+    if (start > 0) {
+        memmove(buffer, buffer + start, length - start);
+        length -= start;
+        scanned -= start;
+        start = 0;
+    }
+
+    size_t dropped = 0;
+    if (length + data.length() > sizeof(buffer)) {
+        // No modem takes a line this long; drop it and start over
+        dropped = length;
+        length = 0;
+        scanned = 0;
+        if (data.length() > sizeof(buffer)) {
+            dropped += data.length() - sizeof(buffer);
+            data.remove_prefix(data.length() - sizeof(buffer));
+        }
+    }
+    memmove(buffer + length, data.data(), data.length()); // data may be a view from take_rest()
+    length += data.length();
+    return dropped;
+}
+
+bool at_line_reader::next_line(std::string_view *line)
+{
+    while (scanned < length) {
+        const auto cr = static_cast<const char *>(memchr(buffer + scanned, '\x0d', length - scanned));
+        if (cr == nullptr) {
+            scanned = length;
+            return false;
+        }
+        const size_t end = cr - buffer;
+        *line = std::string_view(buffer + start, end - start);
+        start = end + 1;
+        scanned = start;
+        if (!line->empty()) {return true;}
+    }
+    return false;
+}
+
+std::string_view at_line_reader::take_rest(void)
+{
+    const auto rest = std::string_view(buffer + start, length - start);
+    start = length;
+    scanned = length;
+    return rest;
+}
+
+void at_reset(at_state *state)
+{
+    state->echo = true; // turn on echo only in this emulator
+    memcpy(state->s, s_defaults, sizeof(state->s));
+}
+
+at_result at_parse(std::string_view line, at_state *state)
+{
+    at_result result = {AT_ACTION_NONE, std::string_view()};
+
+    // LF of a CR LF line ending ends up in front of the next line
+    while (!line.empty() && (line.front() == '\n' || line.front() == ' ')) {line.remove_prefix(1);}
+    if (line.length() < 2 || to_upper(line[0]) != 'A' || to_upper(line[1]) != 'T') {return result;}
+
+    // Chained commands in one pass: a letter, optionally prefixed, and its number
+    size_t pos = 2;
+    while (pos < line.length()) {
+        auto c = to_upper(line[pos++]);
+        if (c == ' ') {continue;}
+        if (c == 'A') {
+            result.action = AT_ACTION_ANSWER;
+            break;
+        }
+        if (c == 'D') {
+            // The rest of the line is the dial string
+            if (pos < line.length() && (to_upper(line[pos]) == 'T' || to_upper(line[pos]) == 'P')) {pos++;}
+            result.action = AT_ACTION_DIAL;
+            result.dial = line.substr(pos);
+            break;
+        }
+        if (c == 'S') {
+            const auto reg = read_number(line, &pos);
+            if (pos < line.length() && line[pos] == '=') {
+                pos++;
+                const auto value = read_number(line, &pos);
+                if (reg >= 0 && reg < AT_S_REGISTERS) {state->s[reg] = value < 0 ? 0 : value;}
+            } else if (pos < line.length() && line[pos] == '?') {
+                pos++; // queries are not answered
+            }
+            continue;
+        }
+
+        char prefix = 0;
+        if (c == '&' || c == '\\' || c == '%') {
+            if (pos >= line.length()) {break;}
+            prefix = c;
+            c = to_upper(line[pos++]);
+        }
+        const auto value = read_number(line, &pos);
+        // The diagnostics pages of the last call on USR (I6) and Rockwell (&V1) modems
+        if ((prefix == 0 && c == 'I' && value == 6) || (prefix == '&' && c == 'V' && value == 1)) {
+            result.action = AT_ACTION_LINK_STATS;
+            continue;
+        }
+        for (const auto &command : at_commands) {
+            if (command.prefix == prefix && command.letter == c) {
+                command.apply(state, value < 0 ? 0 : value);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+bool parse_address(std::string_view addr, struct sockaddr_in *parsed_addr)
+{
+    // Input format: "000-000-000-000#00000"
+    int d[4] = {0, 0, 0, 0};
+    int port = TCP_DEFAULT_PORT;
+
+    char str[64];
+    if (addr.length() >= sizeof(str)) {return false;}
+    memcpy(str, addr.data(), addr.length());
+    str[addr.length()] = '\0';
+    auto has_port = addr.find('#') != std::string_view::npos;
+
+    // Parse IPv4 address
+    if (has_port) {
+        auto ret = sscanf(str, "%u-%u-%u-%u#%u", &d[0], &d[1], &d[2], &d[3], &port);
+        if (ret != 5) {return false;}
+    } else {
+        auto ret = sscanf(str, "%u-%u-%u-%u", &d[0], &d[1], &d[2], &d[3]);
+        if (ret != 4) {return false;}
+    }
+
+    // Check each digit range
+    for (int i = 0; i < 4; i++) {
+        if (d[i] < 0 || d[i] > 255) {return false;}
+    }
+
+    // Check port range (1 - 65535)
+    if (port < 1 || port > 65535) {return false;}
+
+    char ip_addr[16];
+    sprintf(ip_addr, "%d.%d.%d.%d", d[0], d[1], d[2], d[3]);
+
+    memset(parsed_addr, 0, sizeof(*parsed_addr));
+    parsed_addr->sin_family = AF_INET;
+    parsed_addr->sin_port = htons(port);
+    parsed_addr->sin_addr.s_addr = inet_addr(ip_addr);
+
+    return true;
+}
+
+bool parse_dial_target(std::string_view dial, std::string *host, uint16_t *port)
+{
+    struct sockaddr_in addr;
+    if (parse_address(dial, &addr)) {
+        char ip_addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip_addr, sizeof(ip_addr));
+        *host = ip_addr;
+        *port = ntohs(addr.sin_port);
+        return true;
+    }
+
+    int target_port = TCP_DEFAULT_PORT;
+    const auto hash = dial.find('#');
+    if (hash != std::string_view::npos) {
+        const auto digits = dial.substr(hash + 1);
+        if (digits.empty() || digits.length() > 5) {return false;}
+        target_port = 0;
+        for (auto c : digits) {
+            if (c < '0' || c > '9') {return false;}
+            target_port = target_port * 10 + (c - '0');
+        }
+        if (target_port < 1 || target_port > 65535) {return false;}
+        dial = dial.substr(0, hash);
+    }
+
+    if (dial.length() > 2 && dial.front() == '[' && dial.back() == ']') {
+        const std::string v6(dial.substr(1, dial.length() - 2));
+        struct in6_addr addr6;
+        if (inet_pton(AF_INET6, v6.c_str(), &addr6) != 1) {return false;}
+        *host = v6;
+        *port = target_port;
+        return true;
+    }
+
+    // Host name: letters, digits, '-' and '.', at most 253 characters
+    if (dial.empty() || dial.length() > 253) {return false;}
+    bool has_name = false;
+    for (auto c : dial) {
+        const auto upper = to_upper(c);
+        if (upper >= 'A' && upper <= 'Z') {has_name = true;}
+        else if (c == '.') {has_name = true;}
+        else if ((c < '0' || c > '9') && c != '-') {return false;}
+    }
+    if (!has_name) {return false;}
+    *host = std::string(dial);
+    *port = target_port;
+    return true;
+}
@@ -0,0 +1,57 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <netinet/in.h>
+
+constexpr size_t AT_LINE_MAX = 256; // longer lines are dropped
+constexpr int AT_S_REGISTERS = 16;
+
+enum at_action {
+    AT_ACTION_NONE,
+    AT_ACTION_ANSWER, // ATA
+    AT_ACTION_DIAL, // ATD...
+    AT_ACTION_LINK_STATS, // ATI6 or AT&V1: link statistics, then OK
+};
+
+// Modem settings changed by AT commands
+struct at_state {
+    bool echo;
+    uint8_t s[AT_S_REGISTERS]; // S0: rings before auto-answer, S2: escape character, ...
+};
+
+struct at_result {
+    at_action action;
+    std::string_view dial; // ATD: dial string after D, T or P; points into the line
+};
+
+// Splits the bulk-OUT stream into CR-terminated lines without allocating.
+// Scanning resumes where the previous call stopped, so a line that arrives
+// in many packets is searched once.
+class at_line_reader {
+    private:
+        char buffer[AT_LINE_MAX];
+        size_t length; // bytes in buffer
+        size_t start; // first byte not yet returned as a line
+        size_t scanned; // end of the bytes already searched for CR
+    public:
+        at_line_reader(void);
+        // Appends received bytes. Returns the number of bytes dropped because a line got too long.
+        size_t feed(std::string_view data);
+        // Takes the next non-empty line, without CR. Valid until the next feed().
+        bool next_line(std::string_view *line);
+        // Takes everything not returned as a line yet, e.g. data sent right after ATA.
+        std::string_view take_rest(void);
+};
+
+// Restores the factory settings (AT&F).
+void at_reset(at_state *state);
+// Applies a command line, which may chain commands (AT&FE0S0=1), to state
+// and tells what the modem must do.
+at_result at_parse(std::string_view line, at_state *state);
+// Parses a dial string "000-000-000-000[#00000]".
+bool parse_address(std::string_view addr, struct sockaddr_in *parsed_addr);
+// Parses a dial string naming any host: "000-000-000-000", "[IPv6 address]"
+// or a host name (with a letter or a dot), each optionally followed by
+// "#00000". A plain phone number is not a host.
+bool parse_dial_target(std::string_view dial, std::string *host, uint16_t *port);
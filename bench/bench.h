@@ -0,0 +1,51 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Heap allocations made by the process so far (operator new is counted in bench_main.cpp)
+extern std::atomic<uint64_t> bench_allocs;
+// Recording and speed for bench_replay (-y), empty to skip it
+extern std::string bench_recording;
+extern double bench_replay_speed;
+
+// Adds one result to the machine-readable output (-o), if enabled.
+void bench_record(const char *name, const char *metric, double value);
+// Prints and records ns/op, bytes/s (if bytes_per_op is set) and allocations/op.
+void bench_report(const char *name, uint64_t iterations, double ns_total, size_t bytes_per_op, uint64_t allocs);
+// Reports a broken guarantee; the bench then exits non-zero after the run.
+void bench_fail(const char *name, const char *reason);
+// A port the kernel has free for this socket type (SOCK_STREAM or
+// SOCK_DGRAM), so that a rerun or a second run never finds its listener's
+// fixed port still taken.
+uint16_t bench_free_port(int type);
+
+// Times `iterations` calls of op after a short warm-up. Returns the heap
+// allocations they made.
+template <typename F>
+uint64_t bench_run(const char *name, uint64_t iterations, size_t bytes_per_op, F op)
+{
+    for (uint64_t i = 0; i < iterations / 10 + 1; i++) {op();}
+
+    const auto allocs_before = bench_allocs.load();
+    const auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {op();}
+    const auto end = std::chrono::steady_clock::now();
+    const auto allocs = bench_allocs.load() - allocs_before;
+
+    bench_report(name, iterations, std::chrono::duration<double, std::nano>(end - start).count(), bytes_per_op, allocs);
+    return allocs;
+}
+
+void bench_ring_buffer(void);
+void bench_hot_path(void);
+void bench_bulk_in(void);
+void bench_tcp_sock(void);
+void bench_relay(void);
+void bench_transport(void);
+void bench_rt(void);
+void bench_impairment(void);
+void bench_link_probe(void);
+void bench_e2e(void);
+void bench_replay(void);
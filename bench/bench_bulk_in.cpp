@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+#include "../ring_buffer.h"
+#include "../bulk_in_scheduler.h"
+#include "../line_pacer.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr size_t PAYLOAD_SIZE = 62;
+constexpr auto FRAME_INTERVAL = std::chrono::microseconds(16667); // 60 fps game traffic
+constexpr auto PHASE_DURATION = std::chrono::seconds(2);
+
+// Stand-in for usb_raw_gadget::ep_write(). The simulated host accepts every
+// packet immediately; latency is taken from the timestamps the producer
+// wrote into the stream.
+struct fake_host {
+    std::vector<char> partial;
+    std::vector<double> latency_us;
+    std::atomic<uint64_t> packets{0};
+
+    void write(const char *payload, size_t length)
+    {
+        const auto now = bench_clock::now().time_since_epoch().count();
+        packets++;
+        partial.insert(partial.end(), payload, payload + length);
+        while (partial.size() >= sizeof(int64_t)) {
+            int64_t sent_at;
+            memcpy(&sent_at, partial.data(), sizeof(sent_at));
+            partial.erase(partial.begin(), partial.begin() + sizeof(sent_at));
+            latency_us.push_back((now - sent_at) / 1000.0);
+        }
+    }
+};
+
+// The loop used before bulk_in_scheduler: fixed 40 ms tick.
+static void legacy_loop(ring_buffer<char> &q, std::atomic<bool> &connected, std::atomic<bool> &stop, fake_host &host)
+{
+    char data[64];
+    auto timeout_at = bench_clock::now();
+
+    while (!stop.load()) {
+        const auto now = bench_clock::now();
+        while (timeout_at <= now) {
+            timeout_at += std::chrono::milliseconds(40);
+        }
+        q.wait(timeout_at);
+
+        data[0] = 0x31;
+        data[1] = 0x60;
+        const auto payload_length = q.dequeue(&data[2], PAYLOAD_SIZE);
+        if (connected.load()) {data[0] |= 0x80;}
+        host.write(&data[2], payload_length);
+    }
+}
+
+static void scheduler_loop(ring_buffer<char> &q, std::atomic<bool> &connected, std::atomic<bool> &stop, fake_host &host)
+{
+    char data[64];
+    bulk_in_scheduler scheduler(&q, &connected, bulk_in_policy());
+
+    while (!stop.load()) {
+        scheduler.wait_next();
+
+        const bool dcd = connected.load();
+        data[0] = 0x31;
+        data[1] = 0x60;
+        const auto payload_length = q.dequeue(&data[2], PAYLOAD_SIZE);
+        if (dcd) {data[0] |= 0x80;}
+        host.write(&data[2], payload_length);
+        scheduler.sent(payload_length, dcd);
+    }
+}
+
+static double thread_cpu_us(std::thread &t)
+{
+    clockid_t cid;
+    struct timespec ts;
+    pthread_getcpuclockid(t.native_handle(), &cid);
+    clock_gettime(cid, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+template <typename F>
+static void run(const char *name, F loop)
+{
+    ring_buffer<char> q(524288);
+    std::atomic<bool> connected(true);
+    std::atomic<bool> stop(false);
+    fake_host host;
+
+    std::thread consumer([&] {
+        loop(q, connected, stop, host);
+    });
+
+    // Active phase: one timestamped 8 byte message per game frame
+    const auto active_end = bench_clock::now() + PHASE_DURATION;
+    while (bench_clock::now() < active_end) {
+        const int64_t now = bench_clock::now().time_since_epoch().count();
+        q.enqueue(reinterpret_cast<const char *>(&now), sizeof(now));
+        std::this_thread::sleep_for(FRAME_INTERVAL);
+    }
+
+    // Idle phase: nothing to send, only status packets
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const auto idle_packets_start = host.packets.load();
+    const auto idle_cpu_start = thread_cpu_us(consumer);
+    std::this_thread::sleep_for(PHASE_DURATION);
+    const auto idle_cpu_us = thread_cpu_us(consumer) - idle_cpu_start;
+    const auto idle_packets = host.packets.load() - idle_packets_start;
+
+    stop.store(true);
+    q.notify_one();
+    consumer.join();
+
+    auto &lat = host.latency_us;
+    std::sort(lat.begin(), lat.end());
+    double sum = 0;
+    for (const auto l : lat) {sum += l;}
+    const auto seconds = std::chrono::duration<double>(PHASE_DURATION).count();
+
+    printf("%-12s %10.1f %10.1f %10.1f %14.1f %14.1f\n", name,
+        sum / lat.size(), lat[lat.size() * 99 / 100], lat.back(),
+        idle_packets / seconds, idle_cpu_us / seconds);
+    bench_record(name, "latency_mean_us", sum / lat.size());
+    bench_record(name, "latency_p99_us", lat[lat.size() * 99 / 100]);
+    bench_record(name, "idle_packets_per_sec", idle_packets / seconds);
+    bench_record(name, "idle_cpu_us_per_sec", idle_cpu_us / seconds);
+}
+
+// A peer burst drained through the pacer: the rate the console sees
+static void run_paced(const char *name, int line_rate, size_t burst_bytes)
+{
+    ring_buffer<char> q(524288);
+    std::atomic<bool> connected(true);
+    line_pacer pacer(line_rate);
+    bulk_in_scheduler scheduler(&q, &connected, bulk_in_policy());
+    scheduler.set_pacer(pacer.is_unlimited() ? nullptr : &pacer, PAYLOAD_SIZE);
+
+    std::vector<char> burst(burst_bytes, 'x');
+    char data[64];
+    uint64_t packets = 0;
+    size_t received = 0;
+    const auto start = bench_clock::now();
+    q.enqueue(burst.data(), burst.size());
+    while (received < burst_bytes) {
+        scheduler.wait_next();
+        const auto payload_length = q.dequeue(&data[2], scheduler.get_payload_limit());
+        scheduler.sent(payload_length, true);
+        received += payload_length;
+        packets++;
+    }
+    const auto seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+    printf("%-12s %10zu %10.3f %14.0f %10.1f\n", name, burst_bytes, seconds, received / seconds, (double) received / packets);
+    bench_record(name, "bytes_per_sec", received / seconds);
+    bench_record(name, "bytes_per_packet", (double) received / packets);
+}
+
+void bench_bulk_in(void)
+{
+    printf("%-12s %10s %10s %10s %14s %14s\n", "loop", "mean us", "p99 us", "max us", "idle pkt/s", "idle cpu us/s");
+    run("fixed 40ms", legacy_loop);
+    run("scheduler", scheduler_loop);
+
+    printf("%-12s %10s %10s %14s %10s\n", "pacing", "bytes", "seconds", "bytes/s", "bytes/pkt");
+    run_paced("unlimited", 0, 65536);
+    run_paced("57600 bps", MODEM_LINE_RATE, 8192);
+}
@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../usb_gadget.h"
+#include "../usb_sim_host.h"
+#include "../ring_buffer.h"
+#include "../latency_histogram.h"
+#include "../bulk_in_scheduler.h"
+#include "../line_pacer.h"
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../link_probe.h"
+#include "../modem_session.h"
+#include "../metrics_server.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr uint16_t E2E_PORT = 47200;
+constexpr uint16_t METRICS_PORT = 47201;
+constexpr uint16_t DEAD_PORT = 47202; // SYNs go unanswered
+constexpr uint16_t QUEUE_PORT = 47203;
+constexpr int AT_ROUNDS = 20;
+constexpr int LATENCY_SAMPLES = 200;
+constexpr size_t STREAM_BYTES = 32 * 1024;
+constexpr auto TIMEOUT = std::chrono::milliseconds(5000);
+
+static double elapsed_ms(bench_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(bench_clock::now() - t0).count();
+}
+
+static std::string scrape(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+    ::send(fd, request.c_str(), request.length(), 0);
+    std::string response;
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::recv(fd, buf, sizeof(buf), 0)) > 0) {response.append(buf, n);}
+    close(fd);
+    return response;
+}
+
+// Listener whose accept queue is full, so new SYNs go unanswered like those
+// to a host that is down. The queue holds one connection with backlog 0.
+static int start_blackhole(uint16_t port, int *filler)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    listen(fd, 0);
+    *filler = socket(AF_INET, SOCK_STREAM, 0);
+    ::connect(*filler, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    return fd;
+}
+
+// A caller without a modem of its own: a plain TCP connection
+static int connect_caller(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    return fd;
+}
+
+static void print_distribution(const char *name, std::vector<double> &samples)
+{
+    std::sort(samples.begin(), samples.end());
+    printf("%-16s %14.2f %14.2f %14.2f\n", name, samples[samples.size() / 2],
+        samples[samples.size() * 99 / 100], samples.back());
+    bench_record(name, "p50_ms", samples[samples.size() / 2]);
+    bench_record(name, "p99_ms", samples[samples.size() * 99 / 100]);
+}
+
+static double process_cpu_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// STREAM_BYTES from one game to the other with the given transfer sizes:
+// ioctls per KB on both USB sides and process CPU per MB moved. With probing
+// (-P), the caller's ATI6 report after the call is printed too.
+static void run_stream(event_loop *loop, int in_packets, int out_packets, uint16_t port, std::chrono::milliseconds probe_interval)
+{
+    usb_sim_host_timing timing;
+    auto answer_host = new usb_sim_host(timing);
+    auto call_host = new usb_sim_host(timing);
+    modem_config answer_config = {"sim", "sim.0", "127.0.0.1", port, true, -1, nullptr, false, 0, std::chrono::milliseconds(0), false,
+        in_packets, out_packets, false, 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), nullptr, probe_interval, nullptr};
+    modem_config call_config = {"sim", "sim.1", "127.0.0.1", port, false, -1, nullptr, false, 0, std::chrono::milliseconds(0), false,
+        in_packets, out_packets, false, 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), nullptr, probe_interval, nullptr};
+    bulk_in_policy policy;
+    auto answer = new modem_session(0, answer_config, policy, loop, answer_host, 0);
+    auto call = new modem_session(1, call_config, policy, loop, call_host, 0);
+    answer->start();
+    call->start();
+
+    const auto name = "transfer " + std::to_string(in_packets) + "," + std::to_string(out_packets) + (probe_interval.count() > 0 ? " -P" : "");
+    if (!answer_host->wait_configured(TIMEOUT) || !call_host->wait_configured(TIMEOUT)) {
+        printf("%-16s enumeration timed out\n", name.c_str());
+        return;
+    }
+    call_host->write("ATDT127-000-000-001#" + std::to_string(port) + "\r");
+    if (!answer_host->read_until("RING\r\n", TIMEOUT)) {
+        printf("%-16s no RING\n", name.c_str());
+        return;
+    }
+    answer_host->write("ATA\r");
+    const auto connected = answer_host->read_until("CONNECT", TIMEOUT) && answer_host->read_until("\r\n", TIMEOUT) &&
+        call_host->read_until("CONNECT", TIMEOUT) && call_host->read_until("\r\n", TIMEOUT);
+    if (!connected) {
+        printf("%-16s no CONNECT\n", name.c_str());
+        return;
+    }
+
+    const auto out_before = call_host->get_stats();
+    const auto in_before = answer_host->get_stats();
+    const auto cpu_before = process_cpu_ms();
+    const auto t0 = bench_clock::now();
+    call_host->write(std::string(STREAM_BYTES, 'x'));
+    size_t received = 0;
+    char buf[4096];
+    while (received < STREAM_BYTES) {
+        const auto n = answer_host->read(buf, sizeof(buf), TIMEOUT);
+        if (n == 0) {break;}
+        received += n;
+    }
+    const auto seconds = elapsed_ms(t0) / 1000;
+    const auto cpu_ms = process_cpu_ms() - cpu_before;
+    const auto out_transfers = call_host->get_stats().out_transfers - out_before.out_transfers;
+    const auto in_transfers = answer_host->get_stats().in_transfers - in_before.in_transfers;
+    const auto kb = received / 1024.0;
+
+    printf("%-16s %10.1f %12.2f %12.2f %12.1f\n", name.c_str(), kb / seconds, out_transfers / kb, in_transfers / kb,
+        cpu_ms / (received / 1048576.0));
+    bench_record(name.c_str(), "bytes_per_sec", received / seconds);
+    bench_record(name.c_str(), "out_ioctls_per_kb", out_transfers / kb);
+    bench_record(name.c_str(), "in_ioctls_per_kb", in_transfers / kb);
+    bench_record(name.c_str(), "cpu_ms_per_mb", cpu_ms / (received / 1048576.0));
+    answer_host->set_dtr(false);
+    call_host->read_until("NO CARRIER\r\n", TIMEOUT);
+    if (probe_interval.count() == 0) {return;}
+
+    call_host->write("ATI6\r");
+    std::string report;
+    while (report.find("OK\r\n") == std::string::npos) {
+        const auto n = call_host->read(buf, sizeof(buf), TIMEOUT);
+        if (n == 0) {break;}
+        report.append(buf, n);
+    }
+    const auto rtt = report.find("ROUND TRIP");
+    printf("%-16s %s\n", "ATI6", rtt == std::string::npos ? "(no round trip)" : report.substr(rtt, report.find('\r', rtt) - rtt).c_str());
+}
+
+// Two emulators, each driven by a simulated host, talking over loopback:
+// "answer" listens (-s), "call" dials it with ATD.
+void bench_e2e(void)
+{
+    usb_sim_host_timing timing;
+    auto loop = new event_loop();
+    auto answer_host = new usb_sim_host(timing);
+    auto call_host = new usb_sim_host(timing);
+
+    modem_config answer_config = {"sim", "sim.0", "127.0.0.1", E2E_PORT, true, -1, nullptr, false, 0, std::chrono::milliseconds(0), false,
+        BULK_IN_PACKETS_DEFAULT, 1, false, 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), nullptr, std::chrono::milliseconds(0), nullptr};
+    modem_config call_config = {"sim", "sim.1", "127.0.0.1", E2E_PORT, false, -1, nullptr, false, 0, std::chrono::milliseconds(0), false,
+        BULK_IN_PACKETS_DEFAULT, 1, false, 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), nullptr, std::chrono::milliseconds(0), nullptr};
+    bulk_in_policy policy;
+    auto answer = new modem_session(0, answer_config, policy, loop, answer_host, 0);
+    auto call = new modem_session(1, call_config, policy, loop, call_host, 0);
+    answer->start();
+    call->start();
+
+    if (!answer_host->wait_configured(TIMEOUT) || !call_host->wait_configured(TIMEOUT)) {
+        printf("enumeration timed out\n");
+        return;
+    }
+    printf("%-16s %14.2f ms\n", "enumeration", std::chrono::duration<double, std::milli>(call_host->get_enumeration_time()).count());
+
+    // Off-line command round trip
+    std::vector<double> at_ms;
+    for (int i = 0; i < AT_ROUNDS; i++) {
+        const auto t0 = bench_clock::now();
+        call_host->write("AT\r");
+        if (!call_host->read_until("OK\r\n", TIMEOUT)) {break;}
+        at_ms.push_back(elapsed_ms(t0));
+    }
+
+    // Dial, RING, ATA, CONNECT on both sides
+    const auto t0 = bench_clock::now();
+    call_host->write("ATDT127-000-000-001#" + std::to_string(E2E_PORT) + "\r");
+    if (!answer_host->read_until("RING\r\n", TIMEOUT)) {
+        printf("no RING\n");
+        return;
+    }
+    answer_host->write("ATA\r");
+    const auto connected = answer_host->read_until("CONNECT", TIMEOUT) && call_host->read_until("CONNECT", TIMEOUT);
+    const auto connect_ms = elapsed_ms(t0);
+    answer_host->read_until("\r\n", TIMEOUT);
+    call_host->read_until("\r\n", TIMEOUT);
+    if (!connected) {
+        printf("no CONNECT\n");
+        return;
+    }
+
+    printf("%-16s %14s %14s %14s\n", "latency", "p50 ms", "p99 ms", "max ms");
+    print_distribution("AT -> OK", at_ms);
+    std::vector<double> dial_ms = {connect_ms};
+    print_distribution("ATD -> CONNECT", dial_ms);
+
+    // One byte from one game to the other, USB OUT -> TCP -> USB IN
+    std::vector<double> one_way_ms;
+    for (int i = 0; i < LATENCY_SAMPLES; i++) {
+        char c;
+        const auto t1 = bench_clock::now();
+        call_host->write("x", 1);
+        if (answer_host->read(&c, 1, TIMEOUT) != 1) {break;}
+        one_way_ms.push_back(elapsed_ms(t1));
+    }
+    print_distribution("host to host", one_way_ms);
+
+    // Bulk transfer in one direction
+    std::string chunk(STREAM_BYTES, 'x');
+    const auto t2 = bench_clock::now();
+    call_host->write(chunk);
+    size_t received = 0;
+    char buf[4096];
+    while (received < STREAM_BYTES) {
+        const auto n = answer_host->read(buf, sizeof(buf), TIMEOUT);
+        if (n == 0) {break;}
+        received += n;
+    }
+    const auto stream_sec = elapsed_ms(t2) / 1000;
+    printf("%-16s %14.1f KB/s (%zu bytes)\n", "throughput", received / 1024.0 / stream_sec, received);
+    bench_record("throughput", "bytes_per_sec", received / stream_sec);
+
+    // Metrics scrape while on-line
+    std::vector<modem_session *> modems = {answer, call};
+    auto metrics = new metrics_server(loop, ("127.0.0.1:" + std::to_string(METRICS_PORT)).c_str(),
+        [&modems](std::string &out) {render_modem_metrics(out, modems);});
+    std::vector<double> scrape_ms;
+    size_t scrape_bytes = 0;
+    for (int i = 0; i < AT_ROUNDS; i++) {
+        const auto t4 = bench_clock::now();
+        scrape_bytes = scrape(METRICS_PORT).length();
+        scrape_ms.push_back(elapsed_ms(t4));
+    }
+    print_distribution("metrics scrape", scrape_ms);
+    printf("%-16s %14zu bytes\n", "metrics size", scrape_bytes);
+    delete metrics;
+
+    // Hang up on one side, NO CARRIER on the other
+    const auto t3 = bench_clock::now();
+    answer_host->set_dtr(false);
+    const auto no_carrier = call_host->read_until("NO CARRIER", TIMEOUT);
+    printf("%-16s %14.2f ms%s\n", "hang-up", elapsed_ms(t3), no_carrier ? "" : " (timed out)");
+
+    // Dialing a host that never answers: S7 ends it, and a hang-up ends it
+    // without stopping the AT command reader
+    int filler;
+    const int dead_fd = start_blackhole(DEAD_PORT, &filler);
+    const auto dead_dial = "DT127-000-000-001#" + std::to_string(DEAD_PORT) + "\r";
+    const auto t5 = bench_clock::now();
+    call_host->write("ATS7=1" + dead_dial);
+    const auto timed_out = call_host->read_until("NO CARRIER\r\n", TIMEOUT);
+    printf("%-16s %14.2f ms%s\n", "dial, S7=1", elapsed_ms(t5), timed_out ? "" : " (no NO CARRIER)");
+    bench_record("dial dead host", "s7_timeout_ms", elapsed_ms(t5));
+    call_host->write("ATS7=50" + dead_dial);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const auto t6 = bench_clock::now();
+    call_host->set_dtr(false);
+    call_host->set_dtr(true);
+    call_host->write("AT\r");
+    const auto ok = call_host->read_until("OK\r\n", TIMEOUT);
+    printf("%-16s %14.2f ms%s\n", "hang-up -> AT OK", elapsed_ms(t6), ok ? "" : " (timed out)");
+    bench_record("dial dead host", "hangup_to_ok_ms", elapsed_ms(t6));
+    close(filler);
+    close(dead_fd);
+
+    const auto in = answer_host->get_stats();
+    const auto out = call_host->get_stats();
+    printf("%-16s %14lu in (%lu status only), %lu out, %lu control, %lu stalls\n", "usb packets",
+        (unsigned long) (in.in_packets + out.in_packets), (unsigned long) (in.in_status_packets + out.in_status_packets),
+        (unsigned long) (in.out_packets + out.out_packets), (unsigned long) (in.control_requests + out.control_requests),
+        (unsigned long) (in.stalls + out.stalls));
+    printf("%-16s %14lu in, %lu out\n", "usb transfers", (unsigned long) (in.in_transfers + out.in_transfers),
+        (unsigned long) (in.out_transfers + out.out_transfers));
+
+    // A server holding two callers and answering on the first ring (-Q 2 -A 1):
+    // hanging up on one call rings the next, a third waiting caller is turned away
+    auto queue_host = new usb_sim_host(timing);
+    modem_config queue_config = {"sim", "sim.2", "127.0.0.1", QUEUE_PORT, true, -1, nullptr, false, 0, std::chrono::milliseconds(0), false,
+        BULK_IN_PACKETS_DEFAULT, 1, false, 0, std::chrono::milliseconds(0), 2, std::chrono::milliseconds(5000), 1, std::chrono::milliseconds(0), nullptr, std::chrono::milliseconds(0), nullptr};
+    auto queue_modem = new modem_session(2, queue_config, policy, loop, queue_host, 0);
+    queue_modem->start();
+    if (queue_host->wait_configured(TIMEOUT)) {
+        const int first = connect_caller(QUEUE_PORT);
+        const auto answered = queue_host->read_until("CONNECT", TIMEOUT) && queue_host->read_until("\r\n", TIMEOUT);
+        const int second = connect_caller(QUEUE_PORT);
+        const int third = connect_caller(QUEUE_PORT);
+        const int fourth = connect_caller(QUEUE_PORT);
+        const std::string hello = "hello";
+        ::send(second, hello.c_str(), hello.length(), 0);
+        char c;
+        const auto turned_away = ::recv(fourth, &c, 1, 0) == 0;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        const auto t7 = bench_clock::now();
+        queue_host->set_dtr(false);
+        queue_host->set_dtr(true);
+        const auto next = queue_host->read_until("RING\r\n", TIMEOUT) && queue_host->read_until("CONNECT", TIMEOUT) &&
+            queue_host->read_until("\r\n", TIMEOUT);
+        const auto next_ms = elapsed_ms(t7);
+        const auto data = next && queue_host->read_until(hello, TIMEOUT);
+        printf("%-16s %14.2f ms%s\n", "hang-up -> next", next_ms,
+            !answered ? " (first not answered)" : !next ? " (next not answered)" : !data ? " (no data)" : !turned_away ? " (fourth not turned away)" : "");
+        bench_record("call queue", "hangup_to_next_connect_ms", next_ms);
+        queue_host->set_dtr(false);
+        queue_host->set_dtr(true);
+        queue_host->read_until("CONNECT", TIMEOUT);
+        const auto stats = queue_modem->get_metrics();
+        printf("%-16s %14.2f ms p50 wait, %lu turned away\n", "call queue", stats.call_setup_seconds[0][0] * 1e3, (unsigned long) stats.callers_turned_away);
+        for (auto fd : {first, second, third, fourth}) {close(fd);}
+    }
+
+    // Same stream with 1 to 16 packets per ioctl; OUT reads above one packet
+    // rely on the simulated host ending every transfer
+    printf("%-16s %10s %12s %12s %12s\n", "packets in,out", "KB/s", "out ioctl/KB", "in ioctl/KB", "cpu ms/MB");
+    uint16_t port = E2E_PORT + 10;
+    for (const auto &packets : {std::make_pair(1, 1), std::make_pair(BULK_IN_PACKETS_DEFAULT, 1), std::make_pair(BULK_IN_PACKETS_DEFAULT, BULK_IN_PACKETS_DEFAULT),
+        std::make_pair(BULK_TRANSFER_PACKETS_MAX, BULK_TRANSFER_PACKETS_MAX)}) {
+        run_stream(loop, packets.first, packets.second, port++, std::chrono::milliseconds(0));
+    }
+    run_stream(loop, BULK_IN_PACKETS_DEFAULT, 1, port++, LINK_PROBE_INTERVAL_MIN);
+
+    // The modem threads never return, so the sessions are left running
+}
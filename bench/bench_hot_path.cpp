@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <netinet/in.h>
+
+#include "../usb_gadget.h"
+#include "../usb_raw_control_event.h"
+#include "../ring_buffer.h"
+#include "../latency_histogram.h"
+#include "../bulk_in_scheduler.h"
+#include "../line_pacer.h"
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../modem_session.h"
+#include "../at_command.h"
+#include "../async_log.h"
+#include "../me56ps2.h"
+#include "bench.h"
+
+constexpr uint64_t ITERATIONS = 1000000;
+constexpr size_t CHUNK_SIZE = 64;
+
+// Typical init string of a game, sent before dialing, one command per line and chained
+static const char *const init_commands[] = {"AT&F", "ATE0", "ATX3", "AT\\N3", "AT%C1", "ATS0=0", "AT&FE0V1X3\\N3%C1S0=1"};
+
+void bench_hot_path(void)
+{
+    {
+        ring_buffer<char> q(524288);
+        char chunk[CHUNK_SIZE];
+        memset(chunk, 'x', sizeof(chunk));
+        bench_run("ring_buffer enqueue+dequeue 64B", ITERATIONS, CHUNK_SIZE, [&] {
+            q.enqueue(chunk, sizeof(chunk));
+            q.dequeue(chunk, sizeof(chunk));
+        });
+        bench_run("ring_buffer enqueue+dequeue 1B", ITERATIONS, 1, [&] {
+            q.enqueue(chunk, 1);
+            q.dequeue(chunk, 1);
+        });
+    }
+
+    {
+        // Same steps as the off-line loop of usb_bulk_out_thread, minus USB
+        ring_buffer<char> q(524288);
+        at_line_reader reader;
+        at_state at;
+        at_reset(&at);
+        size_t n = 0;
+        char out[CHUNK_SIZE];
+        const std::string ok_reply = "OK\r\n";
+        const std::string connect_reply = "CONNECT 57600 V42\r\n";
+        // The parser must not allocate per line: it runs on the USB thread
+        auto allocs = bench_run("AT line handling", ITERATIONS, 0, [&] {
+            const std::string_view cmd = init_commands[n++ % (sizeof(init_commands) / sizeof(init_commands[0]))];
+            reader.feed(cmd);
+            reader.feed("\r");
+            std::string_view line;
+            while (reader.next_line(&line)) {
+                // Echoed whatever the line set, as after AT&F
+                q.enqueue(line.data(), line.length());
+                q.enqueue("\r\n", 2);
+                const auto reply = at_parse(line, &at).action == AT_ACTION_ANSWER ? &connect_reply : &ok_reply;
+                q.enqueue(reply->c_str(), reply->length());
+            }
+            while (q.dequeue(out, sizeof(out)) > 0) {}
+        });
+
+        // One long line arriving in 8 byte USB packets
+        std::string long_line = "AT";
+        while (long_line.length() < 200) {long_line += "&FE0V1X3S0=1";}
+        long_line += "\r";
+        allocs += bench_run("AT 200B line in 8B packets", ITERATIONS / 10, long_line.length(), [&] {
+            std::string_view line;
+            for (size_t i = 0; i < long_line.length(); i += 8) {
+                reader.feed(std::string_view(long_line).substr(i, 8));
+                while (reader.next_line(&line)) {at_parse(line, &at);}
+            }
+        });
+        if (allocs > 0) {bench_fail("AT parsing", "at_parse/at_line_reader allocate");}
+    }
+
+    {
+        // Per-stage timing cost: one clock read and one histogram update
+        latency_histogram h;
+        uint64_t v = 0;
+        bench_run("steady_clock::now", ITERATIONS, 0, [&] {
+            v += std::chrono::steady_clock::now().time_since_epoch().count();
+        });
+        bench_run("latency_histogram::record", ITERATIONS, 0, [&] {
+            h.record(v++ & 0xfffff);
+        });
+    }
+
+    {
+        line_pacer pacer(MODEM_LINE_RATE);
+        auto now = std::chrono::steady_clock::now();
+        bench_run("line_pacer::take", ITERATIONS, 0, [&] {
+            now += std::chrono::microseconds(100);
+            pacer.take(1, now);
+        });
+    }
+
+    {
+        struct sockaddr_in addr;
+        const std::string dial = "192-168-001-010#10023";
+        bench_run("parse_address", ITERATIONS, 0, [&] {
+            parse_address(dial, &addr);
+        });
+    }
+
+    {
+        // The control requests of an enumeration, as the control thread
+        // answers them: table dispatch and a copy out of the descriptor blob
+        const uint8_t get = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+        const struct usb_ctrlrequest requests[] = {
+            {get, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, 64},
+            {get, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, 255},
+            {get, USB_REQ_GET_DESCRIPTOR, USB_DT_STRING << 8, 0, 255},
+            {get, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) | 2, 0x0409, 255},
+            {USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE, USB_REQ_SET_CONFIGURATION, 1, 0, 0},
+            {USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0x01, 0x0101, 0, 0},
+        };
+        constexpr size_t count = sizeof(requests) / sizeof(requests[0]);
+        struct usb_packet_control pkt;
+        size_t n = 0, sent = 0;
+        bench_run("control request", ITERATIONS, 0, [&] {
+            const auto &ctrl = requests[n++ % count];
+            pkt.header.length = 0;
+            if (get_control_action(ctrl) == CONTROL_GET_DESCRIPTOR) {
+                uint16_t length;
+                const auto descriptor = find_descriptor(ctrl.wValue, &length);
+                pkt.header.length = std::min<unsigned int>(length, ctrl.wLength);
+                memcpy(pkt.data, descriptor, pkt.header.length);
+            }
+            sent += pkt.header.length;
+        });
+
+        // The names of the -v control event log
+        usb_raw_control_event e;
+        bench_run("control debug names", ITERATIONS, 0, [&] {
+            e.ctrl = requests[n++ % count];
+            sent += strlen(e.get_request_string()) + strlen(e.get_descriptor_type_string());
+        });
+        if (sent == 0) {printf("control: nothing sent\n");}
+    }
+
+    {
+        // Cost of the debug log lines when they are enabled (-v)
+        FILE *devnull = fopen("/dev/null", "w");
+        const std::string line = "ATDT192-168-001-010#10023";
+        bench_run("log: AT command", ITERATIONS, 0, [&] {
+            fprintf(devnull, "modem%d: AT command: %s\n", 0, line.c_str());
+        });
+        bench_run("log: usb_tx_buffer usage", ITERATIONS, 0, [&] {
+            fprintf(devnull, "usb_tx_buffer: used %ld bytes / %ld bytes (%.f%% used).\n", 1234L, 524288L, 1234.0f / 524288);
+        });
+        bench_run("log: ep write", ITERATIONS, 0, [&] {
+            fprintf(devnull, "ep%d: write: transferred %d bytes.\n", 1, 64);
+        });
+
+        // The same through async_log: what the data thread pays. Few enough
+        // records to fit the ring, then the cost of dropping when it is full.
+        char packet[64];
+        memset(packet, 'x', sizeof(packet));
+        log_start(devnull);
+        bench_run("log: ep write, async", LOG_RING_SIZE / 2, 0, [&] {
+            log_write(LOG_EP_WRITE, 1, 64);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        bench_run("log: ep write+64B, async", LOG_RING_SIZE / 2, 0, [&] {
+            log_write(LOG_EP_WRITE, 1, 64, packet, sizeof(packet));
+        });
+        bench_run("log: ring full, dropped", ITERATIONS, 0, [&] {
+            log_write(LOG_EP_WRITE, 1, 64);
+        });
+        log_stop();
+        fclose(devnull);
+    }
+}
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../tcp_sock.h"
+#include "../impairment.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr size_t IMPAIRMENT_MESSAGE_SIZE = 64;
+constexpr int IMPAIRMENT_MESSAGES = 200;
+constexpr auto IMPAIRMENT_INTERVAL = std::chrono::milliseconds(10);
+constexpr auto IMPAIRMENT_TIMEOUT = std::chrono::milliseconds(5000);
+
+static const char *const profiles[] = {
+    "", // the clean link: how much of the rest is this machine
+    "delay=40",
+    "delay=40,jitter=10,dist=normal",
+    "delay=40,jitter=10,dist=pareto",
+    "rate=57600",
+    "stall=300/1000",
+};
+
+// One-way latency of each time-stamped message over loopback, the sender
+// behind the impairment; empty if the call could not be set up
+static std::vector<double> run_profile(event_loop *loop, const impairment_profile &profile, uint16_t port, uint64_t *stalled)
+{
+    auto server = new tcp_sock(loop, true, "127.0.0.1", port);
+    auto client = new impaired_transport(loop, new tcp_sock(loop, false, "127.0.0.1", port), profile);
+
+    std::mutex mtx;
+    std::vector<double> latency_ms;
+    std::string stream;
+    server->set_ring_callback([]{});
+    server->set_disconnect_callback([]{});
+    server->set_recv_callback([&](const char *buffer, size_t length) {
+        const auto now = bench_clock::now();
+        stream.append(buffer, length);
+        std::lock_guard<std::mutex> lock(mtx);
+        while (stream.length() >= IMPAIRMENT_MESSAGE_SIZE) {
+            int64_t sent_ns;
+            memcpy(&sent_ns, stream.data(), sizeof(sent_ns));
+            latency_ms.push_back((now.time_since_epoch().count() - sent_ns) / 1e6);
+            stream.erase(0, IMPAIRMENT_MESSAGE_SIZE);
+        }
+    });
+    client->set_ring_callback([]{});
+    client->set_recv_callback([](const char *, size_t) {});
+    client->set_disconnect_callback([]{});
+
+    std::vector<double> samples;
+    if (client->connect()) {
+        char message[IMPAIRMENT_MESSAGE_SIZE];
+        memset(message, 'x', sizeof(message));
+        auto next = bench_clock::now();
+        for (int i = 0; i < IMPAIRMENT_MESSAGES; i++) {
+            std::this_thread::sleep_until(next);
+            next += IMPAIRMENT_INTERVAL;
+            const int64_t now_ns = bench_clock::now().time_since_epoch().count();
+            memcpy(message, &now_ns, sizeof(now_ns));
+            client->send(message, sizeof(message));
+        }
+
+        const auto deadline = bench_clock::now() + IMPAIRMENT_TIMEOUT;
+        while (bench_clock::now() < deadline) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (latency_ms.size() >= (size_t) IMPAIRMENT_MESSAGES) {break;}
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        samples = latency_ms;
+    }
+    *stalled = client->get_stalled_chunks();
+    client->disconnect();
+    delete client;
+    delete server;
+    return samples;
+}
+
+// How each profile shapes the latency of small game messages, and how close
+// a second run with the same seed comes to the first
+void bench_impairment(void)
+{
+    auto loop = new event_loop();
+    printf("%zu byte messages every %ld ms, sender impaired\n", IMPAIRMENT_MESSAGE_SIZE, (long) IMPAIRMENT_INTERVAL.count());
+    printf("%-32s %8s %8s %8s %6s %8s %14s\n", "profile", "p50 ms", "p99 ms", "max ms", "msgs", "stalled", "rerun p50 diff");
+    for (const auto profile_spec : profiles) {
+        const auto spec = *profile_spec != '\0' ? profile_spec : "none";
+        impairment_profile profile;
+        parse_impairment_profile(profile_spec, &profile);
+        uint64_t stalled, stalled_again;
+        const auto first = run_profile(loop, profile, bench_free_port(SOCK_STREAM), &stalled);
+        const auto second = run_profile(loop, profile, bench_free_port(SOCK_STREAM), &stalled_again);
+        if (first.size() < (size_t) IMPAIRMENT_MESSAGES || second.size() < (size_t) IMPAIRMENT_MESSAGES) {
+            printf("%-32s %zu and %zu of %d messages arrived\n", spec, first.size(), second.size(), IMPAIRMENT_MESSAGES);
+            continue;
+        }
+
+        // Message by message: the same seed should give the same delays, up
+        // to how late this machine wakes the threads
+        std::vector<double> diffs;
+        for (size_t i = 0; i < first.size(); i++) {diffs.push_back(std::fabs(first[i] - second[i]));}
+        std::sort(diffs.begin(), diffs.end());
+        const auto diff = diffs[diffs.size() / 2];
+        auto samples = first;
+        std::sort(samples.begin(), samples.end());
+        auto pct = [&](size_t per_mille) {return samples[std::min(samples.size() - 1, samples.size() * per_mille / 1000)];};
+        printf("%-32s %8.2f %8.2f %8.2f %6zu %8lu %14.2f\n", spec, pct(500), pct(990), samples.back(), samples.size(),
+            (unsigned long) stalled, diff);
+        bench_record(spec, "p50_ms", pct(500));
+        bench_record(spec, "p99_ms", pct(990));
+        bench_record(spec, "max_ms", samples.back());
+        bench_record(spec, "rerun_p50_diff_ms", diff);
+    }
+    delete loop;
+}
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../tcp_sock.h"
+#include "../impairment.h"
+#include "../link_probe.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr auto LINK_PROBE_INTERVAL = std::chrono::milliseconds(100);
+constexpr size_t LINK_MESSAGE_SIZE = 64;
+constexpr auto LINK_MESSAGE_INTERVAL = std::chrono::milliseconds(10);
+constexpr auto LINK_RUN_TIME = std::chrono::milliseconds(3000);
+constexpr auto LINK_TIMEOUT = std::chrono::milliseconds(5000);
+
+static const char *const profiles[] = {
+    "",
+    "delay=20",
+    "delay=20,jitter=5,dist=normal",
+    "rate=57600",
+};
+
+// Game-sized messages both ways over loopback, the caller behind the
+// impairment, while both sides probe: what the caller measured, what it
+// cost, and whether every byte of the stream came through as sent
+static void run_profile(event_loop *loop, const char *profile_spec, uint16_t port)
+{
+    const auto spec = *profile_spec != '\0' ? profile_spec : "none";
+    impairment_profile profile;
+    parse_impairment_profile(profile_spec, &profile);
+    transport *client_sock = new tcp_sock(loop, false, "127.0.0.1", port);
+    if (*profile_spec != '\0') {client_sock = new impaired_transport(loop, client_sock, profile);}
+    auto server = new probed_transport(new tcp_sock(loop, true, "127.0.0.1", port), LINK_PROBE_INTERVAL);
+    auto client = new probed_transport(client_sock, LINK_PROBE_INTERVAL);
+
+    // Every byte value, so data frames carry the probe frame headers too
+    std::mutex mtx;
+    size_t received[2] = {0, 0};
+    size_t corrupted = 0;
+    auto check = [&](int side, const char *buffer, size_t length) {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (size_t i = 0; i < length; i++) {
+            if (static_cast<uint8_t>(buffer[i]) != static_cast<uint8_t>(received[side] + i)) {corrupted++;}
+        }
+        received[side] += length;
+    };
+    server->set_ring_callback([]{});
+    server->set_disconnect_callback([]{});
+    server->set_recv_callback([&](const char *buffer, size_t length){check(0, buffer, length);});
+    client->set_ring_callback([]{});
+    client->set_disconnect_callback([]{});
+    client->set_recv_callback([&](const char *buffer, size_t length){check(1, buffer, length);});
+
+    if (!client->connect()) {
+        printf("%-32s no connection\n", spec);
+        delete client;
+        delete server;
+        return;
+    }
+    char message[LINK_MESSAGE_SIZE];
+    size_t sent[2] = {0, 0}; // by the caller, by the server
+    const auto t0 = bench_clock::now();
+    auto next = t0;
+    while (bench_clock::now() - t0 < LINK_RUN_TIME) {
+        std::this_thread::sleep_until(next);
+        next += LINK_MESSAGE_INTERVAL;
+        for (int side = 0; side < 2; side++) {
+            if (side == 1 && !server->is_connected()) {continue;} // not accepted yet
+            for (size_t i = 0; i < sizeof(message); i++) {message[i] = static_cast<char>(sent[side] + i);}
+            (side == 0 ? client : server)->send(message, sizeof(message));
+            sent[side] += sizeof(message);
+        }
+    }
+    const auto deadline = bench_clock::now() + LINK_TIMEOUT;
+    while (bench_clock::now() < deadline) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (received[0] >= sent[0] && received[1] >= sent[1]) {break;}
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    const auto link = client->get_link_stats();
+    const auto seconds = std::chrono::duration<double>(link.duration).count();
+    printf("%-32s %8.1f %8.1f %8.1f %8.1f %6lu %10.0f %10.1f %s\n", spec, link.srtt_ns / 1e6, link.min_rtt_ns / 1e6,
+        link.max_rtt_ns / 1e6, link.jitter_ns / 1e6, (unsigned long) link.samples, link.tx_rate, link.overhead_bytes / seconds,
+        received[0] < sent[0] || received[1] < sent[1] ? "data missing" : corrupted > 0 ? "data corrupted" : "ok");
+    bench_record(spec, "srtt_ms", link.srtt_ns / 1e6);
+    bench_record(spec, "jitter_ms", link.jitter_ns / 1e6);
+    bench_record(spec, "overhead_bytes_per_sec", link.overhead_bytes / seconds);
+    client->disconnect();
+    delete client;
+    delete server;
+}
+
+// The RTT the probes report under each profile next to the delays put in,
+// and the bytes probing adds
+void bench_link_probe(void)
+{
+    auto loop = new event_loop();
+    printf("%zu byte messages every %ld ms each way, probes every %ld ms, caller impaired\n", LINK_MESSAGE_SIZE,
+        (long) LINK_MESSAGE_INTERVAL.count(), (long) LINK_PROBE_INTERVAL.count());
+    printf("%-32s %8s %8s %8s %8s %6s %10s %10s %s\n", "profile", "srtt ms", "min ms", "max ms", "jitter", "probes", "tx B/s", "ovh B/s", "stream");
+    for (const auto profile_spec : profiles) {run_profile(loop, profile_spec, bench_free_port(SOCK_STREAM));}
+    delete loop;
+}
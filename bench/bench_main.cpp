@@ -0,0 +1,179 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#include "../board.h"
+
+std::atomic<uint64_t> bench_allocs(0);
+
+void *operator new(size_t size)
+{
+    bench_allocs.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) {throw std::bad_alloc();}
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+    (void) size;
+    free(p);
+}
+
+struct bench_entry {
+    const char *name;
+    void (*func)(void);
+};
+
+static const bench_entry benches[] = {
+    {"ring_buffer", bench_ring_buffer},
+    {"hot_path", bench_hot_path},
+    {"bulk_in", bench_bulk_in},
+    {"tcp_sock", bench_tcp_sock},
+    {"relay", bench_relay},
+    {"transport", bench_transport},
+    {"rt", bench_rt},
+    {"impairment", bench_impairment},
+    {"link_probe", bench_link_probe},
+    // These leave their modem threads running, keep them last
+    {"e2e", bench_e2e},
+    {"replay", bench_replay},
+};
+
+static FILE *record_fp = nullptr;
+static const char *current_bench = "";
+static int failures = 0;
+static struct utsname host;
+
+void bench_record(const char *name, const char *metric, double value)
+{
+    if (record_fp == nullptr) {return;}
+
+    // One JSON object per line, keyed so results of different builds can be joined
+    fprintf(record_fp, "{\"board\":\"%s\",\"machine\":\"%s\",\"compiler\":\"%s\",\"bench\":\"%s\",\"name\":\"%s\",\"metric\":\"%s\",\"value\":%.6g}\n",
+        BOARD_NAME, host.machine, __VERSION__, current_bench, name, metric, value);
+    fflush(record_fp);
+}
+
+void bench_report(const char *name, uint64_t iterations, double ns_total, size_t bytes_per_op, uint64_t allocs)
+{
+    const auto ns_per_op = ns_total / iterations;
+    const auto allocs_per_op = (double) allocs / iterations;
+    if (bytes_per_op > 0) {
+        const auto mb_per_sec = bytes_per_op / ns_per_op * 1e3;
+        printf("%-32s %12.1f ns/op %12.1f MB/s %10.2f allocs/op\n", name, ns_per_op, mb_per_sec, allocs_per_op);
+        bench_record(name, "bytes_per_sec", mb_per_sec * 1e6);
+    } else {
+        printf("%-32s %12.1f ns/op %12s      %10.2f allocs/op\n", name, ns_per_op, "", allocs_per_op);
+    }
+    bench_record(name, "ns_per_op", ns_per_op);
+    bench_record(name, "allocs_per_op", allocs_per_op);
+}
+
+void bench_fail(const char *name, const char *reason)
+{
+    printf("FAIL: %s: %s\n", name, reason);
+    bench_record(name, "failed", 1);
+    failures++;
+}
+
+uint16_t bench_free_port(int type)
+{
+    int fd = socket(AF_INET, type, 0);
+    const int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    socklen_t length = sizeof(addr);
+    if (fd < 0 || bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        getsockname(fd, reinterpret_cast<struct sockaddr *>(&addr), &length) < 0) {
+        perror("bench: free port");
+        exit(1);
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static void show_usage(char *prog_name)
+{
+    printf("Usage: %s [-h] [-o result.jsonl] [-y recording[,speed]] [bench]...\n", prog_name);
+    printf("  -o    also write results as JSON lines to this file\n");
+    printf("  -y    replay this recording (me56ps2 -T) in bench replay, speed times as fast (default: 1, 0 for unpaced)\n");
+    printf("Benchmarks:");
+    for (const auto &b : benches) {printf(" %s", b.name);}
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "ho:y:")) != -1) {
+        switch (opt) {
+            case 'o':
+                record_fp = fopen(optarg, "w");
+                if (record_fp == nullptr) {
+                    perror("fopen()");
+                    exit(1);
+                }
+                break;
+            case 'y': {
+                // Input format: "path" or "path,speed"
+                bench_recording = optarg;
+                const auto comma = bench_recording.rfind(',');
+                if (comma != std::string::npos) {
+                    bench_replay_speed = atof(bench_recording.c_str() + comma + 1);
+                    bench_recording.resize(comma);
+                }
+                if (bench_recording.empty() || bench_replay_speed < 0) {
+                    show_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'h':
+                show_usage(argv[0]);
+                exit(0);
+            default:
+                show_usage(argv[0]);
+                exit(1);
+        }
+    }
+    uname(&host);
+    printf("board: %s, machine: %s, compiler: %s\n\n", BOARD_NAME, host.machine, __VERSION__);
+
+    // Run all benchmarks, or only the ones named on the command line
+    for (const auto &b : benches) {
+        bool selected = optind >= argc;
+        for (int i = optind; i < argc; i++) {
+            if (strcmp(argv[i], b.name) == 0) {selected = true;}
+        }
+        if (!selected) {continue;}
+
+        printf("== %s ==\n", b.name);
+        current_bench = b.name;
+        b.func();
+        printf("\n");
+    }
+
+    if (record_fp != nullptr) {fclose(record_fp);}
+    if (failures > 0) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
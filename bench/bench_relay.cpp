@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../tcp_sock.h"
+#include "../relay_server.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr uint16_t RELAY_PORT = 47100;
+constexpr uint16_t DIRECT_PORT = 47101;
+constexpr int SESSIONS = 2000;
+constexpr int PING_ROUNDS = 4000;
+constexpr size_t PING_SIZE = 64;
+constexpr size_t SATURATE_BYTES = 16 << 20; // each way
+constexpr int SATURATE_SOCKET_BUFFER = 16384;
+constexpr auto SATURATE_READ_DELAY = std::chrono::milliseconds(200);
+constexpr auto SATURATE_TIMEOUT = std::chrono::seconds(5);
+
+static struct sockaddr_in loopback(uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+static int dial(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    auto addr = loopback(port);
+    ::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    return fd;
+}
+
+static void send_line(int fd, const std::string &line)
+{
+    const auto s = line + "\r\n";
+    ::send(fd, s.c_str(), s.length(), 0);
+}
+
+static bool read_reply(int fd)
+{
+    // Read up to and including '\n', one byte at a time so no modem data is eaten
+    std::string line;
+    char c;
+    while (::recv(fd, &c, 1, 0) == 1) {
+        if (c == '\n') {return line.compare(0, 7, "CONNECT") == 0;}
+        line += c;
+    }
+    return false;
+}
+
+static void read_full(int fd, char *buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length) {
+        auto n = ::recv(fd, buffer + done, length - done, 0);
+        if (n <= 0) {return;}
+        done += n;
+    }
+}
+
+// Round trip of PING_SIZE bytes a -> b -> a, spread over the given pairs
+static std::vector<double> ping_pong(const std::vector<std::pair<int, int>> &pairs)
+{
+    std::vector<double> rtt;
+    char buf[PING_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    for (int i = 0; i < PING_ROUNDS; i++) {
+        const auto &p = pairs[i % pairs.size()];
+        const auto t0 = bench_clock::now();
+        ::send(p.first, buf, sizeof(buf), 0);
+        read_full(p.second, buf, sizeof(buf));
+        ::send(p.second, buf, sizeof(buf), 0);
+        read_full(p.first, buf, sizeof(buf));
+        rtt.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t0).count());
+    }
+    std::sort(rtt.begin(), rtt.end());
+    return rtt;
+}
+
+static void print_rtt(const char *name, const std::vector<double> &rtt)
+{
+    printf("%-16s %14.1f %14.1f %14.1f\n", name, rtt[rtt.size() / 2], rtt[rtt.size() * 99 / 100], rtt.back());
+    bench_record(name, "rtt_p50_us", rtt[rtt.size() / 2]);
+    bench_record(name, "rtt_p99_us", rtt[rtt.size() * 99 / 100]);
+}
+
+// Both ends send SATURATE_BYTES at once and start reading only after a
+// while, so both directions of the session back up in the relay together;
+// every byte must still come through
+static void bench_saturate(int a, int b)
+{
+    const struct timeval timeout = {SATURATE_TIMEOUT.count(), 0};
+    std::atomic<size_t> received[2] = {{0}, {0}};
+    std::vector<std::thread> threads;
+    const auto t0 = bench_clock::now();
+    for (int i = 0; i < 2; i++) {
+        const int fd = i == 0 ? a : b;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        // Small buffers, so the backlog is in the relay and not in the ends
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SATURATE_SOCKET_BUFFER, sizeof(SATURATE_SOCKET_BUFFER));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &SATURATE_SOCKET_BUFFER, sizeof(SATURATE_SOCKET_BUFFER));
+        threads.emplace_back([fd] {
+            std::vector<char> chunk(65536, 's');
+            size_t sent = 0;
+            while (sent < SATURATE_BYTES) {
+                const auto n = ::send(fd, chunk.data(), std::min(chunk.size(), SATURATE_BYTES - sent), MSG_NOSIGNAL);
+                if (n <= 0) {return;}
+                sent += n;
+            }
+        });
+        threads.emplace_back([fd, i, &received] {
+            std::this_thread::sleep_for(SATURATE_READ_DELAY);
+            std::vector<char> buf(65536);
+            while (received[i].load() < SATURATE_BYTES) {
+                const auto n = ::recv(fd, buf.data(), buf.size(), 0);
+                if (n <= 0) {return;}
+                received[i] += n;
+            }
+        });
+    }
+    for (auto &t : threads) {t.join();}
+    const auto sec = std::chrono::duration<double>(bench_clock::now() - t0).count();
+    const auto ok = received[0].load() == SATURATE_BYTES && received[1].load() == SATURATE_BYTES;
+    printf("%-16s %14.1f %14.1f %14s\n", "both ways", received[0].load() * 2 / sec / 1e6, sec * 1e3, ok ? "ok" : "stalled");
+    bench_record("saturate", "mb_per_sec", received[0].load() * 2 / sec / 1e6);
+    bench_record("saturate", "stalled", ok ? 0 : 1);
+}
+
+static void bench_tcp_sock_relay(void)
+{
+    // Two emulated modems on the relay: B dials A's number
+    auto loop = new event_loop();
+    auto a = new tcp_sock(loop, false, "127.0.0.1", RELAY_PORT);
+    auto b = new tcp_sock(loop, false, "127.0.0.1", RELAY_PORT);
+    std::atomic<bool> ring(false);
+    std::atomic<size_t> received(0);
+    a->set_ring_callback([&ring]{ring.store(true);});
+    a->set_recv_callback([&received](const char *buffer, size_t length){(void) buffer; received += length;});
+    a->set_relay("5551000");
+    b->set_relay("5551001");
+    b->set_dial_number("5551000");
+
+    // Let A register first
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const auto t0 = bench_clock::now();
+    const auto paired = b->connect();
+    while (paired && !ring.load()) {std::this_thread::yield();}
+    const auto t1 = bench_clock::now();
+    b->send("hello", 5);
+    while (paired && received.load() < 5) {std::this_thread::yield();}
+
+    printf("%-16s %14s %14.1f\n", "tcp_sock ATD", paired ? "CONNECT" : "BUSY",
+        std::chrono::duration<double, std::micro>(t1 - t0).count());
+
+    delete b;
+    delete a;
+    delete loop;
+}
+
+void bench_relay(void)
+{
+    auto relay = new relay_server("127.0.0.1", RELAY_PORT, std::thread::hardware_concurrency(), 0);
+
+    // Pair SESSIONS answer/dial connections
+    std::vector<int> answer_fds, dial_fds;
+    for (int i = 0; i < SESSIONS; i++) {
+        int fd = dial(RELAY_PORT);
+        send_line(fd, "ME56PS2 ANSWER " + std::to_string(1000000 + i));
+        answer_fds.push_back(fd);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // answerers registered
+    const auto t1 = bench_clock::now();
+    int connected = 0;
+    std::vector<std::pair<int, int>> relay_pairs;
+    for (int i = 0; i < SESSIONS; i++) {
+        int fd = dial(RELAY_PORT);
+        send_line(fd, "ME56PS2 DIAL " + std::to_string(1000000 + i));
+        dial_fds.push_back(fd);
+        if (read_reply(fd) && read_reply(answer_fds[i])) {
+            connected++;
+            relay_pairs.push_back({dial_fds[i], answer_fds[i]});
+        }
+    }
+    const auto t2 = bench_clock::now();
+    printf("%-16s %14s %14s\n", "setup", "sessions", "dial us");
+    printf("%-16s %14d %14.1f\n", "relay", connected,
+        std::chrono::duration<double, std::micro>(t2 - t1).count() / SESSIONS);
+    bench_record("relay", "dial_us", std::chrono::duration<double, std::micro>(t2 - t1).count() / SESSIONS);
+
+    // Busy number
+    {
+        int fd = dial(RELAY_PORT);
+        send_line(fd, "ME56PS2 DIAL 9999999");
+        printf("%-16s %14s\n", "unknown number", read_reply(fd) ? "CONNECT" : "BUSY");
+        close(fd);
+    }
+
+    // Direct loopback connection for comparison
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    auto addr = loopback(DIRECT_PORT);
+    bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    listen(listen_fd, 1);
+    int direct_a = dial(DIRECT_PORT);
+    int direct_b = accept(listen_fd, nullptr, nullptr);
+    const int nodelay = 1;
+    setsockopt(direct_b, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    printf("%-16s %14s %14s %14s\n", "rtt 64B", "p50 us", "p99 us", "max us");
+    const auto direct = ping_pong({{direct_a, direct_b}});
+    print_rtt("direct", direct);
+    if (!relay_pairs.empty()) {
+        const auto relayed = ping_pong(relay_pairs);
+        print_rtt("relay", relayed);
+        printf("%-16s %14.1f us per direction at p50, %d sessions open\n", "overhead",
+            (relayed[relayed.size() / 2] - direct[direct.size() / 2]) / 2, connected);
+    }
+    close(direct_a);
+    close(direct_b);
+    close(listen_fd);
+
+    if (!relay_pairs.empty()) {
+        printf("%-16s %14s %14s %14s\n", "saturate 16MB", "MB/s", "ms", "stream");
+        bench_saturate(relay_pairs[0].first, relay_pairs[0].second);
+    }
+
+    relay->print_stats();
+
+    for (auto fd : dial_fds) {close(fd);}
+    for (auto fd : answer_fds) {close(fd);}
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    bench_tcp_sock_relay();
+    relay->print_stats();
+    delete relay;
+}
@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../usb_gadget.h"
+#include "../usb_sim_host.h"
+#include "../ring_buffer.h"
+#include "../latency_histogram.h"
+#include "../bulk_in_scheduler.h"
+#include "../line_pacer.h"
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../modem_session.h"
+#include "../traffic_record.h"
+#include "bench.h"
+
+#include "../board.h"
+#include "../me56ps2.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr uint16_t REPLAY_PORT = 47600;
+constexpr auto REPLAY_TIMEOUT = std::chrono::milliseconds(5000);
+
+std::string bench_recording;
+double bench_replay_speed = 1.0;
+
+// One write of the game, at its time into the replay
+struct replay_chunk {
+    int64_t at_ns;
+    std::string data;
+};
+
+// One direction of the replayed call: what goes in on one host and comes out
+// of the other, and when each chunk came out complete
+struct replay_stream {
+    std::vector<replay_chunk> chunks;
+    std::string expected;
+    std::vector<bench_clock::time_point> sent; // per chunk
+    std::vector<double> latency_ms; // per chunk
+    size_t received;
+    bool corrupted;
+};
+
+// The on-line periods of one modem, with the off-line time in between left
+// out: bulk-OUT payloads (packet headers dropped) as sent by its console and
+// socket data as received from the remote side
+static bool load_recording(const char *path, int modem, replay_stream *out, replay_stream *in, int64_t *recorded_ns)
+{
+    recording_reader reader;
+    if (!reader.open(path)) {return false;}
+    bool online = false;
+    int64_t skipped = 0, last = 0; // off-line time so far, end of the last call
+    record_view r;
+    while (reader.next(&r)) {
+        if (r.modem != modem) {continue;}
+        const int64_t t = r.time_ns;
+        if (r.kind == RECORD_CALL) {
+            if (r.arg != 0 && !online) {
+                skipped += t - last;
+            } else if (r.arg == 0 && online) {
+                last = t;
+            }
+            online = r.arg != 0;
+            continue;
+        }
+        if (!online) {continue;}
+        if (r.kind == RECORD_BULK_OUT) {
+            std::string payload;
+            for (size_t offset = 0; offset < r.length; offset += MAX_PACKET_SIZE_BULK) {
+                const auto packet_length = std::min<size_t>(MAX_PACKET_SIZE_BULK, r.length - offset);
+                const auto length = std::min<size_t>(r.data[offset] >> 2, packet_length - 1);
+                payload.append(reinterpret_cast<const char *>(&r.data[offset + 1]), length);
+            }
+            if (!payload.empty()) {out->chunks.push_back({t - skipped, payload});}
+        } else if (r.kind == RECORD_SOCK_RX && r.length > 0) {
+            in->chunks.push_back({t - skipped, std::string(reinterpret_cast<const char *>(r.data), r.length)});
+        }
+    }
+    for (auto s : {out, in}) {
+        // Threads record out of order by a few us; send in time order
+        std::stable_sort(s->chunks.begin(), s->chunks.end(), [](const replay_chunk &a, const replay_chunk &b){return a.at_ns < b.at_ns;});
+        for (const auto &c : s->chunks) {s->expected += c.data;}
+        s->sent.resize(s->chunks.size());
+        s->received = 0;
+        s->corrupted = false;
+    }
+    int64_t first = INT64_MAX, end = 0;
+    for (auto s : {out, in}) {
+        if (s->chunks.empty()) {continue;}
+        first = std::min(first, s->chunks.front().at_ns);
+        end = std::max(end, s->chunks.back().at_ns);
+    }
+    if (first == INT64_MAX) {return true;}
+    for (auto s : {out, in}) {
+        for (auto &c : s->chunks) {c.at_ns -= first;}
+    }
+    *recorded_ns = end - first;
+    return true;
+}
+
+static void send_stream(usb_sim_host *host, replay_stream *s, bench_clock::time_point t0, double speed)
+{
+    for (size_t i = 0; i < s->chunks.size(); i++) {
+        if (speed > 0) {std::this_thread::sleep_until(t0 + std::chrono::nanoseconds(static_cast<int64_t>(s->chunks[i].at_ns / speed)));}
+        s->sent[i] = bench_clock::now();
+        host->write(s->chunks[i].data);
+    }
+}
+
+static void receive_stream(usb_sim_host *host, replay_stream *s)
+{
+    // A chunk is through once every byte up to its end has come out
+    char buf[4096];
+    size_t chunk = 0, chunk_end = s->chunks.empty() ? 0 : s->chunks[0].data.length();
+    while (s->received < s->expected.length()) {
+        const auto n = host->read(buf, sizeof(buf), REPLAY_TIMEOUT);
+        if (n == 0) {break;}
+        const auto now = bench_clock::now();
+        if (memcmp(buf, s->expected.data() + s->received, std::min(n, s->expected.length() - s->received)) != 0) {s->corrupted = true;}
+        s->received += n;
+        while (chunk < s->chunks.size() && s->received >= chunk_end) {
+            s->latency_ms.push_back(std::chrono::duration<double, std::milli>(now - s->sent[chunk]).count());
+            if (++chunk < s->chunks.size()) {chunk_end += s->chunks[chunk].data.length();}
+        }
+    }
+}
+
+static void print_stream(const char *name, replay_stream *s)
+{
+    if (s->latency_ms.empty()) {
+        printf("%-24s %8zu %10zu %10s %10s %10s %s\n", name, s->chunks.size(), s->expected.length(), "-", "-", "-",
+            s->chunks.empty() ? "empty" : "data missing");
+        return;
+    }
+    auto &l = s->latency_ms;
+    std::sort(l.begin(), l.end());
+    const auto p50 = l[l.size() / 2], p99 = l[l.size() * 99 / 100], max = l.back();
+    printf("%-24s %8zu %10zu %10.2f %10.2f %10.2f %s\n", name, s->chunks.size(), s->expected.length(), p50, p99, max,
+        s->received < s->expected.length() ? "data missing" : s->corrupted ? "data corrupted" : "ok");
+    bench_record(name, "p50_ms", p50);
+    bench_record(name, "p99_ms", p99);
+    bench_record(name, "max_ms", max);
+}
+
+// A recorded call (me56ps2 -T) played back through two emulators over
+// loopback: what the recorded console sent goes into one simulated host,
+// what the remote side sent into the other, at the recorded times (or
+// faster with -y file,speed; 0 for as fast as possible). The latency of each
+// chunk through the data path compares builds on the same game traffic.
+void bench_replay(void)
+{
+    if (bench_recording.empty()) {
+        printf("no recording, skipped (-y file[,speed], recorded with me56ps2 -T)\n");
+        return;
+    }
+    replay_stream out, in;
+    int64_t recorded_ns = 0;
+    if (!load_recording(bench_recording.c_str(), 0, &out, &in, &recorded_ns)) {return;}
+    if (out.chunks.empty() && in.chunks.empty()) {
+        printf("%s: no call data of modem0\n", bench_recording.c_str());
+        return;
+    }
+
+    usb_sim_host_timing timing;
+    auto loop = new event_loop();
+    auto answer_host = new usb_sim_host(timing);
+    auto call_host = new usb_sim_host(timing);
+    modem_config answer_config = {"sim", "sim.0", "127.0.0.1", REPLAY_PORT, true, -1, nullptr, false, 0, std::chrono::milliseconds(0), false,
+        BULK_IN_PACKETS_DEFAULT, 1, false, 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), nullptr, std::chrono::milliseconds(0), nullptr};
+    modem_config call_config = {"sim", "sim.1", "127.0.0.1", REPLAY_PORT, false, -1, nullptr, false, 0, std::chrono::milliseconds(0), false,
+        BULK_IN_PACKETS_DEFAULT, 1, false, 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), 0, std::chrono::milliseconds(0), nullptr, std::chrono::milliseconds(0), nullptr};
+    bulk_in_policy policy;
+    auto answer = new modem_session(0, answer_config, policy, loop, answer_host, 0);
+    auto call = new modem_session(1, call_config, policy, loop, call_host, 0);
+    answer->start();
+    call->start();
+    if (!answer_host->wait_configured(REPLAY_TIMEOUT) || !call_host->wait_configured(REPLAY_TIMEOUT)) {
+        printf("enumeration timed out\n");
+        return;
+    }
+    call_host->write("ATDT127-000-000-001#" + std::to_string(REPLAY_PORT) + "\r");
+    if (!answer_host->read_until("RING\r\n", REPLAY_TIMEOUT)) {
+        printf("no RING\n");
+        return;
+    }
+    answer_host->write("ATA\r");
+    const auto connected = answer_host->read_until("CONNECT", REPLAY_TIMEOUT) && answer_host->read_until("\r\n", REPLAY_TIMEOUT) &&
+        call_host->read_until("CONNECT", REPLAY_TIMEOUT) && call_host->read_until("\r\n", REPLAY_TIMEOUT);
+    if (!connected) {
+        printf("no CONNECT\n");
+        return;
+    }
+
+    // The caller plays the recorded console, the answering side the remote game
+    if (bench_replay_speed > 0) {
+        printf("%s: %.1f s of call at %gx speed\n", bench_recording.c_str(), recorded_ns / 1e9, bench_replay_speed);
+    } else {
+        printf("%s: %.1f s of call, unpaced\n", bench_recording.c_str(), recorded_ns / 1e9);
+    }
+    printf("%-24s %8s %10s %10s %10s %10s %s\n", "direction", "chunks", "bytes", "p50 ms", "p99 ms", "max ms", "stream");
+    const auto t0 = bench_clock::now();
+    std::thread out_receiver([&]{receive_stream(answer_host, &out);});
+    std::thread in_receiver([&]{receive_stream(call_host, &in);});
+    std::thread out_sender([&]{send_stream(call_host, &out, t0, bench_replay_speed);});
+    std::thread in_sender([&]{send_stream(answer_host, &in, t0, bench_replay_speed);});
+    out_sender.join();
+    in_sender.join();
+    out_receiver.join();
+    in_receiver.join();
+    const auto replay_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - t0).count();
+
+    print_stream("console -> remote", &out);
+    print_stream("remote -> console", &in);
+    printf("%-24s %10.1f s replayed in %.1f s\n", "duration", recorded_ns / 1e9, replay_ns / 1e9);
+    bench_record("duration", "recorded_sec", recorded_ns / 1e9);
+    bench_record("duration", "replay_sec", replay_ns / 1e9);
+    answer_host->set_dtr(false);
+    call_host->read_until("NO CARRIER\r\n", REPLAY_TIMEOUT);
+}
@@ -0,0 +1,156 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../ring_buffer.h"
+#include "ring_buffer_mutex.h"
+#include "bench.h"
+
+constexpr size_t BUFFER_SIZE = 524288;
+constexpr size_t CHUNK_SIZE = 64; // tcp_sock receive chunk
+constexpr size_t READ_SIZE = 62; // bulk-in payload per packet
+constexpr size_t TOTAL_BYTES = 64 * 1024 * 1024;
+constexpr size_t SOCKET_BYTES = 16 * 1024 * 1024;
+constexpr size_t SOCKET_WRITE_SIZE = 1024; // a burst from the peer
+constexpr size_t RECV_BUF_SIZE = 4096; // tcp_sock::recv_buf
+
+// Producers push CHUNK_SIZE chunks, the consumer drains READ_SIZE at a time
+// like usb_bulk_in_thread does. notify tells whether the producer has to
+// call notify_one() itself (ring_buffer_mutex) or not (ring_buffer).
+template <typename Q>
+static double run(Q &q, int producers, bool notify)
+{
+    const size_t per_producer = TOTAL_BYTES / producers;
+    std::vector<std::thread> threads;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < producers; i++) {
+        threads.emplace_back([&] {
+            char chunk[CHUNK_SIZE];
+            memset(chunk, 'x', sizeof(chunk));
+            size_t sent = 0;
+            while (sent < per_producer) {
+                const auto len = q.enqueue(chunk, std::min(sizeof(chunk), per_producer - sent));
+                if (len == 0) {std::this_thread::yield(); continue;}
+                if (notify) {q.notify_one();}
+                sent += len;
+            }
+        });
+    }
+
+    char buf[READ_SIZE];
+    size_t received = 0;
+    while (received < per_producer * producers) {
+        const auto len = q.dequeue(buf, sizeof(buf));
+        if (len == 0) {
+            q.wait(std::chrono::steady_clock::now() + std::chrono::milliseconds(1));
+            continue;
+        }
+        received += len;
+    }
+    const auto end = std::chrono::steady_clock::now();
+
+    for (auto &t : threads) {t.join();}
+
+    const auto sec = std::chrono::duration<double>(end - start).count();
+    return received / sec / 1e6;
+}
+
+// A peer writes bursts into a socket; the receiver moves them into the ring
+// either through a recv() buffer and enqueue(), or with readv() straight
+// into the free space. The consumer drains like usb_bulk_in_thread.
+static double run_socket(bool in_place, double *reads_per_mb)
+{
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    ring_buffer<char> q(BUFFER_SIZE);
+    size_t reads = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    std::thread peer([&] {
+        char chunk[SOCKET_WRITE_SIZE];
+        memset(chunk, 'x', sizeof(chunk));
+        for (size_t sent = 0; sent < SOCKET_BYTES; sent += sizeof(chunk)) {
+            if (write(fds[1], chunk, sizeof(chunk)) < 0) {break;}
+        }
+    });
+    std::thread receiver([&] {
+        char buf[RECV_BUF_SIZE];
+        size_t received = 0;
+        while (received < SOCKET_BYTES) {
+            if (in_place) {
+                struct iovec iov[2];
+                const auto segments = q.begin_write(iov);
+                if (segments == 0) {std::this_thread::yield(); continue;}
+                const auto len = readv(fds[0], iov, segments);
+                q.commit_write(len > 0 ? len : 0);
+                if (len <= 0) {break;}
+                received += len;
+            } else {
+                const auto len = recv(fds[0], buf, sizeof(buf), 0);
+                if (len <= 0) {break;}
+                for (size_t queued = 0; queued < static_cast<size_t>(len);) {
+                    const auto n = q.enqueue(buf + queued, len - queued);
+                    if (n == 0) {std::this_thread::yield();}
+                    queued += n;
+                }
+                received += len;
+            }
+            reads++;
+        }
+    });
+
+    char buf[READ_SIZE];
+    size_t received = 0;
+    while (received < SOCKET_BYTES) {
+        const auto len = q.dequeue(buf, sizeof(buf));
+        if (len == 0) {
+            q.wait(std::chrono::steady_clock::now() + std::chrono::milliseconds(1));
+            continue;
+        }
+        received += len;
+    }
+    const auto end = std::chrono::steady_clock::now();
+    peer.join();
+    receiver.join();
+    close(fds[0]);
+    close(fds[1]);
+
+    *reads_per_mb = reads / (SOCKET_BYTES / 1e6);
+    const auto sec = std::chrono::duration<double>(end - start).count();
+    return received / sec / 1e6;
+}
+
+void bench_ring_buffer(void)
+{
+    printf("%-24s %10s %12s\n", "ring buffer", "producers", "MB/s");
+    for (const int producers : {1, 3}) {
+        ring_buffer_mutex<char> old_q(BUFFER_SIZE);
+        const auto old_mbps = run(old_q, producers, true);
+        printf("%-24s %10d %12.1f\n", "ring_buffer_mutex", producers, old_mbps);
+        bench_record(("ring_buffer_mutex x" + std::to_string(producers)).c_str(), "bytes_per_sec", old_mbps * 1e6);
+
+        ring_buffer<char> new_q(BUFFER_SIZE);
+        const auto new_mbps = run(new_q, producers, false);
+        printf("%-24s %10d %12.1f\n", "ring_buffer (lock-free)", producers, new_mbps);
+        bench_record(("ring_buffer x" + std::to_string(producers)).c_str(), "bytes_per_sec", new_mbps * 1e6);
+
+        printf("%-24s %10d %11.2fx\n", "speedup", producers, new_mbps / old_mbps);
+    }
+
+    printf("%-24s %10s %12s\n", "socket to ring", "reads/MB", "MB/s");
+    for (const bool in_place : {false, true}) {
+        const char *name = in_place ? "readv into ring" : "recv + enqueue";
+        double reads_per_mb;
+        const auto mbps = run_socket(in_place, &reads_per_mb);
+        printf("%-24s %10.1f %12.1f\n", name, reads_per_mb, mbps);
+        bench_record(name, "bytes_per_sec", mbps * 1e6);
+        bench_record(name, "reads_per_mb", reads_per_mb);
+    }
+}
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+
+#include "../ring_buffer.h"
+#include "../latency_histogram.h"
+#include "../bulk_in_scheduler.h"
+#include "../rt_profile.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr auto RT_PHASE_DURATION = std::chrono::seconds(2);
+constexpr auto RT_PRODUCE_INTERVAL = std::chrono::microseconds(3100); // off the 1 ms status grid
+constexpr int RT_PRIORITY = 80;
+
+// Stand-in for Wi-Fi and logging work: every CPU is kept busy, with short
+// sleeps so the scheduler keeps moving threads around.
+static void load_thread(std::atomic<bool> *stop)
+{
+    FILE *fp = fopen("/dev/null", "w");
+    while (!stop->load()) {
+        const auto until = bench_clock::now() + std::chrono::milliseconds(5);
+        while (bench_clock::now() < until) {fprintf(fp, "load %ld\n", (long) until.time_since_epoch().count());}
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    fclose(fp);
+}
+
+// The bulk-IN thread's wait loop with a 1 ms status interval, woken by
+// timestamped data every RT_PRODUCE_INTERVAL. Returns false if the profile
+// could not be applied.
+static bool run_phase(const char *name, bool rt, int load_threads)
+{
+    latency_histogram wake_late, data_wake;
+    ring_buffer<char> buffer(4096);
+    std::atomic<bool> dcd(false), stop(false), applied(true);
+
+    std::vector<std::thread> load;
+    for (int i = 0; i < load_threads; i++) {load.emplace_back(load_thread, &stop);}
+
+    std::thread consumer([&] {
+        if (rt) {applied.store(rt_enter_thread("bench", RT_PRIORITY));}
+        bulk_in_policy policy;
+        policy.status_interval = std::chrono::milliseconds(1);
+        policy.status_interval_max = std::chrono::milliseconds(1);
+        bulk_in_scheduler scheduler(&buffer, &dcd, policy);
+        scheduler.set_wake_probe(&wake_late);
+        while (!stop.load()) {
+            scheduler.wait_next();
+            int64_t sent_at;
+            size_t n = 0;
+            while (buffer.get_count() >= sizeof(sent_at)) {
+                buffer.dequeue(reinterpret_cast<char *>(&sent_at), sizeof(sent_at));
+                if (scheduler.get_woke_on_data()) {data_wake.record(std::max<int64_t>(0, bench_clock::now().time_since_epoch().count() - sent_at));}
+                n += sizeof(sent_at);
+            }
+            scheduler.sent(n, false);
+        }
+    });
+
+    const auto end = bench_clock::now() + RT_PHASE_DURATION;
+    while (bench_clock::now() < end) {
+        std::this_thread::sleep_for(RT_PRODUCE_INTERVAL);
+        const int64_t now = bench_clock::now().time_since_epoch().count();
+        buffer.enqueue(reinterpret_cast<const char *>(&now), sizeof(now));
+    }
+    stop.store(true);
+    buffer.notify_one();
+    consumer.join();
+    for (auto &t : load) {t.join();}
+
+    if (!applied.load()) {
+        printf("%-24s (SCHED_FIFO not permitted)\n", name);
+        return false;
+    }
+    for (const auto &probe : {std::make_pair("wake late", &wake_late), std::make_pair("enqueue -> wake", &data_wake)}) {
+        const auto h = probe.second;
+        const auto row = std::string(name) + " " + probe.first;
+        printf("%-32s %10.1f %10.1f %10.1f %10.1f\n", row.c_str(),
+            h->get_percentile(50) / 1e3, h->get_percentile(99) / 1e3, h->get_percentile(99.9) / 1e3, h->get_max() / 1e3);
+        bench_record(row.c_str(), "p50_us", h->get_percentile(50) / 1e3);
+        bench_record(row.c_str(), "p99_us", h->get_percentile(99) / 1e3);
+        bench_record(row.c_str(), "p999_us", h->get_percentile(99.9) / 1e3);
+        bench_record(row.c_str(), "max_us", h->get_max() / 1e3);
+    }
+    return true;
+}
+
+void bench_rt(void)
+{
+    const int cpus = std::max(1u, std::thread::hardware_concurrency());
+    printf("%-32s %10s %10s %10s %10s\n", "bulk-in jitter", "p50 us", "p99 us", "p99.9 us", "max us");
+    run_phase("idle", false, 0);
+    run_phase("loaded", false, cpus);
+    // The profile as -r applies it to the USB threads
+    const auto locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+    run_phase(locked ? "loaded rt" : "loaded rt (unlocked)", true, cpus);
+    if (locked) {munlockall();}
+}
@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../tcp_sock.h"
+#include "../resolver.h"
+#include "tcp_sock_select.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr uint16_t PORT_BASE = 47000;
+constexpr int DIAL_COUNT = 50;
+constexpr auto DEAD_HOST_TIMEOUT = std::chrono::milliseconds(500);
+constexpr size_t STREAM_BYTES = 1024 * 1024;
+constexpr size_t STREAM_CHUNK = 64;
+constexpr auto RESUME_GRACE = std::chrono::milliseconds(2000);
+constexpr int RESUME_CUTS = 5;
+constexpr auto RESUME_CUT_INTERVAL = std::chrono::milliseconds(200);
+constexpr auto RESUME_SEND_INTERVAL = std::chrono::microseconds(500); // 64 bytes each way, 128 KB/s
+
+static event_loop *bench_loop;
+static std::atomic<int64_t> ring_at(0);
+static std::atomic<size_t> received(0);
+
+static void on_ring(void)
+{
+    ring_at.store(bench_clock::now().time_since_epoch().count());
+}
+
+static void on_recv(const char *buffer, size_t length)
+{
+    (void) buffer;
+    received += length;
+}
+
+static int count_threads(void)
+{
+    int n = 0;
+    DIR *dir = opendir("/proc/self/task");
+    while (readdir(dir) != nullptr) {n++;}
+    closedir(dir);
+    return n - 2; // "." and ".."
+}
+
+static struct sockaddr_in loopback(uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+// Plain listener that accepts and immediately drops connections
+static int start_sink(uint16_t port, std::thread **t)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    auto addr = loopback(port);
+    bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    listen(fd, SOMAXCONN);
+    *t = new std::thread([fd] {
+        while (true) {
+            int c = accept(fd, nullptr, nullptr);
+            if (c < 0) {break;}
+            close(c);
+        }
+    });
+    return fd;
+}
+
+static int dial(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    auto addr = loopback(port);
+    ::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    return fd;
+}
+
+template <typename S>
+static void bench_dial(const char *name, S *client, uint16_t port)
+{
+    auto addr = loopback(port);
+    client->set_addr(&addr);
+    client->set_recv_callback(on_recv);
+
+    const auto threads_before = count_threads();
+    double connect_us = 0, disconnect_us = 0;
+    for (int i = 0; i < DIAL_COUNT; i++) {
+        const auto t0 = bench_clock::now();
+        client->connect();
+        const auto t1 = bench_clock::now();
+        client->disconnect();
+        const auto t2 = bench_clock::now();
+        connect_us += std::chrono::duration<double, std::micro>(t1 - t0).count();
+        disconnect_us += std::chrono::duration<double, std::micro>(t2 - t1).count();
+    }
+    printf("%-16s %14.1f %14.1f %14d\n", name, connect_us / DIAL_COUNT, disconnect_us / DIAL_COUNT, count_threads() - threads_before);
+    bench_record((std::string("dial ") + name).c_str(), "connect_us", connect_us / DIAL_COUNT);
+    bench_record((std::string("dial ") + name).c_str(), "hangup_us", disconnect_us / DIAL_COUNT);
+}
+
+// Listener on ::1 whose accept queue is full, so new SYNs go unanswered
+// like those to a host that is down
+static int start_blackhole(uint16_t port, int *filler)
+{
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    const int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_loopback;
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fd, 0) < 0) {
+        close(fd);
+        return -1;
+    }
+    *filler = socket(AF_INET6, SOCK_STREAM, 0);
+    ::connect(*filler, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    return fd;
+}
+
+static double dial_target_ms(tcp_sock *client, const char *host, uint16_t port, std::chrono::milliseconds timeout, dial_result *result)
+{
+    client->set_target(host, port);
+    std::promise<dial_result> done;
+    const auto t0 = bench_clock::now();
+    client->connect_async([&done](dial_result r){done.set_value(r);}, timeout);
+    *result = done.get_future().get();
+    const auto ms = std::chrono::duration<double, std::milli>(bench_clock::now() - t0).count();
+    client->disconnect();
+    return ms;
+}
+
+static const char *dial_result_name(dial_result result)
+{
+    return result == DIAL_CONNECTED ? "CONNECT" : result == DIAL_BUSY ? "BUSY" : "NO CARRIER";
+}
+
+static void bench_dial_target(const char *name, tcp_sock *client, const char *host, uint16_t port, int count, std::chrono::milliseconds timeout)
+{
+    double ms = 0;
+    dial_result result = DIAL_CONNECTED;
+    for (int i = 0; i < count; i++) {
+        dial_result r;
+        ms += dial_target_ms(client, host, port, timeout, &r);
+        if (r != DIAL_CONNECTED) {result = r;}
+    }
+    printf("%-24s %14.3f %14s\n", name, ms / count, dial_result_name(result));
+    bench_record((std::string("dial ") + name).c_str(), "connect_ms", ms / count);
+}
+
+// TCP forwarder between a client and a server. Each cut resets both of its
+// connections, as a NAT that forgets them would, and takes the next one.
+static std::thread *start_cutting_proxy(uint16_t port, uint16_t upstream_port, std::atomic<int> *cuts, std::atomic<bool> *stop)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    auto addr = loopback(port);
+    bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    listen(listen_fd, SOMAXCONN);
+    return new std::thread([listen_fd, upstream_port, cuts, stop] {
+        while (!stop->load()) {
+            struct pollfd lp = {listen_fd, POLLIN, 0};
+            if (poll(&lp, 1, 10) <= 0) {continue;}
+            int fds[2] = {accept(listen_fd, nullptr, nullptr), dial(upstream_port)};
+            const auto cuts_before = cuts->load();
+            char buf[4096];
+            bool open = true;
+            while (open && !stop->load() && cuts->load() == cuts_before) {
+                struct pollfd p[2] = {{fds[0], POLLIN, 0}, {fds[1], POLLIN, 0}};
+                if (poll(p, 2, 1) <= 0) {continue;}
+                for (int i = 0; i < 2 && open; i++) {
+                    if (!(p[i].revents & (POLLIN | POLLHUP | POLLERR))) {continue;}
+                    const auto n = ::recv(fds[i], buf, sizeof(buf), 0);
+                    open = n > 0 && ::send(fds[1 - i], buf, n, MSG_NOSIGNAL) == n;
+                }
+            }
+            // RST instead of FIN: a drop, not a hang-up
+            const struct linger reset = {1, 0};
+            for (auto fd : fds) {
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+                close(fd);
+            }
+        }
+        close(listen_fd);
+    });
+}
+
+// A counting byte stream in both directions through the proxy, whose
+// connection is reset RESUME_CUTS times: the call must carry on with every
+// byte in order and no hang-up
+static void bench_resume(const char *name, uint16_t proxy_port, uint16_t server_port, bool use_io_uring)
+{
+    std::atomic<int> cuts(0);
+    std::atomic<bool> stop(false);
+    auto proxy = start_cutting_proxy(proxy_port, server_port, &cuts, &stop);
+    auto server = new tcp_sock(bench_loop, true, "127.0.0.1", server_port);
+    auto client = new tcp_sock(bench_loop, false, "127.0.0.1", proxy_port);
+    if (use_io_uring && (!server->enable_io_uring() || !client->enable_io_uring())) {
+        printf("%-16s (io_uring not available)\n", name);
+    } else {
+        server->enable_resume(RESUME_GRACE);
+        client->enable_resume(RESUME_GRACE);
+        std::atomic<uint64_t> got[2] = {{0}, {0}}, wrong(0), hang_ups(0);
+        std::atomic<bool> rang(false);
+        tcp_sock *socks[2] = {server, client};
+        for (int i = 0; i < 2; i++) {
+            auto counter = &got[i];
+            socks[i]->set_recv_callback([counter, &wrong](const char *buffer, size_t length) {
+                for (size_t j = 0; j < length; j++) {
+                    if (static_cast<uint8_t>(buffer[j]) != static_cast<uint8_t>(counter->load() + j)) {wrong++;}
+                }
+                *counter += length;
+            });
+            socks[i]->set_disconnect_callback([&hang_ups]{hang_ups++;});
+        }
+        server->set_ring_callback([&rang]{rang.store(true);});
+
+        if (client->connect()) {
+            while (!rang.load()) {std::this_thread::yield();}
+            const auto duration = RESUME_CUT_INTERVAL * (RESUME_CUTS + 1);
+            std::vector<std::thread> senders;
+            std::atomic<uint64_t> sent[2] = {{0}, {0}};
+            for (int i = 0; i < 2; i++) {
+                senders.emplace_back([i, &socks, &sent, duration] {
+                    const auto end = bench_clock::now() + duration;
+                    char chunk[STREAM_CHUNK];
+                    uint64_t n = 0;
+                    while (bench_clock::now() < end) {
+                        for (auto &c : chunk) {c = static_cast<char>(n++);}
+                        socks[1 - i]->send(chunk, sizeof(chunk));
+                        std::this_thread::sleep_for(RESUME_SEND_INTERVAL);
+                    }
+                    sent[i].store(n);
+                });
+            }
+            std::vector<double> resume_ms;
+            for (int i = 0; i < RESUME_CUTS; i++) {
+                std::this_thread::sleep_for(RESUME_CUT_INTERVAL);
+                const auto resumes = client->get_stats().resumes;
+                cuts++;
+                const auto until = bench_clock::now() + RESUME_GRACE;
+                while (client->get_stats().resumes == resumes && bench_clock::now() < until) {std::this_thread::sleep_for(std::chrono::milliseconds(1));}
+                resume_ms.push_back(client->get_stats().last_resume_ns / 1e6);
+            }
+            for (auto &t : senders) {t.join();}
+            const auto until = bench_clock::now() + RESUME_GRACE;
+            while ((got[0].load() < sent[0].load() || got[1].load() < sent[1].load()) && bench_clock::now() < until) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            std::sort(resume_ms.begin(), resume_ms.end());
+            const auto lost = sent[0].load() + sent[1].load() - got[0].load() - got[1].load();
+            printf("%-16s %10zu %10.1f %10.1f %10lu %10lu %10lu\n", name, resume_ms.size(), resume_ms[resume_ms.size() / 2], resume_ms.back(),
+                (unsigned long) lost, (unsigned long) wrong.load(), (unsigned long) hang_ups.load());
+            bench_record((std::string("resume ") + name).c_str(), "resume_ms_p50", resume_ms[resume_ms.size() / 2]);
+            bench_record((std::string("resume ") + name).c_str(), "resume_ms_max", resume_ms.back());
+            bench_record((std::string("resume ") + name).c_str(), "bytes_lost", lost);
+            client->disconnect();
+        } else {
+            printf("%-16s no CONNECT\n", name);
+        }
+    }
+    stop.store(true);
+    proxy->join();
+    delete client;
+    delete server;
+}
+
+template <typename S>
+static void bench_accept(const char *name, S *server, uint16_t port)
+{
+    server->set_ring_callback(on_ring);
+    server->set_recv_callback(on_recv);
+
+    std::vector<double> latency;
+    for (int i = 0; i < DIAL_COUNT; i++) {
+        ring_at.store(0);
+        const auto t0 = bench_clock::now().time_since_epoch().count();
+        int fd = dial(port);
+        while (ring_at.load() == 0) {std::this_thread::yield();}
+        latency.push_back((ring_at.load() - t0) / 1000.0);
+        server->disconnect();
+        close(fd);
+    }
+    std::sort(latency.begin(), latency.end());
+    double sum = 0;
+    for (const auto l : latency) {sum += l;}
+    printf("%-16s %14.1f %14.1f\n", name, sum / latency.size(), latency[latency.size() * 99 / 100]);
+    bench_record((std::string("accept ") + name).c_str(), "to_ring_us", sum / latency.size());
+}
+
+static double loop_cpu_ms(void)
+{
+    // CPU time of the thread that receives, for both servers (select has its own thread)
+    struct timespec ts = {0, 0};
+    bench_loop->run_sync([&ts]{clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);});
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+template <typename S>
+static void bench_stream(const char *name, S *server, uint16_t port, uint64_t (*syscalls)(S *), bool on_loop)
+{
+    server->set_ring_callback(on_ring);
+    server->set_recv_callback(on_recv);
+
+    ring_at.store(0);
+    int fd = dial(port);
+    while (ring_at.load() == 0) {std::this_thread::yield();}
+
+    received.store(0);
+    const auto syscalls_before = syscalls(server);
+    const auto cpu_before = on_loop ? loop_cpu_ms() : 0;
+    const auto t0 = bench_clock::now();
+    char chunk[STREAM_CHUNK];
+    memset(chunk, 'x', sizeof(chunk));
+    for (size_t sent = 0; sent < STREAM_BYTES; sent += sizeof(chunk)) {
+        ::send(fd, chunk, sizeof(chunk), 0);
+    }
+    while (received.load() < STREAM_BYTES) {std::this_thread::yield();}
+    const auto t1 = bench_clock::now();
+    const auto calls = syscalls(server) - syscalls_before;
+    const auto cpu_ms = on_loop ? loop_cpu_ms() - cpu_before : 0;
+
+    server->disconnect();
+    close(fd);
+
+    const auto sec = std::chrono::duration<double>(t1 - t0).count();
+    const auto mb = STREAM_BYTES / 1e6;
+    if (on_loop) {
+        printf("%-16s %14.1f %14.1f %14.2f\n", name, calls / (STREAM_BYTES / 1024.0), mb / sec, cpu_ms / mb);
+        bench_record((std::string("stream ") + name).c_str(), "loop_cpu_ms_per_mb", cpu_ms / mb);
+    } else {
+        printf("%-16s %14.1f %14.1f %14s\n", name, calls / (STREAM_BYTES / 1024.0), mb / sec, "-");
+    }
+    bench_record((std::string("stream ") + name).c_str(), "syscalls_per_kb", calls / (STREAM_BYTES / 1024.0));
+    bench_record((std::string("stream ") + name).c_str(), "bytes_per_sec", STREAM_BYTES / sec);
+}
+
+static uint64_t select_syscalls(tcp_sock_select *s)
+{
+    return s->recv_syscalls.load();
+}
+
+static uint64_t epoll_syscalls(tcp_sock *s)
+{
+    // recv() (or io_uring_enter()) calls plus epoll_wait() returns
+    return s->get_stats().recv_calls + bench_loop->get_wakeups();
+}
+
+void bench_tcp_sock(void)
+{
+    bench_loop = new event_loop();
+    std::thread *sink_thread;
+    const int sink_fd = start_sink(PORT_BASE, &sink_thread);
+
+    printf("%-16s %14s %14s %14s\n", "dial", "connect us", "hangup us", "threads left");
+    {
+        auto client = new tcp_sock_select(false, "127.0.0.1", PORT_BASE);
+        bench_dial("select", client, PORT_BASE);
+        delete client;
+    }
+    {
+        auto client = new tcp_sock(bench_loop, false, "127.0.0.1", PORT_BASE);
+        bench_dial("epoll", client, PORT_BASE);
+        delete client;
+    }
+
+    // Targets of ATD: the resolver cache and racing the addresses of a host
+    printf("%-24s %14s %14s\n", "dial target", "connect ms", "result");
+    {
+        auto client = new tcp_sock(bench_loop, false, "127.0.0.1", PORT_BASE);
+        bench_dial_target("IPv4 literal", client, "127.0.0.1", PORT_BASE, DIAL_COUNT, std::chrono::milliseconds(0));
+        bench_dial_target("localhost, lookup", client, "localhost", PORT_BASE, 1, std::chrono::milliseconds(0));
+        bench_dial_target("localhost, cached", client, "localhost", PORT_BASE, DIAL_COUNT, std::chrono::milliseconds(0));
+        bench_record("dial localhost", "lookups", client->get_resolver()->get_lookups());
+
+        // PORT_BASE + 4 is dead on ::1 and answered on 127.0.0.1
+        int filler;
+        const int blackhole_fd = start_blackhole(PORT_BASE + 4, &filler);
+        if (blackhole_fd >= 0) {
+            std::thread *race_sink_thread;
+            const int race_sink_fd = start_sink(PORT_BASE + 4, &race_sink_thread);
+            struct sockaddr_storage dead, alive;
+            memset(&dead, 0, sizeof(dead));
+            auto dead6 = reinterpret_cast<struct sockaddr_in6 *>(&dead);
+            dead6->sin6_family = AF_INET6;
+            dead6->sin6_addr = in6addr_loopback;
+            const auto alive4 = loopback(0);
+            memset(&alive, 0, sizeof(alive));
+            memcpy(&alive, &alive4, sizeof(alive4));
+            client->get_resolver()->pin("dead.invalid", {dead});
+            client->get_resolver()->pin("race.invalid", {dead, alive});
+            bench_dial_target("dead host, 500 ms limit", client, "dead.invalid", PORT_BASE + 4, 1, DEAD_HOST_TIMEOUT);
+            // The IPv4 attempt starts DIAL_ATTEMPT_DELAY after the stalled IPv6 one
+            bench_dial_target("dead IPv6, live IPv4", client, "race.invalid", PORT_BASE + 4, 3, std::chrono::milliseconds(0));
+            shutdown(race_sink_fd, SHUT_RDWR);
+            close(race_sink_fd);
+            race_sink_thread->join();
+            close(filler);
+            close(blackhole_fd);
+        } else {
+            printf("%-24s (no IPv6 loopback)\n", "dead host");
+        }
+        delete client;
+    }
+
+    // Calls carried through reset connections (enable_resume())
+    printf("%-16s %10s %10s %10s %10s %10s %10s\n", "resume", "cuts", "p50 ms", "max ms", "lost B", "wrong B", "hang-ups");
+    bench_resume("epoll", PORT_BASE + 5, PORT_BASE + 6, false);
+    bench_resume("io_uring", PORT_BASE + 7, PORT_BASE + 8, true);
+
+    // The select() server can not be destroyed (its accept() never returns),
+    // so it is shared by the accept and stream runs and then leaked.
+    auto select_server = new tcp_sock_select(true, "127.0.0.1", PORT_BASE + 1);
+    auto epoll_server = new tcp_sock(bench_loop, true, "127.0.0.1", PORT_BASE + 2);
+    auto uring_server = new tcp_sock(bench_loop, true, "127.0.0.1", PORT_BASE + 3);
+    const auto has_uring = uring_server->enable_io_uring();
+
+    printf("%-16s %14s %14s\n", "accept", "to RING us", "p99 us");
+    bench_accept("select", select_server, PORT_BASE + 1);
+    bench_accept("epoll", epoll_server, PORT_BASE + 2);
+    if (has_uring) {bench_accept("io_uring", uring_server, PORT_BASE + 3);}
+
+    printf("%-16s %14s %14s %14s\n", "stream 64B", "syscalls/KB", "MB/s", "loop CPU ms/MB");
+    bench_stream("select", select_server, PORT_BASE + 1, select_syscalls, false);
+    bench_stream("epoll", epoll_server, PORT_BASE + 2, epoll_syscalls, true);
+    if (has_uring) {
+        // Completions are read from shared memory, only re-arming enters the kernel
+        bench_stream("io_uring", uring_server, PORT_BASE + 3, epoll_syscalls, true);
+    } else {
+        printf("%-16s (not available)\n", "io_uring");
+    }
+
+    delete uring_server;
+    delete epoll_server;
+    shutdown(sink_fd, SHUT_RDWR);
+    close(sink_fd);
+    sink_thread->join();
+    delete bench_loop;
+}
@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "../ring_buffer.h"
+#include "../event_loop.h"
+#include "../transport.h"
+#include "../tcp_sock.h"
+#include "../udp_sock.h"
+#include "bench.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+// The link: 10.99.0.1 is local; packets to 10.99.0.2 come back from 10.99.0.3
+// and the other way round, so both ends of a connection live in this process
+// but every packet crosses the lossy TUN device once.
+constexpr char LINK_NAME[] = "me56bench0";
+constexpr uint32_t LINK_LOCAL = 0x0a630001; // 10.99.0.1
+constexpr uint32_t LINK_PEER = 0x0a630002; // 10.99.0.2
+constexpr uint32_t LINK_REFLECTED = 0x0a630003; // 10.99.0.3
+constexpr auto LINK_DELAY = std::chrono::milliseconds(5); // one way
+constexpr size_t MESSAGE_SIZE = 64;
+constexpr auto TIMEOUT = std::chrono::milliseconds(5000);
+
+static uint16_t checksum(const uint8_t *data, size_t length, uint32_t sum)
+{
+    for (size_t i = 0; i + 1 < length; i += 2) {sum += (data[i] << 8) | data[i + 1];}
+    if (length & 1) {sum += data[length - 1] << 8;}
+    while (sum >> 16) {sum = (sum & 0xffff) + (sum >> 16);}
+    return ~sum & 0xffff;
+}
+
+// Rewrites the addresses of one IPv4 packet and fixes up its checksums
+static bool reflect(uint8_t *pkt, size_t length)
+{
+    if (length < sizeof(struct iphdr)) {return false;}
+    auto ip = reinterpret_cast<struct iphdr *>(pkt);
+    if (ip->version != 4) {return false;}
+    const size_t ihl = ip->ihl * 4;
+    const size_t total = ntohs(ip->tot_len);
+    if (total > length || ihl > total) {return false;}
+
+    const auto dst = ntohl(ip->daddr);
+    if (dst == LINK_PEER) {
+        ip->saddr = htonl(LINK_REFLECTED);
+    } else if (dst == LINK_REFLECTED) {
+        ip->saddr = htonl(LINK_PEER);
+    } else {
+        return false;
+    }
+    ip->daddr = htonl(LINK_LOCAL);
+    ip->check = 0;
+    ip->check = htons(checksum(pkt, ihl, 0));
+
+    size_t sum_offset;
+    if (ip->protocol == IPPROTO_TCP) {
+        sum_offset = 16;
+    } else if (ip->protocol == IPPROTO_UDP) {
+        sum_offset = 6;
+    } else {
+        return false;
+    }
+    auto l4 = pkt + ihl;
+    const auto l4_length = total - ihl;
+    if (l4_length < sum_offset + 2) {return false;}
+    l4[sum_offset] = 0;
+    l4[sum_offset + 1] = 0;
+    // Pseudo header: addresses, protocol, length
+    uint32_t sum = (ntohl(ip->saddr) >> 16) + (ntohl(ip->saddr) & 0xffff) + (ntohl(ip->daddr) >> 16) + (ntohl(ip->daddr) & 0xffff);
+    sum += ip->protocol + l4_length;
+    auto l4_sum = checksum(l4, l4_length, sum);
+    if (ip->protocol == IPPROTO_UDP && l4_sum == 0) {l4_sum = 0xffff;}
+    l4[sum_offset] = l4_sum >> 8;
+    l4[sum_offset + 1] = l4_sum & 0xff;
+    return true;
+}
+
+class lossy_link
+{
+    private:
+        int tun_fd;
+        std::thread *thread_ptr;
+        std::atomic<bool> running;
+        std::atomic<uint32_t> loss_ppm; // per packet, in both directions
+        std::atomic<uint64_t> dropped, forwarded;
+        void link_thread(void);
+    public:
+        lossy_link() : tun_fd(-1), thread_ptr(nullptr) {}
+        ~lossy_link();
+        bool open(void);
+        void set_loss(double loss) {loss_ppm.store(loss * 1e6);}
+        uint64_t get_dropped(void) {return dropped.load();}
+        uint64_t get_forwarded(void) {return forwarded.load();}
+};
+
+bool lossy_link::open(void)
+{
+    tun_fd = ::open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (tun_fd < 0) {
+        printf("transport: /dev/net/tun: %s, skipped\n", std::strerror(errno));
+        return false;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, LINK_NAME, IFNAMSIZ - 1);
+    if (ioctl(tun_fd, TUNSETIFF, &ifr) < 0) {
+        printf("transport: TUNSETIFF: %s, skipped\n", std::strerror(errno));
+        return false;
+    }
+
+    // 10.99.0.1/24, up
+    const auto fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    auto sin = reinterpret_cast<struct sockaddr_in *>(&ifr.ifr_addr);
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(LINK_LOCAL);
+    auto ok = ioctl(fd, SIOCSIFADDR, &ifr) == 0;
+    sin->sin_addr.s_addr = htonl(0xffffff00);
+    ok = ok && ioctl(fd, SIOCSIFNETMASK, &ifr) == 0;
+    ok = ok && ioctl(fd, SIOCGIFFLAGS, &ifr) == 0;
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    ok = ok && ioctl(fd, SIOCSIFFLAGS, &ifr) == 0;
+    if (!ok) {printf("transport: configuring %s: %s, skipped\n", LINK_NAME, std::strerror(errno));}
+    close(fd);
+    if (!ok) {return false;}
+
+    loss_ppm.store(0);
+    dropped.store(0);
+    forwarded.store(0);
+    running.store(true);
+    thread_ptr = new std::thread([this]{link_thread();});
+    return true;
+}
+
+lossy_link::~lossy_link()
+{
+    if (thread_ptr != nullptr) {
+        running.store(false);
+        thread_ptr->join();
+        delete thread_ptr;
+    }
+    if (tun_fd >= 0) {close(tun_fd);} // the device goes away with it
+}
+
+void lossy_link::link_thread(void)
+{
+    std::mt19937 rng(1); // same losses on every run
+    std::uniform_int_distribution<uint32_t> dist(0, 999999);
+    std::deque<std::pair<bench_clock::time_point, std::string>> queue; // constant delay keeps it sorted
+    uint8_t buf[2048];
+
+    while (running.load()) {
+        // Sleep until the next release, with sub-millisecond precision
+        auto wait = std::chrono::nanoseconds(std::chrono::milliseconds(10));
+        if (!queue.empty()) {
+            wait = std::max(std::chrono::nanoseconds(0), std::min(wait, std::chrono::duration_cast<std::chrono::nanoseconds>(queue.front().first - bench_clock::now())));
+        }
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = wait.count()};
+        struct pollfd pfd = {.fd = tun_fd, .events = POLLIN, .revents = 0};
+        ppoll(&pfd, 1, &ts, nullptr);
+
+        ssize_t n;
+        while ((n = read(tun_fd, buf, sizeof(buf))) > 0) {
+            if (dist(rng) < loss_ppm.load()) {
+                dropped++;
+                continue;
+            }
+            if (!reflect(buf, n)) {continue;}
+            queue.emplace_back(bench_clock::now() + LINK_DELAY, std::string(reinterpret_cast<char *>(buf), n));
+        }
+
+        const auto now = bench_clock::now();
+        while (!queue.empty() && queue.front().first <= now) {
+            if (write(tun_fd, queue.front().second.data(), queue.front().second.length()) > 0) {forwarded++;}
+            queue.pop_front();
+        }
+    }
+}
+
+// How a game sends: a steady stream, or one update per video frame. With
+// gaps longer than the RTT every message is a tail that only a timer recovers.
+struct traffic_pattern {
+    const char *name;
+    std::chrono::milliseconds interval;
+    int messages;
+};
+
+static const traffic_pattern patterns[] = {
+    {"2ms", std::chrono::milliseconds(2), 1000},
+    {"60Hz", std::chrono::milliseconds(16), 500},
+};
+
+// Time-stamped messages over one transport, receiver side on the loop thread
+static void run_transport(event_loop *loop, lossy_link *link, const traffic_pattern &pattern, bool use_udp, double loss, uint16_t port)
+{
+    const auto name = std::string(use_udp ? "udp " : "tcp ") + pattern.name + " " + std::to_string((int) (loss * 100)) + "%";
+    char peer_ip[INET_ADDRSTRLEN];
+    const struct in_addr peer_addr = {htonl(LINK_PEER)};
+    inet_ntop(AF_INET, &peer_addr, peer_ip, sizeof(peer_ip));
+
+    transport *server, *client;
+    if (use_udp) {
+        server = new udp_sock(loop, true, "10.99.0.1", port);
+        client = new udp_sock(loop, false, peer_ip, port);
+    } else {
+        server = new tcp_sock(loop, true, "10.99.0.1", port);
+        client = new tcp_sock(loop, false, peer_ip, port);
+    }
+
+    std::mutex mtx;
+    std::vector<double> latency_ms;
+    std::string stream;
+    server->set_ring_callback([]{});
+    server->set_disconnect_callback([]{});
+    server->set_recv_callback([&](const char *buffer, size_t length) {
+        const auto now = bench_clock::now();
+        stream.append(buffer, length);
+        std::lock_guard<std::mutex> lock(mtx);
+        while (stream.length() >= MESSAGE_SIZE) {
+            int64_t sent_ns;
+            memcpy(&sent_ns, stream.data(), sizeof(sent_ns));
+            latency_ms.push_back((now.time_since_epoch().count() - sent_ns) / 1e6);
+            stream.erase(0, MESSAGE_SIZE);
+        }
+    });
+    client->set_ring_callback([]{});
+    client->set_recv_callback([](const char *, size_t) {});
+    client->set_disconnect_callback([]{});
+
+    // Handshake without loss; only the data phase is measured
+    link->set_loss(0);
+    if (!client->connect()) {
+        printf("%-16s connect failed\n", name.c_str());
+        delete client;
+        delete server;
+        return;
+    }
+    link->set_loss(loss);
+    const auto dropped_before = link->get_dropped();
+
+    char message[MESSAGE_SIZE];
+    memset(message, 'x', sizeof(message));
+    auto next = bench_clock::now();
+    for (int i = 0; i < pattern.messages; i++) {
+        std::this_thread::sleep_until(next);
+        next += pattern.interval;
+        const int64_t now_ns = bench_clock::now().time_since_epoch().count();
+        memcpy(message, &now_ns, sizeof(now_ns));
+        client->send(message, sizeof(message));
+    }
+
+    const auto deadline = bench_clock::now() + TIMEOUT;
+    while (bench_clock::now() < deadline) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (latency_ms.size() >= (size_t) pattern.messages) {break;}
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    const auto dropped = link->get_dropped() - dropped_before;
+    link->set_loss(0);
+
+    std::vector<double> samples;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        samples = latency_ms;
+    }
+    const auto retransmits = client->get_stats().retransmits;
+    client->disconnect();
+    delete client;
+    delete server;
+
+    if (samples.empty()) {
+        printf("%-16s no messages arrived\n", name.c_str());
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&](size_t per_mille) {return samples[std::min(samples.size() - 1, samples.size() * per_mille / 1000)];};
+    printf("%-16s %9.2f %9.2f %9.2f %9.2f %7zu %7lu %7lu\n", name.c_str(), pct(500), pct(990), pct(999), samples.back(),
+        samples.size(), (unsigned long) dropped, (unsigned long) retransmits);
+    bench_record(name.c_str(), "p50_ms", pct(500));
+    bench_record(name.c_str(), "p99_ms", pct(990));
+    bench_record(name.c_str(), "p999_ms", pct(999));
+    bench_record(name.c_str(), "max_ms", samples.back());
+}
+
+// Flow control: a fast sender against a slow console, over loopback.
+// Same buffer and watermarks as modem_session.
+constexpr size_t FLOW_BUFFER_SIZE = 524288;
+constexpr size_t FLOW_PAUSE_BYTES = 65536;
+constexpr size_t FLOW_RESUME_BYTES = 16384;
+constexpr size_t FLOW_TOTAL_BYTES = 2 * 1048576;
+constexpr size_t FLOW_DRAIN_BYTES = 2048; // per FLOW_DRAIN_INTERVAL, 1 MB/s
+constexpr auto FLOW_DRAIN_INTERVAL = std::chrono::milliseconds(2);
+
+static void run_flow_control(event_loop *loop, bool use_udp, bool paused_enabled, uint16_t port)
+{
+    const auto name = std::string(use_udp ? "udp" : "tcp") + (paused_enabled ? " paused" : " no pause");
+    transport *server, *client;
+    if (use_udp) {
+        server = new udp_sock(loop, true, "127.0.0.1", port);
+        client = new udp_sock(loop, false, "127.0.0.1", port);
+    } else {
+        server = new tcp_sock(loop, true, "127.0.0.1", port);
+        client = new tcp_sock(loop, false, "127.0.0.1", port);
+    }
+
+    ring_buffer<char> queue(FLOW_BUFFER_SIZE);
+    std::atomic<bool> throttled(false);
+    std::atomic<uint64_t> received(0), dropped(0), pauses(0), high_water(0);
+    server->set_ring_callback([]{});
+    server->set_disconnect_callback([]{});
+    server->set_recv_callback([&](const char *buffer, size_t length) {
+        const auto queued = queue.enqueue(buffer, length);
+        received += length;
+        dropped += length - queued;
+        const auto count = queue.get_count();
+        if (count > high_water.load()) {high_water.store(count);}
+        if (paused_enabled && count > FLOW_PAUSE_BYTES && !throttled.exchange(true)) {
+            pauses++;
+            server->set_recv_paused(true);
+        }
+    });
+    client->set_ring_callback([]{});
+    client->set_recv_callback([](const char *, size_t) {});
+    client->set_disconnect_callback([]{});
+    if (!client->connect()) {
+        printf("%-16s connect failed\n", name.c_str());
+        delete client;
+        delete server;
+        return;
+    }
+
+    // The console: drains at a fixed rate, like the bulk-IN thread
+    std::atomic<uint64_t> consumed(0);
+    std::atomic<bool> stop(false);
+    std::thread consumer([&] {
+        char buf[FLOW_DRAIN_BYTES];
+        auto next = bench_clock::now();
+        while (!stop.load()) {
+            next += FLOW_DRAIN_INTERVAL;
+            std::this_thread::sleep_until(next);
+            consumed += queue.dequeue(buf, sizeof(buf));
+            if (throttled.load() && queue.get_count() <= FLOW_RESUME_BYTES && throttled.exchange(false)) {
+                server->set_recv_paused(false);
+            }
+        }
+    });
+
+    const auto start = bench_clock::now();
+    char chunk[1200];
+    memset(chunk, 'x', sizeof(chunk));
+    for (size_t sent = 0; sent < FLOW_TOTAL_BYTES; sent += sizeof(chunk)) {
+        client->send(chunk, std::min(sizeof(chunk), FLOW_TOTAL_BYTES - sent));
+    }
+    const auto deadline = bench_clock::now() + TIMEOUT + std::chrono::seconds(FLOW_TOTAL_BYTES / (FLOW_DRAIN_BYTES * 500));
+    while (consumed.load() + dropped.load() < FLOW_TOTAL_BYTES && bench_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    const auto seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    stop.store(true);
+    consumer.join();
+    const auto retransmits = client->get_stats().retransmits;
+    client->disconnect();
+    delete client;
+    delete server;
+
+    printf("%-16s %10lu %10lu %8lu %10lu %12.0f %7lu\n", name.c_str(), (unsigned long) received.load(), (unsigned long) dropped.load(),
+        (unsigned long) pauses.load(), (unsigned long) high_water.load(), consumed.load() / seconds, (unsigned long) retransmits);
+    bench_record(name.c_str(), "dropped_bytes", dropped.load());
+    bench_record(name.c_str(), "pauses", pauses.load());
+    bench_record(name.c_str(), "max_queued_bytes", high_water.load());
+    bench_record(name.c_str(), "bytes_per_sec", consumed.load() / seconds);
+}
+
+// One-way latency of small game messages over a link with loss, TCP vs UDP
+void bench_transport(void)
+{
+    auto loop = new event_loop();
+    printf("flow control: %zu KB sent into a %zu KB buffer drained at %zu KB/s\n", FLOW_TOTAL_BYTES / 1024, FLOW_BUFFER_SIZE / 1024,
+        FLOW_DRAIN_BYTES * 1000 / FLOW_DRAIN_INTERVAL.count() / 1024);
+    printf("%-16s %10s %10s %8s %10s %12s %7s\n", "flow", "received", "dropped", "pauses", "max queue", "drained B/s", "retrans");
+    for (const auto use_udp : {false, true}) {
+        for (const auto paused_enabled : {false, true}) {
+            run_flow_control(loop, use_udp, paused_enabled, bench_free_port(use_udp ? SOCK_DGRAM : SOCK_STREAM));
+        }
+    }
+
+    lossy_link link;
+    if (!link.open()) {
+        delete loop;
+        return;
+    }
+    printf("link: %ld ms one way, messages of %zu bytes\n", (long) LINK_DELAY.count(), MESSAGE_SIZE);
+    printf("%-16s %9s %9s %9s %9s %7s %7s %7s\n", "one way", "p50 ms", "p99 ms", "p99.9 ms", "max ms", "msgs", "dropped", "retrans");
+    for (const auto &pattern : patterns) {
+        for (const auto loss : {0.0, 0.01, 0.02, 0.05}) {
+            run_transport(loop, &link, pattern, false, loss, bench_free_port(SOCK_STREAM));
+            run_transport(loop, &link, pattern, true, loss, bench_free_port(SOCK_DGRAM));
+        }
+    }
+    delete loop;
+}
@@ -0,0 +1,106 @@
+#include <algorithm>
+
+#include <thread>
+
+#include "ring_buffer.h"
+#include "line_pacer.h"
+#include "latency_histogram.h"
+#include "bulk_in_scheduler.h"
+
+bulk_in_scheduler::bulk_in_scheduler(ring_buffer<char> *buffer, const std::atomic<bool> *dcd, const bulk_in_policy &policy)
+{
+    bulk_in_scheduler::buffer = buffer;
+    bulk_in_scheduler::dcd = dcd;
+    pacer = nullptr;
+    max_payload = 0;
+    bulk_in_scheduler::policy = policy;
+    interval = policy.status_interval;
+    next_status_at = std::chrono::steady_clock::now();
+    last_dcd = dcd->load();
+    woke_on_data = false;
+    wake_late = nullptr;
+    stats = {};
+}
+
+const bulk_in_policy &bulk_in_scheduler::get_policy(void)
+{
+    return policy;
+}
+
+bulk_in_stats bulk_in_scheduler::get_stats(void)
+{
+    return stats;
+}
+
+void bulk_in_scheduler::set_pacer(line_pacer *pacer, size_t max_payload)
+{
+    bulk_in_scheduler::pacer = pacer;
+    bulk_in_scheduler::max_payload = max_payload;
+}
+
+size_t bulk_in_scheduler::get_payload_limit(void)
+{
+    if (pacer == nullptr) {return max_payload;}
+    return pacer->take(std::min(max_payload, buffer->get_count()), std::chrono::steady_clock::now());
+}
+
+void bulk_in_scheduler::set_wake_probe(latency_histogram *wake_late)
+{
+    bulk_in_scheduler::wake_late = wake_late;
+}
+
+bool bulk_in_scheduler::get_woke_on_data(void)
+{
+    return woke_on_data;
+}
+
+void bulk_in_scheduler::record_late(std::chrono::steady_clock::time_point wake_at)
+{
+    if (wake_late == nullptr) {return;}
+    const auto late = std::chrono::steady_clock::now() - wake_at;
+    wake_late->record(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(late).count()));
+}
+
+void bulk_in_scheduler::wait_next(void)
+{
+    woke_on_data = false;
+    while (dcd->load() == last_dcd) {
+        const auto now = std::chrono::steady_clock::now();
+        if (!buffer->is_empty()) {
+            if (pacer == nullptr) {break;}
+            const auto ready_at = pacer->available_at(std::min(max_payload, buffer->get_count()), now);
+            if (ready_at <= now) {break;}
+            // Status packets still go out while the line is busy
+            if (now >= next_status_at) {break;}
+            const auto wake_at = std::min(ready_at, next_status_at);
+            std::this_thread::sleep_until(wake_at);
+            record_late(wake_at);
+            continue;
+        }
+        if (now >= next_status_at) {break;}
+        if (buffer->wait(next_status_at)) {
+            woke_on_data = true;
+        } else if (std::chrono::steady_clock::now() >= next_status_at) {
+            // Not when a DCD change cut the wait short
+            record_late(next_status_at);
+        }
+    }
+}
+
+void bulk_in_scheduler::sent(size_t payload_length, bool dcd_sent)
+{
+    if (payload_length > 0 || dcd_sent != last_dcd) {
+        // Link is active, keep status packets at the base rate
+        interval = policy.status_interval;
+    } else {
+        interval = std::min(interval * 2, policy.status_interval_max);
+    }
+    if (payload_length > 0) {
+        stats.data_packets++;
+        stats.payload_bytes += payload_length;
+    } else {
+        stats.status_packets++;
+    }
+    last_dcd = dcd_sent;
+    next_status_at = std::chrono::steady_clock::now() + interval;
+}
@@ -0,0 +1,52 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+template <typename T> class ring_buffer;
+class line_pacer;
+class latency_histogram;
+
+// Timing policy of the bulk-in endpoint.
+// Data is sent as soon as it is queued. Status-only packets are sent every
+// status_interval after the last packet and the interval doubles on each idle
+// packet up to status_interval_max. A DCD change is always sent immediately.
+struct bulk_in_policy {
+    std::chrono::milliseconds status_interval{40};
+    std::chrono::milliseconds status_interval_max{320};
+};
+
+struct bulk_in_stats {
+    uint64_t data_packets;
+    uint64_t status_packets;
+    uint64_t payload_bytes;
+};
+
+class bulk_in_scheduler
+{
+    private:
+        ring_buffer<char> *buffer;
+        const std::atomic<bool> *dcd;
+        line_pacer *pacer;
+        size_t max_payload;
+        bulk_in_policy policy;
+        std::chrono::milliseconds interval;
+        std::chrono::steady_clock::time_point next_status_at;
+        bool last_dcd;
+        bool woke_on_data;
+        latency_histogram *wake_late;
+        bulk_in_stats stats;
+        void record_late(std::chrono::steady_clock::time_point wake_at);
+    public:
+        bulk_in_scheduler(ring_buffer<char> *buffer, const std::atomic<bool> *dcd, const bulk_in_policy &policy);
+        const bulk_in_policy &get_policy(void);
+        bulk_in_stats get_stats(void);
+        void set_pacer(line_pacer *pacer, size_t max_payload);
+        // Jitter probe: records how late timed wakeups (status interval, pacer) run
+        void set_wake_probe(latency_histogram *wake_late);
+        // The last wait_next() slept until data was queued
+        bool get_woke_on_data(void);
+        size_t get_payload_limit(void); // bytes the pacer lets through now
+        void wait_next(void);
+        void sent(size_t payload_length, bool dcd_sent);
+};
@@ -0,0 +1,179 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+constexpr int MAX_EVENTS = 64;
+
+void* event_loop::loop_thread(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    thread_id.store(std::this_thread::get_id());
+
+    while (running.load()) {
+        const auto n = epoll_wait(epoll_fd, events, MAX_EVENTS, next_timeout_ms());
+        if (n < 0) {
+            if (errno == EINTR) {continue;}
+            printf("event_loop: epoll_wait(): %s\n", std::strerror(errno));
+            break;
+        }
+        wakeups++;
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == nullptr) {
+                // wakeup_fd
+                uint64_t value;
+                while (read(wakeup_fd, &value, sizeof(value)) == sizeof(value)) {}
+                continue;
+            }
+            (*static_cast<handler *>(events[i].data.ptr))(events[i].events);
+        }
+        run_tasks();
+    }
+
+    return nullptr;
+}
+
+void event_loop::run_tasks(void)
+{
+    std::vector<std::function<void(void)>> pending;
+    {
+        std::lock_guard<std::mutex> lock(task_mtx);
+        pending.swap(tasks);
+
+        // Expired timers
+        const auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.begin()->first <= now) {
+            pending.push_back(std::move(timers.begin()->second));
+            timers.erase(timers.begin());
+        }
+    }
+    for (auto &task : pending) {task();}
+}
+
+int event_loop::next_timeout_ms(void)
+{
+    std::lock_guard<std::mutex> lock(task_mtx);
+
+    if (!tasks.empty()) {return 0;}
+    if (timers.empty()) {return -1;}
+
+    const auto wait = timers.begin()->first - std::chrono::steady_clock::now();
+    if (wait <= std::chrono::steady_clock::duration::zero()) {return 0;}
+    // Round up so that the timer has expired when epoll_wait() returns
+    return std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+}
+
+event_loop::event_loop()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw std::runtime_error((std::string) "event_loop: epoll_create1(): " + std::strerror(errno));
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0) {
+        throw std::runtime_error((std::string) "event_loop: eventfd(): " + std::strerror(errno));
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) < 0) {
+        throw std::runtime_error((std::string) "event_loop: epoll_ctl(): " + std::strerror(errno));
+    }
+
+    wakeups.store(0);
+    running.store(true);
+    thread_ptr = new std::thread([this]{loop_thread();});
+}
+
+event_loop::~event_loop()
+{
+    post([this]{running.store(false);});
+    thread_ptr->join();
+    delete thread_ptr;
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void event_loop::add(int fd, uint32_t events, handler *h)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        throw std::runtime_error((std::string) "event_loop: epoll_ctl(EPOLL_CTL_ADD): " + std::strerror(errno));
+    }
+}
+
+void event_loop::modify(int fd, uint32_t events, handler *h)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        throw std::runtime_error((std::string) "event_loop: epoll_ctl(EPOLL_CTL_MOD): " + std::strerror(errno));
+    }
+}
+
+void event_loop::remove(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void event_loop::post(std::function<void(void)> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(task_mtx);
+        tasks.push_back(std::move(task));
+    }
+    const uint64_t value = 1;
+    if (write(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        printf("event_loop: write(): %s\n", std::strerror(errno));
+    }
+}
+
+void event_loop::run_sync(std::function<void(void)> task)
+{
+    if (in_loop_thread()) {
+        task();
+        return;
+    }
+
+    std::promise<void> done;
+    post([&]{
+        task();
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+void event_loop::call_later(std::chrono::milliseconds delay, std::function<void(void)> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(task_mtx);
+        timers.emplace(std::chrono::steady_clock::now() + delay, std::move(task));
+    }
+    // Wake the loop so that it picks up the new deadline
+    const uint64_t value = 1;
+    if (write(wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        printf("event_loop: write(): %s\n", std::strerror(errno));
+    }
+}
+
+bool event_loop::in_loop_thread(void)
+{
+    return std::this_thread::get_id() == thread_id.load();
+}
+
+uint64_t event_loop::get_wakeups(void)
+{
+    return wakeups.load();
+}
@@ -0,0 +1,43 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/epoll.h>
+
+// Single-threaded epoll reactor.
+// Handlers registered with add() and tasks passed to post(), run_sync() or
+// call_later() always run on the loop thread, so state they touch needs no
+// locking.
+class event_loop
+{
+    private:
+        int epoll_fd;
+        int wakeup_fd;
+        std::thread *thread_ptr;
+        std::atomic<std::thread::id> thread_id;
+        std::atomic<bool> running;
+        std::mutex task_mtx;
+        std::vector<std::function<void(void)>> tasks;
+        std::multimap<std::chrono::steady_clock::time_point, std::function<void(void)>> timers;
+        std::atomic<uint64_t> wakeups;
+        void* loop_thread(void);
+        void run_tasks(void);
+        int next_timeout_ms(void);
+    public:
+        using handler = std::function<void(uint32_t)>;
+        event_loop();
+        ~event_loop();
+        void add(int fd, uint32_t events, handler *h);
+        void modify(int fd, uint32_t events, handler *h);
+        void remove(int fd);
+        void post(std::function<void(void)> task);
+        void run_sync(std::function<void(void)> task);
+        void call_later(std::chrono::milliseconds delay, std::function<void(void)> task);
+        bool in_loop_thread(void);
+        uint64_t get_wakeups(void);
+};
@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "event_loop.h"
+#include "transport.h"
+#include "impairment.h"
+
+constexpr double PARETO_SHAPE = 3.0;
+// Draw streams, so the two directions and the stalls never share a number
+constexpr uint64_t DRAW_SEND = 0;
+constexpr uint64_t DRAW_RECV = 1;
+constexpr uint64_t DRAW_STALL = 2;
+
+bool parse_impairment_profile(const char *arg, impairment_profile *profile)
+{
+    *profile = {std::chrono::microseconds(0), std::chrono::microseconds(0), DELAY_UNIFORM, 0,
+        std::chrono::milliseconds(0), std::chrono::milliseconds(0), 1};
+    std::string rest = arg;
+    while (!rest.empty()) {
+        const auto comma = rest.find(',');
+        const auto item = rest.substr(0, comma);
+        rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+
+        char key[16], value[32];
+        if (sscanf(item.c_str(), "%15[^=]=%31s", key, value) != 2) {return false;}
+        double ms;
+        int length, every;
+        unsigned long long seed;
+        if (strcmp(key, "delay") == 0 && sscanf(value, "%lf", &ms) == 1 && ms >= 0) {
+            profile->delay = std::chrono::microseconds(std::lround(ms * 1000));
+        } else if (strcmp(key, "jitter") == 0 && sscanf(value, "%lf", &ms) == 1 && ms >= 0) {
+            profile->jitter = std::chrono::microseconds(std::lround(ms * 1000));
+        } else if (strcmp(key, "dist") == 0 && strcmp(value, "uniform") == 0) {
+            profile->distribution = DELAY_UNIFORM;
+        } else if (strcmp(key, "dist") == 0 && strcmp(value, "normal") == 0) {
+            profile->distribution = DELAY_NORMAL;
+        } else if (strcmp(key, "dist") == 0 && strcmp(value, "pareto") == 0) {
+            profile->distribution = DELAY_PARETO;
+        } else if (strcmp(key, "rate") == 0 && sscanf(value, "%d", &length) == 1 && length >= 0) {
+            profile->rate = length;
+        } else if (strcmp(key, "stall") == 0 && sscanf(value, "%d/%d", &length, &every) == 2 && length > 0 && every > 0) {
+            profile->stall_length = std::chrono::milliseconds(length);
+            profile->stall_every = std::chrono::milliseconds(every);
+        } else if (strcmp(key, "seed") == 0 && sscanf(value, "%llu", &seed) == 1) {
+            profile->seed = seed;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string describe_impairment(const impairment_profile &profile)
+{
+    const char *names[] = {"uniform", "normal", "pareto"};
+    char buf[160];
+    snprintf(buf, sizeof(buf), "delay=%g,jitter=%g,dist=%s,rate=%d,stall=%ld/%ld,seed=%llu",
+        profile.delay.count() / 1e3, profile.jitter.count() / 1e3, names[profile.distribution], profile.rate,
+        (long) profile.stall_length.count(), (long) profile.stall_every.count(), (unsigned long long) profile.seed);
+    return buf;
+}
+
+// splitmix64: one well mixed number per (seed, stream, index), in any order
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+impaired_transport::impaired_transport(event_loop *loop, transport *inner, const impairment_profile &profile)
+{
+    impaired_transport::loop = loop;
+    impaired_transport::inner = inner;
+    impaired_transport::profile = profile;
+    stopping = false;
+    recv_paused = false;
+    for (auto d : {&out, &in}) {d->queued_bytes = 0;}
+    call = 0;
+    stalled_chunks = 0;
+    start_call();
+
+    inner->set_recv_callback([this](const char *buffer, size_t length) {
+        std::lock_guard<std::mutex> lock(mtx);
+        push(in, DRAW_RECV, buffer, length, impaired_transport::inner->get_recv_time());
+    });
+    inner->set_disconnect_callback([this] {
+        // Hung up behind the data still on its way; what was going the
+        // other way has nowhere to go
+        std::lock_guard<std::mutex> lock(mtx);
+        out.queue.clear();
+        out.queued_bytes = 0;
+        const auto release = std::max(std::chrono::steady_clock::now() + impaired_transport::profile.delay, in.last_release);
+        in.queue.push_back({release, "", true});
+        in.last_release = release;
+        cv.notify_all();
+    });
+    worker = new std::thread([this]{worker_thread();});
+}
+
+impaired_transport::~impaired_transport()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker->join();
+    delete worker;
+    delete inner;
+    // Deliveries already posted still point here
+    loop->run_sync([]{});
+}
+
+double impaired_transport::draw(uint64_t stream, uint64_t index)
+{
+    const auto bits = mix(mix(profile.seed ^ (stream << 56)) ^ index);
+    return ((bits >> 11) + 0.5) / 9007199254740992.0; // (0, 1)
+}
+
+std::chrono::steady_clock::duration impaired_transport::draw_delay(uint64_t stream, uint64_t cell)
+{
+    const double jitter = profile.jitter.count();
+    double extra = 0;
+    if (jitter > 0) {
+        const auto u = draw(stream, cell * 2);
+        switch (profile.distribution) {
+            case DELAY_UNIFORM:
+                extra = (2 * u - 1) * jitter;
+                break;
+            case DELAY_NORMAL:
+                extra = std::sqrt(-2 * std::log(u)) * std::cos(2 * M_PI * draw(stream, cell * 2 + 1)) * jitter;
+                break;
+            case DELAY_PARETO:
+                extra = (PARETO_SHAPE - 1) * (std::pow(u, -1 / PARETO_SHAPE) - 1) * jitter;
+                break;
+        }
+    }
+    const auto us = std::max(0.0, profile.delay.count() + extra);
+    return std::chrono::microseconds(std::llround(us));
+}
+
+std::chrono::steady_clock::time_point impaired_transport::after_stall(std::chrono::steady_clock::time_point t)
+{
+    if (profile.stall_every.count() == 0) {return t;}
+    // Exponential gaps between the end of one stall and the start of the next
+    while (stalls.empty() || stalls.back().second <= t) {
+        const auto from = stalls.empty() ? started : stalls.back().second;
+        const auto gap = std::chrono::duration<double, std::milli>(-std::log(draw(DRAW_STALL, stall_index++)) * profile.stall_every.count());
+        const auto start = from + std::chrono::duration_cast<std::chrono::steady_clock::duration>(gap);
+        stalls.push_back({start, start + profile.stall_length});
+    }
+    // The two directions ask out of order by up to their delays
+    while (stalls.size() > 2 && stalls.front().second + std::chrono::seconds(10) < t) {stalls.pop_front();}
+    for (const auto &stall : stalls) {
+        if (t >= stall.first && t < stall.second) {return stall.second;}
+    }
+    return t;
+}
+
+void impaired_transport::push(direction &d, uint64_t stream, const char *buffer, size_t length, std::chrono::steady_clock::time_point now)
+{
+    size_t done = 0;
+    while (done < length) {
+        const auto n = std::min(length - done, IMPAIRMENT_CELL_SIZE - d.offset % IMPAIRMENT_CELL_SIZE);
+        auto release = std::max(now + draw_delay(stream, d.offset / IMPAIRMENT_CELL_SIZE), d.last_release);
+        if (profile.rate > 0) {
+            release = std::max(release, d.link_free) + std::chrono::nanoseconds(n * 8 * 1000000000ULL / profile.rate);
+        }
+        const auto stalled = after_stall(release);
+        if (stalled != release) {stalled_chunks++;}
+        release = stalled;
+        d.link_free = d.last_release = release;
+
+        if (!d.queue.empty() && d.queue.back().release == release && !d.queue.back().hang_up) {
+            d.queue.back().data.append(buffer + done, n);
+        } else {
+            d.queue.push_back({release, std::string(buffer + done, n), false});
+        }
+        d.queued_bytes += n;
+        d.offset += n;
+        done += n;
+    }
+    cv.notify_all();
+}
+
+void impaired_transport::clear(void)
+{
+    call++;
+    for (auto d : {&out, &in}) {
+        d->queue.clear();
+        d->queued_bytes = 0;
+    }
+    cv.notify_all();
+}
+
+void impaired_transport::start_call(void)
+{
+    // Every call meets the network from the top: the same delay draws for the
+    // same bytes and the same stalls at the same time into the call
+    std::lock_guard<std::mutex> lock(mtx);
+    started = std::chrono::steady_clock::now();
+    for (auto d : {&out, &in}) {
+        d->offset = 0;
+        d->last_release = d->link_free = started;
+    }
+    stall_index = 0;
+    stalls.clear();
+}
+
+void impaired_transport::worker_thread(void)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stopping) {
+        const auto now = std::chrono::steady_clock::now();
+        std::string to_send, to_recv;
+        bool hang_up = false;
+        while (!out.queue.empty() && out.queue.front().release <= now) {
+            to_send += out.queue.front().data;
+            out.queued_bytes -= out.queue.front().data.length();
+            out.queue.pop_front();
+        }
+        while (!recv_paused && !hang_up && !in.queue.empty() && in.queue.front().release <= now) {
+            to_recv += in.queue.front().data;
+            hang_up = in.queue.front().hang_up;
+            in.queued_bytes -= in.queue.front().data.length();
+            in.queue.pop_front();
+        }
+
+        if (!to_send.empty() || !to_recv.empty() || hang_up) {
+            const auto for_call = call;
+            if (!to_send.empty()) {cv.notify_all();} // room for a blocked send()
+            lock.unlock();
+            if (!to_recv.empty() || hang_up) {
+                loop->post([this, for_call, to_recv, hang_up]{deliver(for_call, to_recv, hang_up);});
+            }
+            // May block on a full socket buffer, as send() would have. Sent
+            // after a hang-up, before the modem hears of it, goes nowhere.
+            if (!to_send.empty() && inner->is_connected()) {inner->send(to_send.data(), to_send.length());}
+            lock.lock();
+            continue;
+        }
+
+        auto next = std::chrono::steady_clock::time_point::max();
+        if (!out.queue.empty()) {next = out.queue.front().release;}
+        if (!recv_paused && !in.queue.empty()) {next = std::min(next, in.queue.front().release);}
+        if (next == std::chrono::steady_clock::time_point::max()) {
+            cv.wait(lock);
+        } else {
+            cv.wait_until(lock, next);
+        }
+    }
+}
+
+void impaired_transport::deliver(uint64_t for_call, const std::string &data, bool hang_up)
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (for_call != call) {return;} // hung up since
+        if (hang_up) {clear();}
+    }
+    if (!data.empty()) {
+        recv_at = std::chrono::steady_clock::now();
+        recv_callback(data.data(), data.length());
+    }
+    if (hang_up && disconnect_callback) {disconnect_callback();}
+}
+
+void impaired_transport::set_debug_level(const int level)
+{
+    inner->set_debug_level(level);
+}
+
+void impaired_transport::set_ring_callback(std::function<void(void)> func)
+{
+    inner->set_ring_callback([this, func] {
+        start_call();
+        func();
+    });
+}
+
+void impaired_transport::set_recv_callback(std::function<void(const char *, size_t)> func)
+{
+    recv_callback = func;
+}
+
+void impaired_transport::set_disconnect_callback(std::function<void(void)> func)
+{
+    disconnect_callback = func;
+}
+
+void impaired_transport::set_addr(const struct sockaddr_in *addr_in)
+{
+    inner->set_addr(addr_in);
+}
+
+void impaired_transport::set_target(const std::string &host, uint16_t port)
+{
+    inner->set_target(host, port);
+}
+
+void impaired_transport::set_relay(const char *number)
+{
+    inner->set_relay(number);
+}
+
+void impaired_transport::set_dial_number(const std::string &number)
+{
+    inner->set_dial_number(number);
+}
+
+bool impaired_transport::is_connected()
+{
+    return inner->is_connected();
+}
+
+bool impaired_transport::connect()
+{
+    if (!inner->connect()) {return false;}
+    start_call();
+    return true;
+}
+
+void impaired_transport::connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout)
+{
+    inner->connect_async([this, done](dial_result result) {
+        if (result == DIAL_CONNECTED) {start_call();}
+        done(result);
+    }, timeout);
+}
+
+void impaired_transport::abort_connect()
+{
+    inner->abort_connect();
+}
+
+void impaired_transport::disconnect()
+{
+    {
+        // What is still on its way goes down with the call
+        std::lock_guard<std::mutex> lock(mtx);
+        clear();
+    }
+    inner->disconnect();
+}
+
+void impaired_transport::send(const char *buffer, size_t length)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{return stopping || out.queued_bytes < IMPAIRMENT_SEND_QUEUE_MAX;});
+    push(out, DRAW_SEND, buffer, length, std::chrono::steady_clock::now());
+}
+
+void impaired_transport::set_recv_paused(bool paused)
+{
+    inner->set_recv_paused(paused);
+    std::lock_guard<std::mutex> lock(mtx);
+    recv_paused = paused;
+    cv.notify_all();
+}
+
+std::chrono::steady_clock::time_point impaired_transport::get_recv_time(void)
+{
+    return recv_at;
+}
+
+std::chrono::steady_clock::duration impaired_transport::get_ring_wait(void)
+{
+    return inner->get_ring_wait();
+}
+
+transport_stats impaired_transport::get_stats(void)
+{
+    return inner->get_stats();
+}
+
+uint64_t impaired_transport::get_stalled_chunks(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return stalled_chunks;
+}
@@ -0,0 +1,108 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+class event_loop;
+
+constexpr size_t IMPAIRMENT_CELL_SIZE = 64; // bytes of the stream that share one delay draw
+constexpr size_t IMPAIRMENT_SEND_QUEUE_MAX = 65536; // send() blocks above this, like a full socket buffer
+
+enum delay_distribution {
+    DELAY_UNIFORM, // delay +- jitter
+    DELAY_NORMAL, // jitter is the standard deviation
+    DELAY_PARETO, // delay plus a long tail averaging jitter
+};
+
+struct impairment_profile {
+    std::chrono::microseconds delay; // one way, added in each direction
+    std::chrono::microseconds jitter;
+    delay_distribution distribution;
+    int rate; // bits/s each way, 0 for unlimited
+    std::chrono::milliseconds stall_length; // nothing gets through for this long
+    std::chrono::milliseconds stall_every; // mean time between stalls, 0 for none
+    uint64_t seed;
+};
+
+// "delay=40,jitter=10,dist=normal,rate=9600,stall=300/5000,seed=1", times in
+// ms; keys left out are off. describe_impairment() gives the same format back.
+bool parse_impairment_profile(const char *arg, impairment_profile *profile);
+std::string describe_impairment(const impairment_profile &profile);
+
+// A bad network in front of another transport, for trying how a game copes
+// with latency without a second board far away. Sent and received data wait
+// for a delay drawn from the profile, behind a bandwidth cap, and not at all
+// during stalls. The stream stays in order, as over TCP: a late chunk holds up
+// the ones after it. Delays are drawn per IMPAIRMENT_CELL_SIZE bytes of the
+// stream from the seed, and stalls follow a timeline drawn from it from the
+// start of each call, so the same traffic meets the same network on every
+// run. Received data waits here, so it reaches the recv callback and never a
+// recv sink: the socket is not read straight into the ring while impaired.
+class impaired_transport : public transport
+{
+    private:
+        struct chunk {
+            std::chrono::steady_clock::time_point release;
+            std::string data;
+            bool hang_up; // the remote side hung up after the data before it
+        };
+        struct direction {
+            std::deque<chunk> queue;
+            size_t queued_bytes;
+            uint64_t offset; // stream bytes so far, picks the delay draw
+            std::chrono::steady_clock::time_point last_release; // keeps the stream in order
+            std::chrono::steady_clock::time_point link_free; // for the bandwidth cap
+        };
+        event_loop *loop;
+        transport *inner; // owned
+        impairment_profile profile;
+        std::chrono::steady_clock::time_point started; // stall timeline origin, the start of the call
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::thread *worker;
+        bool stopping;
+        bool recv_paused;
+        direction out, in;
+        uint64_t call; // bumped by a hang-up; what was in flight is dropped
+        uint64_t stall_index; // next stall window to draw
+        std::deque<std::pair<std::chrono::steady_clock::time_point, std::chrono::steady_clock::time_point>> stalls; // drawn windows, oldest first
+        std::function<void(const char *, size_t)> recv_callback; // loop thread
+        std::function<void(void)> disconnect_callback;
+        std::chrono::steady_clock::time_point recv_at;
+        uint64_t stalled_chunks;
+        double draw(uint64_t stream, uint64_t index);
+        std::chrono::steady_clock::duration draw_delay(uint64_t stream, uint64_t cell);
+        std::chrono::steady_clock::time_point after_stall(std::chrono::steady_clock::time_point t);
+        void push(direction &d, uint64_t stream, const char *buffer, size_t length, std::chrono::steady_clock::time_point now);
+        void clear(void);
+        void start_call(void);
+        void worker_thread(void);
+        void deliver(uint64_t for_call, const std::string &data, bool hang_up);
+    public:
+        impaired_transport(event_loop *loop, transport *inner, const impairment_profile &profile);
+        ~impaired_transport();
+        void set_debug_level(const int level) override;
+        void set_ring_callback(std::function<void(void)> func) override;
+        void set_recv_callback(std::function<void(const char *, size_t)> func) override;
+        void set_disconnect_callback(std::function<void(void)> func) override;
+        void set_addr(const struct sockaddr_in *addr_in) override;
+        void set_target(const std::string &host, uint16_t port) override;
+        void set_relay(const char *number) override;
+        void set_dial_number(const std::string &number) override;
+        bool is_connected() override;
+        bool connect() override;
+        void connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout) override;
+        void abort_connect() override;
+        void disconnect() override;
+        void send(const char *buffer, size_t length) override;
+        void set_recv_paused(bool paused) override;
+        std::chrono::steady_clock::time_point get_recv_time(void) override;
+        std::chrono::steady_clock::duration get_ring_wait(void) override;
+        transport_stats get_stats(void) override;
+        uint64_t get_stalled_chunks(void);
+};
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+#include "latency_histogram.h"
+
+latency_histogram::latency_histogram()
+{
+    reset();
+}
+
+size_t latency_histogram::bucket_of(uint64_t ns)
+{
+    // Values below SUB_BUCKETS get one bucket each, above that the top
+    // SUB_BUCKET_BITS bits below the leading one pick the sub-bucket.
+    if (ns < SUB_BUCKETS) {return ns;}
+    const int msb = 63 - __builtin_clzll(ns);
+    const int magnitude = msb - SUB_BUCKET_BITS + 1;
+    if (magnitude >= MAGNITUDES) {return MAGNITUDES * SUB_BUCKETS - 1;}
+    const auto sub = (ns >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return magnitude * SUB_BUCKETS + sub;
+}
+
+uint64_t latency_histogram::bucket_value(size_t bucket)
+{
+    // Upper edge of the bucket
+    const auto magnitude = bucket / SUB_BUCKETS;
+    const auto sub = bucket % SUB_BUCKETS;
+    if (magnitude == 0) {return sub;}
+    const auto shift = magnitude - 1;
+    return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void latency_histogram::record(uint64_t ns)
+{
+    counts[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    auto max = max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+}
+
+void latency_histogram::reset(void)
+{
+    for (auto &c : counts) {c.store(0, std::memory_order_relaxed);}
+    total_count.store(0, std::memory_order_relaxed);
+    total_ns.store(0, std::memory_order_relaxed);
+    max_ns.store(0, std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::get_count(void)
+{
+    return total_count.load(std::memory_order_relaxed);
+}
+
+uint64_t latency_histogram::get_max(void)
+{
+    return max_ns.load(std::memory_order_relaxed);
+}
+
+double latency_histogram::get_mean(void)
+{
+    const auto n = get_count();
+    return n == 0 ? 0.0 : (double) total_ns.load(std::memory_order_relaxed) / n;
+}
+
+uint64_t latency_histogram::get_percentile(double percentile)
+{
+    const auto n = get_count();
+    if (n == 0) {return 0;}
+
+    const auto target = static_cast<uint64_t>(n * percentile / 100.0);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < MAGNITUDES * SUB_BUCKETS; i++) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen > target) {return std::min(bucket_value(i), get_max());}
+    }
+    return get_max();
+}
+
+void latency_histogram::print(const char *prefix, const char *name)
+{
+    printf("%s%-20s n %8lu  p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  max %9.1f us\n", prefix, name,
+        (unsigned long) get_count(), get_percentile(50) / 1e3, get_percentile(99) / 1e3,
+        get_percentile(99.9) / 1e3, get_max() / 1e3);
+}
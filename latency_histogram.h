@@ -0,0 +1,30 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear (HDR style) histogram of durations in nanoseconds. Values are
+// grouped by power of two and split into 16 sub-buckets each, so percentiles
+// are within ~6% of the real value. record() is a few relaxed atomic adds;
+// it is safe from any thread and never blocks.
+class latency_histogram
+{
+    private:
+        static constexpr int SUB_BUCKET_BITS = 4;
+        static constexpr int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+        static constexpr int MAGNITUDES = 40; // up to 2^40 ns, about 18 minutes
+        std::atomic<uint64_t> counts[MAGNITUDES * SUB_BUCKETS];
+        std::atomic<uint64_t> total_count;
+        std::atomic<uint64_t> total_ns;
+        std::atomic<uint64_t> max_ns;
+        static size_t bucket_of(uint64_t ns);
+        static uint64_t bucket_value(size_t bucket);
+    public:
+        latency_histogram();
+        void record(uint64_t ns);
+        void reset(void);
+        uint64_t get_count(void);
+        uint64_t get_max(void);
+        double get_mean(void);
+        uint64_t get_percentile(double percentile);
+        void print(const char *prefix, const char *name);
+};
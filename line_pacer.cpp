@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <chrono>
+
+#include "line_pacer.h"
+
+constexpr int BITS_PER_BYTE = 10;
+constexpr double BURST_NS = 20e6;
+constexpr double BURST_MIN = 64;
+
+line_pacer::line_pacer(int bits_per_sec)
+{
+    bytes_per_ns = bits_per_sec > 0 ? bits_per_sec / (double) BITS_PER_BYTE / 1e9 : 0;
+    burst = std::max(BURST_MIN, bytes_per_ns * BURST_NS);
+    tokens = burst;
+    last_refill = std::chrono::steady_clock::now();
+}
+
+void line_pacer::refill(std::chrono::steady_clock::time_point now)
+{
+    if (now <= last_refill) {return;}
+    const auto elapsed_ns = std::chrono::duration<double, std::nano>(now - last_refill).count();
+    tokens = std::min(burst, tokens + elapsed_ns * bytes_per_ns);
+    last_refill = now;
+}
+
+bool line_pacer::is_unlimited(void)
+{
+    return bytes_per_ns == 0;
+}
+
+size_t line_pacer::get_burst(void)
+{
+    return burst;
+}
+
+size_t line_pacer::take(size_t want, std::chrono::steady_clock::time_point now)
+{
+    if (is_unlimited()) {return want;}
+
+    refill(now);
+    const auto granted = std::min(want, static_cast<size_t>(tokens));
+    tokens -= granted;
+    return granted;
+}
+
+std::chrono::steady_clock::time_point line_pacer::available_at(size_t want, std::chrono::steady_clock::time_point now)
+{
+    if (is_unlimited()) {return now;}
+
+    refill(now);
+    const auto missing = std::min<double>(want, burst) - tokens;
+    if (missing <= 0) {return now;}
+    return now + std::chrono::nanoseconds(static_cast<int64_t>(missing / bytes_per_ns) + 1);
+}
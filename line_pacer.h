@@ -0,0 +1,28 @@
+#include <chrono>
+#include <cstddef>
+
+// Line rate the modem reports in CONNECT, in bits per second
+constexpr int MODEM_LINE_RATE = 57600;
+
+// Token bucket that holds a byte stream to a serial line rate.
+// A byte costs 10 bits (start, 8 data, stop) as on the modem's DTE side.
+// The bucket holds up to 20 ms of data, at least one USB packet, so pacing
+// adds at most about that much latency. Not thread safe: each direction has
+// its own pacer, used by one thread.
+class line_pacer
+{
+    private:
+        double bytes_per_ns; // 0 for unlimited
+        double burst;
+        double tokens;
+        std::chrono::steady_clock::time_point last_refill;
+        void refill(std::chrono::steady_clock::time_point now);
+    public:
+        line_pacer(int bits_per_sec);
+        bool is_unlimited(void);
+        size_t get_burst(void);
+        // Takes up to `want` bytes worth of tokens and returns how many it got
+        size_t take(size_t want, std::chrono::steady_clock::time_point now);
+        // When `want` bytes (at most get_burst()) can be taken
+        std::chrono::steady_clock::time_point available_at(size_t want, std::chrono::steady_clock::time_point now);
+};
@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "transport.h"
+#include "link_probe.h"
+
+constexpr size_t LINK_PROBE_SIZE = 8;
+constexpr size_t LINK_REPLY_SIZE = 16;
+
+static uint64_t clock_ns(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+static void put64(uint8_t *p, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {value = (value << 8) | p[i];}
+    return value;
+}
+
+std::string describe_link_stats(const link_stats &stats)
+{
+    char buf[192];
+    if (stats.samples == 0) {
+        snprintf(buf, sizeof(buf), "no rtt yet, rx %.0f B/s, tx %.0f B/s", stats.rx_rate, stats.tx_rate);
+    } else {
+        snprintf(buf, sizeof(buf), "rtt %.1f ms (min %.1f, max %.1f), jitter %.1f ms, rx %.0f B/s, tx %.0f B/s, %lu probes",
+            stats.srtt_ns / 1e6, stats.min_rtt_ns / 1e6, stats.max_rtt_ns / 1e6, stats.jitter_ns / 1e6,
+            stats.rx_rate, stats.tx_rate, (unsigned long) stats.samples);
+    }
+    return buf;
+}
+
+probed_transport::probed_transport(transport *inner, std::chrono::milliseconds interval)
+    : debug_level(0)
+{
+    probed_transport::inner = inner;
+    probed_transport::interval = std::max(interval, std::chrono::milliseconds(LINK_PROBE_INTERVAL_MIN));
+    stopping = false;
+    probe_out = false;
+    probe_clock = 0;
+    stats = link_stats();
+    call_started = rate_at = std::chrono::steady_clock::now();
+    rated = false;
+    rate_rx_bytes = rate_tx_bytes = 0;
+    reset_frames();
+
+    inner->set_ring_callback([this] {
+        start_call();
+        if (ring_callback) {ring_callback();}
+    });
+    inner->set_recv_callback([this](const char *buffer, size_t length){receive(buffer, length);});
+    inner->set_disconnect_callback([this] {
+        end_call();
+        reset_frames();
+        if (disconnect_callback) {disconnect_callback();}
+    });
+    worker = new std::thread([this]{worker_thread();});
+}
+
+probed_transport::~probed_transport()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker->join();
+    delete worker;
+    delete inner;
+}
+
+void probed_transport::start_call(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    stats = link_stats();
+    stats.in_call = true;
+    call_started = rate_at = std::chrono::steady_clock::now();
+    rated = false;
+    rate_rx_bytes = rate_tx_bytes = 0;
+    probe_out = false;
+    replies.clear();
+    cv.notify_all();
+}
+
+void probed_transport::end_call(void)
+{
+    // The stats stay for the AT queries until the next call
+    std::lock_guard<std::mutex> lock(mtx);
+    if (stats.in_call) {
+        stats.in_call = false;
+        stats.duration = std::chrono::steady_clock::now() - call_started;
+    }
+    probe_out = false;
+    replies.clear();
+}
+
+void probed_transport::reset_frames(void)
+{
+    frame_type = 0;
+    frame_left = 0;
+    frame_length = 0;
+}
+
+void probed_transport::send_frame(uint8_t type, const uint8_t *payload, size_t length)
+{
+    uint8_t frame[1 + LINK_FRAME_PAYLOAD_MAX];
+    frame[0] = type;
+    memcpy(frame + 1, payload, length);
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        inner->send(reinterpret_cast<const char *>(frame), 1 + length);
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    stats.overhead_bytes += 1 + length;
+}
+
+void probed_transport::receive(const char *buffer, size_t length)
+{
+    // Loop thread. The data frames of one read go to the recv callback together.
+    const auto received = inner->get_recv_time();
+    recv_data.clear();
+    uint64_t bad = 0;
+    size_t pos = 0;
+    while (pos < length) {
+        if (frame_left == 0) {
+            frame_type = static_cast<uint8_t>(buffer[pos++]);
+            frame_length = 0;
+            if (frame_type < LINK_FRAME_DATA_MAX) {
+                frame_left = frame_type + 1;
+            } else if (frame_type == LINK_FRAME_PROBE) {
+                frame_left = LINK_PROBE_SIZE;
+            } else if (frame_type == LINK_FRAME_REPLY) {
+                frame_left = LINK_REPLY_SIZE;
+            } else {
+                bad++;
+            }
+            continue;
+        }
+        const auto n = std::min(frame_left, length - pos);
+        if (frame_type < LINK_FRAME_DATA_MAX) {
+            recv_data.append(buffer + pos, n);
+        } else {
+            memcpy(frame_payload + frame_length, buffer + pos, n);
+            frame_length += n;
+        }
+        pos += n;
+        frame_left -= n;
+        if (frame_left == 0 && frame_type >= LINK_FRAME_DATA_MAX) {frame_received(received);}
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stats.rx_bytes += recv_data.length();
+        stats.bad_frames += bad;
+    }
+    if (bad > 0 && debug_level.load() >= 1) {printf("link probe: %lu bytes of unknown frames dropped.\n", (unsigned long) bad);}
+    if (!recv_data.empty() && recv_callback) {recv_callback(recv_data.data(), recv_data.length());}
+}
+
+void probed_transport::frame_received(std::chrono::steady_clock::time_point received)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    if (frame_type == LINK_FRAME_PROBE) {
+        // Answered by the worker, which may block on sending
+        if (replies.size() < LINK_REPLIES_MAX) {
+            replies.push_back({get64(frame_payload), received});
+            cv.notify_all();
+        }
+        return;
+    }
+
+    // A reply: round trip less the time the other side held the probe
+    const auto sent = get64(frame_payload);
+    const auto held = get64(frame_payload + 8);
+    if (!probe_out || sent != probe_clock) {return;} // from before a hang-up
+    probe_out = false;
+    const int64_t rtt = std::max<int64_t>(0, clock_ns(received) - sent - held);
+    if (stats.samples == 0) {
+        stats.srtt_ns = stats.min_rtt_ns = stats.max_rtt_ns = rtt;
+        stats.jitter_ns = 0;
+    } else {
+        stats.srtt_ns += (rtt - stats.srtt_ns) / 8;
+        stats.jitter_ns += (std::abs(rtt - stats.last_rtt_ns) - stats.jitter_ns) / 16;
+        stats.min_rtt_ns = std::min(stats.min_rtt_ns, rtt);
+        stats.max_rtt_ns = std::max(stats.max_rtt_ns, rtt);
+    }
+    stats.last_rtt_ns = rtt;
+    stats.samples++;
+    if (debug_level.load() >= 1) {printf("link probe: rtt %.1f ms, smoothed %.1f ms.\n", rtt / 1e6, stats.srtt_ns / 1e6);}
+}
+
+void probed_transport::worker_thread(void)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    auto next = std::chrono::steady_clock::now() + interval;
+    while (!stopping) {
+        if (!replies.empty()) {
+            const auto r = replies.front();
+            replies.pop_front();
+            lock.unlock();
+            uint8_t payload[LINK_REPLY_SIZE];
+            put64(payload, r.probe_clock);
+            put64(payload + 8, clock_ns(std::chrono::steady_clock::now()) - clock_ns(r.received));
+            send_frame(LINK_FRAME_REPLY, payload, sizeof(payload));
+            lock.lock();
+            continue;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (now < next) {
+            cv.wait_until(lock, next);
+            continue;
+        }
+        next = std::max(next + interval, now);
+        if (!stats.in_call) {continue;}
+
+        // Game bytes per second over the last interval
+        const auto seconds = std::chrono::duration<double>(now - rate_at).count();
+        const auto rx_rate = (stats.rx_bytes - rate_rx_bytes) / seconds;
+        const auto tx_rate = (stats.tx_bytes - rate_tx_bytes) / seconds;
+        stats.rx_rate = rated ? stats.rx_rate + (rx_rate - stats.rx_rate) / 4 : rx_rate;
+        stats.tx_rate = rated ? stats.tx_rate + (tx_rate - stats.tx_rate) / 4 : tx_rate;
+        rated = true;
+        rate_rx_bytes = stats.rx_bytes;
+        rate_tx_bytes = stats.tx_bytes;
+        rate_at = now;
+
+        // One probe in flight at most: a slow link is probed less often
+        if (probe_out) {continue;}
+        lock.unlock();
+        const bool up = inner->is_connected();
+        lock.lock();
+        if (!up || !stats.in_call || probe_out) {continue;}
+        probe_out = true;
+        probe_clock = clock_ns(std::chrono::steady_clock::now());
+        stats.probes_sent++;
+        const auto clock = probe_clock;
+        lock.unlock();
+        uint8_t payload[LINK_PROBE_SIZE];
+        put64(payload, clock);
+        send_frame(LINK_FRAME_PROBE, payload, sizeof(payload));
+        lock.lock();
+    }
+}
+
+void probed_transport::set_debug_level(const int level)
+{
+    debug_level.store(level);
+    inner->set_debug_level(level);
+}
+
+void probed_transport::set_ring_callback(std::function<void(void)> func)
+{
+    ring_callback = func;
+}
+
+void probed_transport::set_recv_callback(std::function<void(const char *, size_t)> func)
+{
+    recv_callback = func;
+}
+
+void probed_transport::set_disconnect_callback(std::function<void(void)> func)
+{
+    disconnect_callback = func;
+}
+
+void probed_transport::set_addr(const struct sockaddr_in *addr_in)
+{
+    inner->set_addr(addr_in);
+}
+
+void probed_transport::set_target(const std::string &host, uint16_t port)
+{
+    inner->set_target(host, port);
+}
+
+void probed_transport::set_relay(const char *number)
+{
+    inner->set_relay(number);
+}
+
+void probed_transport::set_dial_number(const std::string &number)
+{
+    inner->set_dial_number(number);
+}
+
+bool probed_transport::is_connected()
+{
+    return inner->is_connected();
+}
+
+bool probed_transport::connect()
+{
+    // No call, so nothing is received meanwhile
+    reset_frames();
+    if (!inner->connect()) {return false;}
+    start_call();
+    return true;
+}
+
+void probed_transport::connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout)
+{
+    reset_frames();
+    inner->connect_async([this, done](dial_result result) {
+        if (result == DIAL_CONNECTED) {start_call();}
+        done(result);
+    }, timeout);
+}
+
+void probed_transport::abort_connect()
+{
+    inner->abort_connect();
+}
+
+void probed_transport::disconnect()
+{
+    end_call();
+    inner->disconnect();
+}
+
+void probed_transport::send(const char *buffer, size_t length)
+{
+    size_t headers = 0;
+    {
+        // Frames are built in one buffer and sent at once, so a probe never lands inside one
+        std::lock_guard<std::mutex> lock(send_mtx);
+        send_buffer.clear();
+        for (size_t done = 0; done < length; headers++) {
+            const auto n = std::min(length - done, LINK_FRAME_DATA_MAX);
+            send_buffer += static_cast<char>(n - 1);
+            send_buffer.append(buffer + done, n);
+            done += n;
+        }
+        inner->send(send_buffer.data(), send_buffer.length());
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    stats.tx_bytes += length;
+    stats.overhead_bytes += headers;
+}
+
+void probed_transport::set_recv_paused(bool paused)
+{
+    inner->set_recv_paused(paused);
+}
+
+std::chrono::steady_clock::time_point probed_transport::get_recv_time(void)
+{
+    return inner->get_recv_time();
+}
+
+std::chrono::steady_clock::duration probed_transport::get_ring_wait(void)
+{
+    return inner->get_ring_wait();
+}
+
+transport_stats probed_transport::get_stats(void)
+{
+    return inner->get_stats();
+}
+
+link_stats probed_transport::get_link_stats(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    auto s = stats;
+    if (s.in_call) {s.duration = std::chrono::steady_clock::now() - call_started;}
+    return s;
+}
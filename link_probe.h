@@ -0,0 +1,112 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+constexpr auto LINK_PROBE_INTERVAL_MIN = std::chrono::milliseconds(100);
+// Frame headers: a data frame of 1 to LINK_FRAME_DATA_MAX bytes has its
+// length - 1 as header, probes and replies have their own
+constexpr size_t LINK_FRAME_DATA_MAX = 0x80;
+constexpr uint8_t LINK_FRAME_PROBE = 0x80; // 8 bytes: sender's clock
+constexpr uint8_t LINK_FRAME_REPLY = 0x81; // 16 bytes: the probe's clock, how long the reply was held
+constexpr size_t LINK_FRAME_PAYLOAD_MAX = 16;
+constexpr size_t LINK_REPLIES_MAX = 4; // replies owed at once; a peer asking faster is not answered
+
+// Link quality of the current call, or of the last one after a hang-up
+struct link_stats {
+    bool in_call;
+    uint64_t samples; // answered probes
+    int64_t srtt_ns; // smoothed as TCP does (RFC 6298)
+    int64_t last_rtt_ns;
+    int64_t min_rtt_ns;
+    int64_t max_rtt_ns;
+    int64_t jitter_ns; // mean change between RTT samples (RFC 3550)
+    double rx_rate; // game bytes/s, smoothed per probe interval
+    double tx_rate;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t probes_sent;
+    uint64_t overhead_bytes; // sent on top of the game bytes: frame headers, probes and replies
+    uint64_t bad_frames; // unknown frame headers, e.g. from a peer without -P
+    std::chrono::steady_clock::duration duration;
+};
+
+// Measures the link in-band, in front of another transport. The game stream
+// is cut into small frames and a probe frame carrying a time stamp goes in
+// between every interval; the other side, which must use the same wrapper,
+// sends it straight back with how long it held it. Probes never split a data
+// frame and are taken out before the game bytes reach the recv callback, so
+// the game sees its stream unchanged. At most one probe is unanswered at a
+// time, so probing costs at most one probe and one reply (26 bytes) each way
+// per interval, plus a header byte per LINK_FRAME_DATA_MAX bytes of data.
+class probed_transport : public transport
+{
+    private:
+        transport *inner; // owned
+        std::chrono::milliseconds interval;
+        std::thread *worker;
+        std::mutex send_mtx; // one frame at a time on the inner transport
+        std::string send_buffer; // guarded by send_mtx
+        std::mutex mtx; // below, except the receive state
+        std::condition_variable cv;
+        bool stopping;
+        struct reply {
+            uint64_t probe_clock;
+            std::chrono::steady_clock::time_point received;
+        };
+        std::deque<reply> replies; // owed to the peer, sent by the worker
+        bool probe_out; // waiting for the reply of a probe
+        uint64_t probe_clock; // the one sent last
+        link_stats stats;
+        std::chrono::steady_clock::time_point call_started;
+        bool rated; // rx_rate and tx_rate have a first value
+        std::chrono::steady_clock::time_point rate_at;
+        uint64_t rate_rx_bytes, rate_tx_bytes; // at rate_at
+        // receive state, loop thread
+        uint8_t frame_type;
+        size_t frame_left; // payload bytes still to come
+        uint8_t frame_payload[LINK_FRAME_PAYLOAD_MAX];
+        size_t frame_length;
+        std::string recv_data;
+        std::function<void(void)> ring_callback;
+        std::function<void(const char *, size_t)> recv_callback;
+        std::function<void(void)> disconnect_callback;
+        std::atomic<int> debug_level;
+        void start_call(void);
+        void end_call(void);
+        void reset_frames(void);
+        void send_frame(uint8_t type, const uint8_t *payload, size_t length);
+        void receive(const char *buffer, size_t length);
+        void frame_received(std::chrono::steady_clock::time_point received);
+        void worker_thread(void);
+    public:
+        probed_transport(transport *inner, std::chrono::milliseconds interval);
+        ~probed_transport();
+        void set_debug_level(const int level) override;
+        void set_ring_callback(std::function<void(void)> func) override;
+        void set_recv_callback(std::function<void(const char *, size_t)> func) override;
+        void set_disconnect_callback(std::function<void(void)> func) override;
+        void set_addr(const struct sockaddr_in *addr_in) override;
+        void set_target(const std::string &host, uint16_t port) override;
+        void set_relay(const char *number) override;
+        void set_dial_number(const std::string &number) override;
+        bool is_connected() override;
+        bool connect() override;
+        void connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout) override;
+        void abort_connect() override;
+        void disconnect() override;
+        void send(const char *buffer, size_t length) override;
+        void set_recv_paused(bool paused) override;
+        std::chrono::steady_clock::time_point get_recv_time(void) override;
+        std::chrono::steady_clock::duration get_ring_wait(void) override;
+        transport_stats get_stats(void) override;
+        link_stats get_link_stats(void);
+};
+
+// "rtt 42.1 ms (min 40.2, max 61.0), jitter 1.3 ms, rx 960 B/s, tx 955 B/s"
+std::string describe_link_stats(const link_stats &stats);
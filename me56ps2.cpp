@@ -1,318 +1,211 @@
-#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <csignal>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <mutex>
+#include <sched.h>
 #include <string>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
+#include "usb_gadget.h"
 #include "usb_raw_gadget.h"
-#include "usb_raw_control_event.h"
 #include "ring_buffer.h"
-#include "tcp_sock.h"
-
-#include "me56ps2.h"
-
-std::thread *thread_bulk_in = nullptr;
-std::thread *thread_bulk_out = nullptr;
-
-ring_buffer<char> usb_tx_buffer(524288);
-tcp_sock *sock;
+#include "latency_histogram.h"
+#include "bulk_in_scheduler.h"
+#include "line_pacer.h"
+#include "event_loop.h"
+#include "transport.h"
+#include "impairment.h"
+#include "link_probe.h"
+#include "traffic_record.h"
+#include "pcapng.h"
+#include "modem_session.h"
+#include "relay_server.h"
+#include "metrics_server.h"
+#include "async_log.h"
+#include "rt_profile.h"
+
+#include "board.h"
 
 int debug_level = 0;
+bulk_in_policy bulk_in_timing;
 
-std::atomic<bool> connected(false);
-
-bool parse_address(const std::string addr, struct sockaddr_in *parsed_addr)
+bool parse_bulk_in_policy(const char *arg, bulk_in_policy *policy)
 {
-    // Input format: "000-000-000-000#00000"
-    int d[4] = {0, 0, 0, 0};
-    int port = TCP_DEFAULT_PORT;
-
-    auto has_port = addr.find('#') != std::string::npos;
-
-    // Parse IPv4 address
-    if (has_port) {
-        auto ret = sscanf(addr.c_str(), "%u-%u-%u-%u#%u", &d[0], &d[1], &d[2], &d[3], &port);
-        if (ret != 5) {return false;}
-    } else {
-        auto ret = sscanf(addr.c_str(), "%u-%u-%u-%u", &d[0], &d[1], &d[2], &d[3]);
-        if (ret != 4) {return false;}
-    }
+    // Input format: "40" or "40,320"
+    int interval, interval_max;
+    const auto ret = sscanf(arg, "%d,%d", &interval, &interval_max);
+    if (ret < 1 || interval < 1) {return false;}
+    if (ret == 1) {interval_max = interval;}
+    if (interval_max < interval) {return false;}
+
+    policy->status_interval = std::chrono::milliseconds(interval);
+    policy->status_interval_max = std::chrono::milliseconds(interval_max);
+    return true;
+}
 
-    // Check each digit range
-    for (int i = 0; i < 4; i++) {
-        if (d[i] < 0 || d[i] > 255) {return false;}
+bool parse_line_rate(const char *arg, int *line_rate)
+{
+    // Input format: "line" (the CONNECT rate), bits per second, or 0 for unlimited
+    if (strcmp(arg, "line") == 0) {
+        *line_rate = MODEM_LINE_RATE;
+        return true;
     }
-
-    // Check port range (1 - 65535)
-    if (port < 1 || port > 65535) {return false;}
-
-    char ip_addr[16];
-    sprintf(ip_addr, "%d.%d.%d.%d", d[0], d[1], d[2], d[3]);
-
-    memset(parsed_addr, 0, sizeof(*parsed_addr));
-    parsed_addr->sin_family = AF_INET;
-    parsed_addr->sin_port = htons(port);
-    parsed_addr->sin_addr.s_addr = inet_addr(ip_addr);
-
+    char *end;
+    const auto rate = strtol(arg, &end, 10);
+    if (*end != '\0' || rate < 0) {return false;}
+    *line_rate = rate;
     return true;
 }
 
-void ring_callback()
+bool parse_tx_deadline(const char *arg, std::chrono::milliseconds *deadline, bool *shed)
 {
-    const std::string ring = "RING\r\n";
-    usb_tx_buffer.enqueue(ring.c_str(), ring.length());
-    usb_tx_buffer.notify_one();
-
-    printf("Clinet connected.\n");
+    // Input format: "200" or "200,shed"
+    int ms;
+    char mode[16] = "";
+    const auto ret = sscanf(arg, "%d,%15s", &ms, mode);
+    if (ret < 1 || ms < 1) {return false;}
+    if (ret == 2 && strcmp(mode, "shed") != 0) {return false;}
+    *deadline = std::chrono::milliseconds(ms);
+    *shed = ret == 2;
+    return true;
 }
 
-void recv_callback(const char *buffer, size_t length)
+bool parse_bulk_packets(const char *arg, int *in_packets, int *out_packets)
 {
-    if (connected.load()) {
-        const auto sent_length = usb_tx_buffer.enqueue(buffer, length);
-        if (debug_level >= 2) {
-            const auto buffer_size = usb_tx_buffer.get_buffer_size();
-            const auto data_count = usb_tx_buffer.get_count();
-            printf("usb_tx_buffer: used %ld bytes / %ld bytes (%.f%% used).\n", (long) data_count, (long) buffer_size, (float) data_count / buffer_size);
-        }
-        if (sent_length < length) {
-            printf("Transmit buffer is full! (overflow %ld bytes.)\n", length - sent_length);
-        }
-        usb_tx_buffer.notify_one();
-    }
+    // Input format: "8" or "8,4", packets per bulk-IN and bulk-OUT transfer
+    int in, out = 1;
+    const auto ret = sscanf(arg, "%d,%d", &in, &out);
+    if (ret < 1) {return false;}
+    if (in < 1 || in > BULK_TRANSFER_PACKETS_MAX || out < 1 || out > BULK_TRANSFER_PACKETS_MAX) {return false;}
+    *in_packets = in;
+    *out_packets = out;
+    return true;
 }
 
-void *usb_bulk_in_thread(usb_raw_gadget *usb, int ep_num)
+bool parse_call_queue(const char *arg, int *callers, std::chrono::milliseconds *wait)
 {
-    struct usb_packet_control pkt;
-    auto timeout_at = std::chrono::steady_clock::now();
-
-    while (true) {
-        const auto now = std::chrono::steady_clock::now();
-        while (timeout_at <= now) {
-            timeout_at += std::chrono::milliseconds(40);
-        }
-        usb_tx_buffer.wait(timeout_at);
-
-        pkt.data[0] = 0x31;
-        pkt.data[1] = 0x60;
-        int payload_length = usb_tx_buffer.dequeue(&pkt.data[2], sizeof(pkt.data) - 2);
-
-        pkt.header.ep = ep_num;
-        pkt.header.flags = 0;
-        pkt.header.length = 2 + payload_length;
-
-        if (connected.load()) {pkt.data[0] |= 0x80;}
-
-        usb->ep_write(reinterpret_cast<struct usb_raw_ep_io *>(&pkt));
-    }
-
-    return NULL;
+    // Input format: "2" or "2,30", callers held and seconds each may wait
+    int n, sec = 60;
+    const auto ret = sscanf(arg, "%d,%d", &n, &sec);
+    if (ret < 1 || n < 0 || sec < 1) {return false;}
+    *callers = n;
+    *wait = std::chrono::seconds(sec);
+    return true;
 }
 
-void *usb_bulk_out_thread(usb_raw_gadget *usb, int ep_num) {
-    struct usb_packet_bulk pkt;
-    std::string buffer;
-
-    // modem echo flag
-    bool echo = false;
-
-    while (true) {
-        pkt.header.ep = ep_num;
-        pkt.header.flags = 0;
-        pkt.header.length = sizeof(pkt.data);
-
-        int ret = usb->ep_read(reinterpret_cast<struct usb_raw_ep_io *>(&pkt));
-        int payload_length = pkt.data[0] >> 2;
-        if (payload_length != ret - 1) {
-            printf("Payload length mismatch! (payload length in header: %d, received payload: %d)\n", payload_length, ret - 1);
-            payload_length = std::min(payload_length, ret - 1);
-        }
-        buffer.append(&pkt.data[1], payload_length);
-
-        // Off-line mode loop
-        while (!connected.load()) {
-            bool enter_online = false;
-
-            // Fetch one line from the receive buffer
-            auto newline_pos = buffer.find('\x0d');
-            if (newline_pos == std::string::npos) {break;}
-            std::string line = buffer.substr(0, newline_pos);
-            buffer.erase(0, newline_pos + 1);
-            if (line.empty()) {break;}
-
-            printf("AT command: %s\n", line.c_str());
-
-            if (echo) {
-                const auto s = line + "\r\n";
-                usb_tx_buffer.enqueue(s.c_str(), s.length());
-            }
-
-            std::string reply = "OK\r\n";
-            if (line == "AT&F") {echo = true;} // Restore factory default (turn on echo only in this emulator)
-            if (line == "ATE0") {echo = false;} // Turn off echo
-            if (line == "ATA") {
-                // Answer an incoming call
-                reply = "CONNECT 57600 V42\r\n";
-                enter_online = true;
-            }
-            if (strncmp(line.c_str(), "ATD", 3) == 0) {
-                // Dial. Ignore after "ATD"
-                struct sockaddr_in addr;
-                if (parse_address(line.substr(4), &addr)) {
-                    sock->set_addr(&addr);
-                }
-                if (sock->connect()) {
-                    reply = "CONNECT 57600 V42\r\n";
-                    enter_online = true;
-                } else {
-                    reply = "BUSY\r\n";
-                }
-            }
-
-            usb_tx_buffer.enqueue(reply.c_str(), reply.length());
-            usb_tx_buffer.notify_one();
-
-            if (enter_online) {
-                printf("Enter on-line mode.\n");
-                connected.store(true);
-            }
-        }
-
-        // On-line mode loop
-        while (connected.load() && buffer.length() > 0) {
-            sock->send(buffer.c_str(), buffer.length());
-            buffer.clear();
-        }
-    }
-
-    return NULL;
+bool parse_rt_profile(const char *arg, rt_profile *profile)
+{
+    // Input format: "80" or "80,0", SCHED_FIFO priority and event loop CPU
+    int priority, loop_cpu = -1;
+    const auto ret = sscanf(arg, "%d,%d", &priority, &loop_cpu);
+    if (ret < 1) {return false;}
+    // The event loop runs one below, so it needs room
+    if (priority < 2 || priority > sched_get_priority_max(SCHED_FIFO)) {return false;}
+    profile->priority = priority;
+    profile->loop_cpu = loop_cpu;
+    return true;
 }
 
-bool process_control_packet(usb_raw_gadget *usb, usb_raw_control_event *e, struct usb_packet_control *pkt)
+bool parse_modem_config(const char *arg, modem_config *config)
 {
-    if (e->is_event(USB_TYPE_STANDARD, USB_REQ_GET_DESCRIPTOR)) {
-        const auto descriptor_type = e->get_descriptor_type();
-        if (descriptor_type == USB_DT_DEVICE) {
-            memcpy(pkt->data, &me56ps2_device_descriptor, sizeof(me56ps2_device_descriptor));
-            pkt->header.length = sizeof(me56ps2_device_descriptor);
-            return true;
-        }
-        if (descriptor_type == USB_DT_CONFIG) {
-            memcpy(pkt->data, &me56ps2_config_descriptors, sizeof(me56ps2_config_descriptors));
-            pkt->header.length = sizeof(me56ps2_config_descriptors);
-            return true;
-        }
-        if (descriptor_type == USB_DT_STRING) {
-            const auto id = e->ctrl.wValue & 0x00ff;
-            if (id >= STRING_DESCRIPTORS_NUM) {return false;} // invalid string id
-            const auto len = reinterpret_cast<const struct _usb_string_descriptor<1> *>(me56ps2_string_descriptors[id])->bLength;
-            memcpy(pkt->data, me56ps2_string_descriptors[id], len);
-            pkt->header.length = len;
-            return true;
-        }
-    }
-    if (e->is_event(USB_TYPE_STANDARD, USB_REQ_SET_CONFIGURATION)) {
-        if (thread_bulk_in == nullptr) {
-            const int ep_num_bulk_in = usb->ep_enable(
-                reinterpret_cast<struct usb_endpoint_descriptor *>(&me56ps2_config_descriptors.endpoint_bulk_in));
-            thread_bulk_in = new std::thread(usb_bulk_in_thread, usb, ep_num_bulk_in);
-        }
-        if (thread_bulk_out == nullptr) {
-            const int ep_num_bulk_out = usb->ep_enable(
-                reinterpret_cast<struct usb_endpoint_descriptor *>(&me56ps2_config_descriptors.endpoint_bulk_out));
-            thread_bulk_out = new std::thread(usb_bulk_out_thread, usb, ep_num_bulk_out);
-        }
-        usb->vbus_draw(me56ps2_config_descriptors.config.bMaxPower);
-        usb->configure();
-        printf("USB configurated.\n");
-        pkt->header.length = 0;
-        return true;
-    }
-    if (e->is_event(USB_TYPE_STANDARD, USB_REQ_SET_INTERFACE)) {
-        pkt->header.length = 0;
-        return true;
-    }
-    if (e->is_event(USB_TYPE_VENDOR, 0x01)) {
-        pkt->header.length = 0;
-
-        if ((e->ctrl.wValue & 0x0101) == 0x0100) {
-            // set DTR to LOW for on-hook
-            if (debug_level >= 2) {printf("on-hook\n");};
-            // disconnect
-            connected.store(false);
-            if (sock != nullptr && sock->is_connected()) {
-                sock->disconnect();
-                printf("disconnected.\n");
-            }
-        } else if ((e->ctrl.wValue & 0x0101) == 0x0101) {
-            // set DTR to HIGH for off-hook
-            if (debug_level >= 2) {printf("off-hook\n");};
-        }
-
-        return true;
-    }
-    if (e->is_event(USB_TYPE_VENDOR)) {
-        pkt->header.length = 0;
-        return true;
-    }
+    // Input format: "ip_addr,port,usb_driver,usb_device[,cpu]"
+    char ip_addr[64], driver[64], device[64];
+    int port, cpu = -1;
+    const auto ret = sscanf(arg, "%63[^,],%d,%63[^,],%63[^,],%d", ip_addr, &port, driver, device, &cpu);
+    if (ret < 4) {return false;}
+    if (port < 1 || port > 65535) {return false;}
 
-    return false;
+    config->ip_addr = strdup(ip_addr);
+    config->port = port;
+    config->driver = strdup(driver);
+    config->device = strdup(device);
+    config->cpu = cpu;
+    config->relay_number = nullptr;
+    config->use_udp = false;
+    config->line_rate = 0;
+    config->tx_deadline = std::chrono::milliseconds(0);
+    config->tx_shed = false;
+    config->bulk_in_packets = BULK_IN_PACKETS_DEFAULT;
+    config->bulk_out_packets = 1;
+    config->use_io_uring = false;
+    config->rt_priority = 0;
+    config->dial_timeout = std::chrono::milliseconds(0);
+    config->call_queue_max = 0;
+    config->call_queue_wait = std::chrono::milliseconds(0);
+    config->auto_answer = 0;
+    config->resume_grace = std::chrono::milliseconds(0);
+    config->impairment = nullptr;
+    config->probe_interval = std::chrono::milliseconds(0);
+    config->recorder = nullptr;
+    return true;
 }
 
-bool event_usb_control_loop(usb_raw_gadget *usb)
+void print_report(std::vector<modem_session *> &modems)
 {
-    usb_raw_control_event e;
-    e.event.type = 0;
-    e.event.length = sizeof(e.ctrl);
-
-    struct usb_packet_control pkt;
-    pkt.header.ep = 0;
-    pkt.header.flags = 0;
-    pkt.header.length = 0;
-
-    usb->event_fetch(&e.event);
-    if (debug_level >= 1) {e.print_debug_log();}
-
-    switch(e.event.type) {
-        case USB_RAW_EVENT_CONNECT:
-            break;
-        case USB_RAW_EVENT_CONTROL:
-            if (!process_control_packet(usb, &e, &pkt)) {
-                usb->ep0_stall();
-                break;
-            }
-
-            pkt.header.length = std::min(pkt.header.length, static_cast<unsigned int>(e.ctrl.wLength));
-            if (e.ctrl.bRequestType & USB_DIR_IN) {
-                usb->ep0_write(reinterpret_cast<struct usb_raw_ep_io *>(&pkt));
-            } else {
-                usb->ep0_read(reinterpret_cast<struct usb_raw_ep_io *>(&pkt));
-            }
-            break;
-        default:
-            break;
+    // Resident set size of the whole process, to size boards per modem
+    long pages = 0, rss_pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp != nullptr) {
+        if (fscanf(fp, "%ld %ld", &pages, &rss_pages) != 2) {rss_pages = 0;}
+        fclose(fp);
     }
-
-    return true;
+    const auto rss_kb = rss_pages * sysconf(_SC_PAGESIZE) / 1024;
+    printf("process: %zu modems, rss %ld KB (%ld KB per modem)\n",
+        modems.size(), rss_kb, modems.empty() ? 0 : rss_kb / (long) modems.size());
+    for (auto m : modems) {m->print_stats();}
 }
 
 void show_usage(char *prog_name, bool verbose)
 {
-    printf("Usage: %s [-svh] ip_addr port [usb_driver] [usb_device]\n", prog_name);
+    printf("Usage: %s [-svuhRU] [-i interval_ms[,max_ms]] [-c cpu] [-m modem]... [-n number] [-w workers] [-M metrics_addr] [-p bps] [-q deadline_ms[,shed]] [-b in_packets[,out_packets]] [-r priority[,loop_cpu]] [-l log_file] [-T file[,MB]] [-E recording] ip_addr port [usb_driver] [usb_device]\n", prog_name);
     if (!verbose) {return;}
 
     printf("\n");
     printf("Options:\n");
     printf("  -s    run as server\n");
+    printf("  -u    talk to the remote modem over UDP with selective retransmission (both sides need -u)\n");
+    printf("  -U    do TCP socket I/O through io_uring (multishot recv, fewer system calls); falls back to epoll\n");
     printf("  -v    verbose. increment log level\n");
+    printf("  -l    write the verbose USB and socket log to this file instead of stdout\n");
+    printf("  -i    bulk-in status interval and idle backoff limit in ms (default: %ld,%ld)\n",
+        (long) bulk_in_timing.status_interval.count(), (long) bulk_in_timing.status_interval_max.count());
+    printf("  -p    pace both directions to this many bits/s, or \"line\" for the CONNECT rate (%d) (default: 0, unlimited)\n", MODEM_LINE_RATE);
+    printf("  -q    queue deadline in ms for data to the console, \",shed\" to drop older data instead of counting it\n");
+    printf("  -b    64 byte packets per bulk-IN transfer and bulk-OUT read, up to %d (default: %d,1)\n", BULK_TRANSFER_PACKETS_MAX, BULK_IN_PACKETS_DEFAULT);
+    printf("  -r    real-time profile: SCHED_FIFO priority of the USB threads (the socket loop runs one below),\n");
+    printf("        locked memory and pre-faulted stacks; optionally pin the socket loop to loop_cpu\n");
+    printf("  -t    give up dialing after this many seconds, or sooner if the game sets S7 lower (default: S7, 50 s)\n");
+    printf("  -Q    server: hold up to this many callers while the line is busy, ringing the next as it frees,\n");
+    printf("        each for at most seconds: callers[,seconds] (default: 0, busy; 60 s)\n");
+    printf("  -A    server: answer after this many rings, whatever the game sets S0 to (default: S0)\n");
+    printf("  -G    keep a call through a dropped TCP connection for this many seconds, resending what was lost (both sides need -G)\n");
+    printf("  -I    emulate a bad network on this side: delay=ms,jitter=ms,dist=uniform|normal|pareto,rate=bits/s,\n");
+    printf("        stall=ms/every_ms,seed=n (delays apply each way; e.g. delay=40,jitter=10 for about 80 ms RTT)\n");
+    printf("  -P    measure the link with an in-band probe every this many ms, at least %ld (both sides need -P);\n",
+        (long) LINK_PROBE_INTERVAL_MIN.count());
+    printf("        ATI6 or AT&V1 reports RTT, jitter and throughput\n");
+    printf("  -T    record the control requests, USB transfers and socket data of all modems to a file mapped\n");
+    printf("        into memory, sized up front: file[,MB] (default: %zu MB); see bench \"replay\"\n", RECORDING_SIZE_DEFAULT);
+    printf("  -E    export a recording made with -T to <recording>.pcapng for Wireshark and exit\n");
+    printf("  -c    pin the threads of the first modem to this CPU core\n");
+    printf("  -m    add a modem: ip_addr,port,usb_driver,usb_device[,cpu] (repeatable)\n");
+    printf("  -n    take calls for this number on the relay server at ip_addr:port; ATD dials a number\n");
+    printf("  -R    run as relay server on ip_addr:port (no USB)\n");
+    printf("  -w    relay worker threads (default: number of CPUs)\n");
+    printf("  -M    serve Prometheus metrics on a UNIX socket (/path) or TCP (ip:port)\n");
     printf("  -h    show this help message.\n");
     printf("\n");
+    printf("Send SIGUSR1 to print memory, CPU usage and latency per modem, or relay statistics.\n");
+    printf("\n");
     printf("Parameters:\n");
-    printf("  ip_addr       server IPv4 address\n");
+    printf("  ip_addr       server address: IPv4, IPv6 or host name (a server binds IPv4)\n");
     printf("  port          port number\n");
     printf("  usb_driver    driver name (default: %s)\n", USB_RAW_GADGET_DRIVER_DEFAULT);
     printf("  usb_device    device name (default: %s)\n", USB_RAW_GADGET_DEVICE_DEFAULT);
@@ -325,14 +218,153 @@ int main(int argc, char *argv[])
     const char *device = USB_RAW_GADGET_DEVICE_DEFAULT;
     const char *ip_addr = nullptr;
     int port = -1;
+    int cpu = -1;
     bool is_server = false;
+    bool is_relay = false;
+    bool use_udp = false;
+    bool use_io_uring = false;
+    rt_profile rt = {0, -1};
+    int line_rate = 0;
+    std::chrono::milliseconds tx_deadline(0);
+    bool tx_shed = false;
+    std::chrono::milliseconds dial_timeout(0);
+    int call_queue_max = 0;
+    std::chrono::milliseconds call_queue_wait(0);
+    int auto_answer = 0;
+    std::chrono::milliseconds resume_grace(0);
+    impairment_profile impairment;
+    bool impaired = false;
+    std::chrono::milliseconds probe_interval(0);
+    int bulk_in_packets = BULK_IN_PACKETS_DEFAULT;
+    int bulk_out_packets = 1;
+    int relay_workers = std::thread::hardware_concurrency();
+    const char *relay_number = nullptr;
+    const char *metrics_addr = nullptr;
+    const char *log_path = nullptr;
+    std::string record_path;
+    size_t record_size = 0;
+    const char *export_path = nullptr;
+    std::vector<modem_config> extra_configs;
 
     int opt;
-    while((opt = getopt(argc, argv, "svh")) != -1) {
+    while((opt = getopt(argc, argv, "svuhRUi:c:m:n:w:M:p:q:l:b:r:t:Q:A:G:I:P:T:E:")) != -1) {
         switch(opt) {
             case 's':
                 is_server = true;
                 break;
+            case 'u':
+                use_udp = true;
+                break;
+            case 'R':
+                is_relay = true;
+                break;
+            case 'U':
+                use_io_uring = true;
+                break;
+            case 'n':
+                relay_number = optarg;
+                break;
+            case 'M':
+                metrics_addr = optarg;
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 'w':
+                relay_workers = atoi(optarg);
+                break;
+            case 'p':
+                if (!parse_line_rate(optarg, &line_rate)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                if (!parse_tx_deadline(optarg, &tx_deadline, &tx_shed)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                if (!parse_bulk_packets(optarg, &bulk_in_packets, &bulk_out_packets)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                if (!parse_rt_profile(optarg, &rt)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                break;
+            case 't':
+                if (atoi(optarg) < 1) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                dial_timeout = std::chrono::seconds(atoi(optarg));
+                break;
+            case 'Q':
+                if (!parse_call_queue(optarg, &call_queue_max, &call_queue_wait)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                break;
+            case 'A':
+                if (atoi(optarg) < 1) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                auto_answer = atoi(optarg);
+                break;
+            case 'G':
+                if (atoi(optarg) < 1) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                resume_grace = std::chrono::seconds(atoi(optarg));
+                break;
+            case 'I':
+                if (!parse_impairment_profile(optarg, &impairment)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                impaired = true;
+                break;
+            case 'P':
+                if (atoi(optarg) < LINK_PROBE_INTERVAL_MIN.count()) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                probe_interval = std::chrono::milliseconds(atoi(optarg));
+                break;
+            case 'T':
+                if (!parse_recording_arg(optarg, &record_path, &record_size)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                break;
+            case 'E':
+                export_path = optarg;
+                break;
+            case 'c':
+                cpu = atoi(optarg);
+                break;
+            case 'm': {
+                modem_config config;
+                if (!parse_modem_config(optarg, &config)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                extra_configs.push_back(config);
+                break;
+            }
+            case 'i':
+                if (!parse_bulk_in_policy(optarg, &bulk_in_timing)) {
+                    show_usage(argv[0], false);
+                    exit(1);
+                }
+                break;
             case 'v':
                 debug_level++;
                 break;
@@ -345,6 +377,11 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (export_path != nullptr) {
+        const auto out = (std::string) export_path + ".pcapng";
+        exit(export_pcapng(export_path, out.c_str()) ? 0 : 1);
+    }
+
     if (optind < argc) {ip_addr = argv[optind++];}
     if (optind < argc) {port = atoi(argv[optind++]);}
     if (optind < argc) {driver = argv[optind++];}
@@ -355,19 +392,129 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    usb_raw_gadget *usb = new usb_raw_gadget("/dev/raw-gadget");
-    usb->set_debug_level(debug_level);
-    usb->init(USB_SPEED_HIGH, driver, device);
-    usb->run();
+    if (use_udp && (is_relay || relay_number != nullptr)) {
+        printf("The relay server only carries TCP, -u cannot be used with -R or -n.\n");
+        exit(1);
+    }
+    if (resume_grace.count() > 0 && (use_udp || relay_number != nullptr)) {
+        printf("Calls are resumed over direct TCP only, -G cannot be used with -u or -n.\n");
+        exit(1);
+    }
 
-    sock = new tcp_sock(is_server, ip_addr, port);
-    sock->set_debug_level(debug_level);
-    sock->set_ring_callback(ring_callback);
-    sock->set_recv_callback(recv_callback);
+    // Signals are handled by the main thread only
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigset, nullptr);
+
+    if (is_relay) {
+        relay_server *relay = new relay_server(ip_addr, port, relay_workers, debug_level);
+        printf("relay: listening on %s:%d.\n", ip_addr, port);
+        while (true) {
+            int sig;
+            sigwait(&sigset, &sig);
+            relay->print_stats();
+            if (sig != SIGUSR1) {break;}
+        }
+        delete relay;
+        return 0;
+    }
 
-    while(event_usb_control_loop(usb));
+    // Data threads only queue their log records; a writer thread formats them
+    FILE *log_file = stdout;
+    if (log_path != nullptr) {
+        log_file = fopen(log_path, "a");
+        if (log_file == nullptr) {
+            printf("Cannot open %s: %s\n", log_path, std::strerror(errno));
+            exit(1);
+        }
+    }
+    if (debug_level >= 1) {log_start(log_file);}
 
-    delete usb;
+    if (debug_level >= 1) {
+        printf("bulk-in: status interval %ld ms, idle backoff up to %ld ms.\n",
+            (long) bulk_in_timing.status_interval.count(), (long) bulk_in_timing.status_interval_max.count());
+    }
 
+    traffic_recorder *recorder = nullptr;
+    if (!record_path.empty()) {
+        recorder = new traffic_recorder(record_path.c_str(), record_size);
+        printf("record: writing to %s, up to %zu MB.\n", record_path.c_str(), record_size >> 20);
+    }
+
+    std::vector<modem_config> configs;
+    configs.push_back({driver, device, ip_addr, port, is_server && relay_number == nullptr, cpu, relay_number, use_udp,
+        line_rate, tx_deadline, tx_shed, bulk_in_packets, bulk_out_packets, use_io_uring, rt.priority, dial_timeout,
+        call_queue_max, call_queue_wait, auto_answer, resume_grace, impaired ? &impairment : nullptr, probe_interval, recorder});
+    for (auto &config : extra_configs) {
+        config.is_server = is_server;
+        config.use_udp = use_udp;
+        config.line_rate = line_rate;
+        config.tx_deadline = tx_deadline;
+        config.tx_shed = tx_shed;
+        config.bulk_in_packets = bulk_in_packets;
+        config.bulk_out_packets = bulk_out_packets;
+        config.use_io_uring = use_io_uring;
+        config.rt_priority = rt.priority;
+        config.dial_timeout = dial_timeout;
+        config.call_queue_max = call_queue_max;
+        config.call_queue_wait = call_queue_wait;
+        config.auto_answer = auto_answer;
+        config.resume_grace = resume_grace;
+        config.impairment = impaired ? &impairment : nullptr;
+        config.probe_interval = probe_interval;
+        config.recorder = recorder;
+        configs.push_back(config);
+    }
+
+    if (rt.priority > 0) {
+        // Before the modems allocate, so their buffers are locked as they are touched
+        const auto locked = rt_lock_memory();
+        printf("rt: USB threads SCHED_FIFO priority %d, event loop %d, memory %s.\n",
+            rt.priority, rt.priority - 1, locked ? "locked" : "not locked");
+    }
+
+    // All modems share one event loop for their sockets
+    event_loop *loop = new event_loop();
+    if (rt.priority > 0 || rt.loop_cpu >= 0) {
+        loop->run_sync([&rt]{
+            rt_set_affinity("event loop", rt.loop_cpu);
+            rt_enter_thread("event loop", rt.priority > 0 ? rt.priority - 1 : 0);
+        });
+    }
+    std::vector<modem_session *> modems;
+    for (size_t i = 0; i < configs.size(); i++) {
+        auto m = new modem_session(i, configs[i], bulk_in_timing, loop, new usb_raw_gadget("/dev/raw-gadget"), debug_level);
+        m->start();
+        modems.push_back(m);
+    }
+
+    metrics_server *metrics = nullptr;
+    if (metrics_addr != nullptr) {
+        metrics = new metrics_server(loop, metrics_addr, [&modems](std::string &out) {
+            render_modem_metrics(out, modems);
+            metrics_append(out, "me56ps2_log_dropped_records_total", "counter", "Debug log records dropped because a logging thread's ring was full.",
+                {{"", (double) log_get_dropped()}});
+        });
+        printf("metrics: serving on %s.\n", metrics_addr);
+    }
+
+    while (true) {
+        int sig;
+        sigwait(&sigset, &sig);
+        print_report(modems);
+        if (sig != SIGUSR1) {break;}
+    }
+
+    delete metrics;
+    if (recorder != nullptr) {
+        // The modems keep running, so the recorder stays; it drops what they record from here on
+        recorder->close();
+        printf("record: %s closed at %zu bytes, %lu records dropped.\n", record_path.c_str(), recorder->get_size(),
+            (unsigned long) recorder->get_dropped());
+    }
+    log_stop();
     return 0;
 }
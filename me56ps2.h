@@ -1,19 +1,3 @@
-#if defined(HW_NANOPI_NEO2) // for NanoPi NEO2
-constexpr char USB_RAW_GADGET_DRIVER_DEFAULT[] = "musb-hdrc";
-constexpr char USB_RAW_GADGET_DEVICE_DEFAULT[] = "musb-hdrc.2.auto";
-#elif defined(HW_RPI_ZERO) // for Raspberry Pi Zero W
-constexpr char USB_RAW_GADGET_DRIVER_DEFAULT[] = "20980000.usb";
-constexpr char USB_RAW_GADGET_DEVICE_DEFAULT[] = "20980000.usb";
-#elif defined(HW_RPI_ZERO2) // for Raspberry Pi Zero 2 W
-constexpr char USB_RAW_GADGET_DRIVER_DEFAULT[] = "3f980000.usb";
-constexpr char USB_RAW_GADGET_DEVICE_DEFAULT[] = "3f980000.usb";
-#else // for Raspberry Pi 4 Model B
-constexpr char USB_RAW_GADGET_DRIVER_DEFAULT[] = "fe980000.usb";
-constexpr char USB_RAW_GADGET_DEVICE_DEFAULT[] = "fe980000.usb";
-#endif
-
-constexpr auto TCP_DEFAULT_PORT = 10023;
-
 constexpr auto BCD_USB = 0x0110U; // USB 1.1
 constexpr auto BCD_DEVICE = 0x0101U;
 constexpr auto USB_VENDOR = 0x0590U; // Omron Corp.
@@ -27,14 +11,26 @@ constexpr auto STRING_ID_MANUFACTURER = 1U;
 constexpr auto STRING_ID_PRODUCT = 2U;
 constexpr auto STRING_ID_SERIAL = 3U;
 
+// Same layout as struct usb_raw_ep_io. Newer kernel headers declare its data
+// as a flexible array member, which can not be followed by our buffer.
+struct usb_ep_io_header {
+    __u16 ep;
+    __u16 flags;
+    __u32 length;
+};
+static_assert(sizeof(usb_ep_io_header) == sizeof(usb_raw_ep_io), "usb_ep_io_header must match usb_raw_ep_io");
+
 struct usb_packet_control {
-    struct usb_raw_ep_io header;
+    struct usb_ep_io_header header;
     char data[MAX_PACKET_SIZE_CONTROL];
 };
 
-struct usb_packet_bulk {
-    struct usb_raw_ep_io header;
-    char data[MAX_PACKET_SIZE_BULK];
+// Up to BULK_TRANSFER_PACKETS_MAX (modem_session.h) packets per
+// ep_read/ep_write; the UDC splits the transfer at MAX_PACKET_SIZE_BULK and
+// every packet keeps its own ME56PS2 header.
+struct usb_transfer_bulk {
+    struct usb_ep_io_header header;
+    char data[MAX_PACKET_SIZE_BULK * BULK_TRANSFER_PACKETS_MAX];
 };
 
 struct _usb_endpoint_descriptor {
@@ -60,7 +56,7 @@ struct usb_config_descriptors {
     struct _usb_endpoint_descriptor endpoint_bulk_out;
 };
 
-struct usb_device_descriptor me56ps2_device_descriptor = {
+constexpr struct usb_device_descriptor me56ps2_device_descriptor = {
     .bLength            = USB_DT_DEVICE_SIZE,
     .bDescriptorType    = USB_DT_DEVICE,
     .bcdUSB             = __constant_cpu_to_le16(BCD_USB),
@@ -77,7 +73,7 @@ struct usb_device_descriptor me56ps2_device_descriptor = {
     .bNumConfigurations = 1,
 };
 
-struct usb_config_descriptors me56ps2_config_descriptors = {
+constexpr struct usb_config_descriptors me56ps2_config_descriptors = {
     .config = {
         .bLength             = USB_DT_CONFIG_SIZE,
         .bDescriptorType     = USB_DT_CONFIG,
@@ -117,35 +113,181 @@ struct usb_config_descriptors me56ps2_config_descriptors = {
     }
 };
 
-const struct _usb_string_descriptor<1> me56ps2_string_descriptor_0 = {
+constexpr struct _usb_string_descriptor<1> me56ps2_string_descriptor_0 = {
     .bLength = sizeof(me56ps2_string_descriptor_0),
     .bDescriptorType = USB_DT_STRING,
-    .wData = {__constant_cpu_to_le16(0x0409)},
+    .wData = {0x0409},
 };
 
-// FIXME: specify byte order
-const struct _usb_string_descriptor<3> me56ps2_string_descriptor_1 = { // Manufacturer
+constexpr struct _usb_string_descriptor<3> me56ps2_string_descriptor_1 = { // Manufacturer
     .bLength = sizeof(me56ps2_string_descriptor_1),
     .bDescriptorType = USB_DT_STRING,
     .wData = {u'N', u'/', u'A'},
 };
 
-const struct _usb_string_descriptor<14> me56ps2_string_descriptor_2 = { // Product
+constexpr struct _usb_string_descriptor<14> me56ps2_string_descriptor_2 = { // Product
     .bLength = sizeof(me56ps2_string_descriptor_2),
     .bDescriptorType = USB_DT_STRING,
     .wData = {u'M', u'o', u'd', u'e', u'm', u' ', u'e', u'm', u'u', u'l', u'a', u't', u'o', u'r'},
 };
 
-const struct _usb_string_descriptor<3> me56ps2_string_descriptor_3 = { // Serial
+constexpr struct _usb_string_descriptor<3> me56ps2_string_descriptor_3 = { // Serial
     .bLength = sizeof(me56ps2_string_descriptor_3),
     .bDescriptorType = USB_DT_STRING,
     .wData = {u'N', u'/', u'A'},
 };
 
 constexpr auto STRING_DESCRIPTORS_NUM = 4;
-const void *me56ps2_string_descriptors[STRING_DESCRIPTORS_NUM] = {
-    &me56ps2_string_descriptor_0,
-    &me56ps2_string_descriptor_1,
-    &me56ps2_string_descriptor_2,
-    &me56ps2_string_descriptor_3,
+
+// The descriptors as sent on the wire, back to back in one blob built at
+// compile time. A GET_DESCRIPTOR reply is a slice of it, found by descriptor
+// type and index with two table lookups.
+constexpr size_t DESCRIPTOR_BLOB_SIZE = USB_DT_DEVICE_SIZE + sizeof(usb_config_descriptors) +
+    sizeof(me56ps2_string_descriptor_0) + sizeof(me56ps2_string_descriptor_1) +
+    sizeof(me56ps2_string_descriptor_2) + sizeof(me56ps2_string_descriptor_3);
+constexpr size_t DESCRIPTOR_SLICES = 2 + STRING_DESCRIPTORS_NUM;
+
+struct descriptor_slice {
+    uint16_t offset;
+    uint16_t length;
+};
+
+struct descriptor_set {
+    uint8_t blob[DESCRIPTOR_BLOB_SIZE];
+    descriptor_slice slices[DESCRIPTOR_SLICES];
+    uint8_t first_slice[256]; // by descriptor type
+    uint8_t count[256]; // descriptors of the type; higher indexes are stalled
+};
+
+struct descriptor_writer {
+    descriptor_set set;
+    size_t length;
+    size_t slices;
+    constexpr void put8(uint8_t value) {set.blob[length++] = value;}
+    constexpr void put16(uint16_t value) {put8(value & 0xff); put8(value >> 8);} // little endian
+    constexpr void begin(uint8_t type)
+    {
+        if (set.count[type]++ == 0) {set.first_slice[type] = static_cast<uint8_t>(slices);}
+        set.slices[slices++].offset = static_cast<uint16_t>(length);
+    }
+    constexpr void end(void) {set.slices[slices - 1].length = static_cast<uint16_t>(length - set.slices[slices - 1].offset);}
+    constexpr void put_endpoint(const struct _usb_endpoint_descriptor &d)
+    {
+        put8(d.bLength);
+        put8(d.bDescriptorType);
+        put8(d.bEndpointAddress);
+        put8(d.bmAttributes);
+        put16(d.wMaxPacketSize);
+        put8(d.bInterval);
+    }
+    template<int N>
+    constexpr void put_string(const struct _usb_string_descriptor<N> &d)
+    {
+        begin(USB_DT_STRING);
+        put8(d.bLength);
+        put8(d.bDescriptorType);
+        for (int i = 0; i < N; i++) {put16(d.wData[i]);}
+        end();
+    }
 };
+
+constexpr descriptor_set make_descriptor_set(void)
+{
+    descriptor_writer w = {};
+    const auto &dev = me56ps2_device_descriptor;
+    w.begin(USB_DT_DEVICE);
+    w.put8(dev.bLength);
+    w.put8(dev.bDescriptorType);
+    w.put16(__le16_to_cpu(dev.bcdUSB));
+    w.put8(dev.bDeviceClass);
+    w.put8(dev.bDeviceSubClass);
+    w.put8(dev.bDeviceProtocol);
+    w.put8(dev.bMaxPacketSize0);
+    w.put16(__le16_to_cpu(dev.idVendor));
+    w.put16(__le16_to_cpu(dev.idProduct));
+    w.put16(__le16_to_cpu(dev.bcdDevice));
+    w.put8(dev.iManufacturer);
+    w.put8(dev.iProduct);
+    w.put8(dev.iSerialNumber);
+    w.put8(dev.bNumConfigurations);
+    w.end();
+
+    const auto &conf = me56ps2_config_descriptors.config;
+    w.begin(USB_DT_CONFIG);
+    w.put8(conf.bLength);
+    w.put8(conf.bDescriptorType);
+    w.put16(__le16_to_cpu(conf.wTotalLength));
+    w.put8(conf.bNumInterfaces);
+    w.put8(conf.bConfigurationValue);
+    w.put8(conf.iConfiguration);
+    w.put8(conf.bmAttributes);
+    w.put8(conf.bMaxPower);
+    const auto &intf = me56ps2_config_descriptors.interface;
+    w.put8(intf.bLength);
+    w.put8(intf.bDescriptorType);
+    w.put8(intf.bInterfaceNumber);
+    w.put8(intf.bAlternateSetting);
+    w.put8(intf.bNumEndpoints);
+    w.put8(intf.bInterfaceClass);
+    w.put8(intf.bInterfaceSubClass);
+    w.put8(intf.bInterfaceProtocol);
+    w.put8(intf.iInterface);
+    w.put_endpoint(me56ps2_config_descriptors.endpoint_bulk_in);
+    w.put_endpoint(me56ps2_config_descriptors.endpoint_bulk_out);
+    w.end();
+
+    w.put_string(me56ps2_string_descriptor_0);
+    w.put_string(me56ps2_string_descriptor_1);
+    w.put_string(me56ps2_string_descriptor_2);
+    w.put_string(me56ps2_string_descriptor_3);
+    return w.set;
+}
+
+constexpr descriptor_set me56ps2_descriptors = make_descriptor_set();
+static_assert(me56ps2_descriptors.slices[0].length == USB_DT_DEVICE_SIZE, "device descriptor size");
+static_assert(me56ps2_descriptors.slices[1].length == sizeof(usb_config_descriptors), "configuration descriptor size");
+static_assert(me56ps2_descriptors.count[USB_DT_STRING] == STRING_DESCRIPTORS_NUM, "string descriptor count");
+
+// The reply to GET_DESCRIPTOR for wValue, nullptr if there is no such descriptor
+inline const uint8_t *find_descriptor(uint16_t value, uint16_t *length)
+{
+    const auto type = value >> 8;
+    const auto index = value & 0xff;
+    if (index >= me56ps2_descriptors.count[type]) {return nullptr;}
+    const auto &slice = me56ps2_descriptors.slices[me56ps2_descriptors.first_slice[type] + index];
+    *length = slice.length;
+    return me56ps2_descriptors.blob + slice.offset;
+}
+
+enum control_action : uint8_t {
+    CONTROL_STALL,
+    CONTROL_GET_DESCRIPTOR,
+    CONTROL_SET_CONFIGURATION,
+    CONTROL_ACK, // no data stage, nothing to do
+    CONTROL_SET_LINE, // vendor request 0x01: DTR
+};
+
+// Control requests we handle, by the type bits of bmRequestType and bRequest
+struct control_table {
+    control_action actions[4][256];
+};
+
+constexpr control_table make_control_table(void)
+{
+    control_table t = {};
+    constexpr auto standard = USB_TYPE_STANDARD >> 5;
+    constexpr auto vendor = USB_TYPE_VENDOR >> 5;
+    t.actions[standard][USB_REQ_GET_DESCRIPTOR] = CONTROL_GET_DESCRIPTOR;
+    t.actions[standard][USB_REQ_SET_CONFIGURATION] = CONTROL_SET_CONFIGURATION;
+    t.actions[standard][USB_REQ_SET_INTERFACE] = CONTROL_ACK;
+    for (auto &action : t.actions[vendor]) {action = CONTROL_ACK;}
+    t.actions[vendor][0x01] = CONTROL_SET_LINE;
+    return t;
+}
+
+constexpr control_table me56ps2_control_table = make_control_table();
+
+inline control_action get_control_action(const struct usb_ctrlrequest &ctrl)
+{
+    return me56ps2_control_table.actions[(ctrl.bRequestType & USB_TYPE_MASK) >> 5][ctrl.bRequest];
+}
@@ -0,0 +1,181 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "event_loop.h"
+#include "metrics_server.h"
+
+constexpr size_t METRICS_REQUEST_MAX = 4096;
+
+metrics_server::metrics_server(event_loop *loop, const char *addr, std::function<void(std::string &)> render)
+{
+    metrics_server::loop = loop;
+    metrics_server::render = render;
+
+    if (addr[0] == '/') {
+        struct sockaddr_un un;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(un.sun_path)) {
+            throw std::runtime_error((std::string) "metrics_server: path too long: " + addr);
+        }
+        strcpy(un.sun_path, addr);
+        unlink(addr);
+        unix_path = addr;
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<struct sockaddr *>(&un), sizeof(un)) < 0) {
+            throw std::runtime_error((std::string) "metrics_server: bind(): " + std::strerror(errno));
+        }
+    } else {
+        char ip_addr[64];
+        int port;
+        if (sscanf(addr, "%63[^:]:%d", ip_addr, &port) != 2 || port < 1 || port > 65535) {
+            throw std::runtime_error((std::string) "metrics_server: bad address: " + addr);
+        }
+        struct sockaddr_in in;
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(port);
+        in.sin_addr.s_addr = inet_addr(ip_addr);
+
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        const int reuse = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<struct sockaddr *>(&in), sizeof(in)) < 0) {
+            throw std::runtime_error((std::string) "metrics_server: bind(): " + std::strerror(errno));
+        }
+    }
+
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        throw std::runtime_error((std::string) "metrics_server: listen(): " + std::strerror(errno));
+    }
+    listen_handler = [this](uint32_t events) {on_listen_event(events);};
+    loop->add(listen_fd, EPOLLIN, &listen_handler);
+}
+
+metrics_server::~metrics_server()
+{
+    loop->run_sync([this]{
+        loop->remove(listen_fd);
+        close(listen_fd);
+        while (!clients.empty()) {close_client(clients.begin()->first);}
+    });
+    if (!unix_path.empty()) {unlink(unix_path.c_str());}
+}
+
+void metrics_server::on_listen_event(uint32_t events)
+{
+    (void) events;
+
+    while (true) {
+        auto fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("metrics_server: accept(): %s\n", std::strerror(errno));
+            }
+            return;
+        }
+
+        auto c = new client();
+        c->sent = 0;
+        c->handler = [this, fd](uint32_t events) {on_client_event(fd, events);};
+        clients[fd] = c;
+        loop->add(fd, EPOLLIN | EPOLLRDHUP, &c->handler);
+    }
+}
+
+void metrics_server::on_client_event(int fd, uint32_t events)
+{
+    auto it = clients.find(fd);
+    if (it == clients.end()) {return;}
+    auto c = it->second;
+
+    if (!c->response.empty()) {
+        // Waiting for room in the socket buffer
+        if (events & (EPOLLHUP | EPOLLERR)) {
+            close_client(fd);
+        } else {
+            send_response(fd, c);
+        }
+        return;
+    }
+
+    char buf[1024];
+    auto len = ::recv(fd, buf, sizeof(buf), 0);
+    if (len > 0) {c->request.append(buf, len);}
+
+    // Answer once the request header is complete, whatever it asks for
+    const auto complete = c->request.find("\r\n\r\n") != std::string::npos || c->request.find("\n\n") != std::string::npos;
+    if (!complete && len != 0 && !(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        if (c->request.length() > METRICS_REQUEST_MAX) {close_client(fd);}
+        return;
+    }
+
+    if (!complete) {
+        close_client(fd);
+        return;
+    }
+    std::string body;
+    render(body);
+    c->response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+        + std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+    send_response(fd, c);
+}
+
+void metrics_server::send_response(int fd, client *c)
+{
+    // Many modems make a body larger than the socket buffer; the rest goes
+    // out on EPOLLOUT
+    while (c->sent < c->response.length()) {
+        const auto n = ::send(fd, c->response.c_str() + c->sent, c->response.length() - c->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {continue;}
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                loop->modify(fd, EPOLLOUT, &c->handler);
+                return;
+            }
+            printf("metrics_server: send(): %s\n", std::strerror(errno));
+            close_client(fd);
+            return;
+        }
+        c->sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+    close_client(fd);
+}
+
+void metrics_server::close_client(int fd)
+{
+    auto it = clients.find(fd);
+    if (it == clients.end()) {return;}
+
+    loop->remove(fd);
+    close(fd);
+    // The handler may be the one running right now, free it after this event
+    auto c = it->second;
+    clients.erase(it);
+    loop->post([c]{delete c;});
+}
+
+void metrics_append(std::string &out, const char *name, const char *type, const char *help,
+    const std::vector<std::pair<std::string, double>> &samples)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    out += line;
+    for (const auto &s : samples) {
+        snprintf(line, sizeof(line), "%s{%s} %.17g\n", name, s.first.c_str(), s.second);
+        out += line;
+    }
+}
@@ -0,0 +1,38 @@
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class event_loop;
+
+// Serves the Prometheus text format over HTTP on a UNIX socket ("/path")
+// or TCP ("ip:port"). Runs on the event loop; render only reads atomics,
+// so a scrape never waits for a data thread.
+class metrics_server
+{
+    private:
+        event_loop *loop;
+        int listen_fd;
+        std::string unix_path;
+        std::function<void(std::string &)> render;
+        std::function<void(uint32_t)> listen_handler;
+        struct client {
+            std::string request;
+            std::string response; // still to be sent, from sent on
+            size_t sent;
+            std::function<void(uint32_t)> handler;
+        };
+        std::unordered_map<int, client *> clients;
+        void on_listen_event(uint32_t events);
+        void on_client_event(int fd, uint32_t events);
+        void send_response(int fd, client *c);
+        void close_client(int fd);
+    public:
+        metrics_server(event_loop *loop, const char *addr, std::function<void(std::string &)> render);
+        ~metrics_server();
+};
+
+// Appends one metric family; labels and values are given per sample.
+void metrics_append(std::string &out, const char *name, const char *type, const char *help,
+    const std::vector<std::pair<std::string, double>> &samples);
@@ -0,0 +1,1033 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "usb_gadget.h"
+#include "usb_raw_control_event.h"
+#include "ring_buffer.h"
+#include "latency_histogram.h"
+#include "bulk_in_scheduler.h"
+#include "rt_profile.h"
+#include "line_pacer.h"
+#include "event_loop.h"
+#include "transport.h"
+#include "tcp_sock.h"
+#include "udp_sock.h"
+#include "impairment.h"
+#include "link_probe.h"
+#include "traffic_record.h"
+#include "at_command.h"
+#include "async_log.h"
+#include "modem_session.h"
+#include "metrics_server.h"
+
+#include "board.h"
+#include "me56ps2.h"
+
+constexpr size_t USB_TX_BUFFER_SIZE = 524288;
+constexpr size_t USB_TX_STAMPS_SIZE = 4096; // chunks in flight; more are not timed
+constexpr size_t BULK_IN_PAYLOAD = MAX_PACKET_SIZE_BULK - 2; // after the status bytes
+// Stop reading from the remote side above this much queued data and read
+// again below the low mark, so the transmit buffer never overflows
+constexpr size_t TX_PAUSE_BYTES = 65536;
+constexpr size_t TX_RESUME_BYTES = 16384;
+constexpr auto RING_INTERVAL = std::chrono::seconds(6); // a ring cadence of 2 s on, 4 s off
+
+static const std::string connect_reply = "CONNECT " + std::to_string(MODEM_LINE_RATE) + " V42\r\n";
+
+static int64_t now_ns(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+modem_session::modem_session(int id, const modem_config &config, const bulk_in_policy &bulk_in_timing, event_loop *loop, usb_gadget *usb, int debug_level)
+    : usb_tx_buffer(USB_TX_BUFFER_SIZE), usb_tx_stamps(USB_TX_STAMPS_SIZE), usb_pacer(config.line_rate),
+      remote_pacer(config.line_rate), connected(false), dialing(false), dial_call(0), ringing(false),
+      auto_answer_rings(config.auto_answer), ring_ns(0), rx_throttled(false), rx_throttle_since_ns(0)
+{
+    modem_session::id = id;
+    modem_session::config = config;
+    modem_session::debug_level = debug_level;
+    modem_session::bulk_in_timing = bulk_in_timing;
+    modem_session::loop = loop;
+    ring_call = 0;
+    rings = 0;
+    enumerating = false;
+    recv_iovcnt = 0;
+    alive = std::make_shared<bool>(true);
+    thread_control = nullptr;
+    thread_bulk_in = nullptr;
+    thread_bulk_out = nullptr;
+    online_total = std::chrono::steady_clock::duration::zero();
+    online_cpu_start_ns = 0;
+    online_cpu_total_ns = 0;
+    for (auto c : {&usb_in_packets, &usb_in_bytes, &usb_out_packets, &usb_out_bytes, &usb_in_transfers, &usb_out_transfers, &tx_high_water, &tx_overflow_bytes,
+        &tx_late_bytes, &tx_shed_bytes, &tx_queue_delay_ns, &rx_throttle_events, &rx_throttle_ns_total, &payload_mismatches, &dial_attempts, &dial_connected, &dial_failed, &calls_answered, &calls_ended,
+        &online_ns_total, &last_call_ns, &enumerations, &last_enumeration_ns}) {
+        c->store(0);
+    }
+
+    modem_session::usb = usb;
+    usb->set_debug_level(debug_level);
+    usb->init(USB_SPEED_HIGH, config.driver, config.device);
+    usb->run();
+
+    if (config.use_udp) {
+        sock = new udp_sock(loop, config.is_server, config.ip_addr, config.port);
+    } else {
+        auto tcp = new tcp_sock(loop, config.is_server, config.ip_addr, config.port);
+        if (config.use_io_uring && !tcp->enable_io_uring()) {
+            printf("modem%d: io_uring is not available, using epoll.\n", id);
+        }
+        if (config.is_server && config.relay_number == nullptr) {tcp->set_accept_queue(config.call_queue_max, config.call_queue_wait);}
+        if (config.resume_grace.count() > 0 && config.relay_number == nullptr) {tcp->enable_resume(config.resume_grace);}
+        sock = tcp;
+    }
+    if (config.impairment != nullptr) {
+        sock = new impaired_transport(loop, sock, *config.impairment);
+        printf("modem%d: impaired link: %s.\n", id, describe_impairment(*config.impairment).c_str());
+    }
+    probe = nullptr;
+    if (config.probe_interval.count() > 0) {
+        // Outside the impairment, so the probes see the emulated network too
+        probe = new probed_transport(sock, config.probe_interval);
+        sock = probe;
+    }
+    sock->set_debug_level(debug_level);
+    sock->set_ring_callback([this]{ring_callback();});
+    sock->set_recv_callback([this](const char *buffer, size_t length){recv_callback(buffer, length);});
+    sock->set_recv_sink([this](struct iovec *iov){return recv_acquire(iov);}, [this](size_t length){recv_commit(length);});
+    sock->set_disconnect_callback([this]{disconnect_callback();});
+    if (config.relay_number != nullptr) {sock->set_relay(config.relay_number);}
+}
+
+modem_session::~modem_session()
+{
+    // RINGs still scheduled find nothing to ring
+    loop->run_sync([this]{alive.reset();});
+    delete sock;
+    delete usb;
+}
+
+void modem_session::pin_thread(std::thread *t)
+{
+    if (config.cpu < 0) {return;}
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(config.cpu, &cpuset);
+    const auto ret = pthread_setaffinity_np(t->native_handle(), sizeof(cpuset), &cpuset);
+    if (ret != 0) {
+        printf("modem%d: pthread_setaffinity_np(): %s\n", id, std::strerror(ret));
+    }
+}
+
+void modem_session::enter_thread(const char *name)
+{
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "modem%d %s", id, name);
+    rt_enter_thread(thread_name, config.rt_priority);
+}
+
+uint64_t modem_session::get_cpu_time_ns(void)
+{
+    // Sum of the CPU time of this modem's own threads
+    uint64_t total = 0;
+    for (auto t : {thread_control, thread_bulk_in, thread_bulk_out}) {
+        if (t == nullptr) {continue;}
+        clockid_t cid;
+        struct timespec ts;
+        if (pthread_getcpuclockid(t->native_handle(), &cid) != 0) {continue;}
+        if (clock_gettime(cid, &ts) != 0) {continue;}
+        total += ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    return total;
+}
+
+void modem_session::set_online(bool online)
+{
+    {
+        std::lock_guard<std::mutex> lock(online_mtx);
+
+        if (connected.exchange(online) == online) {return;}
+
+        const auto now = std::chrono::steady_clock::now();
+        const auto cpu_ns = get_cpu_time_ns();
+        if (online) {
+            online_since = now;
+            online_cpu_start_ns = cpu_ns;
+        } else {
+            online_total += now - online_since;
+            online_cpu_total_ns += cpu_ns - online_cpu_start_ns;
+            const auto call_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - online_since).count();
+            last_call_ns.store(call_ns, std::memory_order_relaxed);
+            online_ns_total.fetch_add(call_ns, std::memory_order_relaxed);
+            calls_ended.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    if (config.recorder != nullptr) {config.recorder->record(RECORD_CALL, id, online ? 1 : 0, nullptr, 0);}
+
+    // One latency report per call
+    if (!online) {
+        print_latency();
+        if (probe != nullptr) {printf("modem%d: link: %s\n", id, describe_link_stats(probe->get_link_stats()).c_str());}
+        for (auto h : {&usb_out_to_tcp, &tcp_to_enqueue, &enqueue_to_usb, &tcp_to_usb_in, &rx_throttle_time}) {h->reset();}
+    }
+}
+
+void modem_session::print_latency(void)
+{
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "modem%d: ", id);
+    usb_out_to_tcp.print(prefix, "usb out -> tcp send");
+    tcp_to_enqueue.print(prefix, "tcp recv -> enqueue");
+    enqueue_to_usb.print(prefix, "enqueue -> usb in");
+    tcp_to_usb_in.print(prefix, "tcp recv -> usb in");
+    if (rx_throttle_time.get_count() > 0) {rx_throttle_time.print(prefix, "remote paused");}
+    if (config.tx_deadline.count() > 0) {
+        printf("%stx queue: %lu bytes later than %ld ms, %lu bytes shed\n", prefix,
+            (unsigned long) tx_late_bytes.load(), (long) config.tx_deadline.count(), (unsigned long) tx_shed_bytes.load());
+    }
+}
+
+void modem_session::ring_callback(void)
+{
+    // Loop thread
+    const auto waited = sock->get_ring_wait();
+    if (waited.count() > 0) {
+        call_queue_wait.record(std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count());
+        printf("modem%d: Clinet connected after waiting %.1f ms.\n", id, std::chrono::duration<double, std::milli>(waited).count());
+    } else {
+        printf("modem%d: Clinet connected.\n", id);
+    }
+    ring_ns.store(now_ns());
+    ringing.store(true);
+    rings = 0;
+    ring(++ring_call);
+}
+
+void modem_session::ring(uint32_t call)
+{
+    // Loop thread
+    if (call != ring_call || !ringing.load()) {return;}
+
+    const std::string ring_reply = "RING\r\n";
+    usb_tx_buffer.enqueue(ring_reply.c_str(), ring_reply.length());
+    usb_tx_buffer.notify_one();
+    rings++;
+
+    const auto s0 = auto_answer_rings.load();
+    if (s0 > 0 && rings >= s0) {
+        if (answer_call()) {printf("modem%d: Enter on-line mode (answered after %d rings).\n", id, rings);}
+        return;
+    }
+    std::weak_ptr<bool> weak = alive;
+    loop->call_later(std::chrono::duration_cast<std::chrono::milliseconds>(RING_INTERVAL), [this, weak, call]{
+        if (weak.lock()) {ring(call);}
+    });
+}
+
+bool modem_session::answer_call(void)
+{
+    std::lock_guard<std::mutex> lock(answer_mtx);
+    if (connected.load()) {return false;}
+
+    usb_tx_buffer.enqueue(connect_reply.c_str(), connect_reply.length());
+    usb_tx_buffer.notify_one();
+    calls_answered.fetch_add(1, std::memory_order_relaxed);
+    // ATA without a call answers too, as it always has
+    if (ringing.exchange(false)) {call_answer_time.record(std::max<int64_t>(0, now_ns() - ring_ns.load()));}
+    set_online(true);
+    return true;
+}
+
+// ATI6 / AT&V1: the link of the current (still ringing) or last call, as a
+// diagnostics page
+std::string modem_session::link_stats_report(void)
+{
+    if (probe == nullptr) {return "LINK PROBES OFF\r\n";}
+    const auto link = probe->get_link_stats();
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%s CALL %.0f S\r\n", link.in_call ? "THIS" : "LAST", std::chrono::duration<double>(link.duration).count());
+    if (link.samples > 0) {
+        n += snprintf(buf + n, sizeof(buf) - n, "ROUND TRIP %.1f MS (MIN %.1f MAX %.1f LAST %.1f)\r\nJITTER %.1f MS\r\n",
+            link.srtt_ns / 1e6, link.min_rtt_ns / 1e6, link.max_rtt_ns / 1e6, link.last_rtt_ns / 1e6, link.jitter_ns / 1e6);
+    } else {
+        n += snprintf(buf + n, sizeof(buf) - n, "ROUND TRIP NOT MEASURED\r\n");
+    }
+    snprintf(buf + n, sizeof(buf) - n, "RX %.0f B/S %lu BYTES\r\nTX %.0f B/S %lu BYTES\r\nPROBES %lu/%lu OVERHEAD %lu BYTES\r\n",
+        link.rx_rate, (unsigned long) link.rx_bytes, link.tx_rate, (unsigned long) link.tx_bytes,
+        (unsigned long) link.samples, (unsigned long) link.probes_sent, (unsigned long) link.overhead_bytes);
+    return buf;
+}
+
+void modem_session::recv_callback(const char *buffer, size_t length)
+{
+    if (config.recorder != nullptr) {
+        struct iovec iov = {const_cast<char *>(buffer), length};
+        config.recorder->record(RECORD_SOCK_RX, id, 0, sock->get_recv_time(), &iov, 1);
+    }
+    if (connected.load()) {
+        // Stamp before enqueueing: the bulk-IN thread may send the data right away
+        latency_stamp stamp;
+        stamp.recv_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(sock->get_recv_time().time_since_epoch()).count();
+        stamp.enqueue_ns = now_ns();
+        const auto sent_length = usb_tx_buffer.enqueue(buffer, length, &stamp.end_position);
+        recv_queued(stamp, length, sent_length);
+    }
+}
+
+int modem_session::recv_acquire(struct iovec *iov)
+{
+    // Off-line data goes to recv_callback() and is dropped there
+    if (!connected.load()) {return 0;}
+    recv_iovcnt = usb_tx_buffer.begin_write(iov);
+    if (config.recorder != nullptr) {memcpy(recv_iov, iov, sizeof(*iov) * recv_iovcnt);}
+    return recv_iovcnt;
+}
+
+void modem_session::recv_commit(size_t length)
+{
+    latency_stamp stamp;
+    stamp.recv_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(sock->get_recv_time().time_since_epoch()).count();
+    stamp.enqueue_ns = now_ns();
+    if (config.recorder != nullptr && length > 0) {
+        // Before the commit, while the bulk-IN thread cannot take the data yet
+        auto left = length;
+        for (int i = 0; i < recv_iovcnt; i++) {
+            recv_iov[i].iov_len = std::min(recv_iov[i].iov_len, left);
+            left -= recv_iov[i].iov_len;
+        }
+        config.recorder->record(RECORD_SOCK_RX, id, 0, sock->get_recv_time(), recv_iov, recv_iovcnt);
+    }
+    usb_tx_buffer.commit_write(length, &stamp.end_position);
+    if (length > 0) {recv_queued(stamp, length, length);}
+}
+
+void modem_session::recv_queued(latency_stamp &stamp, size_t length, size_t sent_length)
+{
+    if (sent_length > 0) {
+        tcp_to_enqueue.record(std::max<int64_t>(0, now_ns() - stamp.recv_ns));
+        usb_tx_stamps.enqueue(&stamp, 1);
+    }
+    const auto count = usb_tx_buffer.get_count();
+    if (count > TX_PAUSE_BYTES && !rx_throttled.exchange(true)) {
+        rx_throttle_since_ns.store(now_ns(), std::memory_order_relaxed);
+        rx_throttle_events.fetch_add(1, std::memory_order_relaxed);
+        sock->set_recv_paused(true);
+        if (debug_level >= 1) {printf("modem%d: %zu bytes queued, remote paused.\n", id, count);}
+    }
+    auto high_water = tx_high_water.load(std::memory_order_relaxed);
+    while (count > high_water && !tx_high_water.compare_exchange_weak(high_water, count, std::memory_order_relaxed)) {}
+    if (debug_level >= 2) {log_write(LOG_TX_BUFFER, count, usb_tx_buffer.get_buffer_size());}
+    if (sent_length < length) {
+        tx_overflow_bytes.fetch_add(length - sent_length, std::memory_order_relaxed);
+        printf("modem%d: Transmit buffer is full! (overflow %ld bytes.)\n", id, length - sent_length);
+    }
+}
+
+void modem_session::resume_rx(void)
+{
+    if (!rx_throttled.exchange(false)) {return;}
+    sock->set_recv_paused(false);
+    const auto paused_ns = std::max<int64_t>(0, now_ns() - rx_throttle_since_ns.load(std::memory_order_relaxed));
+    rx_throttle_time.record(paused_ns);
+    rx_throttle_ns_total.fetch_add(paused_ns, std::memory_order_relaxed);
+    if (debug_level >= 1) {printf("modem%d: remote resumed after %.1f ms.\n", id, paused_ns / 1e6);}
+}
+
+void modem_session::disconnect_callback(void)
+{
+    // Remote side hung up
+    if (connected.load()) {
+        set_online(false);
+        const std::string no_carrier = "NO CARRIER\r\n";
+        usb_tx_buffer.enqueue(no_carrier.c_str(), no_carrier.length());
+        printf("modem%d: disconnected by remote.\n", id);
+    }
+    // A caller who gives up stops the ringing
+    ringing.store(false);
+}
+
+void modem_session::dial_finished(uint32_t call, dial_result result)
+{
+    // Loop thread
+    if (call != dial_call.load() || !dialing.load()) {
+        // Hung up while dialing; a call that got through anyway is dropped
+        if (result == DIAL_CONNECTED) {sock->disconnect();}
+        return;
+    }
+
+    const std::string busy_reply = "BUSY\r\n";
+    const std::string no_carrier_reply = "NO CARRIER\r\n";
+    const auto reply = result == DIAL_CONNECTED ? &connect_reply : result == DIAL_BUSY ? &busy_reply : &no_carrier_reply;
+    usb_tx_buffer.enqueue(reply->c_str(), reply->length());
+    const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - dial_started).count();
+    if (result == DIAL_CONNECTED) {
+        dial_time.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - dial_started).count());
+        dial_connected.fetch_add(1, std::memory_order_relaxed);
+        printf("modem%d: Enter on-line mode (dialed in %.1f ms).\n", id, ms);
+        set_online(true);
+    } else {
+        dial_failed.fetch_add(1, std::memory_order_relaxed);
+        printf("modem%d: Dial failed after %.1f ms: %s", id, ms, reply->c_str());
+    }
+    dialing.store(false);
+    usb_tx_buffer.notify_one();
+}
+
+void modem_session::usb_bulk_in_thread(int ep_num)
+{
+    enter_thread("bulk-in");
+    struct usb_transfer_bulk xfer;
+    bulk_in_scheduler scheduler(&usb_tx_buffer, &connected, bulk_in_timing);
+    scheduler.set_wake_probe(&usb_in_wake_late);
+    scheduler.set_pacer(usb_pacer.is_unlimited() ? nullptr : &usb_pacer, BULK_IN_PAYLOAD * config.bulk_in_packets);
+    const int64_t deadline_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(config.tx_deadline).count();
+    latency_stamp stamp;
+    bool has_stamp = false;
+    size_t last_position = 0; // end of the data written by the previous packet
+    size_t last_stamp_end = 0;
+    int64_t last_done_ns = 0;
+
+    // Time every chunk whose last byte has left through USB. A stamp that
+    // shows up after its data was sent belongs to the previous packet.
+    auto finish_stamps = [&](size_t position, int64_t done_ns) {
+        while (has_stamp || usb_tx_stamps.dequeue(&stamp, 1) == 1) {
+            has_stamp = true;
+            if (stamp.end_position > position) {break;}
+            const auto t = stamp.end_position <= last_position ? last_done_ns : done_ns;
+            const auto queue_ns = std::max<int64_t>(0, t - stamp.enqueue_ns);
+            enqueue_to_usb.record(queue_ns);
+            tcp_to_usb_in.record(std::max<int64_t>(0, t - stamp.recv_ns));
+            if (deadline_ns > 0 && queue_ns > deadline_ns && stamp.end_position > last_stamp_end) {
+                tx_late_bytes.fetch_add(stamp.end_position - last_stamp_end, std::memory_order_relaxed);
+            }
+            last_stamp_end = stamp.end_position;
+            has_stamp = false;
+        }
+    };
+
+    while (true) {
+        scheduler.wait_next();
+
+        // has_stamp is now the oldest chunk still queued, if it was stamped
+        auto position = usb_tx_buffer.get_read_position();
+        finish_stamps(position, last_done_ns);
+        const auto start_ns = now_ns();
+        while (config.tx_shed && deadline_ns > 0 && has_stamp && start_ns - stamp.enqueue_ns > deadline_ns) {
+            const auto shed = usb_tx_buffer.discard(stamp.end_position - position);
+            tx_shed_bytes.fetch_add(shed, std::memory_order_relaxed);
+            if (debug_level >= 1) {
+                printf("modem%d: shed %zu bytes queued for %ld ms.\n", id, shed, (long) ((start_ns - stamp.enqueue_ns) / 1000000));
+            }
+            position += shed;
+            last_position = position;
+            last_stamp_end = stamp.end_position;
+            has_stamp = false;
+            finish_stamps(position, last_done_ns);
+        }
+        tx_queue_delay_ns.store(has_stamp ? std::max<int64_t>(0, start_ns - stamp.enqueue_ns) : 0, std::memory_order_relaxed);
+        if (has_stamp && scheduler.get_woke_on_data()) {usb_in_data_wake.record(std::max<int64_t>(0, start_ns - stamp.enqueue_ns));}
+
+        // Fill packets while they come out full; a short packet ends the transfer
+        const bool dcd = connected.load();
+        const auto limit = scheduler.get_payload_limit();
+        size_t length = 0, payload_length = 0;
+        int packets = 0;
+        do {
+            char *p = &xfer.data[length];
+            p[0] = dcd ? 0xb1 : 0x31;
+            p[1] = 0x60;
+            const auto n = usb_tx_buffer.dequeue(&p[2], std::min(BULK_IN_PAYLOAD, limit - payload_length));
+            length += 2 + n;
+            payload_length += n;
+            packets++;
+            if (n < BULK_IN_PAYLOAD) {break;}
+        } while (packets < config.bulk_in_packets && payload_length < limit && !usb_tx_buffer.is_empty());
+        if (rx_throttled.load(std::memory_order_relaxed) && usb_tx_buffer.get_count() <= TX_RESUME_BYTES) {resume_rx();}
+
+        xfer.header.ep = ep_num;
+        xfer.header.flags = 0;
+        xfer.header.length = length;
+
+        const auto write_ns = now_ns();
+        usb->ep_write(reinterpret_cast<struct usb_raw_ep_io *>(&xfer));
+        ep_write_time.record(std::max<int64_t>(0, now_ns() - write_ns));
+        if (config.recorder != nullptr) {config.recorder->record(RECORD_BULK_IN, id, 0, xfer.data, length);}
+        scheduler.sent(payload_length, dcd);
+        usb_in_transfers.fetch_add(1, std::memory_order_relaxed);
+        usb_in_packets.fetch_add(packets, std::memory_order_relaxed);
+        usb_in_bytes.fetch_add(payload_length, std::memory_order_relaxed);
+
+        const auto done_ns = now_ns();
+        position = usb_tx_buffer.get_read_position();
+        finish_stamps(position, done_ns);
+        last_position = position;
+        last_done_ns = done_ns;
+    }
+}
+
+void modem_session::usb_bulk_out_thread(int ep_num)
+{
+    enter_thread("bulk-out");
+    struct usb_transfer_bulk xfer;
+    at_line_reader reader;
+    int64_t read_ns = 0;
+    std::chrono::steady_clock::time_point read_at;
+
+    // AT settings; echo stays off until the game asks for it
+    at_state at;
+    at_reset(&at);
+    at.echo = false;
+    const std::string ok_reply = "OK\r\n";
+
+    while (true) {
+        xfer.header.ep = ep_num;
+        xfer.header.flags = 0;
+        xfer.header.length = MAX_PACKET_SIZE_BULK * config.bulk_out_packets;
+
+        int ret = usb->ep_read(reinterpret_cast<struct usb_raw_ep_io *>(&xfer));
+        read_at = std::chrono::steady_clock::now();
+        read_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(read_at.time_since_epoch()).count();
+        if (config.recorder != nullptr && ret > 0) {
+            struct iovec iov = {xfer.data, static_cast<size_t>(ret)};
+            config.recorder->record(RECORD_BULK_OUT, id, 0, read_at, &iov, 1);
+        }
+        // Drop the length byte of every packet, moving the payloads together
+        size_t payload_total = 0;
+        int packets = 0;
+        for (int offset = 0; offset < ret; offset += MAX_PACKET_SIZE_BULK) {
+            const int packet_length = std::min<int>(MAX_PACKET_SIZE_BULK, ret - offset);
+            int payload_length = static_cast<uint8_t>(xfer.data[offset]) >> 2; // char is signed on x86
+            if (payload_length != packet_length - 1) {
+                payload_mismatches.fetch_add(1, std::memory_order_relaxed);
+                printf("modem%d: Payload length mismatch! (payload length in header: %d, received payload: %d)\n", id, payload_length, packet_length - 1);
+                payload_length = std::min(payload_length, packet_length - 1);
+            }
+            memmove(&xfer.data[payload_total], &xfer.data[offset + 1], payload_length);
+            payload_total += payload_length;
+            packets++;
+        }
+        usb_out_transfers.fetch_add(1, std::memory_order_relaxed);
+        usb_out_packets.fetch_add(packets, std::memory_order_relaxed);
+        usb_out_bytes.fetch_add(payload_total, std::memory_order_relaxed);
+        std::string_view data(xfer.data, payload_total);
+
+        // Off-line mode loop
+        if (!connected.load() && dialing.load()) {
+            // Any key but the end of the ATD line aborts dialing, as on a Hayes modem
+            if (data.find_first_not_of("\r\n") != std::string_view::npos) {
+                printf("modem%d: Dialing aborted by the console.\n", id);
+                sock->abort_connect();
+            }
+            data = std::string_view();
+        }
+        if (!connected.load()) {
+            if (reader.feed(data) > 0) {printf("modem%d: AT command line too long, dropped.\n", id);}
+            data = std::string_view();
+        }
+        std::string_view line;
+        while (!connected.load() && reader.next_line(&line)) {
+            printf("modem%d: AT command: %.*s\n", id, (int) line.length(), line.data());
+
+            if (at.echo) {
+                usb_tx_buffer.enqueue(line.data(), line.length());
+                usb_tx_buffer.enqueue("\r\n", 2);
+            }
+
+            const auto result = at_parse(line, &at);
+            if (config.auto_answer <= 0) {auto_answer_rings.store(at.s[0]);}
+            if (result.action == AT_ACTION_ANSWER) {
+                // Answer an incoming call; CONNECT is sent by answer_call()
+                if (answer_call()) {
+                    printf("modem%d: Enter on-line mode.\n", id);
+                    // Whatever followed the command is already call data
+                    data = reader.take_rest();
+                }
+                continue;
+            }
+            if (result.action == AT_ACTION_DIAL) {
+                if (config.relay_number != nullptr) {
+                    // Via the relay the dialed digits are the peer's number
+                    std::string number;
+                    for (auto c : result.dial) {
+                        if ((c >= '0' && c <= '9') || c == '*' || c == '#') {number += c;}
+                    }
+                    sock->set_dial_number(number);
+                } else {
+                    // Anything else calls the configured server
+                    std::string host = config.ip_addr;
+                    uint16_t port = config.port;
+                    parse_dial_target(result.dial, &host, &port);
+                    sock->set_target(host, port);
+                }
+                // S7: seconds to wait for the remote side
+                auto timeout = std::chrono::milliseconds(at.s[7] * 1000);
+                if (config.dial_timeout.count() > 0 && (timeout.count() == 0 || config.dial_timeout < timeout)) {timeout = config.dial_timeout;}
+                dial_attempts.fetch_add(1, std::memory_order_relaxed);
+                dial_started = std::chrono::steady_clock::now();
+                dialing.store(true);
+                const auto call = dial_call.load();
+                // The result code comes from dial_finished(); keep reading meanwhile
+                sock->connect_async([this, call](dial_result r){dial_finished(call, r);}, timeout);
+                reader.take_rest();
+                continue;
+            }
+            if (result.action == AT_ACTION_LINK_STATS) {
+                const auto report = link_stats_report();
+                usb_tx_buffer.enqueue(report.c_str(), report.length());
+            }
+
+            usb_tx_buffer.enqueue(ok_reply.c_str(), ok_reply.length());
+            usb_tx_buffer.notify_one();
+        }
+
+        // On-line mode loop
+        while (connected.load() && data.length() > 0) {
+            auto length = data.length();
+            if (!remote_pacer.is_unlimited()) {
+                // Holding the data here also holds off the next bulk-OUT read,
+                // which throttles the console like a modem dropping CTS
+                const auto want = std::min(length, remote_pacer.get_burst());
+                std::this_thread::sleep_until(remote_pacer.available_at(want, std::chrono::steady_clock::now()));
+                length = remote_pacer.take(want, std::chrono::steady_clock::now());
+            }
+            if (config.recorder != nullptr) {
+                // Stamped when read (or released by the pacer), not after send() waited for room
+                struct iovec iov = {const_cast<char *>(data.data()), length};
+                const auto sent_at = remote_pacer.is_unlimited() ? read_at : std::chrono::steady_clock::now();
+                config.recorder->record(RECORD_SOCK_TX, id, 0, sent_at, &iov, 1);
+            }
+            sock->send(data.data(), length);
+            data.remove_prefix(length);
+            usb_out_to_tcp.record(now_ns() - read_ns);
+        }
+        // Hung up while sending: the rest is read as commands again
+        if (data.length() > 0) {reader.feed(data);}
+    }
+}
+
+// ep_enable() reads a whole struct usb_endpoint_descriptor, which has two
+// audio fields after ours
+static struct usb_endpoint_descriptor get_endpoint_descriptor(const struct _usb_endpoint_descriptor &d)
+{
+    struct usb_endpoint_descriptor desc;
+    memset(&desc, 0, sizeof(desc));
+    memcpy(&desc, &d, sizeof(d));
+    return desc;
+}
+
+bool modem_session::process_control_packet(usb_raw_control_event *e, struct usb_packet_control *pkt)
+{
+    switch (get_control_action(e->ctrl)) {
+        case CONTROL_GET_DESCRIPTOR: {
+            uint16_t length;
+            const auto descriptor = find_descriptor(e->ctrl.wValue, &length);
+            if (descriptor == nullptr) {return false;}
+            // A host that was reset or replugged starts over with the device descriptor
+            if (e->get_descriptor_type() == USB_DT_DEVICE && !enumerating) {
+                enumerating = true;
+                enumeration_started = std::chrono::steady_clock::now();
+            }
+            pkt->header.length = std::min<unsigned int>(length, e->ctrl.wLength);
+            memcpy(pkt->data, descriptor, pkt->header.length);
+            return true;
+        }
+        case CONTROL_SET_CONFIGURATION: {
+            if (thread_bulk_in == nullptr) {
+                auto desc = get_endpoint_descriptor(me56ps2_config_descriptors.endpoint_bulk_in);
+                const int ep_num_bulk_in = usb->ep_enable(&desc);
+                thread_bulk_in = new std::thread([this, ep_num_bulk_in]{usb_bulk_in_thread(ep_num_bulk_in);});
+                pin_thread(thread_bulk_in);
+            }
+            if (thread_bulk_out == nullptr) {
+                auto desc = get_endpoint_descriptor(me56ps2_config_descriptors.endpoint_bulk_out);
+                const int ep_num_bulk_out = usb->ep_enable(&desc);
+                thread_bulk_out = new std::thread([this, ep_num_bulk_out]{usb_bulk_out_thread(ep_num_bulk_out);});
+                pin_thread(thread_bulk_out);
+            }
+            usb->vbus_draw(me56ps2_config_descriptors.config.bMaxPower);
+            usb->configure();
+            if (enumerating) {
+                enumerating = false;
+                const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - enumeration_started).count();
+                enumerations.fetch_add(1, std::memory_order_relaxed);
+                last_enumeration_ns.store(ns, std::memory_order_relaxed);
+                printf("modem%d: USB configurated in %.1f ms.\n", id, ns / 1e6);
+            } else {
+                printf("modem%d: USB configurated.\n", id);
+            }
+            pkt->header.length = 0;
+            return true;
+        }
+        case CONTROL_ACK:
+            pkt->header.length = 0;
+            return true;
+        case CONTROL_SET_LINE:
+            pkt->header.length = 0;
+            if ((e->ctrl.wValue & 0x0101) == 0x0100) {
+                // set DTR to LOW for on-hook
+                if (debug_level >= 2) {printf("modem%d: on-hook\n", id);};
+                // A call still being dialed is abandoned without a result code
+                dial_call.fetch_add(1);
+                if (dialing.exchange(false)) {
+                    sock->abort_connect();
+                    printf("modem%d: Dialing aborted by hang-up.\n", id);
+                }
+                // disconnect; a caller still ringing is hung up on too
+                ringing.store(false);
+                set_online(false);
+                usb_tx_buffer.notify_one(); // send the DCD change now
+                if (sock != nullptr && sock->is_connected()) {
+                    sock->disconnect();
+                    printf("modem%d: disconnected.\n", id);
+                }
+            } else if ((e->ctrl.wValue & 0x0101) == 0x0101) {
+                // set DTR to HIGH for off-hook
+                if (debug_level >= 2) {printf("modem%d: off-hook\n", id);};
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+void modem_session::usb_control_thread(void)
+{
+    usb_raw_control_event e;
+    struct usb_packet_control pkt;
+    pkt.header.ep = 0;
+    pkt.header.flags = 0;
+
+    while (true) {
+        // The kernel writes back the length of what it fetched
+        e.event.type = 0;
+        e.event.length = sizeof(e.ctrl);
+        usb->event_fetch(e.get_raw_event());
+        if (debug_level >= 1) {e.print_debug_log();}
+        if (config.recorder != nullptr) {
+            const bool control = e.event.type == USB_RAW_EVENT_CONTROL;
+            config.recorder->record(RECORD_USB_EVENT, id, e.event.type, control ? &e.ctrl : nullptr, control ? sizeof(e.ctrl) : 0);
+        }
+
+        switch(e.event.type) {
+            case USB_RAW_EVENT_CONNECT:
+                enumerating = true;
+                enumeration_started = std::chrono::steady_clock::now();
+                break;
+            case USB_RAW_EVENT_CONTROL:
+                if (!process_control_packet(&e, &pkt)) {
+                    usb->ep0_stall();
+                    if (config.recorder != nullptr) {config.recorder->record(RECORD_EP0_STALL, id, 0, nullptr, 0);}
+                    break;
+                }
+
+                pkt.header.length = std::min(pkt.header.length, static_cast<unsigned int>(e.ctrl.wLength));
+                int ret;
+                if (e.ctrl.bRequestType & USB_DIR_IN) {
+                    ret = usb->ep0_write(reinterpret_cast<struct usb_raw_ep_io *>(&pkt));
+                } else {
+                    ret = usb->ep0_read(reinterpret_cast<struct usb_raw_ep_io *>(&pkt));
+                }
+                if (config.recorder != nullptr) {
+                    config.recorder->record(RECORD_EP0, id, e.ctrl.bRequestType & USB_DIR_IN, pkt.data, std::max(ret, 0));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void modem_session::start(void)
+{
+    thread_control = new std::thread([this]{
+        enter_thread("control");
+        usb_control_thread();
+    });
+    pin_thread(thread_control);
+}
+
+size_t modem_session::get_memory_footprint(void)
+{
+    // Heap owned by this modem; thread stacks are reported separately
+    return sizeof(*this) + usb_tx_buffer.get_buffer_size() + usb_tx_stamps.get_buffer_size() * sizeof(latency_stamp) + (config.use_udp ? sizeof(udp_sock) : sizeof(tcp_sock)) +
+        (config.impairment != nullptr ? sizeof(impaired_transport) : 0) + (probe != nullptr ? sizeof(probed_transport) : 0);
+}
+
+void modem_session::print_stats(void)
+{
+    std::chrono::steady_clock::duration online_time;
+    uint64_t online_cpu_ns;
+    {
+        std::lock_guard<std::mutex> lock(online_mtx);
+        online_time = online_total;
+        online_cpu_ns = online_cpu_total_ns;
+        if (connected.load()) {
+            online_time += std::chrono::steady_clock::now() - online_since;
+            online_cpu_ns += get_cpu_time_ns() - online_cpu_start_ns;
+        }
+    }
+
+    const auto online_sec = std::chrono::duration<double>(online_time).count();
+    const auto stats = sock->get_stats();
+    printf("modem%d: memory %zu KB, cpu %.1f ms total, on-line %.1f s, cpu while on-line %.3f%%, %s rx %lu / tx %lu bytes, %lu retransmits\n",
+        id, get_memory_footprint() / 1024, get_cpu_time_ns() / 1e6, online_sec,
+        online_sec > 0 ? online_cpu_ns / 1e9 / online_sec * 100 : 0.0, config.use_udp ? "udp" : "tcp",
+        (unsigned long) stats.recv_bytes, (unsigned long) stats.send_bytes, (unsigned long) stats.retransmits);
+    if (enumerations.load() > 0) {
+        printf("modem%d: USB enumerated %lu times, last in %.1f ms\n", id, (unsigned long) enumerations.load(), last_enumeration_ns.load() / 1e6);
+    }
+    if (config.call_queue_max > 0) {
+        printf("modem%d: %lu callers waiting, %lu turned away\n", id, (unsigned long) stats.callers_waiting, (unsigned long) stats.callers_turned_away);
+    }
+    if (config.resume_grace.count() > 0) {
+        printf("modem%d: %lu calls resumed (last after %.1f ms), %lu lost\n", id, (unsigned long) stats.resumes,
+            stats.last_resume_ns / 1e6, (unsigned long) stats.resume_failures);
+    }
+    if (probe != nullptr) {
+        const auto link = probe->get_link_stats();
+        printf("modem%d: link (%s call): %s, %lu bytes overhead\n", id, link.in_call ? "this" : "last",
+            describe_link_stats(link).c_str(), (unsigned long) link.overhead_bytes);
+    }
+    print_latency();
+    print_jitter();
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "modem%d: ", id);
+    if (call_queue_wait.get_count() > 0) {call_queue_wait.print(prefix, "call queue wait");}
+    if (call_answer_time.get_count() > 0) {call_answer_time.print(prefix, "ring -> connect");}
+    if (dial_time.get_count() > 0) {dial_time.print(prefix, "dial -> connect");}
+}
+
+void modem_session::print_jitter(void)
+{
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "modem%d: ", id);
+    usb_in_wake_late.print(prefix, "bulk-in wake late");
+    usb_in_data_wake.print(prefix, "enqueue -> wake");
+    ep_write_time.print(prefix, "ep_write");
+}
+
+modem_metrics modem_session::get_metrics(void)
+{
+    modem_metrics m;
+    const auto stats = sock->get_stats();
+    m.usb_in_packets = usb_in_packets.load(std::memory_order_relaxed);
+    m.usb_in_bytes = usb_in_bytes.load(std::memory_order_relaxed);
+    m.usb_out_packets = usb_out_packets.load(std::memory_order_relaxed);
+    m.usb_out_bytes = usb_out_bytes.load(std::memory_order_relaxed);
+    m.usb_in_transfers = usb_in_transfers.load(std::memory_order_relaxed);
+    m.usb_out_transfers = usb_out_transfers.load(std::memory_order_relaxed);
+    m.tcp_rx_bytes = stats.recv_bytes;
+    m.tcp_tx_bytes = stats.send_bytes;
+    m.retransmits = stats.retransmits;
+    m.tx_buffer_bytes = usb_tx_buffer.get_count();
+    m.tx_buffer_high_water = tx_high_water.load(std::memory_order_relaxed);
+    m.tx_overflow_bytes = tx_overflow_bytes.load(std::memory_order_relaxed);
+    m.tx_late_bytes = tx_late_bytes.load(std::memory_order_relaxed);
+    m.tx_shed_bytes = tx_shed_bytes.load(std::memory_order_relaxed);
+    m.rx_throttle_events = rx_throttle_events.load(std::memory_order_relaxed);
+    m.rx_throttled = rx_throttled.load(std::memory_order_relaxed) ? 1 : 0;
+    m.rx_throttle_seconds_total = rx_throttle_ns_total.load(std::memory_order_relaxed) / 1e9;
+    m.tx_queue_delay_seconds = tx_queue_delay_ns.load(std::memory_order_relaxed) / 1e9;
+    m.tx_queue_delay_p50_seconds = enqueue_to_usb.get_percentile(50) / 1e9;
+    m.tx_queue_delay_p99_seconds = enqueue_to_usb.get_percentile(99) / 1e9;
+    latency_histogram *probes[3] = {&usb_in_wake_late, &usb_in_data_wake, &ep_write_time};
+    for (int i = 0; i < 3; i++) {
+        auto h = probes[i];
+        m.jitter_seconds[i][0] = h->get_percentile(50) / 1e9;
+        m.jitter_seconds[i][1] = h->get_percentile(99) / 1e9;
+        m.jitter_seconds[i][2] = h->get_percentile(99.9) / 1e9;
+        m.jitter_seconds[i][3] = h->get_max() / 1e9;
+    }
+    m.payload_mismatches = payload_mismatches.load(std::memory_order_relaxed);
+    m.dial_attempts = dial_attempts.load(std::memory_order_relaxed);
+    m.dial_connected = dial_connected.load(std::memory_order_relaxed);
+    m.dial_failed = dial_failed.load(std::memory_order_relaxed);
+    m.calls_answered = calls_answered.load(std::memory_order_relaxed);
+    m.calls_ended = calls_ended.load(std::memory_order_relaxed);
+    m.callers_waiting = stats.callers_waiting;
+    m.callers_turned_away = stats.callers_turned_away;
+    m.resumes = stats.resumes;
+    m.resume_failures = stats.resume_failures;
+    m.last_resume_seconds = stats.last_resume_ns / 1e9;
+    latency_histogram *setup[3] = {&call_queue_wait, &call_answer_time, &dial_time};
+    for (int i = 0; i < 3; i++) {
+        m.call_setup_seconds[i][0] = setup[i]->get_percentile(50) / 1e9;
+        m.call_setup_seconds[i][1] = setup[i]->get_percentile(99) / 1e9;
+    }
+    m.enumerations = enumerations.load(std::memory_order_relaxed);
+    m.last_enumeration_seconds = last_enumeration_ns.load(std::memory_order_relaxed) / 1e9;
+    link_stats link = link_stats();
+    if (probe != nullptr) {link = probe->get_link_stats();}
+    m.link_rtt_seconds[0] = link.srtt_ns / 1e9;
+    m.link_rtt_seconds[1] = link.min_rtt_ns / 1e9;
+    m.link_rtt_seconds[2] = link.max_rtt_ns / 1e9;
+    m.link_jitter_seconds = link.jitter_ns / 1e9;
+    m.link_rate[0] = link.rx_rate;
+    m.link_rate[1] = link.tx_rate;
+    m.link_probes = link.samples;
+    m.link_overhead_bytes = link.overhead_bytes;
+    m.online = connected.load(std::memory_order_relaxed) ? 1 : 0;
+    m.online_seconds_total = online_ns_total.load(std::memory_order_relaxed) / 1e9;
+    m.last_call_seconds = last_call_ns.load(std::memory_order_relaxed) / 1e9;
+    return m;
+}
+
+void render_modem_metrics(std::string &out, std::vector<modem_session *> &modems)
+{
+    std::vector<modem_metrics> metrics;
+    for (auto m : modems) {metrics.push_back(m->get_metrics());}
+
+    auto family = [&](const char *name, const char *type, const char *help, std::function<double(const modem_metrics &)> value) {
+        std::vector<std::pair<std::string, double>> samples;
+        for (size_t i = 0; i < metrics.size(); i++) {
+            samples.push_back({"modem=\"" + std::to_string(i) + "\"", value(metrics[i])});
+        }
+        metrics_append(out, name, type, help, samples);
+    };
+
+    family("me56ps2_usb_in_packets_total", "counter", "Bulk-IN packets sent to the console.",
+        [](const modem_metrics &m) {return m.usb_in_packets;});
+    family("me56ps2_usb_in_bytes_total", "counter", "Payload bytes sent to the console.",
+        [](const modem_metrics &m) {return m.usb_in_bytes;});
+    family("me56ps2_usb_out_packets_total", "counter", "Bulk-OUT packets received from the console.",
+        [](const modem_metrics &m) {return m.usb_out_packets;});
+    family("me56ps2_usb_out_bytes_total", "counter", "Payload bytes received from the console.",
+        [](const modem_metrics &m) {return m.usb_out_bytes;});
+    family("me56ps2_usb_in_transfers_total", "counter", "Bulk-IN transfers (ep_write calls), each of one or more packets.",
+        [](const modem_metrics &m) {return m.usb_in_transfers;});
+    family("me56ps2_usb_out_transfers_total", "counter", "Bulk-OUT transfers (ep_read calls), each of one or more packets.",
+        [](const modem_metrics &m) {return m.usb_out_transfers;});
+    family("me56ps2_tcp_rx_bytes_total", "counter", "Bytes received from the remote side.",
+        [](const modem_metrics &m) {return m.tcp_rx_bytes;});
+    family("me56ps2_tcp_tx_bytes_total", "counter", "Bytes sent to the remote side.",
+        [](const modem_metrics &m) {return m.tcp_tx_bytes;});
+    family("me56ps2_retransmits_total", "counter", "Segments (TCP) or frames (UDP) sent again to the remote side.",
+        [](const modem_metrics &m) {return m.retransmits;});
+    family("me56ps2_tx_buffer_bytes", "gauge", "Bytes waiting in the transmit buffer.",
+        [](const modem_metrics &m) {return m.tx_buffer_bytes;});
+    family("me56ps2_tx_buffer_high_water_bytes", "gauge", "Most bytes ever waiting in the transmit buffer.",
+        [](const modem_metrics &m) {return m.tx_buffer_high_water;});
+    family("me56ps2_tx_overflow_bytes_total", "counter", "Bytes dropped because the transmit buffer was full.",
+        [](const modem_metrics &m) {return m.tx_overflow_bytes;});
+    family("me56ps2_tx_late_bytes_total", "counter", "Bytes that waited in the transmit buffer longer than the deadline.",
+        [](const modem_metrics &m) {return m.tx_late_bytes;});
+    family("me56ps2_tx_shed_bytes_total", "counter", "Bytes dropped from the transmit buffer for being older than the deadline.",
+        [](const modem_metrics &m) {return m.tx_shed_bytes;});
+    family("me56ps2_rx_throttle_events_total", "counter", "Times reading from the remote side was paused because the transmit buffer filled up.",
+        [](const modem_metrics &m) {return m.rx_throttle_events;});
+    family("me56ps2_rx_throttled", "gauge", "1 while reading from the remote side is paused.",
+        [](const modem_metrics &m) {return m.rx_throttled;});
+    family("me56ps2_rx_throttle_seconds_total", "counter", "Time reading from the remote side was paused.",
+        [](const modem_metrics &m) {return m.rx_throttle_seconds_total;});
+    family("me56ps2_tx_queue_delay_seconds", "gauge", "Age of the oldest data waiting in the transmit buffer.",
+        [](const modem_metrics &m) {return m.tx_queue_delay_seconds;});
+    {
+        std::vector<std::pair<std::string, double>> samples;
+        for (size_t i = 0; i < metrics.size(); i++) {
+            const auto modem = "modem=\"" + std::to_string(i) + "\"";
+            samples.push_back({modem + ",quantile=\"0.5\"", metrics[i].tx_queue_delay_p50_seconds});
+            samples.push_back({modem + ",quantile=\"0.99\"", metrics[i].tx_queue_delay_p99_seconds});
+        }
+        metrics_append(out, "me56ps2_tx_queue_delay_call_seconds", "gauge", "Time data waited in the transmit buffer during the current call.", samples);
+    }
+    {
+        const char *probes[3] = {"bulk_in_wake_late", "enqueue_to_wake", "ep_write"};
+        const char *quantiles[4] = {"0.5", "0.99", "0.999", "1"};
+        std::vector<std::pair<std::string, double>> samples;
+        for (size_t i = 0; i < metrics.size(); i++) {
+            for (int p = 0; p < 3; p++) {
+                for (int q = 0; q < 4; q++) {
+                    samples.push_back({"modem=\"" + std::to_string(i) + "\",probe=\"" + probes[p] + "\",quantile=\"" + quantiles[q] + "\"",
+                        metrics[i].jitter_seconds[p][q]});
+                }
+            }
+        }
+        metrics_append(out, "me56ps2_jitter_seconds", "gauge",
+            "Bulk-IN thread timing since start: timed wakeups past their target, enqueue to wakeup, and ep_write duration.", samples);
+    }
+    family("me56ps2_payload_mismatches_total", "counter", "Bulk-OUT packets whose length header did not match.",
+        [](const modem_metrics &m) {return m.payload_mismatches;});
+    family("me56ps2_dial_attempts_total", "counter", "ATD commands.",
+        [](const modem_metrics &m) {return m.dial_attempts;});
+    family("me56ps2_dial_connected_total", "counter", "ATD commands answered with CONNECT.",
+        [](const modem_metrics &m) {return m.dial_connected;});
+    family("me56ps2_dial_failed_total", "counter", "ATD commands answered with BUSY or NO CARRIER.",
+        [](const modem_metrics &m) {return m.dial_failed;});
+    family("me56ps2_calls_answered_total", "counter", "Incoming calls answered with ATA or automatically (S0).",
+        [](const modem_metrics &m) {return m.calls_answered;});
+    family("me56ps2_callers_waiting", "gauge", "Callers held while the line is busy.",
+        [](const modem_metrics &m) {return m.callers_waiting;});
+    family("me56ps2_callers_turned_away_total", "counter", "Callers hung up on: queue full or waited too long.",
+        [](const modem_metrics &m) {return m.callers_turned_away;});
+    family("me56ps2_resumes_total", "counter", "Calls carried over to a new connection after theirs dropped.",
+        [](const modem_metrics &m) {return m.resumes;});
+    family("me56ps2_resume_failures_total", "counter", "Calls lost because their connection could not be resumed.",
+        [](const modem_metrics &m) {return m.resume_failures;});
+    family("me56ps2_last_resume_seconds", "gauge", "Time from losing the connection to resuming the call, last resume.",
+        [](const modem_metrics &m) {return m.last_resume_seconds;});
+    {
+        const char *stages[3] = {"queue_wait", "answer", "dial"};
+        const char *quantiles[2] = {"0.5", "0.99"};
+        std::vector<std::pair<std::string, double>> samples;
+        for (size_t i = 0; i < metrics.size(); i++) {
+            for (int st = 0; st < 3; st++) {
+                for (int q = 0; q < 2; q++) {
+                    samples.push_back({"modem=\"" + std::to_string(i) + "\",stage=\"" + stages[st] + "\",quantile=\"" + quantiles[q] + "\"",
+                        metrics[i].call_setup_seconds[st][q]});
+                }
+            }
+        }
+        metrics_append(out, "me56ps2_call_setup_seconds", "gauge",
+            "Call setup since start: waiting in the call queue, first RING to CONNECT, ATD to CONNECT.", samples);
+    }
+    family("me56ps2_usb_enumerations_total", "counter", "Times the host enumerated the modem, from power-up or a bus reset.",
+        [](const modem_metrics &m) {return m.enumerations;});
+    family("me56ps2_last_usb_enumeration_seconds", "gauge", "Time from USB connect or the first GET_DESCRIPTOR to SET_CONFIGURATION, last enumeration.",
+        [](const modem_metrics &m) {return m.last_enumeration_seconds;});
+    {
+        const char *kinds[3] = {"smoothed", "min", "max"};
+        std::vector<std::pair<std::string, double>> samples;
+        for (size_t i = 0; i < metrics.size(); i++) {
+            for (int k = 0; k < 3; k++) {
+                samples.push_back({"modem=\"" + std::to_string(i) + "\",kind=\"" + kinds[k] + "\"", metrics[i].link_rtt_seconds[k]});
+            }
+        }
+        metrics_append(out, "me56ps2_link_rtt_seconds", "gauge", "Round trip time measured by in-band probes (-P), current or last call.", samples);
+    }
+    family("me56ps2_link_jitter_seconds", "gauge", "Mean change between round trip samples, current or last call.",
+        [](const modem_metrics &m) {return m.link_jitter_seconds;});
+    {
+        std::vector<std::pair<std::string, double>> samples;
+        for (size_t i = 0; i < metrics.size(); i++) {
+            samples.push_back({"modem=\"" + std::to_string(i) + "\",direction=\"rx\"", metrics[i].link_rate[0]});
+            samples.push_back({"modem=\"" + std::to_string(i) + "\",direction=\"tx\"", metrics[i].link_rate[1]});
+        }
+        metrics_append(out, "me56ps2_link_bytes_per_second", "gauge", "Game bytes per second each way, smoothed over the probe interval.", samples);
+    }
+    family("me56ps2_link_probes", "gauge", "Probes answered in the current or last call.",
+        [](const modem_metrics &m) {return m.link_probes;});
+    family("me56ps2_link_overhead_bytes", "gauge", "Bytes sent for probing and framing in the current or last call.",
+        [](const modem_metrics &m) {return m.link_overhead_bytes;});
+    family("me56ps2_calls_ended_total", "counter", "Calls that went back off-line.",
+        [](const modem_metrics &m) {return m.calls_ended;});
+    family("me56ps2_online", "gauge", "1 while a call is in progress.",
+        [](const modem_metrics &m) {return m.online;});
+    family("me56ps2_online_seconds_total", "counter", "Time spent in ended calls.",
+        [](const modem_metrics &m) {return m.online_seconds_total;});
+    family("me56ps2_last_call_seconds", "gauge", "Duration of the last ended call.",
+        [](const modem_metrics &m) {return m.last_call_seconds;});
+}
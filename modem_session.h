@@ -0,0 +1,203 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class usb_gadget;
+class usb_raw_control_event;
+class event_loop;
+class transport;
+class probed_transport;
+struct impairment_profile;
+class traffic_recorder;
+struct usb_packet_control;
+
+// Marks where a chunk received from TCP ends in usb_tx_buffer
+struct latency_stamp {
+    size_t end_position;
+    int64_t recv_ns;
+    int64_t enqueue_ns;
+};
+
+// Counters for monitoring, see render_modem_metrics()
+struct modem_metrics {
+    uint64_t usb_in_packets;
+    uint64_t usb_in_bytes; // payload only
+    uint64_t usb_out_packets;
+    uint64_t usb_out_bytes;
+    uint64_t usb_in_transfers; // ep_write calls
+    uint64_t usb_out_transfers; // ep_read calls
+    uint64_t tcp_rx_bytes;
+    uint64_t tcp_tx_bytes;
+    uint64_t retransmits;
+    uint64_t tx_buffer_bytes;
+    uint64_t tx_buffer_high_water;
+    uint64_t tx_overflow_bytes;
+    uint64_t tx_late_bytes;
+    uint64_t tx_shed_bytes;
+    uint64_t rx_throttle_events; // times reading from the remote side was paused
+    uint64_t rx_throttled; // 1 while paused
+    double rx_throttle_seconds_total;
+    double tx_queue_delay_seconds; // age of the oldest queued chunk
+    double tx_queue_delay_p50_seconds; // of the current call
+    double tx_queue_delay_p99_seconds;
+    double jitter_seconds[3][4]; // wake late, data wake, ep_write: p50, p99, p99.9, max
+    uint64_t payload_mismatches;
+    uint64_t dial_attempts;
+    uint64_t dial_connected;
+    uint64_t dial_failed;
+    uint64_t calls_answered;
+    uint64_t calls_ended;
+    uint64_t callers_waiting;
+    uint64_t callers_turned_away;
+    double call_setup_seconds[3][2]; // queue wait, RING -> CONNECT, ATD -> CONNECT: p50, p99
+    uint64_t resumes;
+    uint64_t resume_failures;
+    double last_resume_seconds;
+    uint64_t enumerations;
+    double last_enumeration_seconds;
+    double link_rtt_seconds[3]; // smoothed, min, max; of the current or last call
+    double link_jitter_seconds;
+    double link_rate[2]; // game bytes/s received, sent
+    uint64_t link_probes;
+    uint64_t link_overhead_bytes;
+    uint64_t online;
+    double online_seconds_total;
+    double last_call_seconds;
+};
+
+constexpr int BULK_TRANSFER_PACKETS_MAX = 16;
+constexpr int BULK_IN_PACKETS_DEFAULT = 8;
+
+struct modem_config {
+    const char *driver;
+    const char *device;
+    const char *ip_addr;
+    int port;
+    bool is_server;
+    int cpu; // CPU core to pin this modem's threads to, -1 for no pinning
+    const char *relay_number; // phone number on the relay server, nullptr for direct TCP
+    bool use_udp; // udp_sock instead of tcp_sock, both ends must agree
+    int line_rate; // bits per second in both directions, 0 for unlimited
+    std::chrono::milliseconds tx_deadline; // queued data older than this is late, 0 for no limit
+    bool tx_shed; // drop late data instead of only counting it
+    int bulk_in_packets; // packets per bulk-IN transfer, 1 to BULK_TRANSFER_PACKETS_MAX
+    int bulk_out_packets; // packets per bulk-OUT read; >1 needs a console that ends transfers with a short packet
+    bool use_io_uring; // tcp_sock I/O through io_uring, epoll if the kernel cannot
+    int rt_priority; // SCHED_FIFO priority of the USB threads, 0 for normal scheduling (rt_profile.h)
+    std::chrono::milliseconds dial_timeout; // cap on the S7 wait for the remote side, 0 for S7 alone
+    int call_queue_max; // callers held while the line is busy (TCP server), 0 to hang up on them
+    std::chrono::milliseconds call_queue_wait; // how long a held caller waits at most
+    int auto_answer; // rings before answering, overrides S0 when >0
+    std::chrono::milliseconds resume_grace; // keep a TCP call through a dropped connection this long, 0 for off
+    const impairment_profile *impairment; // emulated bad network in front of the socket, nullptr for none
+    std::chrono::milliseconds probe_interval; // in-band RTT probes (link_probe.h) this often, 0 for off; both ends must agree
+    traffic_recorder *recorder; // records this modem's traffic (traffic_record.h), nullptr for off; shared by all modems
+};
+
+// One emulated modem: USB gadget, transmit buffer, socket and AT state.
+// All modems of a process share one event_loop for their sockets.
+class modem_session
+{
+    private:
+        int id;
+        modem_config config;
+        int debug_level;
+        bulk_in_policy bulk_in_timing;
+        usb_gadget *usb; // owned
+        ring_buffer<char> usb_tx_buffer;
+        ring_buffer<latency_stamp> usb_tx_stamps;
+        line_pacer usb_pacer; // remote -> console
+        line_pacer remote_pacer; // console -> remote
+        // per-stage latency of the current call
+        latency_histogram usb_out_to_tcp; // bulk-OUT ep_read -> tcp_sock::send
+        latency_histogram tcp_to_enqueue; // recv -> enqueue in recv_callback
+        latency_histogram enqueue_to_usb; // enqueue -> ep_write done, the queue delay
+        latency_histogram tcp_to_usb_in; // recv -> ep_write done
+        latency_histogram rx_throttle_time; // how long each pause of the remote side lasted
+        // jitter probe, since start
+        latency_histogram usb_in_wake_late; // timed wakeups of the bulk-IN thread past their target
+        latency_histogram usb_in_data_wake; // enqueue -> bulk-IN thread running, when it slept on usb_tx_buffer.wait()
+        latency_histogram ep_write_time; // ep_write() call -> completion
+        // call setup, since start
+        latency_histogram call_queue_wait; // caller held while the line was busy
+        latency_histogram call_answer_time; // first RING -> CONNECT
+        latency_histogram dial_time; // ATD -> CONNECT
+        // USB enumeration, control thread only
+        bool enumerating;
+        std::chrono::steady_clock::time_point enumeration_started; // USB_RAW_EVENT_CONNECT or GET_DESCRIPTOR(DEVICE)
+        event_loop *loop;
+        transport *sock;
+        probed_transport *probe; // sock itself when probing, else nullptr
+        std::atomic<bool> connected;
+        // ATD in progress; the socket answers on the loop thread (dial_finished())
+        std::atomic<bool> dialing;
+        std::atomic<uint32_t> dial_call; // a hang-up makes the answer of the call before it stale
+        std::chrono::steady_clock::time_point dial_started;
+        // incoming call ringing; RINGs repeat on the loop thread until answered
+        std::atomic<bool> ringing;
+        std::atomic<int> auto_answer_rings; // S0
+        std::atomic<int64_t> ring_ns; // first RING of the call
+        uint32_t ring_call; // loop thread
+        int rings; // loop thread
+        std::mutex answer_mtx; // ATA and auto-answer
+        std::shared_ptr<bool> alive; // reset on the loop thread; call_later tasks check it
+        std::thread *thread_control;
+        std::thread *thread_bulk_in;
+        std::thread *thread_bulk_out;
+        // on-line time accounting, guarded by online_mtx
+        std::mutex online_mtx;
+        std::chrono::steady_clock::time_point online_since;
+        std::chrono::steady_clock::duration online_total;
+        uint64_t online_cpu_start_ns;
+        uint64_t online_cpu_total_ns;
+        void pin_thread(std::thread *t);
+        void enter_thread(const char *name);
+        void print_jitter(void);
+        uint64_t get_cpu_time_ns(void);
+        // counters for get_metrics(), relaxed atomics so reading never blocks
+        std::atomic<uint64_t> usb_in_packets, usb_in_bytes, usb_out_packets, usb_out_bytes, usb_in_transfers, usb_out_transfers;
+        std::atomic<uint64_t> tx_high_water, tx_overflow_bytes, payload_mismatches;
+        std::atomic<uint64_t> tx_late_bytes, tx_shed_bytes, tx_queue_delay_ns;
+        std::atomic<uint64_t> rx_throttle_events, rx_throttle_ns_total;
+        // flow control: set by recv_callback above TX_PAUSE_BYTES, cleared by the bulk-IN thread
+        std::atomic<bool> rx_throttled;
+        std::atomic<int64_t> rx_throttle_since_ns;
+        std::atomic<uint64_t> dial_attempts, dial_connected, dial_failed, calls_answered, calls_ended;
+        std::atomic<uint64_t> online_ns_total, last_call_ns;
+        std::atomic<uint64_t> enumerations, last_enumeration_ns;
+        void set_online(bool online);
+        void print_latency(void);
+        void resume_rx(void);
+        void ring_callback(void);
+        void ring(uint32_t call);
+        bool answer_call(void);
+        std::string link_stats_report(void);
+        void recv_callback(const char *buffer, size_t length);
+        int recv_acquire(struct iovec *iov);
+        struct iovec recv_iov[2]; // from recv_acquire(), for the recorder
+        int recv_iovcnt;
+        void recv_commit(size_t length);
+        void recv_queued(latency_stamp &stamp, size_t length, size_t sent_length);
+        void disconnect_callback(void);
+        void dial_finished(uint32_t call, dial_result result);
+        void usb_bulk_in_thread(int ep_num);
+        void usb_bulk_out_thread(int ep_num);
+        bool process_control_packet(usb_raw_control_event *e, struct usb_packet_control *pkt);
+        void usb_control_thread(void);
+    public:
+        modem_session(int id, const modem_config &config, const bulk_in_policy &bulk_in_timing, event_loop *loop, usb_gadget *usb, int debug_level);
+        ~modem_session();
+        void start(void);
+        size_t get_memory_footprint(void);
+        void print_stats(void);
+        modem_metrics get_metrics(void);
+};
+
+// Prometheus text for all modems, labelled modem="<index>"
+void render_modem_metrics(std::string &out, std::vector<modem_session *> &modems);
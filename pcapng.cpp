@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "traffic_record.h"
+#include "pcapng.h"
+
+#include "board.h"
+
+constexpr uint32_t BLOCK_SHB = 0x0a0d0d0a;
+constexpr uint32_t BLOCK_IDB = 1;
+constexpr uint32_t BLOCK_EPB = 6;
+constexpr uint16_t OPTION_END = 0;
+constexpr uint16_t OPTION_IF_NAME = 2;
+constexpr uint16_t OPTION_IF_TSRESOL = 9;
+constexpr size_t TCP_SEGMENT_MAX = 65535 - 40;
+constexpr uint32_t LOCAL_ADDR = 0x0a000001; // 10.0.0.1
+constexpr uint32_t REMOTE_ADDR = 0x0a000002;
+constexpr uint16_t LOCAL_PORT_BASE = 49152; // + modem
+constexpr uint8_t TCP_FIN = 0x01;
+constexpr uint8_t TCP_SYN = 0x02;
+constexpr uint8_t TCP_PSH = 0x08;
+constexpr uint8_t TCP_ACK = 0x10;
+constexpr uint8_t USBMON_EP_BULK = 2; // ENDPOINT_ADDR_BULK in me56ps2.h
+constexpr uint8_t USBMON_XFER_CONTROL = 2; // usbmon's numbering, not USB_ENDPOINT_XFER_*
+constexpr uint8_t USBMON_XFER_BULK = 3;
+
+// The header usbmon puts in front of each URB in its binary interface
+struct usbmon_packet {
+    uint64_t id;
+    uint8_t type; // 'S'ubmission, 'C'ompletion
+    uint8_t xfer_type;
+    uint8_t epnum; // USB_DIR_IN set for IN
+    uint8_t devnum;
+    uint16_t busnum;
+    char flag_setup; // 0: setup is valid
+    char flag_data; // 0: data follows
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length; // of the URB
+    uint32_t len_cap; // data following this header
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;
+};
+static_assert(sizeof(usbmon_packet) == 64, "usbmon_packet must match the kernel's layout");
+
+class pcapng_writer
+{
+    private:
+        FILE *fp;
+        uint32_t interfaces;
+        void write_block(uint32_t type, const std::string &body)
+        {
+            const uint32_t length = 12 + body.length();
+            fwrite(&type, 4, 1, fp);
+            fwrite(&length, 4, 1, fp);
+            fwrite(body.data(), 1, body.length(), fp);
+            fwrite(&length, 4, 1, fp);
+        }
+        static void put(std::string &s, const void *p, size_t length)
+        {
+            s.append(static_cast<const char *>(p), length);
+            s.append((4 - length % 4) % 4, '\0');
+        }
+        static void put_option(std::string &s, uint16_t code, const void *value, uint16_t length)
+        {
+            s.append(reinterpret_cast<const char *>(&code), 2);
+            s.append(reinterpret_cast<const char *>(&length), 2);
+            put(s, value, length);
+        }
+    public:
+        pcapng_writer(FILE *fp)
+        {
+            pcapng_writer::fp = fp;
+            interfaces = 0;
+            std::string body;
+            const uint32_t magic = 0x1a2b3c4d;
+            const uint16_t version[2] = {1, 0};
+            const int64_t section_length = -1;
+            body.append(reinterpret_cast<const char *>(&magic), 4);
+            body.append(reinterpret_cast<const char *>(version), 4);
+            body.append(reinterpret_cast<const char *>(&section_length), 8);
+            const std::string app = "me56ps2";
+            put_option(body, 4, app.data(), app.length()); // shb_userappl
+            put_option(body, OPTION_END, nullptr, 0);
+            write_block(BLOCK_SHB, body);
+        }
+        uint32_t add_interface(uint16_t linktype, const std::string &name)
+        {
+            std::string body;
+            const uint16_t reserved = 0;
+            const uint32_t snaplen = 0;
+            const uint8_t tsresol = 9; // ns
+            body.append(reinterpret_cast<const char *>(&linktype), 2);
+            body.append(reinterpret_cast<const char *>(&reserved), 2);
+            body.append(reinterpret_cast<const char *>(&snaplen), 4);
+            put_option(body, OPTION_IF_NAME, name.data(), name.length());
+            put_option(body, OPTION_IF_TSRESOL, &tsresol, 1);
+            put_option(body, OPTION_END, nullptr, 0);
+            write_block(BLOCK_IDB, body);
+            return interfaces++;
+        }
+        void write_packet(uint32_t interface, uint64_t ts_ns, const std::string &packet)
+        {
+            std::string body;
+            const uint32_t header[5] = {interface, static_cast<uint32_t>(ts_ns >> 32), static_cast<uint32_t>(ts_ns),
+                static_cast<uint32_t>(packet.length()), static_cast<uint32_t>(packet.length())};
+            body.append(reinterpret_cast<const char *>(header), sizeof(header));
+            put(body, packet.data(), packet.length());
+            write_block(BLOCK_EPB, body);
+        }
+};
+
+static uint32_t checksum_add(uint32_t sum, const uint8_t *p, size_t length)
+{
+    for (size_t i = 0; i + 1 < length; i += 2) {sum += (p[i] << 8) | p[i + 1];}
+    if (length % 2 == 1) {sum += p[length - 1] << 8;}
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum)
+{
+    while (sum >> 16) {sum = (sum & 0xffff) + (sum >> 16);}
+    return htons(~sum & 0xffff);
+}
+
+// One direction of a made-up TCP connection per modem
+struct tcp_flow {
+    bool open;
+    uint32_t seq[2]; // next sequence number: from this side, from the remote side
+    uint16_t ip_id;
+};
+
+static std::string tcp_packet(tcp_flow &flow, int modem, bool from_remote, uint8_t flags, const uint8_t *data, size_t length)
+{
+    uint8_t h[40];
+    memset(h, 0, sizeof(h));
+    const uint32_t src = htonl(from_remote ? REMOTE_ADDR : LOCAL_ADDR);
+    const uint32_t dst = htonl(from_remote ? LOCAL_ADDR : REMOTE_ADDR);
+    const uint16_t local_port = htons(LOCAL_PORT_BASE + modem);
+    const uint16_t remote_port = htons(TCP_DEFAULT_PORT);
+    const uint16_t total = htons(40 + length);
+    const uint16_t id = htons(flow.ip_id++);
+    const uint16_t df = htons(0x4000);
+    h[0] = 0x45;
+    memcpy(&h[2], &total, 2);
+    memcpy(&h[4], &id, 2);
+    memcpy(&h[6], &df, 2);
+    h[8] = 64;
+    h[9] = IPPROTO_TCP;
+    memcpy(&h[12], &src, 4);
+    memcpy(&h[16], &dst, 4);
+    const auto ip_sum = checksum_fold(checksum_add(0, h, 20));
+    memcpy(&h[10], &ip_sum, 2);
+
+    uint8_t *t = &h[20];
+    const int side = from_remote ? 1 : 0;
+    const uint32_t seq = htonl(flow.seq[side]);
+    const uint32_t ack = htonl(flow.seq[1 - side]);
+    const uint16_t window = htons(65535);
+    memcpy(&t[0], from_remote ? &remote_port : &local_port, 2);
+    memcpy(&t[2], from_remote ? &local_port : &remote_port, 2);
+    memcpy(&t[4], &seq, 4);
+    if (flags & TCP_ACK) {memcpy(&t[8], &ack, 4);}
+    t[12] = 5 << 4;
+    t[13] = flags;
+    memcpy(&t[14], &window, 2);
+    // Pseudo header, header and data
+    uint32_t sum = checksum_add(0, &h[12], 8) + IPPROTO_TCP + 20 + length;
+    sum = checksum_add(sum, t, 20);
+    sum = checksum_add(sum, data, length);
+    const auto tcp_sum = checksum_fold(sum);
+    memcpy(&t[16], &tcp_sum, 2);
+
+    flow.seq[side] += length + ((flags & (TCP_SYN | TCP_FIN)) ? 1 : 0);
+    std::string packet(reinterpret_cast<const char *>(h), sizeof(h));
+    packet.append(reinterpret_cast<const char *>(data), length);
+    return packet;
+}
+
+static std::string usb_packet(uint64_t id, char type, uint8_t xfer_type, uint8_t epnum, int modem, uint64_t ts_ns, int32_t status,
+    uint32_t length, const uint8_t *setup, const uint8_t *data, size_t data_length)
+{
+    usbmon_packet p;
+    memset(&p, 0, sizeof(p));
+    p.id = id;
+    p.type = type;
+    p.xfer_type = xfer_type;
+    p.epnum = epnum;
+    p.devnum = 1;
+    p.busnum = modem + 1;
+    p.flag_setup = setup != nullptr ? 0 : '-';
+    p.flag_data = data_length > 0 ? 0 : (epnum & USB_DIR_IN) ? '<' : '>';
+    p.ts_sec = ts_ns / 1000000000;
+    p.ts_usec = ts_ns % 1000000000 / 1000;
+    p.status = status;
+    p.length = length;
+    p.len_cap = data_length;
+    if (setup != nullptr) {memcpy(p.setup, setup, sizeof(p.setup));}
+    std::string packet(reinterpret_cast<const char *>(&p), sizeof(p));
+    packet.append(reinterpret_cast<const char *>(data), data_length);
+    return packet;
+}
+
+bool export_pcapng(const char *recording_path, const char *pcapng_path)
+{
+    recording_reader reader;
+    if (!reader.open(recording_path)) {return false;}
+    FILE *fp = fopen(pcapng_path, "wb");
+    if (fp == nullptr) {
+        printf("%s: %s\n", pcapng_path, std::strerror(errno));
+        return false;
+    }
+
+    pcapng_writer writer(fp);
+    const auto start_ns = reader.get_header().start_realtime_ns;
+    std::map<std::pair<int, uint16_t>, uint32_t> interfaces; // (modem, link type) -> interface id
+    auto interface = [&](int modem, uint16_t linktype) {
+        const auto key = std::make_pair(modem, linktype);
+        const auto it = interfaces.find(key);
+        if (it != interfaces.end()) {return it->second;}
+        const auto name = "modem" + std::to_string(modem) + (linktype == PCAPNG_LINKTYPE_RAW ? " tcp" : " usb");
+        return interfaces[key] = writer.add_interface(linktype, name);
+    };
+    std::map<int, tcp_flow> flows;
+    std::map<int, std::pair<uint64_t, usb_ctrlrequest>> controls; // per modem: URB id and setup of the request in progress
+    uint64_t urb_id = 0;
+    uint64_t records = 0, packets = 0;
+
+    auto tcp = [&](int modem, uint64_t ts, bool from_remote, uint8_t flags, const uint8_t *data, size_t length) {
+        writer.write_packet(interface(modem, PCAPNG_LINKTYPE_RAW), ts, tcp_packet(flows[modem], modem, from_remote, flags, data, length));
+        packets++;
+    };
+    auto open_call = [&](int modem, uint64_t ts) {
+        auto &flow = flows[modem];
+        if (flow.open) {return;}
+        flow.open = true;
+        tcp(modem, ts, false, TCP_SYN, nullptr, 0);
+        tcp(modem, ts, true, TCP_SYN | TCP_ACK, nullptr, 0);
+        tcp(modem, ts, false, TCP_ACK, nullptr, 0);
+    };
+    auto usb = [&](int modem, uint64_t ts, const std::string &packet) {
+        writer.write_packet(interface(modem, PCAPNG_LINKTYPE_USB_LINUX_MMAPPED), ts, packet);
+        packets++;
+    };
+
+    record_view r;
+    while (reader.next(&r)) {
+        records++;
+        const auto ts = start_ns + r.time_ns;
+        switch (r.kind) {
+            case RECORD_USB_EVENT: {
+                // Only control requests have a URB
+                if (r.arg != USB_RAW_EVENT_CONTROL || r.length < sizeof(usb_ctrlrequest)) {break;}
+                usb_ctrlrequest ctrl;
+                memcpy(&ctrl, r.data, sizeof(ctrl));
+                controls[r.modem] = {++urb_id, ctrl};
+                usb(r.modem, ts, usb_packet(urb_id, 'S', USBMON_XFER_CONTROL, ctrl.bRequestType & USB_DIR_IN, r.modem, ts, -EINPROGRESS,
+                    ctrl.wLength, r.data, nullptr, 0));
+                break;
+            }
+            case RECORD_EP0:
+            case RECORD_EP0_STALL: {
+                const auto &control = controls[r.modem];
+                const auto status = r.kind == RECORD_EP0_STALL ? -EPIPE : 0;
+                usb(r.modem, ts, usb_packet(control.first, 'C', USBMON_XFER_CONTROL, control.second.bRequestType & USB_DIR_IN, r.modem, ts, status,
+                    r.length, nullptr, r.data, r.length));
+                break;
+            }
+            case RECORD_BULK_OUT:
+                urb_id++;
+                usb(r.modem, ts, usb_packet(urb_id, 'S', USBMON_XFER_BULK, USB_DIR_OUT | USBMON_EP_BULK, r.modem, ts, -EINPROGRESS,
+                    r.length, nullptr, r.data, r.length));
+                usb(r.modem, ts, usb_packet(urb_id, 'C', USBMON_XFER_BULK, USB_DIR_OUT | USBMON_EP_BULK, r.modem, ts, 0,
+                    r.length, nullptr, nullptr, 0));
+                break;
+            case RECORD_BULK_IN:
+                urb_id++;
+                usb(r.modem, ts, usb_packet(urb_id, 'S', USBMON_XFER_BULK, USB_DIR_IN | USBMON_EP_BULK, r.modem, ts, -EINPROGRESS,
+                    r.length, nullptr, nullptr, 0));
+                usb(r.modem, ts, usb_packet(urb_id, 'C', USBMON_XFER_BULK, USB_DIR_IN | USBMON_EP_BULK, r.modem, ts, 0,
+                    r.length, nullptr, r.data, r.length));
+                break;
+            case RECORD_SOCK_RX:
+            case RECORD_SOCK_TX:
+                open_call(r.modem, ts);
+                for (size_t done = 0; done < r.length; done += TCP_SEGMENT_MAX) {
+                    tcp(r.modem, ts, r.kind == RECORD_SOCK_RX, TCP_PSH | TCP_ACK, r.data + done, std::min(TCP_SEGMENT_MAX, r.length - done));
+                }
+                break;
+            case RECORD_CALL:
+                if (r.arg != 0) {
+                    open_call(r.modem, ts);
+                } else if (flows[r.modem].open) {
+                    flows[r.modem].open = false;
+                    tcp(r.modem, ts, false, TCP_FIN | TCP_ACK, nullptr, 0);
+                    tcp(r.modem, ts, true, TCP_FIN | TCP_ACK, nullptr, 0);
+                    tcp(r.modem, ts, false, TCP_ACK, nullptr, 0);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    const auto ok = fclose(fp) == 0;
+    printf("export: %lu records, %lu packets written to %s.\n", (unsigned long) records, (unsigned long) packets, pcapng_path);
+    if (reader.get_header().dropped > 0) {printf("export: %lu records were dropped while recording.\n", (unsigned long) reader.get_header().dropped);}
+    return ok;
+}
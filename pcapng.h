@@ -0,0 +1,12 @@
+#include <cstdint>
+
+constexpr uint16_t PCAPNG_LINKTYPE_RAW = 101; // IPv4 packets, no link layer
+constexpr uint16_t PCAPNG_LINKTYPE_USB_LINUX_MMAPPED = 220; // usbmon with the 64 byte header
+
+// Converts a recording (traffic_record.h) to a pcapng file for Wireshark.
+// Each modem gets two interfaces: its USB traffic as usbmon would show it,
+// control requests and bulk transfers each as a submission and completion,
+// and its socket chunks as one TCP connection per call between 10.0.0.1
+// (this emulator) and 10.0.0.2 (the remote side). The TCP packets are made
+// up from the recorded stream, so only the timing of the game bytes is real.
+bool export_pcapng(const char *recording_path, const char *pcapng_path);
@@ -0,0 +1,10 @@
+// Handshake between an emulator and the relay server (-R).
+// The emulator sends one line, "ME56PS2 ANSWER <number>" to take calls for
+// a number or "ME56PS2 DIAL <number>" to call it. The relay answers with
+// "CONNECT" once the two sides are paired, after which the connection
+// carries the raw modem stream, or with "BUSY" and closes it.
+constexpr char RELAY_HELLO_ANSWER[] = "ME56PS2 ANSWER ";
+constexpr char RELAY_HELLO_DIAL[] = "ME56PS2 DIAL ";
+constexpr char RELAY_REPLY_CONNECT[] = "CONNECT";
+constexpr char RELAY_REPLY_BUSY[] = "BUSY";
+constexpr size_t RELAY_LINE_MAX = 64;
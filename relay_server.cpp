@@ -0,0 +1,504 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "relay_protocol.h"
+#include "relay_server.h"
+
+constexpr int RELAY_MAX_EVENTS = 256;
+constexpr size_t RELAY_SPLICE_SIZE = 65536;
+constexpr int RELAY_PUMP_ROUNDS = 16; // per event, to stay fair between sessions
+
+enum relay_state {
+    RELAY_HELLO,
+    RELAY_WAITING,
+    RELAY_PAIRED,
+    RELAY_CLOSED,
+};
+
+struct relay_conn {
+    int fd;
+    relay_state state;
+    bool dial;
+    std::string number;
+    std::string line; // handshake bytes
+    relay_conn *peer;
+    int pipe_fds[2]; // bytes read from this connection, waiting for the peer
+    size_t pipe_bytes;
+    size_t reply_bytes; // the result code at the head of the pipe, not counted as forwarded
+    uint32_t events;
+};
+
+class relay_worker
+{
+    private:
+        relay_server *server;
+        int index;
+        int debug_level;
+        int epoll_fd;
+        int listen_fd;
+        int inbox_fd;
+        std::mutex inbox_mtx;
+        std::vector<relay_conn *> inbox;
+        std::unordered_map<std::string, relay_conn *> lines; // number -> answering side
+        std::vector<relay_conn *> graveyard;
+        std::thread *thread_ptr;
+        std::atomic<bool> running;
+        void* worker_thread(void);
+        void set_events(relay_conn *c, uint32_t events);
+        void on_accept(void);
+        void on_inbox(void);
+        void on_hello(relay_conn *c);
+        void route(relay_conn *c);
+        void pair(relay_conn *answer, relay_conn *dial);
+        void pump(relay_conn *src);
+        void reply(relay_conn *c, const char *line);
+        void drop(relay_conn *c);
+    public:
+        std::atomic<uint64_t> connections{0};
+        std::atomic<uint64_t> waiting{0};
+        std::atomic<uint64_t> sessions_active{0};
+        std::atomic<uint64_t> sessions_total{0};
+        std::atomic<uint64_t> busy_total{0};
+        std::atomic<uint64_t> bytes_forwarded{0};
+        relay_worker(relay_server *server, int index, const struct sockaddr_in *addr, int debug_level);
+        ~relay_worker();
+        void adopt(relay_conn *c);
+};
+
+relay_worker::relay_worker(relay_server *server, int index, const struct sockaddr_in *addr, int debug_level)
+{
+    relay_worker::server = server;
+    relay_worker::index = index;
+    relay_worker::debug_level = debug_level;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw std::runtime_error((std::string) "relay: epoll_create1(): " + std::strerror(errno));
+    }
+    inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inbox_fd < 0) {
+        throw std::runtime_error((std::string) "relay: eventfd(): " + std::strerror(errno));
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        throw std::runtime_error((std::string) "relay: socket(): " + std::strerror(errno));
+    }
+    const int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(listen_fd, reinterpret_cast<const struct sockaddr *>(addr), sizeof(*addr)) < 0) {
+        throw std::runtime_error((std::string) "relay: bind(): " + std::strerror(errno));
+    }
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        throw std::runtime_error((std::string) "relay: listen(): " + std::strerror(errno));
+    }
+
+    // data.ptr: nullptr = listen socket, this = inbox, otherwise relay_conn
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = this;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inbox_fd, &ev);
+
+    running.store(true);
+    thread_ptr = new std::thread([this]{worker_thread();});
+
+    const auto cpus = std::thread::hardware_concurrency();
+    if (cpus > 1) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(index % cpus, &cpuset);
+        pthread_setaffinity_np(thread_ptr->native_handle(), sizeof(cpuset), &cpuset);
+    }
+}
+
+relay_worker::~relay_worker()
+{
+    running.store(false);
+    const uint64_t value = 1;
+    if (write(inbox_fd, &value, sizeof(value)) < 0) {
+        printf("relay: write(): %s\n", std::strerror(errno));
+    }
+    thread_ptr->join();
+    delete thread_ptr;
+    close(listen_fd);
+    close(inbox_fd);
+    close(epoll_fd);
+}
+
+void* relay_worker::worker_thread(void)
+{
+    struct epoll_event events[RELAY_MAX_EVENTS];
+
+    while (running.load()) {
+        const auto n = epoll_wait(epoll_fd, events, RELAY_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {continue;}
+            printf("relay: epoll_wait(): %s\n", std::strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            const auto ptr = events[i].data.ptr;
+            if (ptr == nullptr) {on_accept(); continue;}
+            if (ptr == this) {on_inbox(); continue;}
+
+            auto c = static_cast<relay_conn *>(ptr);
+            const auto ev = events[i].events;
+            if (c->state == RELAY_CLOSED) {continue;}
+            if (c->state == RELAY_HELLO) {
+                on_hello(c);
+                continue;
+            }
+            if (c->state == RELAY_WAITING) {
+                // Nothing is expected from a waiting answerer except hang-up
+                drop(c);
+                continue;
+            }
+            if (ev & EPOLLOUT) {pump(c->peer);}
+            if (c->state == RELAY_PAIRED && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {pump(c);}
+        }
+
+        // Free connections only after the batch, events may still point at them
+        for (auto c : graveyard) {delete c;}
+        graveyard.clear();
+    }
+
+    return nullptr;
+}
+
+void relay_worker::set_events(relay_conn *c, uint32_t events)
+{
+    if (c->events == events) {return;}
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+void relay_worker::on_accept(void)
+{
+    while (true) {
+        auto fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("relay: accept(): %s\n", std::strerror(errno));
+            }
+            return;
+        }
+
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto c = new relay_conn();
+        c->fd = fd;
+        c->state = RELAY_HELLO;
+        c->peer = nullptr;
+        c->pipe_fds[0] = c->pipe_fds[1] = -1;
+        c->pipe_bytes = 0;
+        c->reply_bytes = 0;
+        c->events = EPOLLIN | EPOLLRDHUP;
+
+        struct epoll_event ev;
+        ev.events = c->events;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        connections++;
+    }
+}
+
+void relay_worker::on_inbox(void)
+{
+    uint64_t value;
+    while (read(inbox_fd, &value, sizeof(value)) == sizeof(value)) {}
+
+    std::vector<relay_conn *> adopted;
+    {
+        std::lock_guard<std::mutex> lock(inbox_mtx);
+        adopted.swap(inbox);
+    }
+    for (auto c : adopted) {
+        struct epoll_event ev;
+        ev.events = c->events;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+        connections++;
+        route(c);
+    }
+}
+
+void relay_worker::adopt(relay_conn *c)
+{
+    {
+        std::lock_guard<std::mutex> lock(inbox_mtx);
+        inbox.push_back(c);
+    }
+    const uint64_t value = 1;
+    if (write(inbox_fd, &value, sizeof(value)) < 0) {
+        printf("relay: write(): %s\n", std::strerror(errno));
+    }
+}
+
+void relay_worker::on_hello(relay_conn *c)
+{
+    char buf[RELAY_LINE_MAX];
+    auto len = ::recv(c->fd, buf, sizeof(buf), 0);
+    if (len <= 0) {
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {return;}
+        drop(c);
+        return;
+    }
+    c->line.append(buf, len);
+
+    const auto newline_pos = c->line.find('\n');
+    if (newline_pos == std::string::npos) {
+        if (c->line.length() > RELAY_LINE_MAX) {drop(c);}
+        return;
+    }
+
+    auto hello = c->line.substr(0, newline_pos);
+    c->line.erase(0, newline_pos + 1); // anything left is early modem data
+    if (!hello.empty() && hello.back() == '\r') {hello.pop_back();}
+
+    if (hello.compare(0, strlen(RELAY_HELLO_DIAL), RELAY_HELLO_DIAL) == 0) {
+        c->dial = true;
+        c->number = hello.substr(strlen(RELAY_HELLO_DIAL));
+    } else if (hello.compare(0, strlen(RELAY_HELLO_ANSWER), RELAY_HELLO_ANSWER) == 0) {
+        c->dial = false;
+        c->number = hello.substr(strlen(RELAY_HELLO_ANSWER));
+    } else {
+        drop(c);
+        return;
+    }
+    if (c->number.empty()) {
+        drop(c);
+        return;
+    }
+    if (debug_level >= 2) {printf("relay%d: %s %s\n", index, c->dial ? "dial" : "answer", c->number.c_str());}
+
+    auto owner = server->get_owner(c->number.c_str());
+    if (owner == this) {
+        route(c);
+        return;
+    }
+
+    // Hand the connection to the worker that owns this number
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+    connections--;
+    owner->adopt(c);
+}
+
+void relay_worker::route(relay_conn *c)
+{
+    auto it = lines.find(c->number);
+
+    if (!c->dial) {
+        if (it != lines.end()) {
+            // Somebody already answers for this number
+            busy_total++;
+            reply(c, RELAY_REPLY_BUSY);
+            drop(c);
+            return;
+        }
+        lines[c->number] = c;
+        c->state = RELAY_WAITING;
+        waiting++;
+        return;
+    }
+
+    if (it == lines.end() || it->second->state != RELAY_WAITING) {
+        busy_total++;
+        reply(c, RELAY_REPLY_BUSY);
+        drop(c);
+        return;
+    }
+    pair(it->second, c);
+}
+
+void relay_worker::pair(relay_conn *answer, relay_conn *dial)
+{
+    for (auto c : {answer, dial}) {
+        if (pipe2(c->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            printf("relay: pipe2(): %s\n", std::strerror(errno));
+            drop(answer);
+            drop(dial);
+            return;
+        }
+    }
+    waiting--;
+    answer->state = RELAY_PAIRED;
+    dial->state = RELAY_PAIRED;
+    answer->peer = dial;
+    dial->peer = answer;
+    sessions_active++;
+    sessions_total++;
+
+    // Each side's pipe starts with what its peer is owed: the result code,
+    // then game bytes that arrived with the handshake. pump() sends them on
+    // and waits for EPOLLOUT if the peer cannot take them all yet.
+    for (auto c : {answer, dial}) {
+        const auto s = std::string(RELAY_REPLY_CONNECT) + "\r\n" + c->line;
+        const auto n = write(c->pipe_fds[1], s.c_str(), s.length());
+        if (n != static_cast<ssize_t>(s.length())) {
+            printf("relay: write(): %s\n", n < 0 ? std::strerror(errno) : "short write");
+            drop(c);
+            return;
+        }
+        c->pipe_bytes = n;
+        c->reply_bytes = n - c->line.length();
+        c->line.clear();
+    }
+    pump(answer);
+    pump(dial);
+}
+
+void relay_worker::pump(relay_conn *src)
+{
+    // Move bytes src -> pipe -> dst without copying them through userspace
+    if (src == nullptr || src->state != RELAY_PAIRED) {return;}
+    auto dst = src->peer;
+
+    for (int round = 0; round < RELAY_PUMP_ROUNDS; round++) {
+        if (src->pipe_bytes > 0) {
+            auto n = splice(src->pipe_fds[0], nullptr, dst->fd, nullptr, src->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    // Peer is slow: stop reading until it drains
+                    // Only the EPOLLIN bit: src may be waiting for EPOLLOUT on the other direction
+                    set_events(src, src->events & ~EPOLLIN);
+                    set_events(dst, dst->events | EPOLLOUT);
+                    return;
+                }
+                drop(src);
+                return;
+            }
+            const auto reply = std::min<size_t>(n, src->reply_bytes);
+            src->reply_bytes -= reply;
+            src->pipe_bytes -= n;
+            bytes_forwarded += n - reply;
+            if (src->pipe_bytes > 0) {continue;}
+            set_events(src, src->events | EPOLLIN);
+            set_events(dst, dst->events & ~EPOLLOUT);
+        }
+
+        auto n = splice(src->fd, nullptr, src->pipe_fds[1], nullptr, RELAY_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0) {
+            drop(src);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN) {return;}
+            drop(src);
+            return;
+        }
+        src->pipe_bytes += n;
+    }
+}
+
+void relay_worker::reply(relay_conn *c, const char *line)
+{
+    // Only for a result code right before drop(): nothing else was sent on
+    // the connection, so its empty send buffer takes the line whole
+    const auto s = std::string(line) + "\r\n";
+    const auto n = ::send(c->fd, s.c_str(), s.length(), MSG_NOSIGNAL);
+    if (n != static_cast<ssize_t>(s.length()) && debug_level >= 1) {printf("relay%d: reply not sent to %s\n", index, c->number.c_str());}
+}
+
+void relay_worker::drop(relay_conn *c)
+{
+    if (c->state == RELAY_CLOSED) {return;}
+
+    if (c->state == RELAY_WAITING) {waiting--;}
+    if (c->state == RELAY_PAIRED && c->peer != nullptr) {sessions_active--;}
+
+    auto it = lines.find(c->number);
+    if (it != lines.end() && (it->second == c || it->second == c->peer)) {lines.erase(it);}
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    for (auto fd : c->pipe_fds) {
+        if (fd >= 0) {close(fd);}
+    }
+    c->state = RELAY_CLOSED;
+    connections--;
+    graveyard.push_back(c);
+
+    // Hang up the other side too
+    auto peer = c->peer;
+    c->peer = nullptr;
+    if (peer != nullptr) {
+        peer->peer = nullptr;
+        drop(peer);
+    }
+}
+
+relay_server::relay_server(const char *ip_addr, uint16_t port, int num_workers, int debug_level)
+{
+    // Every session needs two sockets and two pipes
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip_addr);
+
+    if (num_workers < 1) {num_workers = 1;}
+    for (int i = 0; i < num_workers; i++) {
+        workers.push_back(new relay_worker(this, i, &addr, debug_level));
+    }
+}
+
+relay_server::~relay_server()
+{
+    for (auto w : workers) {delete w;}
+}
+
+relay_worker *relay_server::get_owner(const char *number)
+{
+    return workers[std::hash<std::string>()(number) % workers.size()];
+}
+
+void relay_server::print_stats(void)
+{
+    uint64_t connections = 0, waiting = 0, active = 0, total = 0, busy = 0, bytes = 0;
+    for (auto w : workers) {
+        connections += w->connections.load();
+        waiting += w->waiting.load();
+        active += w->sessions_active.load();
+        total += w->sessions_total.load();
+        busy += w->busy_total.load();
+        bytes += w->bytes_forwarded.load();
+    }
+    printf("relay: %zu workers, %lu connections, %lu waiting, %lu sessions active, %lu sessions total, %lu busy, %lu bytes forwarded\n",
+        workers.size(), (unsigned long) connections, (unsigned long) waiting, (unsigned long) active,
+        (unsigned long) total, (unsigned long) busy, (unsigned long) bytes);
+}
@@ -0,0 +1,21 @@
+#include <cstdint>
+#include <vector>
+
+class relay_worker;
+
+// Standalone relay (-R): pairs "ANSWER <number>" and "DIAL <number>"
+// connections and forwards bytes between them with splice(2).
+// Each worker thread owns a SO_REUSEPORT listen socket, so the kernel
+// spreads incoming connections over the workers. After the handshake a
+// connection is handed to the worker that owns its number, so pairing and
+// forwarding never need a lock.
+class relay_server
+{
+    private:
+        std::vector<relay_worker *> workers;
+    public:
+        relay_server(const char *ip_addr, uint16_t port, int num_workers, int debug_level);
+        ~relay_server();
+        relay_worker *get_owner(const char *number);
+        void print_stats(void);
+};
@@ -0,0 +1,47 @@
+#include <algorithm>
+#include <cstring>
+
+#include "replay_window.h"
+
+replay_window::replay_window(size_t size) : buffer(size)
+{
+    end = 0;
+}
+
+void replay_window::append(const char *data, size_t length)
+{
+    // Only the tail of a write larger than the window can be kept
+    const auto size = buffer.size();
+    if (length > size) {
+        end += length - size;
+        data += length - size;
+        length = size;
+    }
+    const auto pos = end % size;
+    const auto first = std::min(length, size - pos);
+    memcpy(&buffer[pos], data, first);
+    memcpy(&buffer[0], data + first, length - first);
+    end += length;
+}
+
+uint64_t replay_window::get_end(void)
+{
+    return end;
+}
+
+bool replay_window::copy_from(uint64_t offset, std::string *out)
+{
+    const auto size = buffer.size();
+    if (offset > end || end - offset > size) {return false;}
+    const auto length = end - offset;
+    const auto pos = offset % size;
+    const auto first = std::min<uint64_t>(length, size - pos);
+    out->assign(&buffer[pos], first);
+    out->append(&buffer[0], length - first);
+    return true;
+}
+
+void replay_window::reset(void)
+{
+    end = 0;
+}
@@ -0,0 +1,22 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The last bytes sent on a stream, kept by stream offset so that what the
+// peer missed when a connection dropped can be sent again. Older bytes are
+// overwritten. Not thread safe.
+class replay_window
+{
+    private:
+        std::vector<char> buffer;
+        uint64_t end; // stream offset after the last byte appended
+    public:
+        replay_window(size_t size);
+        void append(const char *data, size_t length);
+        uint64_t get_end(void);
+        // Sets out to the bytes from offset on. False if the window no
+        // longer holds all of them, or offset is past the end.
+        bool copy_from(uint64_t offset, std::string *out);
+        void reset(void);
+};
@@ -0,0 +1,166 @@
+#include <cstdio>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "event_loop.h"
+#include "resolver.h"
+
+static void set_port(struct sockaddr_storage *addr, uint16_t port)
+{
+    if (addr->ss_family == AF_INET6) {
+        reinterpret_cast<struct sockaddr_in6 *>(addr)->sin6_port = htons(port);
+    } else {
+        reinterpret_cast<struct sockaddr_in *>(addr)->sin_port = htons(port);
+    }
+}
+
+static bool parse_literal(const std::string &host, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    auto in = reinterpret_cast<struct sockaddr_in *>(addr);
+    if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        return true;
+    }
+    auto in6 = reinterpret_cast<struct sockaddr_in6 *>(addr);
+    if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        return true;
+    }
+    return false;
+}
+
+// Alternates the address families, keeping getaddrinfo()'s order within each
+static std::vector<struct sockaddr_storage> interleave(const std::vector<struct sockaddr_storage> &addrs)
+{
+    std::vector<struct sockaddr_storage> first, second, out;
+    if (addrs.empty()) {return out;}
+    for (const auto &addr : addrs) {
+        (addr.ss_family == addrs[0].ss_family ? first : second).push_back(addr);
+    }
+    for (size_t i = 0; i < first.size() || i < second.size(); i++) {
+        if (i < first.size()) {out.push_back(first[i]);}
+        if (i < second.size()) {out.push_back(second[i]);}
+    }
+    return out;
+}
+
+resolver::resolver(event_loop *loop)
+{
+    resolver::loop = loop;
+    worker = nullptr;
+    stopping = false;
+    lookups = 0;
+    cache_hits = 0;
+}
+
+resolver::~resolver()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_one();
+    if (worker != nullptr) {
+        worker->join();
+        delete worker;
+    }
+}
+
+void resolver::resolve(const std::string &host, uint16_t port, std::function<void(const std::vector<struct sockaddr_storage> &)> done)
+{
+    std::vector<struct sockaddr_storage> addrs(1);
+    if (parse_literal(host, &addrs[0])) {
+        set_port(&addrs[0], port);
+        done(addrs);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        const auto it = cache.find(host);
+        if (it != cache.end() && it->second.expires > std::chrono::steady_clock::now()) {
+            cache_hits++;
+            addrs = it->second.addrs;
+        } else {
+            queue.push_back({host, port, done});
+            if (worker == nullptr) {worker = new std::thread([this]{worker_thread();});}
+            done = nullptr;
+        }
+    }
+    if (done == nullptr) {
+        cv.notify_one();
+        return;
+    }
+    for (auto &addr : addrs) {set_port(&addr, port);}
+    done(addrs);
+}
+
+void resolver::pin(const std::string &host, const std::vector<struct sockaddr_storage> &addrs)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    cache[host] = {interleave(addrs), std::chrono::steady_clock::time_point::max()};
+}
+
+void resolver::worker_thread(void)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        cv.wait(lock, [this]{return stopping || !queue.empty();});
+        if (stopping) {return;}
+        auto req = std::move(queue.front());
+        queue.pop_front();
+
+        // Asked again while an earlier request for the host was looked up
+        std::vector<struct sockaddr_storage> addrs;
+        const auto it = cache.find(req.host);
+        if (it != cache.end() && it->second.expires > std::chrono::steady_clock::now()) {
+            cache_hits++;
+            addrs = it->second.addrs;
+        } else {
+            lookups++;
+            lock.unlock();
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_ADDRCONFIG;
+            struct addrinfo *res = nullptr;
+            const auto ret = getaddrinfo(req.host.c_str(), nullptr, &hints, &res);
+            if (ret != 0) {
+                printf("resolver: %s: %s\n", req.host.c_str(), gai_strerror(ret));
+            }
+            for (auto ai = res; ai != nullptr; ai = ai->ai_next) {
+                if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) {continue;}
+                struct sockaddr_storage addr;
+                memset(&addr, 0, sizeof(addr));
+                memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+                set_port(&addr, 0);
+                addrs.push_back(addr);
+            }
+            if (res != nullptr) {freeaddrinfo(res);}
+            addrs = interleave(addrs);
+            lock.lock();
+            const auto ttl = addrs.empty() ? std::chrono::steady_clock::duration(RESOLVER_NEGATIVE_TTL) : std::chrono::steady_clock::duration(RESOLVER_CACHE_TTL);
+            if (ret != EAI_AGAIN) {cache[req.host] = {addrs, std::chrono::steady_clock::now() + ttl};}
+        }
+
+        for (auto &addr : addrs) {set_port(&addr, req.port);}
+        auto done = std::move(req.done);
+        loop->post([done, addrs]{done(addrs);});
+    }
+}
+
+uint64_t resolver::get_lookups(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return lookups;
+}
+
+uint64_t resolver::get_cache_hits(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return cache_hits;
+}
@@ -0,0 +1,54 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+
+class event_loop;
+
+constexpr auto RESOLVER_CACHE_TTL = std::chrono::seconds(60);
+constexpr auto RESOLVER_NEGATIVE_TTL = std::chrono::seconds(5); // unknown hosts
+
+// Host name lookups for dialing. getaddrinfo() blocks for as long as the DNS
+// server takes, so it runs on a worker thread started on first use; answers
+// are cached. Addresses come back in happy eyeballs order (RFC 8305): the
+// families alternate, starting with the one getaddrinfo() put first.
+// resolve() and its callback run on the loop thread.
+class resolver
+{
+    private:
+        struct entry {
+            std::vector<struct sockaddr_storage> addrs; // port 0
+            std::chrono::steady_clock::time_point expires; // max(): pinned
+        };
+        struct request {
+            std::string host;
+            uint16_t port;
+            std::function<void(const std::vector<struct sockaddr_storage> &)> done;
+        };
+        event_loop *loop;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::thread *worker;
+        bool stopping;
+        std::deque<request> queue;
+        std::map<std::string, entry> cache;
+        uint64_t lookups, cache_hits;
+        void worker_thread(void);
+    public:
+        resolver(event_loop *loop);
+        ~resolver(); // waits for a lookup in progress
+        // done gets the addresses with port set, none if the host is unknown.
+        // Address literals and cached names are answered before this returns.
+        void resolve(const std::string &host, uint16_t port, std::function<void(const std::vector<struct sockaddr_storage> &)> done);
+        // Answers host with addrs from now on, without asking DNS
+        void pin(const std::string &host, const std::vector<struct sockaddr_storage> &addrs);
+        uint64_t get_lookups(void);
+        uint64_t get_cache_hits(void);
+};
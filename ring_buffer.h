@@ -1,29 +1,77 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
-#include <condition_variable>
+#include <cstdio>
 #include <cstddef>
-#include <mutex>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
 
+constexpr size_t CACHE_LINE_SIZE = 64;
+constexpr int RING_SPIN_ROUNDS = 64; // yields before a producer sleeps until begin_write() is over
+// reserve_ptr: the position claimed so far, the number of producers still
+// copying in, and the lock taken by begin_write()
+constexpr size_t RING_WRITE_LOCK = static_cast<size_t>(1) << 63;
+constexpr size_t RING_CLAIM_ONE = static_cast<size_t>(1) << 55;
+constexpr size_t RING_POSITION_MASK = RING_CLAIM_ONE - 1;
+
+// Lock-free multi-producer / single-consumer ring buffer.
+// Producers claim space with a CAS on reserve_ptr, which also counts them in,
+// copy their data and count themselves out again. The last one out publishes
+// everything claimed so far through write_ptr, so no producer waits for
+// another: one preempted while copying only holds back when the data after
+// it shows, which matters on a single core. The consumer sleeps on an
+// eventfd which producers only signal when the consumer is actually waiting.
+// A producer that does not know its length yet, e.g. a socket read, can
+// instead lock the free space with begin_write(), fill it in place and
+// publish what it got with commit_write(). Other producers wait for that
+// one; they spin briefly, then sleep on a futex: under SCHED_FIFO (-r) the
+// reader may have a lower priority on the same core, and would never run
+// while they yield.
 template <typename T>
 class ring_buffer
 {
     private:
         T *buffer;
-        size_t buffer_size;
-        size_t write_ptr, read_ptr;
-        std::mutex mtx;
-        std::condition_variable cv;
-        bool is_empty_without_lock(void);
-        bool is_full_without_lock(void);
-        bool enqueue_signle_without_lock(const T *data);
-        bool dequeue_signle_without_lock(T *data);
+        size_t buffer_size; // always a power of two
+        size_t mask;
+        int event_fd;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> reserve_ptr;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> write_ptr;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> read_ptr;
+        alignas(CACHE_LINE_SIZE) std::atomic<bool> waiting;
+        alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> unlock_seq; // futex, bumped by commit_write() when a producer sleeps
+        std::atomic<int> unlock_waiters;
+        size_t write_lock_pos; // start of the space locked by begin_write()
+        void wait_unlocked(void);
+        void wake_unlocked(void);
+        bool release_claim(size_t delta);
+        void copy_in(size_t pos, const T *data, size_t length);
+        void copy_out(size_t pos, T *data, size_t length);
+        void clear_event(void);
     public:
         ring_buffer(const size_t size);
         ~ring_buffer();
         bool is_empty(void);
         size_t get_buffer_size(void);
         size_t get_count(void);
-        size_t enqueue(const T *data, size_t length);
+        int get_event_fd(void);
+        size_t get_read_position(void);
+        size_t enqueue(const T *data, size_t length, size_t *end_position = nullptr);
+        int begin_write(struct iovec *iov);
+        void commit_write(size_t length, size_t *end_position = nullptr);
         size_t dequeue(T *data, size_t max_length);
+        size_t discard(size_t max_length);
         bool wait(const std::chrono::steady_clock::time_point &timeout_at);
         void notify_one(void);
 };
@@ -31,116 +79,264 @@ class ring_buffer
 template <typename T>
 ring_buffer<T>::ring_buffer(const size_t size)
 {
-    buffer = new T[size];
-    buffer_size = size;
-    write_ptr = 0;
-    read_ptr = 0;
+    buffer_size = 1;
+    while (buffer_size < size) {buffer_size <<= 1;}
+    mask = buffer_size - 1;
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) {
+        throw std::runtime_error((std::string) "ring_buffer: eventfd(): " + std::strerror(errno));
+    }
+
+    buffer = new T[buffer_size];
+    reserve_ptr.store(0);
+    write_ptr.store(0);
+    read_ptr.store(0);
+    waiting.store(false);
+    unlock_seq.store(0);
+    unlock_waiters.store(0);
+    write_lock_pos = 0;
 }
 
 template <typename T>
 ring_buffer<T>::~ring_buffer()
 {
-    delete buffer;
+    close(event_fd);
+    delete[] buffer;
 }
 
 template <typename T>
-bool ring_buffer<T>::is_empty_without_lock(void)
+void ring_buffer<T>::copy_in(size_t pos, const T *data, size_t length)
 {
-    return write_ptr == read_ptr;
+    // Split the copy in two when it wraps around the end of the buffer
+    const auto offset = pos & mask;
+    const auto first = std::min(length, buffer_size - offset);
+    std::copy(data, data + first, buffer + offset);
+    std::copy(data + first, data + length, buffer);
 }
 
 template <typename T>
-bool ring_buffer<T>::is_full_without_lock(void)
+void ring_buffer<T>::copy_out(size_t pos, T *data, size_t length)
 {
-    const auto next_write_ptr = (write_ptr + 1) % buffer_size;
-    return next_write_ptr == read_ptr;
+    const auto offset = pos & mask;
+    const auto first = std::min(length, buffer_size - offset);
+    std::copy(buffer + offset, buffer + offset + first, data);
+    std::copy(buffer, buffer + (length - first), data + first);
 }
 
 template <typename T>
-bool ring_buffer<T>::is_empty(void)
+void ring_buffer<T>::clear_event(void)
+{
+    uint64_t value;
+    while (read(event_fd, &value, sizeof(value)) == sizeof(value)) {}
+}
+
+template <typename T>
+void ring_buffer<T>::wait_unlocked(void)
+{
+    const auto locked = [this]{return (reserve_ptr.load(std::memory_order_seq_cst) & RING_WRITE_LOCK) != 0;};
+    for (int round = 0; locked(); round++) {
+        if (round < RING_SPIN_ROUNDS) {
+            std::this_thread::yield();
+            continue;
+        }
+        unlock_waiters.fetch_add(1, std::memory_order_seq_cst);
+        const auto seq = unlock_seq.load(std::memory_order_seq_cst);
+        if (locked()) {syscall(SYS_futex, &unlock_seq, FUTEX_WAIT_PRIVATE, seq, nullptr, nullptr, 0);}
+        unlock_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+void ring_buffer<T>::wake_unlocked(void)
+{
+    // After the seq_cst update that drops the lock; a waiter either sees
+    // that or the bumped seq
+    if (unlock_waiters.load(std::memory_order_seq_cst) == 0) {return;}
+    unlock_seq.fetch_add(1, std::memory_order_seq_cst);
+    syscall(SYS_futex, &unlock_seq, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+template <typename T>
+bool ring_buffer<T>::release_claim(size_t delta)
 {
-    std::lock_guard<std::mutex> lock(mtx);
+    // Counts this producer out. With nobody else copying in or holding the
+    // lock, everything claimed so far is in place: publish it. A producer
+    // that got here earlier may publish an older end after us, so only move
+    // write_ptr forward.
+    const auto r = reserve_ptr.fetch_add(delta, std::memory_order_seq_cst) + delta;
+    if ((r & ~RING_POSITION_MASK) != 0) {return false;}
+    auto w = write_ptr.load(std::memory_order_relaxed);
+    while (w < r && !write_ptr.compare_exchange_weak(w, r, std::memory_order_seq_cst, std::memory_order_relaxed)) {}
+    return true;
+}
 
-    return is_empty_without_lock();
+template <typename T>
+bool ring_buffer<T>::is_empty(void)
+{
+    return write_ptr.load(std::memory_order_acquire) == read_ptr.load(std::memory_order_relaxed);
 }
 
 template <typename T>
 size_t ring_buffer<T>::get_buffer_size(void)
 {
-    return buffer_size - 1;
+    return buffer_size;
 }
 
 template <typename T>
 size_t ring_buffer<T>::get_count(void)
 {
-    std::lock_guard<std::mutex> lock(mtx);
-    return (write_ptr - read_ptr + buffer_size) % buffer_size;
+    const auto r = read_ptr.load(std::memory_order_acquire);
+    const auto w = write_ptr.load(std::memory_order_acquire);
+    return w - r;
 }
 
 template <typename T>
-bool ring_buffer<T>::enqueue_signle_without_lock(const T *data)
+int ring_buffer<T>::get_event_fd(void)
 {
-    if (is_full_without_lock()) {
-        return false;
-    }
-
-    buffer[write_ptr] = *data;
-    write_ptr = (write_ptr + 1) % buffer_size;
+    return event_fd;
+}
 
-    return true;
+template <typename T>
+size_t ring_buffer<T>::get_read_position(void)
+{
+    // Total number of elements dequeued so far
+    return read_ptr.load(std::memory_order_acquire);
 }
 
 template <typename T>
-size_t ring_buffer<T>::enqueue(const T *data, size_t length)
+size_t ring_buffer<T>::enqueue(const T *data, size_t length, size_t *end_position)
 {
-    std::lock_guard<std::mutex> lock(mtx);
+    // Claim space and count in
+    auto r = reserve_ptr.load(std::memory_order_relaxed);
+    size_t pos, claimed;
+    while (true) {
+        if (r & RING_WRITE_LOCK) {
+            // Space is locked by begin_write() for the length of one read
+            wait_unlocked();
+            r = reserve_ptr.load(std::memory_order_relaxed);
+            continue;
+        }
+        pos = r & RING_POSITION_MASK;
+        const auto used = pos - read_ptr.load(std::memory_order_acquire);
+        claimed = std::min(length, buffer_size - used);
+        if (claimed == 0) {return 0;}
+        if (reserve_ptr.compare_exchange_weak(r, r + claimed + RING_CLAIM_ONE, std::memory_order_relaxed)) {break;}
+    }
 
-    size_t ptr = 0;
-    while(ptr < length && enqueue_signle_without_lock(&data[ptr])) {ptr++;}
+    copy_in(pos, data, claimed);
 
-    return ptr;
+    const auto published = release_claim(-RING_CLAIM_ONE);
+    if (end_position != nullptr) {*end_position = pos + claimed;} // compare with get_read_position()
+
+    if (published && waiting.load(std::memory_order_seq_cst) && waiting.exchange(false)) {notify_one();}
+
+    return claimed;
 }
 
 template <typename T>
-bool ring_buffer<T>::dequeue_signle_without_lock(T *data)
+int ring_buffer<T>::begin_write(struct iovec *iov)
 {
-    if (is_empty_without_lock()) {
-        return false;
+    // Locks all free space, as up to two segments around the end of the
+    // buffer. Returns the number of segments, 0 (and no lock) when full.
+    // Other producers wait until commit_write(), which must follow.
+    auto r = reserve_ptr.load(std::memory_order_relaxed);
+    size_t pos, space;
+    while (true) {
+        if (r & RING_WRITE_LOCK) {
+            wait_unlocked();
+            r = reserve_ptr.load(std::memory_order_relaxed);
+            continue;
+        }
+        pos = r & RING_POSITION_MASK;
+        space = buffer_size - (pos - read_ptr.load(std::memory_order_acquire));
+        if (space == 0) {return 0;}
+        if (reserve_ptr.compare_exchange_weak(r, r + RING_WRITE_LOCK + RING_CLAIM_ONE, std::memory_order_acquire)) {break;}
     }
+    write_lock_pos = pos;
 
-    *data = buffer[read_ptr];
-    read_ptr = (read_ptr + 1) % buffer_size;
+    const auto offset = pos & mask;
+    const auto first = std::min(space, buffer_size - offset);
+    iov[0].iov_base = buffer + offset;
+    iov[0].iov_len = first * sizeof(T);
+    if (first == space) {return 1;}
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = (space - first) * sizeof(T);
+    return 2;
+}
 
-    return true;
+template <typename T>
+void ring_buffer<T>::commit_write(size_t length, size_t *end_position)
+{
+    const auto pos = write_lock_pos;
+
+    // Like the end of enqueue(), claiming what was read and dropping the lock
+    // in the same step; nobody else claimed anything meanwhile
+    const auto published = release_claim(length - RING_CLAIM_ONE - RING_WRITE_LOCK);
+    wake_unlocked();
+    if (end_position != nullptr) {*end_position = pos + length;}
+
+    if (published && length > 0 && waiting.load(std::memory_order_seq_cst) && waiting.exchange(false)) {notify_one();}
 }
 
 template <typename T>
 size_t ring_buffer<T>::dequeue(T *data, size_t max_length)
 {
-    std::lock_guard<std::mutex> lock(mtx);
+    const auto r = read_ptr.load(std::memory_order_relaxed);
+    const auto w = write_ptr.load(std::memory_order_acquire);
+    const auto length = std::min(max_length, w - r);
+
+    copy_out(r, data, length);
+    read_ptr.store(r + length, std::memory_order_release);
 
-    size_t ptr = 0;
-    while(ptr < max_length && dequeue_signle_without_lock(&data[ptr])) {ptr++;}
+    return length;
+}
+
+template <typename T>
+size_t ring_buffer<T>::discard(size_t max_length)
+{
+    // Like dequeue() without the copy
+    const auto r = read_ptr.load(std::memory_order_relaxed);
+    const auto w = write_ptr.load(std::memory_order_acquire);
+    const auto length = std::min(max_length, w - r);
+    read_ptr.store(r + length, std::memory_order_release);
 
-    return ptr;
+    return length;
 }
 
 template <typename T>
 bool ring_buffer<T>::wait(const std::chrono::steady_clock::time_point &timeout_at)
 {
-    std::unique_lock<std::mutex> lock(mtx);
+    if (!is_empty()) {
+        return true;
+    }
+
+    waiting.store(true, std::memory_order_seq_cst);
+    if (write_ptr.load(std::memory_order_seq_cst) != read_ptr.load(std::memory_order_relaxed)) {
+        waiting.store(false, std::memory_order_relaxed);
+        return true;
+    }
 
-    if (!is_empty_without_lock()) {
-        return false;
+    const auto now = std::chrono::steady_clock::now();
+    if (timeout_at > now) {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout_at - now).count();
+        struct timespec ts = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+        struct pollfd pfd = {.fd = event_fd, .events = POLLIN, .revents = 0};
+        ppoll(&pfd, 1, &ts, nullptr);
     }
+    waiting.store(false, std::memory_order_relaxed);
+    clear_event();
 
-    return cv.wait_until(lock, timeout_at, [&]{return !is_empty_without_lock();});
+    return !is_empty();
 }
 
 template <typename T>
 void ring_buffer<T>::notify_one(void)
 {
-    cv.notify_one();
+    const uint64_t value = 1;
+    if (write(event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        printf("ring_buffer: write(): %s\n", std::strerror(errno));
+    }
 
     return;
-}
\ No newline at end of file
+}
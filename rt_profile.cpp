@@ -0,0 +1,55 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rt_profile.h"
+
+static void __attribute__((noinline)) prefault_stack(void)
+{
+    // One write per page is enough to map it; mlockall() keeps it mapped
+    volatile char stack[RT_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {stack[i] = 0;}
+}
+
+bool rt_lock_memory(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        printf("rt: mlockall(): %s\n", std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool rt_set_affinity(const char *name, int cpu)
+{
+    if (cpu < 0) {return true;}
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    const auto ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (ret != 0) {
+        printf("rt: %s: pthread_setaffinity_np(): %s\n", name, std::strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+bool rt_enter_thread(const char *name, int priority)
+{
+    if (priority <= 0) {return true;}
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    const auto ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    prefault_stack();
+    if (ret != 0) {
+        printf("rt: %s: SCHED_FIFO priority %d: %s\n", name, priority, std::strerror(ret));
+        return false;
+    }
+    return true;
+}
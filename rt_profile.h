@@ -0,0 +1,20 @@
+#include <cstddef>
+
+constexpr size_t RT_STACK_PREFAULT = 256 * 1024; // stack touched by rt_enter_thread()
+
+// Real-time execution profile (-r). The USB threads run SCHED_FIFO above
+// everything else on the board, the socket event loop one priority below,
+// memory is locked and thread stacks are touched up front, so neither other
+// work nor a page fault holds up a USB poll response.
+struct rt_profile {
+    int priority; // SCHED_FIFO priority of the USB threads, 0 for normal scheduling
+    int loop_cpu; // CPU core for the event loop thread, -1 for no pinning
+};
+
+// mlockall() of current and future mappings. False (and a message) if not permitted.
+bool rt_lock_memory(void);
+// Pins the calling thread to cpu (-1: leave it). False (and a message) on failure.
+bool rt_set_affinity(const char *name, int cpu);
+// Switches the calling thread to SCHED_FIFO at priority and pre-faults its
+// stack. Does nothing for priority 0. False (and a message) if not permitted.
+bool rt_enter_thread(const char *name, int priority);
@@ -1,120 +1,1163 @@
+#include <algorithm>
 #include <cstring>
+#include <future>
+#include <random>
 #include <stdexcept>
+#include <endian.h>
 #include <sys/socket.h>
-#include <arpa/inet.h> 
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <thread>
 
+#include "event_loop.h"
+#include "relay_protocol.h"
+#include "transport.h"
 #include "tcp_sock.h"
+#include "resolver.h"
+#include "replay_window.h"
+#include "uring.h"
+#include "async_log.h"
 
-void* tcp_sock::recv_thread(void)
+constexpr auto RELAY_RETRY_INTERVAL = std::chrono::milliseconds(5000);
+constexpr unsigned IO_RING_ENTRIES = 16;
+constexpr uint16_t IO_BUF_GROUP = 0;
+constexpr unsigned IO_BUF_COUNT = 16; // power of two
+constexpr size_t IO_BUF_SIZE = 4096;
+constexpr int IO_FILE_SLOT = 0; // the connection in the registered file table
+constexpr size_t SEND_QUEUE_MAX = 65536; // queued behind a busy socket before send() blocks its caller
+// What can be in flight when a connection drops: both socket buffers and the
+// send queue must fit in the replay window
+constexpr size_t RESUME_WINDOW_SIZE = 256 * 1024;
+constexpr int RESUME_SOCKET_BUFFER = 32 * 1024; // doubled by the kernel
+constexpr char RESUME_MAGIC[4] = {'M', '5', '6', 'R'};
+constexpr auto RESUME_HELLO_TIMEOUT = std::chrono::seconds(5); // for a caller to say who it is
+constexpr auto RESUME_RETRY_INTERVAL = std::chrono::milliseconds(250);
+constexpr unsigned RESUME_USER_TIMEOUT_MS = 3000; // unacknowledged data: the link is gone
+constexpr int RESUME_KEEPALIVE_SEC = 1; // idle time and probe interval, 3 probes
+
+enum io_op : uint8_t {
+    IO_OP_RECV = 1,
+    IO_OP_SEND,
+    IO_OP_CANCEL,
+};
+
+static void put_hello(char *hello, uint64_t session_id, uint64_t offset)
 {
-    fd_set readfds;
-    timeval recv_timeout = {.tv_sec = 0, .tv_usec = 100 * 1000}; // 100ms
-    auto comm_fd = tcp_sock::comm_fd.load();
-    char buf[64];
+    const uint64_t id_be = htobe64(session_id);
+    const uint64_t offset_be = htobe64(offset);
+    memcpy(hello, RESUME_MAGIC, sizeof(RESUME_MAGIC));
+    memcpy(hello + 4, &id_be, sizeof(id_be));
+    memcpy(hello + 12, &offset_be, sizeof(offset_be));
+}
+
+static bool get_hello(const char *hello, uint64_t *session_id, uint64_t *offset)
+{
+    if (memcmp(hello, RESUME_MAGIC, sizeof(RESUME_MAGIC)) != 0) {return false;}
+    uint64_t id_be, offset_be;
+    memcpy(&id_be, hello + 4, sizeof(id_be));
+    memcpy(&offset_be, hello + 12, sizeof(offset_be));
+    *session_id = be64toh(id_be);
+    *offset = be64toh(offset_be);
+    return true;
+}
+
+static void send_hello(int fd, uint64_t session_id, uint64_t offset)
+{
+    // Into an empty socket buffer; a failure shows up as the connection closing
+    char hello[RESUME_HELLO_SIZE];
+    put_hello(hello, session_id, offset);
+    if (::send(fd, hello, sizeof(hello), MSG_NOSIGNAL) < 0) {printf("tcp_sock: resume: send(): %s\n", std::strerror(errno));}
+}
+
+static bool is_reset(int fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (fd == 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {return false;}
+    return info.tcpi_state == TCP_CLOSE;
+}
+
+static uint64_t new_session_id(void)
+{
+    static std::mt19937_64 rng(std::random_device{}());
+    uint64_t id;
+    do {id = rng();} while (id == 0);
+    return id;
+}
+
+void tcp_sock::on_listen_event(uint32_t events)
+{
+    (void) events;
 
-    if (debug_level >= 1) {printf("tcp_sock: start recv_thread.\n");}
     while (true) {
-        FD_ZERO(&readfds);
-        FD_SET(comm_fd, &readfds);
-        auto ret = select(comm_fd + 1, &readfds, nullptr, nullptr, &recv_timeout);
-        if (ret < 0) {
-            printf("tcp_sock: select(): %s\n", std::strerror(errno));
-            break;
+        struct sockaddr_in client_addr;
+        socklen_t len = sizeof(client_addr);
+        auto client_fd = accept4(server_fd, reinterpret_cast<struct sockaddr *>(&client_addr), &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("tcp_sock: accept(): %s\n", std::strerror(errno));
+            }
+            return;
         }
-        if (ret == 0) {
-            if (!is_connected()) {
-                // Connection closed
+
+        if (debug_level >= 1) {printf("tcp_sock: client connected.\n");}
+
+        if (resume_grace.count() > 0) {
+            // First learn whether it is a new call or ours coming back
+            start_handshake(client_fd, false);
+        } else {
+            take_caller(client_fd);
+        }
+    }
+}
+
+void tcp_sock::take_caller(int client_fd)
+{
+    if (comm_fd.load() == 0 && !suspended.load() && accept_queue.empty()) {
+        ring_wait = std::chrono::steady_clock::duration::zero();
+        answer(client_fd);
+    } else if (accept_queue.size() < accept_queue_max) {
+        // Hold the caller until the line frees; only its hang-up is of interest
+        auto caller = new tcp_waiting_caller{client_fd, std::chrono::steady_clock::now(), nullptr};
+        caller->handler = [this, caller](uint32_t events) {on_waiting_event(caller, events);};
+        accept_queue.push_back(caller);
+        callers_waiting.store(accept_queue.size());
+        loop->add(client_fd, EPOLLRDHUP, &caller->handler);
+        if (accept_queue.size() == 1) {arm_timer();}
+        if (debug_level >= 1) {printf("tcp_sock: line busy, caller %zu waiting.\n", accept_queue.size());}
+    } else {
+        callers_turned_away++;
+        ::close(client_fd);
+    }
+}
+
+void tcp_sock::answer(int fd)
+{
+    if (resume_grace.count() > 0) {
+        // A new call; the caller learns its id
+        session_id = new_session_id();
+        rx_offset = 0;
+        {
+            std::lock_guard<std::mutex> lock(resume_mtx);
+            sent->reset();
+            send_backlog.clear();
+        }
+        send_hello(fd, session_id, 0);
+    }
+    attach(fd);
+    ring_callback();
+}
+
+void tcp_sock::on_waiting_event(tcp_waiting_caller *caller, uint32_t events)
+{
+    (void) events;
+
+    if (debug_level >= 1) {printf("tcp_sock: waiting caller hung up.\n");}
+    drop_waiting(caller);
+}
+
+void tcp_sock::drop_waiting(tcp_waiting_caller *caller)
+{
+    const auto it = std::find(accept_queue.begin(), accept_queue.end(), caller);
+    if (it == accept_queue.end()) {return;}
+    const auto was_front = it == accept_queue.begin();
+    accept_queue.erase(it);
+    callers_waiting.store(accept_queue.size());
+    loop->remove(caller->fd);
+    ::close(caller->fd);
+    // Its handler may be the one running
+    loop->post([caller]{delete caller;});
+    if (was_front) {arm_timer();}
+}
+
+void tcp_sock::ring_next(void)
+{
+    if (accept_queue.empty() || comm_fd.load() != 0 || suspended.load()) {return;}
+    auto caller = accept_queue.front();
+    accept_queue.pop_front();
+    callers_waiting.store(accept_queue.size());
+    loop->remove(caller->fd);
+    ring_wait = std::chrono::steady_clock::now() - caller->queued_at;
+    const auto fd = caller->fd;
+    loop->post([caller]{delete caller;});
+    arm_timer();
+
+    if (debug_level >= 1) {printf("tcp_sock: next caller, waited %.1f ms.\n", std::chrono::duration<double, std::milli>(ring_wait).count());}
+    answer(fd);
+}
+
+void tcp_sock::on_comm_event(uint32_t events)
+{
+    const auto comm_fd = tcp_sock::comm_fd.load();
+    if (comm_fd == 0) {
+        // Stale event for a socket closed earlier in this epoll batch
+        return;
+    }
+
+    bool closed = false;
+    bool dropped = false; // rather than closed by the peer
+    if (events & EPOLLIN) {
+        // Edge-triggered: drain the socket. A short read means it is empty.
+        while (true) {
+            // Read into the sink's free space, as much as it has, when it has any
+            struct iovec iov[2];
+            const auto segments = sink_acquire ? sink_acquire(iov) : 0;
+            ssize_t len;
+            size_t space;
+            if (segments > 0) {
+                len = ::readv(comm_fd, iov, segments);
+                space = iov[0].iov_len + (segments == 2 ? iov[1].iov_len : 0);
+            } else {
+                len = ::recv(comm_fd, recv_buf, sizeof(recv_buf), 0);
+                space = sizeof(recv_buf);
+            }
+            recv_calls++;
+            if (len <= 0 && segments > 0) {sink_commit(0);}
+            if (len < 0) {
+                if (errno == EINTR) {continue;}
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    printf("tcp_sock: recv(): %s\n", std::strerror(errno));
+                    closed = dropped = true;
+                }
                 break;
             }
-            // No data
+            if (len == 0) {
+                closed = true;
+                break;
+            }
+            recv_at = std::chrono::steady_clock::now();
+            recv_bytes += len;
+            rx_offset += len;
+            if (debug_level >= 2) {log_write(LOG_TCP_RECV, len);}
+            if (segments > 0) {
+                sink_commit(len);
+            } else {
+                recv_callback(recv_buf, len);
+            }
+            if (static_cast<size_t>(len) < space) {break;}
+            if (recv_paused_wanted.load()) {
+                // Leave the rest in the socket; resuming re-arms EPOLLIN
+                apply_recv_paused();
+                break;
+            }
+        }
+    }
+    if ((events & EPOLLOUT) && backlog_armed) {flush_backlog();}
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        closed = true;
+    }
+    if (events & EPOLLERR) {dropped = true;}
+
+    if (closed) {lose_comm(dropped);}
+}
+
+void tcp_sock::arm_backlog(void)
+{
+    const auto comm_fd = tcp_sock::comm_fd.load();
+    if (backlog_armed || comm_fd == 0 || io != nullptr) {return;}
+    backlog_armed = true;
+    loop->modify(comm_fd, comm_events(), &comm_handler);
+}
+
+void tcp_sock::flush_backlog(void)
+{
+    // As much as the socket takes now; the rest on the next EPOLLOUT
+    std::lock_guard<std::mutex> lock(resume_mtx);
+    const auto comm_fd = tcp_sock::comm_fd.load();
+    send_backlog.erase(0, send_some(comm_fd, send_backlog.data(), send_backlog.length()));
+    backlog_cv.notify_all();
+    if (!send_backlog.empty()) {return;}
+    backlog_armed = false;
+    loop->modify(comm_fd, comm_events(), &comm_handler);
+}
+
+void tcp_sock::attach(int fd)
+{
+    send_failed.store(false);
+    const int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    recv_paused = recv_paused_wanted.load();
+    if (io != nullptr) {
+        // Blocking, so the kernel waits for room instead of failing a SEND with EAGAIN
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        io->update_file(IO_FILE_SLOT, fd);
+        {
+            std::lock_guard<std::mutex> lock(send_mtx);
+            io_generation++;
+            comm_fd.store(fd);
+        }
+        io_recv_armed = false;
+        if (!recv_paused) {io_arm_recv();}
+        return;
+    }
+
+    comm_fd.store(fd);
+    loop->add(fd, comm_events(), &comm_handler);
+}
+
+uint32_t tcp_sock::comm_events(void)
+{
+    return (recv_paused ? 0u : (uint32_t) EPOLLIN) | (backlog_armed ? (uint32_t) EPOLLOUT : 0u) | EPOLLRDHUP | EPOLLET;
+}
+
+void tcp_sock::apply_recv_paused(void)
+{
+    const auto paused = recv_paused_wanted.load();
+    if (paused == recv_paused) {return;}
+    recv_paused = paused;
+    if (debug_level >= 2) {printf("tcp_sock: receive %s.\n", paused ? "paused" : "resumed");}
+
+    const auto comm_fd = tcp_sock::comm_fd.load();
+    if (comm_fd == 0) {return;}
+    if (io != nullptr) {
+        // A cancelled recv completes with ECANCELED; resuming before that re-arms there
+        if (paused && io_recv_armed) {io_cancel_recv();}
+        if (!paused && !io_recv_armed) {io_arm_recv();}
+        return;
+    }
+    // EPOLL_CTL_MOD reports data that is already waiting, edge-triggered or not
+    loop->modify(comm_fd, comm_events(), &comm_handler);
+}
+
+bool tcp_sock::detach(void)
+{
+    auto comm_fd = tcp_sock::comm_fd.load();
+    if (comm_fd == 0) {return false;}
+
+    closed_retransmits += get_retransmits(comm_fd);
+    if (io != nullptr) {
+        // Ends the multishot recv and a SEND in flight; their completions are stale now
+        shutdown(comm_fd, SHUT_RDWR);
+        io->update_file(IO_FILE_SLOT, -1);
+        ::close(comm_fd);
+        std::lock_guard<std::mutex> lock(send_mtx);
+        io_generation++;
+        io_recv_armed = false;
+        send_queue.clear();
+        tcp_sock::comm_fd.store(0);
+        send_cv.notify_all();
+    } else {
+        // Not while send() writes to it; the backlog is in the replay window
+        std::lock_guard<std::mutex> lock(resume_mtx);
+        loop->remove(comm_fd);
+        ::close(comm_fd);
+        tcp_sock::comm_fd.store(0);
+        send_backlog.clear();
+        backlog_armed = false;
+        backlog_cv.notify_all();
+    }
+    return true;
+}
+
+void tcp_sock::lose_comm(bool dropped)
+{
+    // A send that failed took the socket error, and recv() then reports a
+    // plain end of stream. With io_uring the failed SEND may not even have
+    // completed yet, but the reset left the socket closed, where a FIN only
+    // leaves it in CLOSE_WAIT. Rarely that was a peer that hung up and got
+    // data after its FIN; resuming then fails or times out instead.
+    if (send_failed.exchange(false) || is_reset(comm_fd.load())) {dropped = true;}
+    if (dropped && session_id != 0) {
+        // Not hung up: keep the call and wait for the connection to come back
+        suspend();
+        return;
+    }
+    printf("tcp_sock: connection closed.\n");
+    close_comm(true);
+}
+
+void tcp_sock::close_comm(bool notify)
+{
+    const auto was_suspended = suspended.exchange(false);
+    if (!detach() && !was_suspended) {return;}
+    end_session();
+
+    if (notify && disconnect_callback) {disconnect_callback();}
+
+    // The line is free again, take calls for our number
+    if (use_relay) {relay_register_later(std::chrono::milliseconds(0));}
+    ring_next();
+}
+
+uint64_t tcp_sock::io_tag(uint8_t op)
+{
+    return (static_cast<uint64_t>(io_generation.load()) << 8) | op;
+}
+
+void tcp_sock::on_io_event(uint32_t events)
+{
+    (void) events;
+
+    bool closed = false;
+    bool dropped = false;
+    struct io_uring_cqe *cqe;
+    while (!closed && (cqe = io->peek_cqe()) != nullptr) {
+        const auto op = static_cast<uint8_t>(cqe->user_data & 0xff);
+        const auto generation = static_cast<uint32_t>(cqe->user_data >> 8);
+        const auto res = cqe->res;
+        const auto flags = cqe->flags;
+        io->cqe_seen();
+
+        if (op == IO_OP_SEND) {
+            on_io_send(generation, res);
             continue;
         }
+        if (op != IO_OP_RECV) {continue;}
 
-        auto len = ::recv(comm_fd, buf, sizeof(buf), 0);
-        if (len < 0) {
-            printf("tcp_sock: recv(): %s\n", std::strerror(errno));
-            break;
+        const auto buf_id = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+        if (generation != io_generation.load()) {
+            // Data of a connection already closed
+            if (flags & IORING_CQE_F_BUFFER) {io->recycle_buffer(buf_id);}
+            continue;
         }
-        if (len == 0) {
-            printf("tcp_sock: connection closed.\n");
-            break;
+        if (!(flags & IORING_CQE_F_MORE)) {io_recv_armed = false;}
+
+        if (res > 0) {
+            recv_at = std::chrono::steady_clock::now();
+            recv_bytes += res;
+            rx_offset += res;
+            if (debug_level >= 2) {log_write(LOG_TCP_RECV, res);}
+            recv_callback(io->get_buffer(buf_id), res);
+            io->recycle_buffer(buf_id);
+        } else if (res == 0) {
+            closed = true;
+        } else if (res != -ENOBUFS && res != -ECANCELED) {
+            printf("tcp_sock: recv(): %s\n", std::strerror(-res));
+            closed = dropped = true;
+        } else if (flags & IORING_CQE_F_BUFFER) {
+            io->recycle_buffer(buf_id);
         }
-        if (debug_level >= 2) {printf("tcp_sock: received %ld bytes.\n", len);}
-        (*recv_callback)(buf, len);
+
+        // The kernel ends a multishot recv when it runs out of buffers
+        if (!closed && !io_recv_armed && !recv_paused && comm_fd.load() != 0) {io_arm_recv();}
     }
 
-    return nullptr;
+    if (closed) {lose_comm(dropped);}
 }
 
-void* tcp_sock::listen_thread(void)
+void tcp_sock::on_io_send(uint32_t generation, int res)
 {
-    if (debug_level >= 1) {printf("tcp_sock: start listen_thread.\n");}
-    while (true) {
-        struct sockaddr_in client_addr;
-        socklen_t len = sizeof(client_addr);
-        auto client_fd = accept(server_fd, reinterpret_cast<struct sockaddr *>(&client_addr), &len);
+    std::lock_guard<std::mutex> lock(send_mtx);
+    if (generation == io_generation.load()) {
+        if (res < 0) {
+            printf("tcp_sock: send(): %s\n", std::strerror(-res));
+            if (res != -EPIPE) {send_failed.store(true);}
+            send_queue.clear();
+        } else {
+            send_bytes += res;
+            if (static_cast<size_t>(res) < send_inflight.length()) {
+                // Interrupted before MSG_WAITALL was satisfied
+                send_inflight.erase(0, res);
+                io_submit_send();
+                return;
+            }
+        }
+    }
+    send_inflight.clear();
+    send_busy = false;
+    if (!send_queue.empty() && comm_fd.load() != 0) {io_start_send();}
+    send_cv.notify_all();
+}
 
-        if (debug_level >= 1) {printf("tcp_sock: client connected.\n");}
+void tcp_sock::io_arm_recv(void)
+{
+    // One multishot recv delivers every segment into a buffer the kernel
+    // picks from the ring, until it runs out of buffers or is cancelled
+    std::lock_guard<std::mutex> lock(io->get_sq_lock());
+    auto sqe = io->get_sqe();
+    if (sqe == nullptr) {return;}
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = IO_FILE_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = IO_BUF_GROUP;
+    sqe->user_data = io_tag(IO_OP_RECV);
+    io->submit();
+    recv_calls++;
+    io_recv_armed = true;
+}
 
-        if (client_fd < 0) {
-            throw std::runtime_error((std::string) "accept(): " + std::strerror(errno));
+void tcp_sock::io_cancel_recv(void)
+{
+    std::lock_guard<std::mutex> lock(io->get_sq_lock());
+    auto sqe = io->get_sqe();
+    if (sqe == nullptr) {return;}
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = io_tag(IO_OP_RECV);
+    sqe->user_data = io_tag(IO_OP_CANCEL);
+    io->submit();
+    recv_calls++;
+}
+
+void tcp_sock::io_start_send(void)
+{
+    // send_mtx held. Everything queued so far goes out as one SEND.
+    send_inflight.swap(send_queue);
+    send_busy = true;
+    io_submit_send();
+}
+
+void tcp_sock::io_submit_send(void)
+{
+    std::lock_guard<std::mutex> lock(io->get_sq_lock());
+    auto sqe = io->get_sqe();
+    if (sqe == nullptr) {return;}
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = IO_FILE_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = reinterpret_cast<uint64_t>(send_inflight.data());
+    sqe->len = send_inflight.length();
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = io_tag(IO_OP_SEND);
+    io->submit();
+    send_calls++;
+}
+
+void tcp_sock::relay_open(bool dial)
+{
+    auto fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error((std::string) "tcp_sock: socket(): " + std::strerror(errno));
+    }
+
+    relay_fd = fd;
+    relay_dialing = dial;
+    relay_hello = (dial ? RELAY_HELLO_DIAL + dial_number : RELAY_HELLO_ANSWER + relay_number) + "\r\n";
+    relay_line.clear();
+
+    auto ret = ::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    if (ret < 0 && errno != EINPROGRESS) {
+        printf("tcp_sock: relay: connect(): %s\n", std::strerror(errno));
+        loop->add(fd, 0, &relay_handler);
+        relay_finish(false, nullptr, 0);
+        return;
+    }
+    loop->add(fd, EPOLLOUT | EPOLLRDHUP, &relay_handler);
+}
+
+void tcp_sock::on_relay_event(uint32_t events)
+{
+    if (relay_fd == 0) {return;}
+
+    if (!relay_hello.empty()) {
+        // Connected (or failed); send the handshake line
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(relay_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || ::send(relay_fd, relay_hello.c_str(), relay_hello.length(), MSG_NOSIGNAL) < 0) {
+            if (debug_level >= 1) {printf("tcp_sock: relay: %s\n", std::strerror(err != 0 ? err : errno));}
+            relay_finish(false, nullptr, 0);
+            return;
         }
+        relay_hello.clear();
+        loop->modify(relay_fd, EPOLLIN | EPOLLRDHUP, &relay_handler);
+        return;
+    }
 
-        if (comm_fd.load() == 0) {
-            comm_fd.store(client_fd);
-            (*ring_callback)();
-            recv_thread_ptr = new std::thread([&]{tcp_sock::recv_thread();});
-        } else {
-            ::close(client_fd);
+    if (events & EPOLLIN) {
+        auto len = ::recv(relay_fd, recv_buf, sizeof(recv_buf), 0);
+        if (len <= 0) {
+            relay_finish(false, nullptr, 0);
+            return;
+        }
+        relay_line.append(recv_buf, len);
+        const auto newline_pos = relay_line.find('\n');
+        if (newline_pos == std::string::npos) {
+            if (relay_line.length() > RELAY_LINE_MAX) {relay_finish(false, nullptr, 0);}
+            return;
+        }
+        // Anything after the reply line is already modem data
+        const auto rest = relay_line.substr(newline_pos + 1);
+        const auto paired = relay_line.compare(0, strlen(RELAY_REPLY_CONNECT), RELAY_REPLY_CONNECT) == 0;
+        relay_finish(paired, rest.c_str(), rest.length());
+        return;
+    }
+
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        relay_finish(false, nullptr, 0);
+    }
+}
+
+void tcp_sock::relay_finish(bool paired, const char *rest, size_t rest_length)
+{
+    const auto fd = relay_fd;
+    const auto dialing = relay_dialing;
+    relay_fd = 0;
+    loop->remove(fd);
+
+    if (paired) {
+        if (debug_level >= 1) {printf("tcp_sock: relay: paired.\n");}
+        attach(fd);
+        if (!dialing) {ring_callback();}
+        if (rest_length > 0) {
+            recv_at = std::chrono::steady_clock::now();
+            recv_callback(rest, rest_length);
+        }
+    } else {
+        ::close(fd);
+    }
+
+    if (dialing) {
+        if (!paired) {relay_register_later(std::chrono::milliseconds(0));}
+        finish_dial(paired ? DIAL_CONNECTED : DIAL_BUSY);
+    } else if (!paired) {
+        relay_register_later(RELAY_RETRY_INTERVAL);
+    }
+}
+
+void tcp_sock::relay_register_later(std::chrono::milliseconds delay)
+{
+    if (relay_number.empty()) {return;}
+
+    std::weak_ptr<bool> weak = alive;
+    loop->call_later(delay, [this, weak]{
+        if (weak.expired()) {return;}
+        if (relay_fd != 0 || comm_fd.load() != 0) {return;}
+        if (debug_level >= 1) {printf("tcp_sock: relay: register number %s.\n", relay_number.c_str());}
+        relay_open(false);
+    });
+}
+
+void tcp_sock::dial_start(const std::vector<struct sockaddr_storage> &addrs)
+{
+    dial_addrs = addrs;
+    dial_next = 0;
+    dial_try_next();
+}
+
+void tcp_sock::dial_try_next(void)
+{
+    while (dial_next < dial_addrs.size()) {
+        const auto &target = dial_addrs[dial_next++];
+        auto fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            // e.g. an IPv6 address on a host without IPv6
+            printf("tcp_sock: socket(): %s\n", std::strerror(errno));
+            continue;
+        }
+        const socklen_t len = target.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        auto ret = ::connect(fd, reinterpret_cast<const struct sockaddr *>(&target), len);
+        if (ret < 0 && errno != EINPROGRESS) {
+            printf("tcp_sock: connect(): %s\n", std::strerror(errno));
+            if (errno == ECONNREFUSED) {dial_refused = true;}
+            ::close(fd);
+            continue;
         }
+
+        // Completion (or failure) is reported by the loop as writability
+        dial_attempts.push_back({fd, nullptr});
+        auto attempt = &dial_attempts.back();
+        attempt->handler = [this, attempt](uint32_t events) {on_dial_event(attempt, events);};
+        loop->add(fd, EPOLLOUT, &attempt->handler);
+        dial_pending++;
+        dial_next_at = std::chrono::steady_clock::now() + DIAL_ATTEMPT_DELAY;
+        arm_timer();
+        return;
     }
 
-    return nullptr;
+    dial_next_at = std::chrono::steady_clock::time_point::max();
+    if (dial_pending == 0) {
+        finish_dial(dial_refused ? DIAL_BUSY : DIAL_NO_CARRIER);
+        return;
+    }
+    arm_timer();
 }
 
-tcp_sock::tcp_sock(bool is_server,  const char *ip_addr, uint16_t port)
+void tcp_sock::on_dial_event(tcp_dial_attempt *attempt, uint32_t events)
+{
+    (void) events;
+    const auto fd = attempt->fd;
+    if (fd == 0) {return;} // lost the race earlier in this epoll batch
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    loop->remove(fd);
+    attempt->fd = 0;
+    dial_pending--;
+    if (err == 0 && resume_grace.count() > 0) {
+        // Connected, but the call is set up (or resumed) by the handshake
+        dial_cancel_attempts();
+        dial_next_at = std::chrono::steady_clock::time_point::max();
+        start_handshake(fd, true);
+        return;
+    }
+    if (err == 0) {
+        attach(fd);
+        finish_dial(DIAL_CONNECTED);
+        return;
+    }
+
+    printf("tcp_sock: connect(): %s\n", std::strerror(err));
+    if (err == ECONNREFUSED) {dial_refused = true;}
+    ::close(fd);
+    // The next address need not wait for the delay
+    dial_try_next();
+}
+
+void tcp_sock::start_handshake(int fd, bool dialed)
+{
+    // Buffers small enough for the replay window to cover them, and a dead
+    // link noticed within seconds rather than the minutes TCP would retry
+    const int buffer_size = RESUME_SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    const unsigned user_timeout = RESUME_USER_TIMEOUT_MS;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    const int keepalive = 1, keepalive_sec = RESUME_KEEPALIVE_SEC, keepalive_count = 3;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_sec, sizeof(keepalive_sec));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive_sec, sizeof(keepalive_sec));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive_count, sizeof(keepalive_count));
+
+    auto handshake = new tcp_handshake{fd, dialed, std::chrono::steady_clock::now(), {}, 0, nullptr};
+    handshake->handler = [this, handshake](uint32_t events) {on_handshake_event(handshake, events);};
+    handshakes.push_back(handshake);
+    loop->add(fd, EPOLLIN | EPOLLRDHUP, &handshake->handler);
+    // The caller speaks first: the call it is in, 0 for a new one
+    if (dialed) {send_hello(fd, session_id, rx_offset);}
+    arm_timer();
+}
+
+void tcp_sock::on_handshake_event(tcp_handshake *handshake, uint32_t events)
+{
+    (void) events;
+    if (handshake->fd == 0) {return;} // taken earlier in this epoll batch
+
+    // No further than the hello: what follows is call data
+    const auto len = ::recv(handshake->fd, handshake->hello + handshake->got, RESUME_HELLO_SIZE - handshake->got, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {return;}
+    if (len <= 0) {
+        // A server that is busy or does not know our call hangs up
+        const auto dialed = handshake->dialed;
+        ::close(release_handshake(handshake));
+        if (dialed) {finish_dial(DIAL_BUSY);}
+        return;
+    }
+    handshake->got += len;
+    if (handshake->got == RESUME_HELLO_SIZE) {finish_handshake(handshake);}
+}
+
+int tcp_sock::release_handshake(tcp_handshake *handshake)
+{
+    const auto fd = handshake->fd;
+    handshakes.remove(handshake);
+    loop->remove(fd);
+    handshake->fd = 0;
+    // Its handler may be the one running
+    loop->post([handshake]{delete handshake;});
+    return fd;
+}
+
+void tcp_sock::finish_handshake(tcp_handshake *handshake)
+{
+    uint64_t id, offset;
+    const auto valid = get_hello(handshake->hello, &id, &offset);
+    const auto dialed = handshake->dialed;
+    const auto fd = release_handshake(handshake);
+    if (!valid) {
+        printf("tcp_sock: resume: the other side does not resume calls.\n");
+        ::close(fd);
+        if (dialed) {finish_dial(DIAL_BUSY);}
+        return;
+    }
+
+    if (dialed) {
+        if (session_id == 0) {
+            if (id == 0) {
+                ::close(fd);
+                finish_dial(DIAL_BUSY);
+                return;
+            }
+            // Answered: a new call
+            session_id = id;
+            rx_offset = 0;
+            {
+                std::lock_guard<std::mutex> lock(resume_mtx);
+                sent->reset();
+                send_backlog.clear();
+            }
+            attach(fd);
+            finish_dial(DIAL_CONNECTED);
+            return;
+        }
+        if (id != session_id || !resume_on(fd, offset)) {
+            printf("tcp_sock: resume: the call could not be resumed.\n");
+            ::close(fd);
+            if (suspended.load()) {
+                resume_failures++;
+                close_comm(true);
+            }
+            finish_dial(DIAL_BUSY);
+            return;
+        }
+        finish_dial(DIAL_CONNECTED);
+        return;
+    }
+
+    if (id == 0) {
+        take_caller(fd);
+        return;
+    }
+    if (id != session_id) {
+        // A call that ended meanwhile
+        send_hello(fd, 0, 0);
+        ::close(fd);
+        return;
+    }
+    // Our call back on a new connection; the old one may not have noticed yet
+    detach();
+    send_hello(fd, session_id, rx_offset);
+    if (!resume_on(fd, offset)) {
+        printf("tcp_sock: resume: the call could not be resumed.\n");
+        ::close(fd);
+        resume_failures++;
+        suspended.store(true); // so that close_comm() ends the call
+        close_comm(true);
+    }
+}
+
+bool tcp_sock::resume_on(int fd, uint64_t peer_offset)
+{
+    // Held until attached, so that send() queues nothing in between. The
+    // missed bytes go out ahead of new ones without the loop waiting for
+    // room: up to the whole window, with the peer maybe resending too.
+    std::lock_guard<std::mutex> lock(resume_mtx);
+    std::string missed;
+    if (!sent->copy_from(peer_offset, &missed)) {
+        printf("tcp_sock: resume: %lu bytes missed, more than kept.\n", (unsigned long) (sent->get_end() - peer_offset));
+        return false;
+    }
+    const auto missed_length = missed.length();
+    if (io != nullptr) {
+        attach(fd);
+        std::lock_guard<std::mutex> send_lock(send_mtx);
+        send_queue.swap(missed);
+        if (!send_busy && !send_queue.empty()) {io_start_send();}
+    } else {
+        send_backlog.swap(missed);
+        backlog_armed = !send_backlog.empty();
+        attach(fd);
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    const auto down = suspended.exchange(false) ? now - suspended_at : std::chrono::steady_clock::duration::zero();
+    resume_deadline = resume_retry_at = std::chrono::steady_clock::time_point::max();
+    arm_timer();
+    resumes++;
+    last_resume_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(down).count());
+    printf("tcp_sock: resumed after %.1f ms, %zu bytes sent again.\n", std::chrono::duration<double, std::milli>(down).count(), missed_length);
+    return true;
+}
+
+void tcp_sock::suspend(void)
+{
+    detach();
+    suspended.store(true);
+    suspended_at = std::chrono::steady_clock::now();
+    resume_deadline = suspended_at + resume_grace;
+    printf("tcp_sock: connection lost, resuming the call within %ld ms.\n", (long) resume_grace.count());
+    // The caller dials again, the server waits for it
+    if (!is_server) {resume_dial();}
+    arm_timer();
+}
+
+void tcp_sock::resume_dial(void)
+{
+    resume_retry_at = std::chrono::steady_clock::time_point::max();
+    resume_dialing = true;
+    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(resume_deadline - std::chrono::steady_clock::now());
+    start_dial([this](dial_result result) {
+        resume_dialing = false;
+        if (result == DIAL_CONNECTED || !suspended.load()) {return;}
+        resume_retry_at = std::chrono::steady_clock::now() + RESUME_RETRY_INTERVAL;
+        arm_timer();
+    }, std::max(left, std::chrono::milliseconds(1)));
+}
+
+void tcp_sock::end_session(void)
+{
+    session_id = 0;
+    rx_offset = 0;
+    resume_deadline = resume_retry_at = std::chrono::steady_clock::time_point::max();
+    if (resume_dialing) {
+        resume_dialing = false;
+        dial_done = nullptr;
+        finish_dial(DIAL_NO_CARRIER);
+    }
+    arm_timer();
+}
+
+void tcp_sock::on_timer(uint32_t events)
+{
+    (void) events;
+
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {return;}
+
+    const auto now = std::chrono::steady_clock::now();
+    while (!accept_queue.empty() && now >= accept_queue.front()->queued_at + accept_queue_wait) {
+        if (debug_level >= 1) {printf("tcp_sock: waiting caller given up on.\n");}
+        callers_turned_away++;
+        drop_waiting(accept_queue.front());
+    }
+    std::vector<tcp_handshake *> expired;
+    for (auto handshake : handshakes) {
+        if (!handshake->dialed && now >= handshake->started + RESUME_HELLO_TIMEOUT) {expired.push_back(handshake);}
+    }
+    for (auto handshake : expired) {::close(release_handshake(handshake));}
+    if (suspended.load() && now >= resume_deadline) {
+        printf("tcp_sock: connection lost, the call could not be resumed.\n");
+        resume_failures++;
+        close_comm(true);
+    } else if (suspended.load() && !resume_dialing && now >= resume_retry_at) {
+        resume_dial();
+    }
+
+    if (!dial_done) {
+        arm_timer();
+    } else if (now >= dial_deadline) {
+        printf("tcp_sock: connect(): timed out\n");
+        dial_abort();
+    } else if (now >= dial_next_at) {
+        dial_try_next();
+    } else {
+        arm_timer();
+    }
+}
+
+void tcp_sock::arm_timer(void)
+{
+    // Zero disarms
+    auto at = std::min(dial_deadline, dial_next_at);
+    if (!accept_queue.empty()) {at = std::min(at, accept_queue.front()->queued_at + accept_queue_wait);}
+    at = std::min({at, resume_deadline, resume_retry_at});
+    for (auto handshake : handshakes) {
+        if (!handshake->dialed) {at = std::min(at, handshake->started + RESUME_HELLO_TIMEOUT);}
+    }
+    int64_t ns = 0;
+    if (at != std::chrono::steady_clock::time_point::max()) {
+        ns = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(at.time_since_epoch()).count(), 1);
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void tcp_sock::dial_abort(void)
+{
+    if (relay_dialing && relay_fd != 0) {
+        loop->remove(relay_fd);
+        ::close(relay_fd);
+        relay_fd = 0;
+        relay_dialing = false;
+        relay_register_later(std::chrono::milliseconds(0));
+    }
+    finish_dial(DIAL_NO_CARRIER);
+}
+
+void tcp_sock::dial_cancel_attempts(void)
+{
+    for (auto &attempt : dial_attempts) {
+        if (attempt.fd == 0) {continue;}
+        loop->remove(attempt.fd);
+        ::close(attempt.fd);
+        attempt.fd = 0;
+    }
+    dial_pending = 0;
+}
+
+void tcp_sock::finish_dial(dial_result result)
+{
+    dial_cancel_attempts();
+    // Our side of a handshake that did not get through
+    std::vector<tcp_handshake *> dialed;
+    for (auto handshake : handshakes) {
+        if (handshake->dialed) {dialed.push_back(handshake);}
+    }
+    for (auto handshake : dialed) {::close(release_handshake(handshake));}
+    dial_generation++;
+    dial_deadline = dial_next_at = std::chrono::steady_clock::time_point::max();
+    arm_timer();
+
+    if (debug_level >= 1 && result == DIAL_CONNECTED) {
+        printf("tcp_sock: connected in %.1f ms.\n", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - dial_started).count());
+    }
+    auto done = std::move(dial_done);
+    dial_done = nullptr;
+    if (done) {done(result);}
+}
+
+tcp_sock::tcp_sock(event_loop *loop, bool is_server,  const char *ip_addr, uint16_t port)
 {
     int ret;
+    tcp_sock::loop = loop;
     comm_fd.store(0);
+    server_fd = 0;
     tcp_sock::is_server = is_server;
+    use_relay = false;
+    relay_fd = 0;
+    relay_dialing = false;
+    alive = std::make_shared<bool>(true);
+    dns = new resolver(loop);
+    dial_generation = 0;
+    dial_next = 0;
+    dial_pending = 0;
+    dial_refused = false;
+    dial_deadline = dial_next_at = std::chrono::steady_clock::time_point::max();
+    accept_queue_max = 0;
+    accept_queue_wait = std::chrono::milliseconds(0);
+    ring_wait = std::chrono::steady_clock::duration::zero();
+    callers_waiting.store(0);
+    callers_turned_away.store(0);
+    resume_grace = std::chrono::milliseconds(0);
+    sent = nullptr;
+    backlog_armed = false;
+    session_id = 0;
+    rx_offset = 0;
+    suspended.store(false);
+    send_failed.store(false);
+    resume_dialing = false;
+    resume_deadline = resume_retry_at = std::chrono::steady_clock::time_point::max();
+    resumes.store(0);
+    resume_failures.store(0);
+    last_resume_ns.store(0);
+    recv_calls.store(0);
+    recv_bytes.store(0);
+    send_calls.store(0);
+    send_bytes.store(0);
+    closed_retransmits.store(0);
+    recv_paused_wanted.store(false);
+    recv_paused = false;
+    io = nullptr;
+    io_generation.store(0);
+    io_recv_armed = false;
+    send_busy = false;
+
+    listen_handler = [this](uint32_t events) {on_listen_event(events);};
+    comm_handler = [this](uint32_t events) {on_comm_event(events);};
+    relay_handler = [this](uint32_t events) {on_relay_event(events);};
+    io_handler = [this](uint32_t events) {on_io_event(events);};
+    timer_handler = [this](uint32_t events) {on_timer(events);};
 
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = inet_addr(ip_addr);
+    // A client may be given a host name or an IPv6 address to call
+    if (!is_server) {target_host = ip_addr;}
+    target_port = port;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        throw std::runtime_error((std::string) "tcp_sock: timerfd_create(): " + std::strerror(errno));
+    }
+    loop->run_sync([this]{tcp_sock::loop->add(timer_fd, EPOLLIN, &timer_handler);});
 
     if (is_server) {
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         if (server_fd < 0) {
             throw std::runtime_error((std::string) "tcp_sock: socket(): " + std::strerror(errno));
         }
 
+        const int reuse = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
         ret = bind(server_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
         if (ret < 0) {
             throw std::runtime_error((std::string) "tcp_sock: bind(): " + std::strerror(errno));
         }
 
-        ret = listen(server_fd, SOMAXCONN); 
+        ret = listen(server_fd, SOMAXCONN);
         if (ret < 0) {
             close(server_fd);
             throw std::runtime_error((std::string) "tcp_sock: listen(): " + std::strerror(errno));
         }
 
-        listen_thread_ptr = new std::thread([&]{listen_thread();});
+        loop->run_sync([this]{tcp_sock::loop->add(server_fd, EPOLLIN, &listen_handler);});
     }
 }
 
 tcp_sock::~tcp_sock()
 {
-    if (server_fd != 0) {
-        close(server_fd);
+    // Answers of lookups already done are posted before the task below
+    delete dns;
+    loop->run_sync([this]{
+        // A call still being set up ends without telling anyone
+        dial_done = nullptr;
+        finish_dial(DIAL_NO_CARRIER);
+        if (server_fd != 0) {
+            loop->remove(server_fd);
+            close(server_fd);
+            server_fd = 0;
+        }
+        while (!accept_queue.empty()) {drop_waiting(accept_queue.front());}
+        while (!handshakes.empty()) {::close(release_handshake(handshakes.front()));}
+        use_relay = false;
+        if (relay_fd != 0) {
+            loop->remove(relay_fd);
+            close(relay_fd);
+            relay_fd = 0;
+        }
+        close_comm(false);
+        // Last, everything above may re-arm it
+        loop->remove(timer_fd);
+        close(timer_fd);
+        alive.reset();
+    });
+
+    if (io != nullptr) {
+        // The kernel may still read send_inflight until the SEND completes
+        {
+            std::unique_lock<std::mutex> lock(send_mtx);
+            send_cv.wait_for(lock, std::chrono::seconds(1), [this]{return !send_busy;});
+        }
+        loop->run_sync([this]{loop->remove(io->get_fd());});
+        delete io;
     }
-    if (listen_thread_ptr != nullptr) {
-        listen_thread_ptr->join();
+    delete sent;
+}
+
+bool tcp_sock::enable_io_uring(void)
+{
+    auto ring = new uring();
+    if (!ring->init(IO_RING_ENTRIES) || !ring->setup_buffers(IO_BUF_GROUP, IO_BUF_COUNT, IO_BUF_SIZE) || !ring->register_files(1)) {
+        delete ring;
+        return false;
     }
-    disconnect();
+    loop->run_sync([this, ring]{
+        io = ring;
+        loop->add(io->get_fd(), EPOLLIN, &io_handler);
+    });
+    return true;
+}
+
+void tcp_sock::set_accept_queue(size_t max_callers, std::chrono::milliseconds max_wait)
+{
+    loop->run_sync([this, max_callers, max_wait]{
+        accept_queue_max = max_callers;
+        accept_queue_wait = max_wait;
+        while (accept_queue.size() > accept_queue_max) {drop_waiting(accept_queue.back());}
+    });
+}
+
+void tcp_sock::enable_resume(std::chrono::milliseconds grace)
+{
+    auto window = new replay_window(RESUME_WINDOW_SIZE);
+    loop->run_sync([this, grace, window]{
+        delete sent;
+        sent = window;
+        resume_grace = grace;
+    });
 }
 
 void tcp_sock::set_debug_level(const int level)
@@ -122,75 +1165,248 @@ void tcp_sock::set_debug_level(const int level)
     debug_level = level;
 }
 
-void tcp_sock::set_ring_callback(void (*func)(void))
+void tcp_sock::set_ring_callback(std::function<void(void)> func)
 {
     ring_callback = func;
 }
 
-void tcp_sock::set_recv_callback(void (*func)(const char *, size_t))
+void tcp_sock::set_recv_callback(std::function<void(const char *, size_t)> func)
 {
     recv_callback = func;
 }
 
+void tcp_sock::set_disconnect_callback(std::function<void(void)> func)
+{
+    disconnect_callback = func;
+}
+
+void tcp_sock::set_recv_sink(std::function<int(struct iovec *)> acquire, std::function<void(size_t)> commit)
+{
+    // The io_uring engine keeps its provided buffers and the recv callback
+    sink_acquire = acquire;
+    sink_commit = commit;
+}
+
 void tcp_sock::set_addr(const struct sockaddr_in *addr_in)
 {
-    memcpy(&addr, addr_in, sizeof(addr));
+    loop->run_sync([this, addr_in]{
+        memcpy(&addr, addr_in, sizeof(addr));
+        target_host.clear();
+    });
+}
+
+void tcp_sock::set_target(const std::string &host, uint16_t port)
+{
+    loop->run_sync([this, host, port]{
+        target_host = host;
+        target_port = port;
+    });
+}
+
+void tcp_sock::set_relay(const char *number)
+{
+    loop->run_sync([this, number]{
+        use_relay = true;
+        relay_number = number;
+        relay_register_later(std::chrono::milliseconds(0));
+    });
+}
+
+void tcp_sock::set_dial_number(const std::string &number)
+{
+    loop->run_sync([this, number]{dial_number = number;});
 }
 
 bool tcp_sock::is_connected()
 {
-    return comm_fd.load() != 0;
+    return comm_fd.load() != 0 || suspended.load();
 }
 
 bool tcp_sock::connect()
 {
-    int ret;
-    auto comm_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (comm_fd < 0) {
-        throw std::runtime_error((std::string) "tcp_sock: socket(): " + std::strerror(errno));
-    }
+    std::promise<bool> result;
+    connect_async([&result](dial_result r){result.set_value(r == DIAL_CONNECTED);}, std::chrono::milliseconds(0));
+    return result.get_future().get();
+}
 
-    ret = ::connect(comm_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
-    if (ret < 0) {
-        printf("tcp_sock: connect(): %s\n", std::strerror(errno));
-        return false;
-    }
-    
-    tcp_sock::comm_fd.store(comm_fd);
-    recv_thread_ptr = new std::thread([&]{tcp_sock::recv_thread();});
-    return true;
+void tcp_sock::connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout)
+{
+    loop->post([this, done, timeout]{
+        if (suspended.load()) {
+            done(DIAL_BUSY);
+            return;
+        }
+        start_dial(done, timeout);
+    });
 }
 
-void tcp_sock::disconnect()
+void tcp_sock::start_dial(std::function<void(dial_result)> done, std::chrono::milliseconds timeout)
 {
-    auto comm_fd = tcp_sock::comm_fd.load();
-    if (comm_fd != 0) {
-        close(comm_fd);
-        tcp_sock::comm_fd.store(0);
+    if (dial_done) {dial_abort();}
+    if (comm_fd.load() != 0) {
+        done(DIAL_BUSY);
+        return;
     }
-    if (recv_thread_ptr != nullptr) {
-        if (recv_thread_ptr->joinable()) {
-            recv_thread_ptr->join();
+    dial_done = done;
+    dial_started = std::chrono::steady_clock::now();
+    dial_deadline = timeout.count() > 0 ? dial_started + timeout : std::chrono::steady_clock::time_point::max();
+    arm_timer();
+
+    if (use_relay) {
+        // Give up our registration while the line is used for dialing
+        if (relay_fd != 0) {
+            loop->remove(relay_fd);
+            ::close(relay_fd);
+            relay_fd = 0;
         }
-        recv_thread_ptr = nullptr;
+        relay_open(true);
+        return;
     }
+
+    // No handler of the previous dial can be running here
+    dial_attempts.clear();
+    dial_refused = false;
+    if (target_host.empty()) {
+        std::vector<struct sockaddr_storage> addrs(1);
+        memset(&addrs[0], 0, sizeof(addrs[0]));
+        memcpy(&addrs[0], &addr, sizeof(addr));
+        dial_start(addrs);
+        return;
+    }
+    const auto generation = dial_generation;
+    dns->resolve(target_host, target_port, [this, generation](const std::vector<struct sockaddr_storage> &addrs) {
+        if (generation != dial_generation || !dial_done) {return;} // aborted meanwhile
+        if (addrs.empty()) {
+            finish_dial(DIAL_NO_CARRIER);
+            return;
+        }
+        dial_start(addrs);
+    });
+}
+
+void tcp_sock::abort_connect()
+{
+    loop->post([this]{
+        if (dial_done) {dial_abort();}
+    });
+}
+
+void tcp_sock::disconnect()
+{
+    loop->run_sync([this]{close_comm(false);});
 }
 
 void tcp_sock::send(const char *buffer, size_t length)
 {
-    size_t ptr = 0;
+    if (io != nullptr) {
+        // Block this caller, not the loop, while the queue behind the SEND
+        // in flight is full; before taking resume_mtx, which the loop takes too
+        std::unique_lock<std::mutex> lock(send_mtx);
+        while (comm_fd.load() != 0 && !send_queue.empty() && send_queue.length() + length > SEND_QUEUE_MAX) {
+            send_cv.wait_for(lock, std::chrono::milliseconds(100));
+        }
+    }
+
+    // Kept first, so that whatever does not get through is sent again on resume
+    std::unique_lock<std::mutex> resume_lock(resume_mtx, std::defer_lock);
+    if (sent != nullptr) {
+        resume_lock.lock();
+        if (io == nullptr) {
+            // Likewise for the backlog; the wait lets go of the lock
+            backlog_cv.wait(resume_lock, [this, length] {
+                return comm_fd.load() == 0 || suspended.load() || send_backlog.empty() || send_backlog.length() + length <= SEND_QUEUE_MAX;
+            });
+        }
+        sent->append(buffer, length);
+        if (suspended.load()) {return;}
+    }
+
+    if (io != nullptr) {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if (comm_fd.load() == 0) {
+            printf("tcp_sock: socket closed.\n");
+            return;
+        }
+        send_queue.append(buffer, length);
+        if (!send_busy) {io_start_send();}
+        return;
+    }
+
     auto comm_fd = tcp_sock::comm_fd.load();
     if (comm_fd == 0) {
         printf("tcp_sock: socket closed.\n");
         return;
     }
+    if (sent == nullptr) {
+        send_all(comm_fd, buffer, length);
+        return;
+    }
+    // resume_mtx is held, so never block: what the socket has no room for
+    // goes behind the backlog, which the loop thread flushes on EPOLLOUT
+    const auto was_empty = send_backlog.empty();
+    const auto done = was_empty ? send_some(comm_fd, buffer, length) : 0;
+    if (done == length) {return;}
+    send_backlog.append(buffer + done, length - done);
+    if (!was_empty) {return;}
+    if (loop->in_loop_thread()) {
+        arm_backlog();
+    } else {
+        loop->post([this]{arm_backlog();});
+    }
+}
+
+void tcp_sock::send_all(int comm_fd, const char *buffer, size_t length)
+{
+    size_t ptr = 0;
     while (ptr < length) {
         auto ret = ::send(comm_fd, buffer + ptr, length - ptr, MSG_NOSIGNAL);
+        send_calls++;
         if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Socket buffer is full. Block this caller, not the loop.
+                struct pollfd pfd = {.fd = comm_fd, .events = POLLOUT, .revents = 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            if (errno == EINTR) {continue;}
             printf("tcp_sock: send(): %s\n", std::strerror(errno));
+            if (errno != EPIPE) {send_failed.store(true);}
             break;
         }
         ptr += ret;
+        send_bytes += ret;
+    }
+}
+
+size_t tcp_sock::send_some(int comm_fd, const char *buffer, size_t length)
+{
+    // Without waiting for room. A failure counts as all sent: what is left
+    // stays in the replay window, and the hang-up follows.
+    size_t ptr = 0;
+    while (ptr < length) {
+        const auto ret = ::send(comm_fd, buffer + ptr, length - ptr, MSG_NOSIGNAL | MSG_DONTWAIT);
+        send_calls++;
+        if (ret < 0) {
+            if (errno == EINTR) {continue;}
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {break;}
+            printf("tcp_sock: send(): %s\n", std::strerror(errno));
+            if (errno != EPIPE) {send_failed.store(true);}
+            return length;
+        }
+        ptr += ret;
+        send_bytes += ret;
+    }
+    return ptr;
+}
+
+void tcp_sock::set_recv_paused(bool paused)
+{
+    // Only the latest wish counts, however the posted tasks interleave
+    recv_paused_wanted.store(paused);
+    if (loop->in_loop_thread()) {
+        apply_recv_paused();
+    } else {
+        loop->post([this]{apply_recv_paused();});
     }
 }
 
@@ -203,3 +1419,33 @@ int tcp_sock::recv(char *buffer, size_t max_length)
     }
     return ret;
 }
+
+std::chrono::steady_clock::time_point tcp_sock::get_recv_time(void)
+{
+    return recv_at;
+}
+
+uint64_t tcp_sock::get_retransmits(int fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (fd == 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {return 0;}
+    return info.tcpi_total_retrans;
+}
+
+resolver *tcp_sock::get_resolver(void)
+{
+    return dns;
+}
+
+std::chrono::steady_clock::duration tcp_sock::get_ring_wait(void)
+{
+    return ring_wait;
+}
+
+transport_stats tcp_sock::get_stats(void)
+{
+    const auto retransmits = closed_retransmits.load() + get_retransmits(comm_fd.load());
+    return {recv_calls.load(), recv_bytes.load(), send_calls.load(), send_bytes.load(), retransmits, callers_waiting.load(), callers_turned_away.load(),
+        resumes.load(), resume_failures.load(), last_resume_ns.load()};
+}
@@ -1,30 +1,208 @@
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
-class tcp_sock {
+class event_loop;
+class uring;
+class resolver;
+class replay_window;
+
+constexpr auto DIAL_ATTEMPT_DELAY = std::chrono::milliseconds(250); // before racing the next address (RFC 8305)
+constexpr size_t RESUME_HELLO_SIZE = 20; // magic, session id, bytes received
+
+// Caller accepted while the line was busy, held until it frees (set_accept_queue())
+struct tcp_waiting_caller {
+    int fd;
+    std::chrono::steady_clock::time_point queued_at;
+    std::function<void(uint32_t)> handler;
+};
+
+// Connection that has yet to say which call it belongs to (enable_resume()):
+// our side of a dial, or one accepted by a server
+struct tcp_handshake {
+    int fd; // 0 once taken
+    bool dialed;
+    std::chrono::steady_clock::time_point started;
+    char hello[RESUME_HELLO_SIZE];
+    size_t got;
+    std::function<void(uint32_t)> handler;
+};
+
+// One connection attempt of a dial; the handler stays valid until the next dial
+struct tcp_dial_attempt {
+    int fd; // 0 once it has failed or lost the race
+    std::function<void(uint32_t)> handler;
+};
+
+class tcp_sock : public transport {
     private:
+        event_loop *loop;
         int server_fd;
         std::atomic<int> comm_fd; // communication socket fd
         bool is_server;
         int debug_level = 0;
         struct sockaddr_in addr;
-        std::thread *recv_thread_ptr;
-        std::thread *listen_thread_ptr;
-        void (*ring_callback)(void);
-        void (*recv_callback)(const char *, size_t);
-        void* recv_thread(void);
-        void* listen_thread(void);
+        char recv_buf[4096];
+        std::chrono::steady_clock::time_point recv_at; // when recv_buf was filled
+        std::atomic<bool> recv_paused_wanted;
+        bool recv_paused; // applied state, loop thread only
+        std::function<void(uint32_t)> listen_handler;
+        std::function<void(uint32_t)> comm_handler;
+        // accept queue, loop thread only; rung in order as the line frees
+        std::deque<tcp_waiting_caller *> accept_queue;
+        size_t accept_queue_max;
+        std::chrono::milliseconds accept_queue_wait;
+        std::chrono::steady_clock::duration ring_wait; // of the caller being rung
+        std::atomic<uint64_t> callers_waiting, callers_turned_away;
+        // direct dial (connect_async()), loop thread only: the addresses of
+        // the target are tried in turn, each DIAL_ATTEMPT_DELAY after the
+        // previous one or as soon as it fails, and the first to connect wins
+        resolver *dns;
+        std::string target_host; // empty: addr
+        uint16_t target_port;
+        uint32_t dial_generation; // tells the answer of an old lookup apart
+        std::function<void(dial_result)> dial_done; // set while a call (also via the relay) is set up
+        std::vector<struct sockaddr_storage> dial_addrs;
+        size_t dial_next; // next of dial_addrs to try
+        int dial_pending; // attempts in flight
+        bool dial_refused;
+        std::list<tcp_dial_attempt> dial_attempts;
+        int timer_fd; // dial delays and deadline, accept queue wait, resume
+        std::function<void(uint32_t)> timer_handler;
+        std::chrono::steady_clock::time_point dial_started, dial_deadline, dial_next_at;
+        // session resumption (enable_resume()), loop thread only unless
+        // noted: both ends count the bytes of a call and keep what they sent;
+        // a connection that drops (not one that is closed) is dialed again by
+        // the client and both send what the other missed
+        std::chrono::milliseconds resume_grace; // 0: off
+        replay_window *sent; // guarded by resume_mtx, which is never held across a blocking call
+        std::mutex resume_mtx;
+        // epoll path: what the socket had no room for, missed bytes after a
+        // resume first; guarded by resume_mtx and flushed by the loop thread
+        std::string send_backlog;
+        std::condition_variable backlog_cv; // room in send_backlog, or the connection gone
+        bool backlog_armed; // EPOLLOUT armed for send_backlog, loop thread only
+        uint64_t session_id; // 0: no call
+        uint64_t rx_offset; // bytes of the call received
+        std::atomic<bool> suspended; // call kept while the connection is down
+        std::atomic<bool> send_failed; // the connection was reset under send()
+        bool resume_dialing;
+        std::chrono::steady_clock::time_point suspended_at, resume_deadline, resume_retry_at;
+        std::list<tcp_handshake *> handshakes;
+        std::atomic<uint64_t> resumes, resume_failures, last_resume_ns;
+        // io_uring engine (see enable_io_uring()), nullptr for the epoll path
+        uring *io;
+        std::atomic<uint32_t> io_generation; // tags the operations of the current connection
+        bool io_recv_armed; // multishot recv in flight, loop thread only
+        std::function<void(uint32_t)> io_handler;
+        std::mutex send_mtx;
+        std::condition_variable send_cv;
+        std::string send_queue; // waits for the SEND in flight
+        std::string send_inflight; // read by the kernel until its completion
+        bool send_busy;
+        // relay client (see relay_protocol.h), only touched on the loop thread
+        bool use_relay;
+        std::string relay_number;
+        std::string dial_number;
+        int relay_fd; // relay connection still in its handshake
+        bool relay_dialing;
+        std::shared_ptr<bool> alive; // reset on the loop thread; call_later tasks check it
+        std::string relay_hello;
+        std::string relay_line;
+        std::function<void(uint32_t)> relay_handler;
+        std::atomic<uint64_t> recv_calls, recv_bytes, send_calls, send_bytes;
+        std::atomic<uint64_t> closed_retransmits; // of connections already closed
+        uint64_t get_retransmits(int fd);
+        std::function<void(void)> ring_callback;
+        std::function<void(const char *, size_t)> recv_callback;
+        std::function<int(struct iovec *)> sink_acquire;
+        std::function<void(size_t)> sink_commit;
+        std::function<void(void)> disconnect_callback;
+        void on_listen_event(uint32_t events);
+        void take_caller(int fd);
+        void answer(int fd);
+        void on_waiting_event(tcp_waiting_caller *caller, uint32_t events);
+        void drop_waiting(tcp_waiting_caller *caller);
+        void ring_next(void);
+        void on_comm_event(uint32_t events);
+        void attach(int fd);
+        uint32_t comm_events(void);
+        void apply_recv_paused(void);
+        bool detach(void);
+        void lose_comm(bool dropped);
+        void close_comm(bool notify);
+        void send_all(int fd, const char *buffer, size_t length);
+        size_t send_some(int fd, const char *buffer, size_t length);
+        void arm_backlog(void);
+        void flush_backlog(void);
+        uint64_t io_tag(uint8_t op);
+        void on_io_event(uint32_t events);
+        void on_io_send(uint32_t generation, int res);
+        void io_arm_recv(void);
+        void io_cancel_recv(void);
+        void io_start_send(void);
+        void io_submit_send(void);
+        void relay_open(bool dial);
+        void on_relay_event(uint32_t events);
+        void relay_finish(bool paired, const char *rest, size_t rest_length);
+        void relay_register_later(std::chrono::milliseconds delay);
+        void start_handshake(int fd, bool dialed);
+        void on_handshake_event(tcp_handshake *handshake, uint32_t events);
+        int release_handshake(tcp_handshake *handshake);
+        void finish_handshake(tcp_handshake *handshake);
+        bool resume_on(int fd, uint64_t peer_offset);
+        void suspend(void);
+        void resume_dial(void);
+        void end_session(void);
+        void start_dial(std::function<void(dial_result)> done, std::chrono::milliseconds timeout);
+        void dial_start(const std::vector<struct sockaddr_storage> &addrs);
+        void dial_try_next(void);
+        void on_dial_event(tcp_dial_attempt *attempt, uint32_t events);
+        void on_timer(uint32_t events);
+        void arm_timer(void);
+        void dial_abort(void);
+        void dial_cancel_attempts(void);
+        void finish_dial(dial_result result);
     public:
-        tcp_sock(bool is_server, const char *ip_addr, uint16_t port);
-        ~tcp_sock();
-        void set_debug_level(const int level);
-        void set_ring_callback(void (*func)(void));
-        void set_recv_callback(void (*func)(const char *, size_t));
-        void set_addr(const struct sockaddr_in *addr_in);
-        bool is_connected();
-        bool connect();
-        void disconnect();
-        void send(const char *buffer, size_t length);
+        tcp_sock(event_loop *loop, bool is_server, const char *ip_addr, uint16_t port);
+        ~tcp_sock() override;
+        // Moves socket I/O to io_uring. Call before connecting; false (and
+        // the epoll path stays) if the kernel cannot do it.
+        bool enable_io_uring(void);
+        // Server: holds up to max_callers callers for up to max_wait while
+        // the line is busy, instead of hanging up on them. 0 turns them away.
+        void set_accept_queue(size_t max_callers, std::chrono::milliseconds max_wait);
+        // Keeps a call through a dropped connection for up to grace, with
+        // the peer doing the same; both ends need it. Call before connecting.
+        void enable_resume(std::chrono::milliseconds grace);
+        void set_debug_level(const int level) override;
+        void set_ring_callback(std::function<void(void)> func) override;
+        void set_recv_callback(std::function<void(const char *, size_t)> func) override;
+        void set_disconnect_callback(std::function<void(void)> func) override;
+        void set_addr(const struct sockaddr_in *addr_in) override;
+        void set_target(const std::string &host, uint16_t port) override;
+        void set_recv_sink(std::function<int(struct iovec *)> acquire, std::function<void(size_t)> commit) override;
+        void set_relay(const char *number) override;
+        void set_dial_number(const std::string &number) override;
+        bool is_connected() override;
+        bool connect() override;
+        void connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout) override;
+        void abort_connect() override;
+        void disconnect() override;
+        void send(const char *buffer, size_t length) override;
+        void set_recv_paused(bool paused) override;
         int recv(char *buffer, size_t max_length);
+        std::chrono::steady_clock::time_point get_recv_time(void) override;
+        std::chrono::steady_clock::duration get_ring_wait(void) override;
+        transport_stats get_stats(void) override;
+        resolver *get_resolver(void);
 };
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "traffic_record.h"
+
+constexpr uint32_t RECORDING_VERSION = 1;
+
+static size_t padded(size_t length)
+{
+    return (length + 7) & ~static_cast<size_t>(7);
+}
+
+bool parse_recording_arg(const char *arg, std::string *path, size_t *capacity)
+{
+    // Input format: "path" or "path,MB"
+    std::string s = arg;
+    *capacity = RECORDING_SIZE_DEFAULT << 20;
+    const auto comma = s.rfind(',');
+    if (comma != std::string::npos) {
+        char *end;
+        const auto mb = strtol(s.c_str() + comma + 1, &end, 10);
+        if (*end != '\0' || mb < 1) {return false;}
+        *capacity = static_cast<size_t>(mb) << 20;
+        s.resize(comma);
+    }
+    if (s.empty()) {return false;}
+    *path = s;
+    return true;
+}
+
+traffic_recorder::traffic_recorder(const char *path, size_t capacity)
+    : offset(sizeof(recording_header)), dropped(0), closing(false), writing(0), end(0)
+{
+    traffic_recorder::capacity = std::max(capacity, sizeof(recording_header));
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error((std::string) "traffic_recorder: open(" + path + "): " + std::strerror(errno));
+    }
+    if (ftruncate(fd, traffic_recorder::capacity) < 0) {
+        throw std::runtime_error((std::string) "traffic_recorder: ftruncate(): " + std::strerror(errno));
+    }
+    map = static_cast<uint8_t *>(mmap(nullptr, traffic_recorder::capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (map == MAP_FAILED) {
+        throw std::runtime_error((std::string) "traffic_recorder: mmap(): " + std::strerror(errno));
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    started = std::chrono::steady_clock::now();
+    recording_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+    header.version = RECORDING_VERSION;
+    header.header_size = sizeof(header);
+    header.start_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    memcpy(map, &header, sizeof(header));
+}
+
+traffic_recorder::~traffic_recorder()
+{
+    close();
+}
+
+void traffic_recorder::close(void)
+{
+    if (closing.exchange(true)) {return;}
+    while (writing.load() > 0) {std::this_thread::yield();}
+
+    end = std::min(offset.load(), capacity);
+    auto header = reinterpret_cast<recording_header *>(map);
+    header->end = end;
+    header->dropped = dropped.load();
+    msync(map, end, MS_SYNC);
+    munmap(map, capacity);
+    if (ftruncate(fd, end) < 0) {printf("traffic_recorder: ftruncate(): %s\n", std::strerror(errno));}
+    ::close(fd);
+}
+
+void traffic_recorder::record(record_kind kind, int modem, uint16_t arg, std::chrono::steady_clock::time_point t, const struct iovec *iov, int iovcnt)
+{
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++) {length += iov[i].iov_len;}
+    const auto size = sizeof(record_header) + padded(length);
+
+    writing.fetch_add(1);
+    if (closing.load()) {
+        writing.fetch_sub(1);
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    const auto at = offset.fetch_add(size, std::memory_order_relaxed);
+    if (at + size > capacity) {
+        writing.fetch_sub(1);
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    auto r = reinterpret_cast<record_header *>(map + at);
+    r->length = length;
+    r->modem = modem;
+    r->arg = arg;
+    r->time_ns = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(t - started).count());
+    auto p = map + at + sizeof(record_header);
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    __atomic_store_n(&r->kind, kind, __ATOMIC_RELEASE);
+    writing.fetch_sub(1);
+}
+
+void traffic_recorder::record(record_kind kind, int modem, uint16_t arg, const void *data, size_t length)
+{
+    struct iovec iov = {const_cast<void *>(data), length};
+    record(kind, modem, arg, std::chrono::steady_clock::now(), &iov, data != nullptr ? 1 : 0);
+}
+
+size_t traffic_recorder::get_size(void)
+{
+    // A record that did not fit leaves its start behind as the end
+    return closing.load() ? end : std::min(offset.load(), capacity);
+}
+
+uint64_t traffic_recorder::get_dropped(void)
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+recording_reader::recording_reader(void)
+{
+    fd = -1;
+    map = nullptr;
+    size = 0;
+    end = 0;
+    offset = 0;
+    memset(&header, 0, sizeof(header));
+}
+
+recording_reader::~recording_reader()
+{
+    if (map != nullptr) {munmap(const_cast<uint8_t *>(map), size);}
+    if (fd >= 0) {::close(fd);}
+}
+
+bool recording_reader::open(const char *path)
+{
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("%s: %s\n", path, std::strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(header)) {
+        printf("%s: not a recording.\n", path);
+        return false;
+    }
+    size = st.st_size;
+    map = static_cast<const uint8_t *>(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+    if (map == MAP_FAILED) {
+        map = nullptr;
+        printf("%s: mmap(): %s\n", path, std::strerror(errno));
+        return false;
+    }
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) != 0 || header.version != RECORDING_VERSION) {
+        printf("%s: not a recording of this version.\n", path);
+        return false;
+    }
+    // Still being written, or cut off by a crash: read up to the first incomplete record
+    if (header.end == 0) {printf("%s: not closed, reading what is complete.\n", path);}
+    end = header.end != 0 ? std::min<size_t>(header.end, size) : size;
+    offset = header.header_size;
+    return true;
+}
+
+bool recording_reader::next(record_view *r)
+{
+    if (offset + sizeof(record_header) > end) {return false;}
+    record_header h;
+    memcpy(&h, map + offset, sizeof(h));
+    if (h.kind == RECORD_END || offset + sizeof(h) + h.length > end) {return false;}
+    r->kind = static_cast<record_kind>(h.kind);
+    r->modem = h.modem;
+    r->arg = h.arg;
+    r->time_ns = h.time_ns;
+    r->data = map + offset + sizeof(h);
+    r->length = h.length;
+    offset += sizeof(h) + padded(h.length);
+    return true;
+}
+
+void recording_reader::rewind(void)
+{
+    offset = header.header_size;
+}
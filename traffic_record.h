@@ -0,0 +1,106 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/uio.h>
+
+constexpr size_t RECORDING_SIZE_DEFAULT = 64; // MB
+constexpr char RECORDING_MAGIC[8] = {'M', 'E', '5', '6', 'R', 'E', 'C', '1'};
+
+// What a record holds; 0 marks the end (or a record cut off by a crash)
+enum record_kind : uint8_t {
+    RECORD_END,
+    RECORD_USB_EVENT, // arg: raw gadget event type; payload: the setup packet of a control request
+    RECORD_EP0, // arg: USB_DIR_IN or USB_DIR_OUT; payload: the data stage
+    RECORD_EP0_STALL,
+    RECORD_BULK_OUT, // a bulk-OUT transfer as read, header byte of each packet included
+    RECORD_BULK_IN, // a bulk-IN transfer as written, status bytes included; timed when done
+    RECORD_SOCK_RX, // bytes from the remote side, timed when received
+    RECORD_SOCK_TX,
+    RECORD_CALL, // arg: 1 on-line, 0 off-line
+};
+
+// At the start of the file; everything little endian as on the boards
+struct recording_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t start_realtime_ns; // CLOCK_REALTIME when the recording started, for pcapng
+    uint64_t end; // file offset after the last record, written on close; 0 after a crash
+    uint64_t dropped; // records that did not fit
+};
+
+// Followed by length bytes of payload, padded to 8 bytes
+struct record_header {
+    uint32_t length;
+    uint8_t kind; // written last: a record is complete once this is set
+    uint8_t modem;
+    uint16_t arg;
+    uint64_t time_ns; // steady clock, since the recording started
+};
+
+// Appends every control event, USB transfer and socket chunk of the modems
+// to a file mapped into memory. Writers only reserve space with one atomic
+// add and copy, so they never wait for each other or for a write(); the
+// kernel writes the pages back. The first record on a page can still fault,
+// and block while the file system allocates it, unless -r has locked the
+// whole mapping into memory (which keeps all of it resident, so size it to
+// the board). The file is sized up front (sparse) and records that do not
+// fit are counted and dropped. close() cuts the file to
+// what was recorded; records made after that are dropped, so threads still
+// running may keep calling record().
+class traffic_recorder
+{
+    private:
+        int fd;
+        uint8_t *map;
+        size_t capacity;
+        std::atomic<size_t> offset;
+        std::atomic<uint64_t> dropped;
+        std::atomic<bool> closing;
+        std::atomic<int> writing; // records being copied; the file is cut only when none are
+        size_t end; // set by close()
+        std::chrono::steady_clock::time_point started;
+    public:
+        traffic_recorder(const char *path, size_t capacity);
+        ~traffic_recorder();
+        void close(void);
+        void record(record_kind kind, int modem, uint16_t arg, std::chrono::steady_clock::time_point t, const struct iovec *iov, int iovcnt);
+        void record(record_kind kind, int modem, uint16_t arg, const void *data, size_t length);
+        size_t get_size(void);
+        uint64_t get_dropped(void);
+};
+
+struct record_view {
+    record_kind kind;
+    int modem;
+    uint16_t arg;
+    uint64_t time_ns;
+    const uint8_t *data;
+    size_t length;
+};
+
+// Reads a recording back, record by record, in the order space was reserved
+// (time order per thread; threads can overtake each other by a few us)
+class recording_reader
+{
+    private:
+        int fd;
+        const uint8_t *map;
+        size_t size; // mapped
+        size_t end; // of the records
+        size_t offset;
+        recording_header header;
+    public:
+        recording_reader(void);
+        ~recording_reader();
+        // Prints why and returns false if path is not a recording
+        bool open(const char *path);
+        bool next(record_view *r);
+        void rewind(void);
+        const recording_header &get_header(void) {return header;}
+};
+
+// "path" or "path,MB"
+bool parse_recording_arg(const char *arg, std::string *path, size_t *capacity);
@@ -0,0 +1,70 @@
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+struct transport_stats {
+    uint64_t recv_calls;
+    uint64_t recv_bytes;
+    uint64_t send_calls;
+    uint64_t send_bytes;
+    uint64_t retransmits; // segments or frames sent again
+    uint64_t callers_waiting; // in the accept queue
+    uint64_t callers_turned_away; // queue full, or waited too long
+    uint64_t resumes; // calls carried over to a new connection
+    uint64_t resume_failures; // calls lost with their connection
+    uint64_t last_resume_ns; // connection lost -> resumed
+};
+
+// How a call started with connect_async() ended
+enum dial_result {
+    DIAL_CONNECTED,
+    DIAL_BUSY, // refused by the remote side or the relay
+    DIAL_NO_CARRIER, // no answer in time, unreachable, unknown host or aborted
+};
+
+// Byte stream to the remote modem, implemented by tcp_sock and udp_sock.
+// The callbacks run on the event loop thread; send() may be called from any
+// other thread.
+class transport {
+    public:
+        virtual ~transport() {}
+        virtual void set_debug_level(const int level) = 0;
+        virtual void set_ring_callback(std::function<void(void)> func) = 0;
+        virtual void set_recv_callback(std::function<void(const char *, size_t)> func) = 0;
+        virtual void set_disconnect_callback(std::function<void(void)> func) = 0;
+        virtual void set_addr(const struct sockaddr_in *addr_in) = 0;
+        // Where the next call goes: host name, IPv4 or IPv6 address. Replaces set_addr().
+        virtual void set_target(const std::string &host, uint16_t port) {(void) host; (void) port;}
+        // Receive straight into the consumer's buffer instead of through the
+        // recv callback: acquire gives up to two segments of free space (0:
+        // none, use the callback) and commit, which always follows, the bytes
+        // written there. Transports that cannot read in place ignore it.
+        virtual void set_recv_sink(std::function<int(struct iovec *)> acquire, std::function<void(size_t)> commit) {(void) acquire; (void) commit;}
+        // Relay server numbers (relay_protocol.h), only supported over TCP
+        virtual void set_relay(const char *number) {(void) number;}
+        virtual void set_dial_number(const std::string &number) {(void) number;}
+        virtual bool is_connected() = 0;
+        virtual bool connect() = 0;
+        // Starts a call without blocking; done runs once, on the loop thread,
+        // when it is connected or has failed. A timeout of 0 leaves it to the
+        // transport. Transports that can only block answer before returning.
+        virtual void connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout)
+        {
+            (void) timeout;
+            done(connect() ? DIAL_CONNECTED : DIAL_NO_CARRIER);
+        }
+        // Ends a call still being set up; its done reports DIAL_NO_CARRIER
+        virtual void abort_connect() {}
+        virtual void disconnect() = 0;
+        virtual void send(const char *buffer, size_t length) = 0;
+        // Stops or restarts delivery to the recv callback, from any thread.
+        // While stopped the peer is held back (TCP window, UDP pause flag).
+        virtual void set_recv_paused(bool paused) = 0;
+        virtual std::chrono::steady_clock::time_point get_recv_time(void) = 0; // valid inside the recv callback
+        // Valid inside the ring callback: how long the caller was held while the line was busy
+        virtual std::chrono::steady_clock::duration get_ring_wait(void) {return std::chrono::steady_clock::duration::zero();}
+        virtual transport_stats get_stats(void) = 0;
+};
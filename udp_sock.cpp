@@ -0,0 +1,704 @@
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "transport.h"
+#include "udp_sock.h"
+#include "resolver.h"
+#include "async_log.h"
+
+using namespace std::chrono_literals;
+
+// Wire format: a fixed header in network byte order, then the payload
+struct udp_frame_header {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t length; // payload bytes
+    uint32_t session;
+    uint32_t seq; // DATA only
+    uint32_t ack; // next in-order sequence number expected from the peer
+    uint32_t sack; // bit i: frame ack + 1 + i was received
+};
+static_assert(sizeof(udp_frame_header) == 20, "udp_frame_header must not be padded");
+
+enum : uint8_t {
+    UDP_SYN = 1,
+    UDP_SYN_ACK = 2,
+    UDP_DATA = 3,
+    UDP_ACK = 4,
+    UDP_FIN = 5, // hang-up, also the reply to a SYN while busy
+};
+
+enum : uint8_t {
+    UDP_FLAG_PAUSED = 0x01, // the receiver holds frames from ack on, send no more
+};
+
+constexpr size_t UDP_PAYLOAD_MAX = 1200; // stays below common path MTUs
+constexpr size_t UDP_WINDOW = 256; // frames in flight before send() blocks
+constexpr auto UDP_RTO_INITIAL = std::chrono::steady_clock::duration(200ms);
+constexpr auto UDP_RTO_MIN = std::chrono::steady_clock::duration(10ms);
+constexpr auto UDP_RTO_SLACK = std::chrono::steady_clock::duration(5ms); // scheduling jitter on top of 4 * rttvar
+constexpr auto UDP_RTO_MAX = std::chrono::steady_clock::duration(1000ms);
+constexpr auto UDP_REORDER_MIN = std::chrono::steady_clock::duration(1ms);
+constexpr auto UDP_SYN_INTERVAL = 250ms;
+constexpr int UDP_SYN_RETRIES = 12;
+constexpr auto UDP_KEEPALIVE_INTERVAL = 1000ms;
+constexpr auto UDP_PEER_TIMEOUT = std::chrono::steady_clock::duration(10000ms);
+
+static bool seq_before(uint32_t a, uint32_t b)
+{
+    return static_cast<int32_t>(a - b) < 0;
+}
+
+static int64_t to_ns(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+static size_t encode_header(char *buf, uint8_t type, uint8_t flags, uint32_t session, uint32_t seq, uint32_t ack, uint32_t sack, size_t length)
+{
+    udp_frame_header hdr;
+    hdr.type = type;
+    hdr.flags = flags;
+    hdr.length = htons(length);
+    hdr.session = htonl(session);
+    hdr.seq = htonl(seq);
+    hdr.ack = htonl(ack);
+    hdr.sack = htonl(sack);
+    memcpy(buf, &hdr, sizeof(hdr));
+    return sizeof(hdr);
+}
+
+void udp_sock::on_sock_event(uint32_t events)
+{
+    (void) events;
+
+    while (fd >= 0) {
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        auto n = recvfrom(fd, recv_buf, sizeof(recv_buf), 0, reinterpret_cast<struct sockaddr *>(&from), &len);
+        recv_calls++;
+        if (n < 0) {
+            if (errno == EINTR) {continue;}
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {break;}
+            if (errno == ECONNREFUSED) {
+                // ICMP port unreachable: nobody listens there (yet)
+                if (connect_done) {
+                    printf("udp_sock: connect(): %s\n", std::strerror(errno));
+                    finish_connect(DIAL_BUSY);
+                }
+                continue;
+            }
+            printf("udp_sock: recvfrom(): %s\n", std::strerror(errno));
+            break;
+        }
+        on_frame(from, recv_buf, n);
+    }
+}
+
+void udp_sock::on_frame(const struct sockaddr_in &from, const char *frame, size_t length)
+{
+    udp_frame_header hdr;
+    if (length < sizeof(hdr)) {return;}
+    memcpy(&hdr, frame, sizeof(hdr));
+    const uint32_t frame_session = ntohl(hdr.session);
+    const size_t payload_length = ntohs(hdr.length);
+    if (payload_length > length - sizeof(hdr)) {return;}
+
+    const auto now = std::chrono::steady_clock::now();
+    if (!connected.load() && !connect_done) {
+        // Idle: only a server takes a new call
+        if (is_server && hdr.type == UDP_SYN) {
+            peer = from;
+            session.store(frame_session);
+            reset_state();
+            connected.store(true);
+            if (debug_level >= 1) {printf("udp_sock: client connected.\n");}
+            send_control(UDP_SYN_ACK, peer, frame_session);
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                rearm_timer(now);
+            }
+            ring_callback();
+        }
+        return;
+    }
+
+    const auto same_peer = from.sin_addr.s_addr == peer.sin_addr.s_addr && from.sin_port == peer.sin_port;
+    if (!same_peer || frame_session != session.load()) {
+        if (hdr.type == UDP_SYN) {send_control(UDP_FIN, from, frame_session);} // busy
+        return;
+    }
+    last_recv_ns.store(to_ns(now));
+
+    if (connect_done) {
+        // Anything but a hang-up from the server means our SYN got through
+        finish_connect(hdr.type != UDP_FIN ? DIAL_CONNECTED : DIAL_BUSY);
+        if (hdr.type != UDP_DATA) {return;}
+    }
+
+    switch (hdr.type) {
+        case UDP_SYN:
+            // Our SYN_ACK was lost
+            if (is_server) {send_control(UDP_SYN_ACK, peer, frame_session);}
+            break;
+        case UDP_DATA:
+            on_ack(ntohl(hdr.ack), ntohl(hdr.sack), hdr.flags & UDP_FLAG_PAUSED);
+            on_data(ntohl(hdr.seq), frame + sizeof(hdr), payload_length);
+            break;
+        case UDP_ACK:
+            on_ack(ntohl(hdr.ack), ntohl(hdr.sack), hdr.flags & UDP_FLAG_PAUSED);
+            break;
+        case UDP_FIN:
+            printf("udp_sock: connection closed.\n");
+            close_comm(true);
+            break;
+        default:
+            break;
+    }
+}
+
+void udp_sock::on_data(uint32_t seq, const char *payload, size_t length)
+{
+    const auto next = rx_next.load();
+    if (seq == next && !rx_paused.load()) {
+        recv_at = std::chrono::steady_clock::now();
+        recv_bytes += length;
+        if (debug_level >= 2) {log_write(LOG_UDP_RECV, length);}
+        recv_callback(payload, length);
+        rx_next.store(next + 1);
+    } else if (!seq_before(seq, next) && seq - next < UDP_WINDOW) {
+        rx_out_of_order.emplace(seq, std::string(payload, length));
+    }
+    deliver_in_order();
+
+    // Acknowledge every frame right away, the sender relies on it to find losses early
+    send_control(UDP_ACK, peer, session.load());
+}
+
+void udp_sock::deliver_in_order(void)
+{
+    // Frames that were waiting for a lost one, or for the receiver to resume
+    auto next = rx_next.load();
+    for (auto it = rx_out_of_order.find(next); it != rx_out_of_order.end() && !rx_paused.load(); it = rx_out_of_order.find(next)) {
+        recv_at = std::chrono::steady_clock::now();
+        recv_bytes += it->second.length();
+        recv_callback(it->second.c_str(), it->second.length());
+        rx_out_of_order.erase(it);
+        next++;
+    }
+
+    uint32_t sack = 0;
+    for (auto it = rx_out_of_order.upper_bound(next); it != rx_out_of_order.end() && it->first - next <= 32; ++it) {
+        sack |= 1u << (it->first - next - 1);
+    }
+    rx_next.store(next);
+    rx_sack.store(sack);
+}
+
+void udp_sock::apply_recv_paused(void)
+{
+    const auto paused = rx_paused_wanted.load();
+    if (paused == rx_paused.load()) {return;}
+    rx_paused.store(paused);
+    if (debug_level >= 2) {printf("udp_sock: receive %s.\n", paused ? "paused" : "resumed");}
+    if (!connected.load()) {return;}
+
+    if (!paused) {deliver_in_order();}
+    // Tell the sender now rather than with the next acknowledgement
+    send_control(UDP_ACK, peer, session.load());
+}
+
+void udp_sock::on_ack(uint32_t ack, uint32_t sack, bool paused)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    const auto now = std::chrono::steady_clock::now();
+
+    if (paused != peer_paused) {
+        peer_paused = paused;
+        if (!paused) {window_cv.notify_all();}
+    }
+
+    bool progress = false;
+    bool has_sample = false;
+    std::chrono::steady_clock::duration sample(0);
+    auto acked = [&](std::map<uint32_t, udp_pending_frame>::iterator it) {
+        // A retransmitted frame may have been acknowledged for its first copy,
+        // so it tells nothing about the RTT or about what was sent after it
+        if (!it->second.retransmitted) {
+            sample = now - it->second.sent_at;
+            has_sample = true;
+            delivered_sent_at = std::max(delivered_sent_at, it->second.sent_at);
+        }
+        progress = true;
+        return pending.erase(it);
+    };
+    for (auto it = pending.begin(); it != pending.end() && seq_before(it->first, ack);) {it = acked(it);}
+    for (int i = 0; sack != 0 && i < 32; i++) {
+        if (!(sack & (1u << i))) {continue;}
+        const auto it = pending.find(ack + 1 + i);
+        if (it != pending.end()) {acked(it);}
+    }
+
+    if (has_sample) {
+        // RFC 6298
+        if (!has_rtt) {
+            srtt = sample;
+            rttvar = sample / 2;
+            has_rtt = true;
+        } else {
+            const auto delta = srtt > sample ? srtt - sample : sample - srtt;
+            rttvar = (rttvar * 3 + delta) / 4;
+            srtt = (srtt * 7 + sample) / 8;
+        }
+        rto = std::min(std::max(srtt + std::max(rttvar * 4, UDP_RTO_SLACK), UDP_RTO_MIN), UDP_RTO_MAX);
+    }
+
+    if (progress) {
+        detect_losses(now);
+        window_cv.notify_all();
+    }
+    rearm_timer(now);
+}
+
+void udp_sock::detect_losses(std::chrono::steady_clock::time_point now)
+{
+    // A frame is lost once a frame sent after it has arrived (plus a little
+    // slack for reordering), or once it is overdue by an RTT from then on.
+    const auto reorder = std::max(srtt / 4, UDP_REORDER_MIN);
+    const auto overdue = has_rtt ? srtt + reorder : rto;
+    for (auto &p : pending) {
+        auto &frame = p.second;
+        if (frame.sent_at >= delivered_sent_at) {continue;}
+        if (frame.sent_at + reorder < delivered_sent_at || now - frame.sent_at >= overdue) {
+            if (debug_level >= 2) {log_write(LOG_UDP_FAST_RETRANSMIT, p.first);}
+            transmit(p.first, frame, now);
+        }
+    }
+}
+
+void udp_sock::send_control(uint8_t type, const struct sockaddr_in &to, uint32_t session)
+{
+    char buf[sizeof(udp_frame_header)];
+    const auto len = encode_header(buf, type, rx_paused.load() ? UDP_FLAG_PAUSED : 0, session, 0, rx_next.load(), rx_sack.load(), 0);
+    sendto(fd, buf, len, 0, reinterpret_cast<const struct sockaddr *>(&to), sizeof(to));
+    send_calls++;
+    keepalive_at = std::chrono::steady_clock::now();
+}
+
+void udp_sock::transmit(uint32_t seq, udp_pending_frame &frame, std::chrono::steady_clock::time_point now)
+{
+    char buf[sizeof(udp_frame_header) + UDP_PAYLOAD_MAX];
+    const auto hdr_len = encode_header(buf, UDP_DATA, rx_paused.load() ? UDP_FLAG_PAUSED : 0, session.load(), seq,
+        rx_next.load(), rx_sack.load(), frame.payload.length());
+    memcpy(buf + hdr_len, frame.payload.data(), frame.payload.length());
+
+    while (sendto(fd, buf, hdr_len + frame.payload.length(), 0, reinterpret_cast<struct sockaddr *>(&peer), sizeof(peer)) < 0) {
+        if (errno == EINTR) {continue;}
+        // Lost like any other datagram; the retransmit timer takes care of it
+        if (debug_level >= 1) {printf("udp_sock: sendto(): %s\n", std::strerror(errno));}
+        break;
+    }
+    send_calls++;
+
+    if (frame.sent_at != std::chrono::steady_clock::time_point()) {
+        frame.retransmitted = true;
+        retransmits++;
+    }
+    frame.sent_at = now;
+}
+
+void udp_sock::on_timer_event(uint32_t events)
+{
+    (void) events;
+
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {return;}
+    const auto now = std::chrono::steady_clock::now();
+
+    if (connect_done) {
+        if (syn_attempts >= UDP_SYN_RETRIES || now >= connect_deadline) {
+            printf("udp_sock: connect(): timed out\n");
+            finish_connect(DIAL_NO_CARRIER);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        if (fd < 0) {
+            // Still looking up the host
+            arm_timer(connect_deadline);
+            return;
+        }
+        syn_attempts++;
+        send_control(UDP_SYN, peer, session.load());
+        arm_timer(std::min(now + std::chrono::steady_clock::duration(UDP_SYN_INTERVAL), connect_deadline));
+        return;
+    }
+    if (!connected.load()) {return;}
+
+    if (now.time_since_epoch() - std::chrono::nanoseconds(last_recv_ns.load()) >= UDP_PEER_TIMEOUT) {
+        printf("udp_sock: connection timed out.\n");
+        close_comm(true);
+        return;
+    }
+
+    if (now - keepalive_at >= UDP_KEEPALIVE_INTERVAL) {send_control(UDP_ACK, peer, session.load());}
+
+    std::lock_guard<std::mutex> lock(mtx);
+    if (peer_paused) {
+        rearm_timer(now);
+        return;
+    }
+    detect_losses(now);
+    bool timed_out = false;
+    for (auto &p : pending) {
+        if (now - p.second.sent_at >= rto) {
+            transmit(p.first, p.second, now);
+            timed_out = true;
+        }
+    }
+    if (timed_out) {
+        if (debug_level >= 1) {printf("udp_sock: retransmit timeout (%ld ms).\n", (long) std::chrono::duration_cast<std::chrono::milliseconds>(rto).count());}
+        rto = std::min(rto * 2, UDP_RTO_MAX);
+    }
+    rearm_timer(now);
+}
+
+void udp_sock::arm_timer(std::chrono::steady_clock::time_point at)
+{
+    // mtx must be held
+    timer_at = at;
+    const auto ns = std::max<int64_t>(to_ns(at), 1);
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void udp_sock::rearm_timer(std::chrono::steady_clock::time_point now)
+{
+    // mtx must be held. Waking up too early is harmless, the handler re-arms.
+    auto next = now + std::chrono::steady_clock::duration(UDP_KEEPALIVE_INTERVAL);
+    if (peer_paused) {
+        // Nothing is lost while the peer holds our frames
+        if (next < timer_at || timer_at <= now) {arm_timer(next);}
+        return;
+    }
+    const auto overdue = has_rtt ? srtt + std::max(srtt / 4, UDP_REORDER_MIN) : rto;
+    for (auto &p : pending) {
+        next = std::min(next, p.second.sent_at + rto);
+        if (p.second.sent_at < delivered_sent_at) {next = std::min(next, p.second.sent_at + overdue);}
+    }
+    if (next < timer_at || timer_at <= now) {arm_timer(next);}
+}
+
+void udp_sock::reset_state(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    const auto now = std::chrono::steady_clock::now();
+    next_seq = 0;
+    pending.clear();
+    delivered_sent_at = std::chrono::steady_clock::time_point();
+    srtt = std::chrono::steady_clock::duration(0);
+    rttvar = std::chrono::steady_clock::duration(0);
+    rto = UDP_RTO_INITIAL;
+    has_rtt = false;
+    peer_paused = false;
+    timer_at = std::chrono::steady_clock::time_point();
+    rx_next.store(0);
+    rx_sack.store(0);
+    rx_out_of_order.clear();
+    rx_paused.store(rx_paused_wanted.load());
+    last_recv_ns.store(to_ns(now));
+    keepalive_at = now;
+}
+
+void udp_sock::finish_connect(dial_result result)
+{
+    auto done = std::move(connect_done);
+    connect_done = nullptr;
+    connect_generation++;
+    if (result == DIAL_CONNECTED) {
+        connected.store(true);
+        std::lock_guard<std::mutex> lock(mtx);
+        rearm_timer(std::chrono::steady_clock::now());
+    } else if (fd >= 0) {
+        loop->remove(fd);
+        ::close(fd);
+        fd = -1;
+    }
+    done(result);
+}
+
+void udp_sock::close_comm(bool notify)
+{
+    if (!connected.load()) {return;}
+    connected.store(false);
+
+    {
+        // A sender blocked on the window gives up once it sees !connected
+        std::lock_guard<std::mutex> lock(mtx);
+        pending.clear();
+        if (!is_server) {
+            loop->remove(fd);
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    window_cv.notify_all();
+
+    if (notify && disconnect_callback) {disconnect_callback();}
+}
+
+udp_sock::udp_sock(event_loop *loop, bool is_server, const char *ip_addr, uint16_t port) : rng(std::random_device()())
+{
+    udp_sock::loop = loop;
+    udp_sock::is_server = is_server;
+    fd = -1;
+    connected.store(false);
+    session.store(0);
+    dns = new resolver(loop);
+    target_port = port;
+    connect_generation = 0;
+    connect_deadline = std::chrono::steady_clock::time_point::max();
+    syn_attempts = 0;
+    recv_calls.store(0);
+    recv_bytes.store(0);
+    send_calls.store(0);
+    send_bytes.store(0);
+    retransmits.store(0);
+    rx_paused_wanted.store(false);
+    reset_state();
+
+    sock_handler = [this](uint32_t events) {on_sock_event(events);};
+    timer_handler = [this](uint32_t events) {on_timer_event(events);};
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip_addr);
+    peer = addr;
+    if (!is_server) {target_host = ip_addr;}
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        throw std::runtime_error((std::string) "udp_sock: timerfd_create(): " + std::strerror(errno));
+    }
+
+    if (is_server) {
+        fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error((std::string) "udp_sock: socket(): " + std::strerror(errno));
+        }
+
+        const int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+            close(fd);
+            throw std::runtime_error((std::string) "udp_sock: bind(): " + std::strerror(errno));
+        }
+    }
+
+    loop->run_sync([this]{
+        udp_sock::loop->add(timer_fd, EPOLLIN, &timer_handler);
+        if (fd >= 0) {udp_sock::loop->add(fd, EPOLLIN, &sock_handler);}
+    });
+}
+
+udp_sock::~udp_sock()
+{
+    // Answers of lookups already done are posted before the task below
+    delete dns;
+    loop->run_sync([this]{
+        close_comm(false);
+        connect_done = nullptr; // the socket is closed below
+        if (fd >= 0) {
+            loop->remove(fd);
+            close(fd);
+            fd = -1;
+        }
+        loop->remove(timer_fd);
+        close(timer_fd);
+    });
+}
+
+void udp_sock::set_debug_level(const int level)
+{
+    debug_level = level;
+}
+
+void udp_sock::set_ring_callback(std::function<void(void)> func)
+{
+    ring_callback = func;
+}
+
+void udp_sock::set_recv_callback(std::function<void(const char *, size_t)> func)
+{
+    recv_callback = func;
+}
+
+void udp_sock::set_disconnect_callback(std::function<void(void)> func)
+{
+    disconnect_callback = func;
+}
+
+void udp_sock::set_addr(const struct sockaddr_in *addr_in)
+{
+    loop->run_sync([this, addr_in]{
+        memcpy(&addr, addr_in, sizeof(addr));
+        target_host.clear();
+    });
+}
+
+bool udp_sock::is_connected()
+{
+    return connected.load();
+}
+
+void udp_sock::set_target(const std::string &host, uint16_t port)
+{
+    loop->run_sync([this, host, port]{
+        target_host = host;
+        target_port = port;
+    });
+}
+
+bool udp_sock::connect()
+{
+    std::promise<bool> result;
+    connect_async([&result](dial_result r){result.set_value(r == DIAL_CONNECTED);}, std::chrono::milliseconds(0));
+    return result.get_future().get();
+}
+
+void udp_sock::connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout)
+{
+    loop->post([this, done, timeout]{
+        if (connect_done) {finish_connect(DIAL_NO_CARRIER);}
+        if (is_server || connected.load()) {
+            done(DIAL_BUSY);
+            return;
+        }
+        connect_done = done;
+        connect_deadline = timeout.count() > 0 ? std::chrono::steady_clock::now() + timeout : std::chrono::steady_clock::time_point::max();
+        syn_attempts = 0;
+        if (target_host.empty()) {
+            start_handshake(addr);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            arm_timer(connect_deadline);
+        }
+        const auto generation = connect_generation;
+        dns->resolve(target_host, target_port, [this, generation](const std::vector<struct sockaddr_storage> &addrs) {
+            if (generation != connect_generation || !connect_done) {return;} // aborted meanwhile
+            for (const auto &a : addrs) {
+                if (a.ss_family != AF_INET) {continue;}
+                struct sockaddr_in to;
+                memcpy(&to, &a, sizeof(to));
+                start_handshake(to);
+                return;
+            }
+            printf("udp_sock: no IPv4 address for %s\n", target_host.c_str());
+            finish_connect(DIAL_NO_CARRIER);
+        });
+    });
+}
+
+void udp_sock::start_handshake(const struct sockaddr_in &to)
+{
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error((std::string) "udp_sock: socket(): " + std::strerror(errno));
+    }
+    // Connected so that the kernel drops datagrams from anyone else
+    if (::connect(fd, reinterpret_cast<const struct sockaddr *>(&to), sizeof(to)) < 0) {
+        printf("udp_sock: connect(): %s\n", std::strerror(errno));
+        ::close(fd);
+        fd = -1;
+        finish_connect(DIAL_NO_CARRIER);
+        return;
+    }
+    loop->add(fd, EPOLLIN, &sock_handler);
+
+    peer = to;
+    session.store(rng());
+    reset_state();
+    syn_attempts = 1;
+    send_control(UDP_SYN, peer, session.load());
+    std::lock_guard<std::mutex> lock(mtx);
+    arm_timer(std::min(std::chrono::steady_clock::now() + std::chrono::steady_clock::duration(UDP_SYN_INTERVAL), connect_deadline));
+}
+
+void udp_sock::abort_connect()
+{
+    loop->post([this]{
+        if (connect_done) {finish_connect(DIAL_NO_CARRIER);}
+    });
+}
+
+void udp_sock::disconnect()
+{
+    loop->run_sync([this]{
+        if (!connected.load()) {return;}
+        // No retransmission for FIN; send it twice and let the peer time out otherwise
+        send_control(UDP_FIN, peer, session.load());
+        send_control(UDP_FIN, peer, session.load());
+        close_comm(false);
+    });
+}
+
+void udp_sock::send(const char *buffer, size_t length)
+{
+    if (!connected.load()) {
+        printf("udp_sock: socket closed.\n");
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mtx);
+    size_t ptr = 0;
+    while (ptr < length) {
+        // Block this caller, not the loop, while the window is full or the peer paused
+        while (connected.load() && (pending.size() >= UDP_WINDOW || peer_paused)) {window_cv.wait_for(lock, 100ms);}
+        if (!connected.load()) {break;}
+
+        const auto chunk = std::min(length - ptr, UDP_PAYLOAD_MAX);
+        auto &frame = pending[next_seq];
+        frame.payload.assign(buffer + ptr, chunk);
+        frame.retransmitted = false;
+        frame.sent_at = std::chrono::steady_clock::time_point();
+        transmit(next_seq, frame, std::chrono::steady_clock::now());
+        next_seq++;
+        ptr += chunk;
+        send_bytes += chunk;
+    }
+    if (connected.load()) {rearm_timer(std::chrono::steady_clock::now());}
+}
+
+void udp_sock::set_recv_paused(bool paused)
+{
+    rx_paused_wanted.store(paused);
+    if (loop->in_loop_thread()) {
+        apply_recv_paused();
+    } else {
+        loop->post([this]{apply_recv_paused();});
+    }
+}
+
+std::chrono::steady_clock::time_point udp_sock::get_recv_time(void)
+{
+    return recv_at;
+}
+
+transport_stats udp_sock::get_stats(void)
+{
+    return {recv_calls.load(), recv_bytes.load(), send_calls.load(), send_bytes.load(), retransmits.load(), 0, 0, 0, 0, 0};
+}
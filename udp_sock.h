@@ -0,0 +1,112 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+class event_loop;
+class resolver;
+
+// Frame sent by udp_sock::send(), kept until the peer acknowledges it
+struct udp_pending_frame {
+    std::string payload;
+    std::chrono::steady_clock::time_point sent_at; // last transmission
+    bool retransmitted; // no RTT sample from it (Karn)
+};
+
+// Datagram transport with selective acknowledgement.
+// Every frame carries a sequence number; the receiver delivers payloads in
+// order and acknowledges with the next expected sequence number plus a bitmap
+// of the 32 frames after it. A frame is sent again as soon as a frame sent
+// after it has been acknowledged, so one lost datagram costs about one round
+// trip instead of a TCP retransmit timeout.
+// Sender state is shared with the sending thread under mtx; receiver state is
+// only touched on the loop thread.
+class udp_sock : public transport {
+    private:
+        event_loop *loop;
+        int fd; // server: bound socket, client: socket of the current call
+        int timer_fd;
+        bool is_server;
+        int debug_level = 0;
+        struct sockaddr_in addr;
+        struct sockaddr_in peer;
+        std::mt19937 rng;
+        char recv_buf[2048];
+        std::chrono::steady_clock::time_point recv_at;
+        std::atomic<bool> connected;
+        std::atomic<uint32_t> session; // random per call, tells stale datagrams apart
+        // client handshake, loop thread only
+        resolver *dns;
+        std::string target_host; // empty: addr; only its IPv4 addresses are used
+        uint16_t target_port;
+        uint32_t connect_generation; // tells the answer of an old lookup apart
+        std::function<void(dial_result)> connect_done; // set while a call is set up
+        std::chrono::steady_clock::time_point connect_deadline;
+        int syn_attempts;
+        // sender state, guarded by mtx
+        std::mutex mtx;
+        std::condition_variable window_cv;
+        uint32_t next_seq;
+        std::map<uint32_t, udp_pending_frame> pending;
+        std::chrono::steady_clock::time_point delivered_sent_at; // latest send time of an acknowledged frame
+        std::chrono::steady_clock::duration srtt, rttvar, rto;
+        bool has_rtt;
+        bool peer_paused; // the peer holds our frames; no new frames, no retransmits
+        std::chrono::steady_clock::time_point timer_at;
+        // receiver state, loop thread only
+        std::atomic<uint32_t> rx_next; // next in-order sequence number
+        std::atomic<uint32_t> rx_sack;
+        std::map<uint32_t, std::string> rx_out_of_order; // also in-order frames while paused
+        std::atomic<bool> rx_paused_wanted;
+        std::atomic<bool> rx_paused; // applied state, written on the loop thread
+        std::atomic<int64_t> last_recv_ns;
+        std::chrono::steady_clock::time_point keepalive_at;
+        std::atomic<uint64_t> recv_calls, recv_bytes, send_calls, send_bytes, retransmits;
+        std::function<void(void)> ring_callback;
+        std::function<void(const char *, size_t)> recv_callback;
+        std::function<void(void)> disconnect_callback;
+        std::function<void(uint32_t)> sock_handler;
+        std::function<void(uint32_t)> timer_handler;
+        void on_sock_event(uint32_t events);
+        void on_timer_event(uint32_t events);
+        void on_frame(const struct sockaddr_in &from, const char *frame, size_t length);
+        void on_data(uint32_t seq, const char *payload, size_t length);
+        void on_ack(uint32_t ack, uint32_t sack, bool paused);
+        void deliver_in_order(void);
+        void apply_recv_paused(void);
+        void send_control(uint8_t type, const struct sockaddr_in &to, uint32_t session);
+        void transmit(uint32_t seq, udp_pending_frame &frame, std::chrono::steady_clock::time_point now);
+        void detect_losses(std::chrono::steady_clock::time_point now);
+        void arm_timer(std::chrono::steady_clock::time_point at);
+        void rearm_timer(std::chrono::steady_clock::time_point now);
+        void reset_state(void);
+        void start_handshake(const struct sockaddr_in &to);
+        void finish_connect(dial_result result);
+        void close_comm(bool notify);
+    public:
+        udp_sock(event_loop *loop, bool is_server, const char *ip_addr, uint16_t port);
+        ~udp_sock() override;
+        void set_debug_level(const int level) override;
+        void set_ring_callback(std::function<void(void)> func) override;
+        void set_recv_callback(std::function<void(const char *, size_t)> func) override;
+        void set_disconnect_callback(std::function<void(void)> func) override;
+        void set_addr(const struct sockaddr_in *addr_in) override;
+        void set_target(const std::string &host, uint16_t port) override;
+        bool is_connected() override;
+        bool connect() override;
+        void connect_async(std::function<void(dial_result)> done, std::chrono::milliseconds timeout) override;
+        void abort_connect() override;
+        void disconnect() override;
+        void send(const char *buffer, size_t length) override;
+        void set_recv_paused(bool paused) override;
+        std::chrono::steady_clock::time_point get_recv_time(void) override;
+        transport_stats get_stats(void) override;
+};
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "uring.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring::uring(void)
+{
+    ring_fd = -1;
+    sq_ring = MAP_FAILED;
+    cq_ring = MAP_FAILED;
+    sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    sq_ring_size = cq_ring_size = sqes_size = 0;
+    sq_queued = 0;
+    buf_ring = static_cast<struct io_uring_buf_ring *>(MAP_FAILED);
+    buf_ring_size = 0;
+    bufs = nullptr;
+    buf_count = 0;
+    buf_size = 0;
+    buf_tail = 0;
+    enters.store(0);
+}
+
+uring::~uring()
+{
+    release();
+}
+
+void uring::release(void)
+{
+    // Closing the ring also drops its registered files and buffers
+    if (ring_fd >= 0) {close(ring_fd);}
+    ring_fd = -1;
+    if (buf_ring != MAP_FAILED) {munmap(buf_ring, buf_ring_size);}
+    buf_ring = static_cast<struct io_uring_buf_ring *>(MAP_FAILED);
+    delete[] bufs;
+    bufs = nullptr;
+    if (sqes != MAP_FAILED) {munmap(sqes, sqes_size);}
+    sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {munmap(cq_ring, cq_ring_size);}
+    cq_ring = MAP_FAILED;
+    if (sq_ring != MAP_FAILED) {munmap(sq_ring, sq_ring_size);}
+    sq_ring = MAP_FAILED;
+}
+
+bool uring::init(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Room for the completions of every buffer while the reaper is busy
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring_fd = io_uring_setup(entries, &params);
+    if (ring_fd < 0) {return false;}
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        release();
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            release();
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        release();
+        return false;
+    }
+
+    auto sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+    return true;
+}
+
+int uring::get_fd(void)
+{
+    return ring_fd;
+}
+
+std::mutex &uring::get_sq_lock(void)
+{
+    return sq_mtx;
+}
+
+struct io_uring_sqe *uring::get_sqe(void)
+{
+    const auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    const auto tail = *sq_tail + sq_queued;
+    if (tail - head >= sq_entries) {return nullptr;}
+
+    const auto index = tail & *sq_mask;
+    auto sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    sq_queued++;
+    return sqe;
+}
+
+int uring::submit(void)
+{
+    if (sq_queued == 0) {return 0;}
+    __atomic_store_n(sq_tail, *sq_tail + sq_queued, __ATOMIC_RELEASE);
+    const auto count = sq_queued;
+    sq_queued = 0;
+
+    int ret;
+    do {
+        ret = io_uring_enter(ring_fd, count, 0, 0);
+        enters++;
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+struct io_uring_cqe *uring::peek_cqe(void)
+{
+    const auto head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {return nullptr;}
+    return &cqes[head & *cq_mask];
+}
+
+void uring::cqe_seen(void)
+{
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool uring::setup_buffers(uint16_t group, unsigned count, size_t size)
+{
+    // The kernel wants a power of two ring on its own pages
+    buf_ring_size = count * sizeof(struct io_uring_buf);
+    buf_ring = static_cast<struct io_uring_buf_ring *>(mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (buf_ring == MAP_FAILED) {return false;}
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(buf_ring, buf_ring_size);
+        buf_ring = static_cast<struct io_uring_buf_ring *>(MAP_FAILED);
+        return false;
+    }
+
+    bufs = new char[count * size];
+    buf_count = count;
+    buf_size = size;
+    buf_tail = 0;
+    for (unsigned id = 0; id < count; id++) {recycle_buffer(id);}
+    return true;
+}
+
+const char *uring::get_buffer(uint16_t id)
+{
+    return bufs + id * buf_size;
+}
+
+void uring::recycle_buffer(uint16_t id)
+{
+    // Not buf_ring->bufs: in C++ the empty struct of __DECLARE_FLEX_ARRAY moves it
+    auto &buf = reinterpret_cast<struct io_uring_buf *>(buf_ring)[buf_tail & (buf_count - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(bufs + id * buf_size);
+    buf.len = buf_size;
+    buf.bid = id;
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+bool uring::register_files(unsigned count)
+{
+    // -1 leaves a slot empty
+    std::vector<int> fds(count, -1);
+    return io_uring_register(ring_fd, IORING_REGISTER_FILES, fds.data(), count) >= 0;
+}
+
+bool uring::update_file(unsigned slot, int fd)
+{
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = reinterpret_cast<uint64_t>(&fd);
+    return io_uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) >= 0;
+}
+
+uint64_t uring::get_enters(void)
+{
+    return enters.load();
+}
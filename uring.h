@@ -0,0 +1,57 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on the raw system calls (liburing is not on the
+// boards). One thread reaps completions; any thread may queue submissions
+// while holding get_sq_lock().
+class uring {
+    private:
+        int ring_fd;
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+        unsigned sq_entries;
+        unsigned sq_queued; // filled by get_sqe(), not yet passed to the kernel
+        std::mutex sq_mtx;
+        // provided buffer ring for multishot receives
+        struct io_uring_buf_ring *buf_ring;
+        size_t buf_ring_size;
+        char *bufs;
+        unsigned buf_count;
+        size_t buf_size;
+        uint16_t buf_tail;
+        std::atomic<uint64_t> enters; // io_uring_enter() calls
+        void release(void);
+    public:
+        uring(void);
+        ~uring();
+        // False when the kernel has no (or a disabled) io_uring
+        bool init(unsigned entries);
+        int get_fd(void);
+        std::mutex &get_sq_lock(void);
+        // Next free submission entry, cleared; nullptr if the SQ is full
+        struct io_uring_sqe *get_sqe(void);
+        // Passes the queued entries to the kernel with one io_uring_enter()
+        int submit(void);
+        // Completions, reaper thread only. No system call is needed.
+        struct io_uring_cqe *peek_cqe(void);
+        void cqe_seen(void);
+        // Registers count buffers of size bytes as buffer group group
+        bool setup_buffers(uint16_t group, unsigned count, size_t size);
+        const char *get_buffer(uint16_t id);
+        // Gives a buffer picked by the kernel back to the ring, reaper thread only
+        void recycle_buffer(uint16_t id);
+        // Sparse table of registered files; slots are set with update_file()
+        bool register_files(unsigned count);
+        bool update_file(unsigned slot, int fd);
+        uint64_t get_enters(void);
+};
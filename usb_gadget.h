@@ -0,0 +1,24 @@
+#include <cstdint>
+
+#include <linux/usb/raw_gadget.h>
+
+// Device side of a USB connection, as seen by the modem emulation.
+// usb_raw_gadget talks to a real host through /dev/raw-gadget;
+// usb_sim_host plays the host in-process.
+class usb_gadget
+{
+    public:
+        virtual ~usb_gadget() {}
+        virtual void set_debug_level(const int level) = 0;
+        virtual void init(enum usb_device_speed speed, const char *driver_name, const char *device_name) = 0;
+        virtual void run(void) = 0;
+        virtual void event_fetch(struct usb_raw_event *event) = 0;
+        virtual int ep0_write(struct usb_raw_ep_io *io) = 0;
+        virtual int ep0_read(struct usb_raw_ep_io *io) = 0;
+        virtual void ep0_stall(void) = 0;
+        virtual int ep_enable(struct usb_endpoint_descriptor *desc) = 0;
+        virtual int ep_write(struct usb_raw_ep_io *io) = 0;
+        virtual int ep_read(struct usb_raw_ep_io *io) = 0;
+        virtual void vbus_draw(uint32_t bMaxPower) = 0;
+        virtual void configure() = 0;
+};
@@ -1,7 +1,4 @@
 #include <cstdio>
-#include <map>
-#include <stdexcept>
-#include <string>
 
 #include <linux/usb/raw_gadget.h>
 
@@ -65,19 +62,16 @@ uint8_t usb_raw_control_event::get_request(void)
 
 const char* usb_raw_control_event::get_request_string(void)
 {
-    static std::map<uint8_t, const char *> request_string_map = {
-        {USB_REQ_GET_DESCRIPTOR, "USB_REQ_GET_DESCRIPTOR"},
-        {USB_REQ_SET_CONFIGURATION, "USB_REQ_SET_CONFIGURATION"},
-        {USB_REQ_SET_INTERFACE, "USB_REQ_SET_INTERFACE"}
-    };
-
-    auto request = get_request();
-
-    if (request_string_map.find(request) != request_string_map.end()) {
-        return request_string_map[request];
+    switch (get_request()) {
+        case USB_REQ_GET_DESCRIPTOR:
+            return "USB_REQ_GET_DESCRIPTOR";
+        case USB_REQ_SET_CONFIGURATION:
+            return "USB_REQ_SET_CONFIGURATION";
+        case USB_REQ_SET_INTERFACE:
+            return "USB_REQ_SET_INTERFACE";
+        default:
+            return "unknown";
     }
-
-    return "unknown";
 }
 
 unsigned int usb_raw_control_event::get_descriptor_type(void)
@@ -87,22 +81,24 @@ unsigned int usb_raw_control_event::get_descriptor_type(void)
 
 const char* usb_raw_control_event::get_descriptor_type_string(void)
 {
-    static std::map<unsigned int, const char *> descriptor_type_string_map = {
-        {USB_DT_DEVICE, "USB_DT_DEVICE"},
-        {USB_DT_CONFIG, "USB_DT_CONFIG"},
-        {USB_DT_STRING, "USB_DT_STRING"},
-        {USB_DT_INTERFACE, "USB_DT_INTERFACE"},
-        {USB_DT_ENDPOINT, "USB_DT_ENDPOINT"},
-        {USB_DT_DEVICE_QUALIFIER, "USB_DT_DEVICE_QUALIFIER"},
-        {USB_DT_OTHER_SPEED_CONFIG, "USB_DT_OTHER_SPEED_CONFIG"},
-        {USB_DT_INTERFACE_POWER, "USB_DT_INTERFACE_POWER"}
-    };
-
-    auto descriptor_type = get_descriptor_type();
-
-    if (descriptor_type_string_map.find(descriptor_type) != descriptor_type_string_map.end()) {
-        return descriptor_type_string_map[descriptor_type];
+    switch (get_descriptor_type()) {
+        case USB_DT_DEVICE:
+            return "USB_DT_DEVICE";
+        case USB_DT_CONFIG:
+            return "USB_DT_CONFIG";
+        case USB_DT_STRING:
+            return "USB_DT_STRING";
+        case USB_DT_INTERFACE:
+            return "USB_DT_INTERFACE";
+        case USB_DT_ENDPOINT:
+            return "USB_DT_ENDPOINT";
+        case USB_DT_DEVICE_QUALIFIER:
+            return "USB_DT_DEVICE_QUALIFIER";
+        case USB_DT_OTHER_SPEED_CONFIG:
+            return "USB_DT_OTHER_SPEED_CONFIG";
+        case USB_DT_INTERFACE_POWER:
+            return "USB_DT_INTERFACE_POWER";
+        default:
+            return "unknown";
     }
-
-    return "unknown";
 }
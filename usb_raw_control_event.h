@@ -2,10 +2,17 @@
 
 #include <linux/usb/raw_gadget.h>
 
+// Same layout as struct usb_raw_event, see usb_ep_io_header in me56ps2.h
+struct usb_raw_event_header {
+    __u32 type;
+    __u32 length;
+};
+static_assert(sizeof(usb_raw_event_header) == sizeof(usb_raw_event), "usb_raw_event_header must match usb_raw_event");
+
 class usb_raw_control_event
 {
     public:
-        struct usb_raw_event event;
+        struct usb_raw_event_header event;
         struct usb_ctrlrequest ctrl;
         bool is_event(__u8 request_type);
         bool is_event(__u8 request_type, __u8 request);
@@ -16,4 +23,5 @@ class usb_raw_control_event
         const char* get_request_string(void);
         unsigned int get_descriptor_type(void);
         const char* get_descriptor_type_string(void);
+        struct usb_raw_event *get_raw_event(void) {return reinterpret_cast<struct usb_raw_event *>(&event);}
 };
@@ -8,26 +8,9 @@
 #include <unistd.h>
 #include <vector>
 
+#include "usb_gadget.h"
 #include "usb_raw_gadget.h"
-
-void usb_raw_gadget::dump_hex_and_ascii(void *data, const size_t length)
-{
-    uint8_t *c = reinterpret_cast<uint8_t *>(data);
-    for (size_t offset = 0; offset < length; offset += 16) {
-        printf("  %04lx: ", offset);
-        for (size_t p = 0; p < 16; p++) {
-            if (offset + p < length) {
-                printf("%02x ", c[offset + p]);
-            } else {
-                printf("   ");
-            }
-        }
-        for (size_t p = 0; p < 16 && offset + p < length; p++) {
-            printf("%c", isprint(c[offset + p]) ? c[offset + p] : '.');
-        }
-        printf("\n");
-    }
-}
+#include "async_log.h"
 
 usb_raw_gadget::usb_raw_gadget(const char *file)
 {
@@ -101,8 +84,7 @@ int usb_raw_gadget::ep0_write(struct usb_raw_ep_io *io)
     if (ret < 0) {
         throw std::runtime_error((std::string) "ioctl(USB_RAW_IOCTL_EP0_WRITE): " + std::strerror(errno));
     }
-    if (debug_level >= 1) {printf("ep0: write: transferred %d bytes.\n", ret);}
-    if (debug_level >= 3) {dump_hex_and_ascii(io->data, ret);}
+    if (debug_level >= 1) {log_write(LOG_EP0_WRITE, ret, 0, debug_level >= 3 ? io->data : nullptr, ret);}
     return ret;
 }
 
@@ -112,14 +94,13 @@ int usb_raw_gadget::ep0_read(struct usb_raw_ep_io *io)
     if (ret < 0) {
         throw std::runtime_error((std::string) "ioctl(USB_RAW_IOCTL_EP0_READ): " + std::strerror(errno));
     }
-    if (debug_level >= 1) {printf("ep0: read: transferred %d bytes.\n", ret);}
-    if (debug_level >= 3) {dump_hex_and_ascii(io->data, ret);}
+    if (debug_level >= 1) {log_write(LOG_EP0_READ, ret, 0, debug_level >= 3 ? io->data : nullptr, ret);}
     return ret;
 }
 
 void usb_raw_gadget::ep0_stall(void)
 {
-    if (debug_level >= 1) {printf("ep0: stall\n");}
+    if (debug_level >= 1) {log_write(LOG_EP0_STALL);}
     int ret = ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
     if (ret < 0) {
         throw std::runtime_error((std::string) "ioctl(USB_RAW_IOCTL_EP0_STALL): " + std::strerror(errno));
@@ -141,8 +122,7 @@ int usb_raw_gadget::ep_write(struct usb_raw_ep_io *io)
     if (ret < 0) {
         throw std::runtime_error((std::string) "ioctl(USB_RAW_IOCTL_EP_WRITE): " + std::strerror(errno));
     }
-    if (debug_level >= 1) {printf("ep%d: write: transferred %d bytes.\n", io->ep, ret);}
-    if (debug_level >= 3) {dump_hex_and_ascii(io->data, ret);}
+    if (debug_level >= 1) {log_write(LOG_EP_WRITE, io->ep, ret, debug_level >= 3 ? io->data : nullptr, ret);}
     return ret;
 }
 
@@ -152,8 +132,7 @@ int usb_raw_gadget::ep_read(struct usb_raw_ep_io *io)
     if (ret < 0) {
         throw std::runtime_error((std::string) "ioctl(USB_RAW_IOCTL_EP_READ): " + std::strerror(errno));
     }
-    if (debug_level >= 1) {printf("ep%d: read: transferred %d bytes.\n", io->ep, ret);}
-    if (debug_level >= 3) {dump_hex_and_ascii(io->data, ret);}
+    if (debug_level >= 1) {log_write(LOG_EP_READ, io->ep, ret, debug_level >= 3 ? io->data : nullptr, ret);}
     return ret;
 }
 
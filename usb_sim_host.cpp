@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "usb_gadget.h"
+#include "usb_sim_host.h"
+
+constexpr size_t BULK_PACKET_SIZE = 64;
+constexpr size_t BULK_OUT_PAYLOAD_MAX = 63; // the length must fit in the header byte as "length << 2"
+
+usb_sim_host::usb_sim_host(const usb_sim_host_timing &timing)
+{
+    usb_sim_host::timing = timing;
+    ep_in = -1;
+    ep_out = -1;
+    num_eps = 0;
+    configured = false;
+    dcd = false;
+    memset(&stats, 0, sizeof(stats));
+}
+
+usb_sim_host::~usb_sim_host()
+{
+}
+
+void usb_sim_host::push_control(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint16_t length)
+{
+    struct usb_ctrlrequest ctrl;
+    ctrl.bRequestType = request_type;
+    ctrl.bRequest = request;
+    ctrl.wValue = value;
+    ctrl.wIndex = index;
+    ctrl.wLength = length;
+    event_queue.push_back({USB_RAW_EVENT_CONTROL, ctrl});
+    cv.notify_all();
+}
+
+void usb_sim_host::set_debug_level(const int level)
+{
+    debug_level = level;
+}
+
+void usb_sim_host::init(enum usb_device_speed speed, const char *driver_name, const char *device_name)
+{
+    (void) speed;
+    (void) driver_name;
+    (void) device_name;
+}
+
+void usb_sim_host::run(void)
+{
+    // Plug in: the host resets the device and walks the usual enumeration
+    std::lock_guard<std::mutex> lock(mtx);
+    run_at = std::chrono::steady_clock::now();
+
+    struct usb_ctrlrequest none;
+    memset(&none, 0, sizeof(none));
+    event_queue.push_back({USB_RAW_EVENT_CONNECT, none});
+
+    const uint8_t get = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE;
+    push_control(get, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, 64);
+    push_control(get, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, USB_DT_DEVICE_SIZE);
+    push_control(get, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, USB_DT_CONFIG_SIZE);
+    push_control(get, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, 255);
+    push_control(get, USB_REQ_GET_DESCRIPTOR, USB_DT_STRING << 8, 0, 255);
+    push_control(get, USB_REQ_GET_DESCRIPTOR, (USB_DT_STRING << 8) | 2, 0x0409, 255);
+    push_control(USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE, USB_REQ_SET_CONFIGURATION, 1, 0, 0);
+}
+
+void usb_sim_host::event_fetch(struct usb_raw_event *event)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{return !event_queue.empty();});
+
+    const auto e = event_queue.front();
+    event_queue.pop_front();
+    event->type = e.first;
+    if (e.first == USB_RAW_EVENT_CONTROL) {
+        memcpy(event->data, &e.second, sizeof(e.second));
+        event->length = sizeof(e.second);
+        stats.control_requests++;
+    } else {
+        event->length = 0;
+    }
+}
+
+int usb_sim_host::ep0_write(struct usb_raw_ep_io *io)
+{
+    if (debug_level >= 1) {printf("sim: ep0: write: transferred %u bytes.\n", io->length);}
+    return io->length;
+}
+
+int usb_sim_host::ep0_read(struct usb_raw_ep_io *io)
+{
+    // None of the requests we send has an OUT data stage
+    (void) io;
+    return 0;
+}
+
+void usb_sim_host::ep0_stall(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    stats.stalls++;
+}
+
+int usb_sim_host::ep_enable(struct usb_endpoint_descriptor *desc)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    const auto ep = num_eps++;
+    if (desc->bEndpointAddress & USB_DIR_IN) {
+        ep_in = ep;
+    } else {
+        ep_out = ep;
+    }
+    return ep;
+}
+
+int usb_sim_host::ep_write(struct usb_raw_ep_io *io)
+{
+    // Bulk IN: the packet leaves when the host polls for it
+    std::unique_lock<std::mutex> lock(mtx);
+    const auto now = std::chrono::steady_clock::now();
+    const auto at = std::max(now, next_in_at);
+    next_in_at = at + timing.in_interval;
+    lock.unlock();
+    std::this_thread::sleep_until(at);
+    lock.lock();
+
+    // The transfer arrives as packets of up to 64 bytes, each with its own
+    // header: status byte (bit 7 = DCD), 0x60, then payload
+    if (io->ep != ep_in || io->length < 2) {return io->length;}
+    stats.in_transfers++;
+    for (size_t offset = 0; offset + 2 <= io->length; offset += BULK_PACKET_SIZE) {
+        const auto packet_length = std::min<size_t>(BULK_PACKET_SIZE, io->length - offset);
+        dcd = (io->data[offset] & 0x80) != 0;
+        rx.append(reinterpret_cast<const char *>(&io->data[offset + 2]), packet_length - 2);
+        stats.in_packets++;
+        if (packet_length == 2) {stats.in_status_packets++;}
+    }
+    cv.notify_all();
+    return io->length;
+}
+
+int usb_sim_host::ep_read(struct usb_raw_ep_io *io)
+{
+    // Bulk OUT: wait for the game to send something
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this]{return !tx.empty();});
+    const auto now = std::chrono::steady_clock::now();
+    const auto at = std::max(now, next_out_at);
+    next_out_at = at + timing.out_interval;
+    lock.unlock();
+    std::this_thread::sleep_until(at);
+    lock.lock();
+
+    // Packets until a short one or the end of the read buffer. When the queue
+    // runs dry after a full packet the transfer ends as if the host had sent
+    // a zero-length packet.
+    size_t offset = 0;
+    while (offset + BULK_PACKET_SIZE <= io->length && !tx.empty()) {
+        const auto length = std::min(tx.length(), BULK_OUT_PAYLOAD_MAX);
+        io->data[offset] = length << 2;
+        memcpy(&io->data[offset + 1], tx.data(), length);
+        tx.erase(0, length);
+        offset += length + 1;
+        stats.out_packets++;
+        if (length < BULK_OUT_PAYLOAD_MAX) {break;}
+    }
+    stats.out_transfers++;
+    return offset;
+}
+
+void usb_sim_host::vbus_draw(uint32_t bMaxPower)
+{
+    (void) bMaxPower;
+}
+
+void usb_sim_host::configure()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    configured = true;
+    configured_at = std::chrono::steady_clock::now();
+    cv.notify_all();
+}
+
+bool usb_sim_host::wait_configured(std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    return cv.wait_for(lock, timeout, [this]{return configured;});
+}
+
+std::chrono::steady_clock::duration usb_sim_host::get_enumeration_time(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return configured ? configured_at - run_at : std::chrono::steady_clock::duration::zero();
+}
+
+void usb_sim_host::set_dtr(bool high)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    push_control(USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0x01, high ? 0x0101 : 0x0100, 0, 0);
+}
+
+void usb_sim_host::write(const char *buffer, size_t length)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    tx.append(buffer, length);
+    cv.notify_all();
+}
+
+void usb_sim_host::write(const std::string &s)
+{
+    write(s.c_str(), s.length());
+}
+
+size_t usb_sim_host::read(char *buffer, size_t max_length, std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(mtx);
+    if (!cv.wait_for(lock, timeout, [this]{return !rx.empty();})) {return 0;}
+    const auto length = std::min(rx.length(), max_length);
+    memcpy(buffer, rx.data(), length);
+    rx.erase(0, length);
+    return length;
+}
+
+bool usb_sim_host::read_until(const std::string &s, std::chrono::milliseconds timeout)
+{
+    // Consume received data up to and including s
+    std::unique_lock<std::mutex> lock(mtx);
+    size_t pos = std::string::npos;
+    const auto found = cv.wait_for(lock, timeout, [this, &s, &pos]{
+        pos = rx.find(s);
+        return pos != std::string::npos;
+    });
+    if (!found) {return false;}
+    rx.erase(0, pos + s.length());
+    return true;
+}
+
+bool usb_sim_host::get_dcd(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return dcd;
+}
+
+usb_sim_host_stats usb_sim_host::get_stats(void)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return stats;
+}
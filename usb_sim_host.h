@@ -0,0 +1,76 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+
+struct usb_sim_host_timing {
+    // The host issues at most one bulk transaction per direction per interval
+    std::chrono::microseconds in_interval{1000};
+    std::chrono::microseconds out_interval{1000};
+};
+
+struct usb_sim_host_stats {
+    uint64_t control_requests;
+    uint64_t stalls;
+    uint64_t in_packets;
+    uint64_t in_status_packets; // bulk-IN packets without payload
+    uint64_t out_packets;
+    uint64_t in_transfers; // ep_write calls
+    uint64_t out_transfers; // ep_read calls
+};
+
+// Simulated PS2 host for running the emulator without a UDC. It enumerates
+// the device with the same control requests a host sends, polls bulk IN and
+// sends bulk-OUT frames with the "length << 2" header byte, several per
+// transfer when the emulator asks for it. The host side
+// methods (write, read_until, set_dtr, ...) stand in for the game.
+class usb_sim_host : public usb_gadget
+{
+    private:
+        int debug_level = 0;
+        usb_sim_host_timing timing;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::pair<uint32_t, struct usb_ctrlrequest>> event_queue; // event type, setup packet
+        int ep_in; // endpoint handles given out by ep_enable()
+        int ep_out;
+        int num_eps;
+        bool configured;
+        bool dcd;
+        std::string rx; // received from the modem
+        std::string tx; // waiting to be sent to the modem
+        std::chrono::steady_clock::time_point run_at;
+        std::chrono::steady_clock::time_point configured_at;
+        std::chrono::steady_clock::time_point next_in_at;
+        std::chrono::steady_clock::time_point next_out_at;
+        usb_sim_host_stats stats;
+        void push_control(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint16_t length);
+    public:
+        usb_sim_host(const usb_sim_host_timing &timing);
+        ~usb_sim_host();
+        // device side (called by the emulator)
+        void set_debug_level(const int level) override;
+        void init(enum usb_device_speed speed, const char *driver_name, const char *device_name) override;
+        void run(void) override;
+        void event_fetch(struct usb_raw_event *event) override;
+        int ep0_write(struct usb_raw_ep_io *io) override;
+        int ep0_read(struct usb_raw_ep_io *io) override;
+        void ep0_stall(void) override;
+        int ep_enable(struct usb_endpoint_descriptor *desc) override;
+        int ep_write(struct usb_raw_ep_io *io) override;
+        int ep_read(struct usb_raw_ep_io *io) override;
+        void vbus_draw(uint32_t bMaxPower) override;
+        void configure() override;
+        // host side (called by the simulated game)
+        bool wait_configured(std::chrono::milliseconds timeout);
+        std::chrono::steady_clock::duration get_enumeration_time(void);
+        void set_dtr(bool high);
+        void write(const char *buffer, size_t length);
+        void write(const std::string &s);
+        size_t read(char *buffer, size_t max_length, std::chrono::milliseconds timeout);
+        bool read_until(const std::string &s, std::chrono::milliseconds timeout);
+        bool get_dcd(void);
+        usb_sim_host_stats get_stats(void);
+};